@@ -520,18 +520,14 @@ unexpected_token (spruce_imap_token_t *token)
 	}
 }
 
-int
-spruce_imap_command_step (SpruceIMAPCommand *ic)
+/* writes the current command part (preceded by the tag if it's the first part) */
+static int
+imap_command_write_part (SpruceIMAPCommand *ic)
 {
 	SpruceIMAPEngine *engine = ic->engine;
-	int result = SPRUCE_IMAP_RESULT_NONE;
-	SpruceIMAPLiteral *literal;
-	spruce_imap_token_t token;
+#if d(!)0
 	unsigned char *linebuf;
-	ssize_t nwritten;
-	size_t len;
-	
-	g_assert (ic->part != NULL);
+#endif
 	
 	if (ic->part == ic->parts) {
 		ic->tag = g_strdup_printf ("%c%.5u", engine->tagprefix, engine->tag++);
@@ -565,7 +561,123 @@ spruce_imap_command_step (SpruceIMAPCommand *ic)
 	}
 #endif
 	
-	if ((nwritten = g_mime_stream_write (engine->ostream, ic->part->buffer, ic->part->buflen)) == -1)
+	if (g_mime_stream_write (engine->ostream, ic->part->buffer, ic->part->buflen) == -1)
+		return -1;
+	
+	return 0;
+}
+
+
+/**
+ * spruce_imap_command_send:
+ * @ic: IMAP command
+ *
+ * Writes @ic to the server without flushing the output stream or
+ * waiting for a response. This is used by the engine to pipeline
+ * commands and so @ic must not contain any literals.
+ *
+ * Returns 0 on success or -1 on error.
+ **/
+int
+spruce_imap_command_send (SpruceIMAPCommand *ic)
+{
+	g_assert (ic->part == ic->parts && ic->part->next == NULL);
+	
+	if (imap_command_write_part (ic) == -1) {
+		ic->status = SPRUCE_IMAP_COMMAND_ERROR;
+		return -1;
+	}
+	
+	return 0;
+}
+
+
+/**
+ * spruce_imap_command_parse_result:
+ * @ic: IMAP command
+ * @err: error
+ *
+ * Parses the remainder of a "<tag> OK/NO/BAD" response line after the
+ * tag has been read. Any response code is saved on the engine's
+ * current command.
+ *
+ * Returns the #SPRUCE_IMAP_RESULT_OK, #SPRUCE_IMAP_RESULT_NO or
+ * #SPRUCE_IMAP_RESULT_BAD result or -1 on error.
+ **/
+int
+spruce_imap_command_parse_result (SpruceIMAPCommand *ic, GError **err)
+{
+	SpruceIMAPEngine *engine = ic->engine;
+	int result = SPRUCE_IMAP_RESULT_NONE;
+	spruce_imap_token_t token;
+	unsigned char *linebuf;
+	size_t len;
+	
+	if (spruce_imap_engine_next_token (engine, &token, err) == -1)
+		return -1;
+	
+	if (token.token == SPRUCE_IMAP_TOKEN_ATOM) {
+		if (!strcmp (token.v.atom, "OK"))
+			result = SPRUCE_IMAP_RESULT_OK;
+		else if (!strcmp (token.v.atom, "NO"))
+			result = SPRUCE_IMAP_RESULT_NO;
+		else if (!strcmp (token.v.atom, "BAD"))
+			result = SPRUCE_IMAP_RESULT_BAD;
+		
+		if (result == SPRUCE_IMAP_RESULT_NONE) {
+			fprintf (stderr, "expected OK/NO/BAD but got %s\n", token.v.atom);
+			goto unexpected;
+		}
+		
+		if (spruce_imap_engine_next_token (engine, &token, err) == -1)
+			return -1;
+		
+		if (token.token == '[') {
+			/* we have a response code */
+			spruce_imap_stream_unget_token (engine->istream, &token);
+			if (spruce_imap_engine_parse_resp_code (engine, err) == -1)
+				return -1;
+		} else if (token.token != '\n') {
+			/* just gobble up the rest of the line */
+			if (spruce_imap_engine_line (engine, NULL, NULL, err) == -1)
+				return -1;
+		}
+		
+		return result;
+	}
+	
+	fprintf (stderr, "expected anything but this: ");
+	unexpected_token (&token);
+	fprintf (stderr, "\n");
+	
+ unexpected:
+	
+	if (spruce_imap_engine_line (engine, &linebuf, &len, err) == -1)
+		return -1;
+	
+	g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_GENERIC,
+		     _("Unexpected response from IMAP server %s: %s"),
+		     engine->url->host, linebuf);
+	
+	g_free (linebuf);
+	
+	return -1;
+}
+
+
+int
+spruce_imap_command_step (SpruceIMAPCommand *ic)
+{
+	SpruceIMAPEngine *engine = ic->engine;
+	int result = SPRUCE_IMAP_RESULT_NONE;
+	SpruceIMAPLiteral *literal;
+	spruce_imap_token_t token;
+	unsigned char *linebuf;
+	size_t len;
+	
+	g_assert (ic->part != NULL);
+	
+	if (imap_command_write_part (ic) == -1)
 		goto exception;
 	
 	if (g_mime_stream_flush (engine->ostream) == -1)
@@ -616,51 +728,15 @@ spruce_imap_command_step (SpruceIMAPCommand *ic)
 			/* we got "<tag> OK/NO/BAD" */
 			fprintf (stderr, "got %s response\n", token.v.atom);
 			
-			if (spruce_imap_engine_next_token (engine, &token, &ic->err) == -1)
+			if ((result = spruce_imap_command_parse_result (ic, &ic->err)) == -1)
 				goto exception;
 			
-			if (token.token == SPRUCE_IMAP_TOKEN_ATOM) {
-				if (!strcmp (token.v.atom, "OK"))
-					result = SPRUCE_IMAP_RESULT_OK;
-				else if (!strcmp (token.v.atom, "NO"))
-					result = SPRUCE_IMAP_RESULT_NO;
-				else if (!strcmp (token.v.atom, "BAD"))
-					result = SPRUCE_IMAP_RESULT_BAD;
-				
-				if (result == SPRUCE_IMAP_RESULT_NONE) {
-					fprintf (stderr, "expected OK/NO/BAD but got %s\n", token.v.atom);
-					goto unexpected;
-				}
-				
-				if (spruce_imap_engine_next_token (engine, &token, &ic->err) == -1)
-					goto exception;
-				
-				if (token.token == '[') {
-					/* we have a response code */
-					spruce_imap_stream_unget_token (engine->istream, &token);
-					if (spruce_imap_engine_parse_resp_code (engine, &ic->err) == -1)
-						goto exception;
-				} else if (token.token != '\n') {
-					/* just gobble up the rest of the line */
-					if (spruce_imap_engine_line (engine, NULL, NULL, &ic->err) == -1)
-						goto exception;
-				}
-			} else {
-				fprintf (stderr, "expected anything but this: ");
-				unexpected_token (&token);
-				fprintf (stderr, "\n");
-				
-				goto unexpected;
-			}
-			
 			break;
 		} else {
 			fprintf (stderr, "wtf is this: ");
 			unexpected_token (&token);
 			fprintf (stderr, "\n");
 			
-		unexpected:
-			
 			/* no fucking clue what we got... */
 			if (spruce_imap_engine_line (engine, &linebuf, &len, &ic->err) == -1)
 				goto exception;
@@ -132,6 +132,12 @@ void spruce_imap_command_unref (SpruceIMAPCommand *ic);
 /* returns 1 when complete, 0 if there is more to do, or -1 on error */
 int spruce_imap_command_step (SpruceIMAPCommand *ic);
 
+/* pipelining: returns 0 on success or -1 on error */
+int spruce_imap_command_send (SpruceIMAPCommand *ic);
+
+/* returns the SPRUCE_IMAP_RESULT_* of a tagged response or -1 on error */
+int spruce_imap_command_parse_result (SpruceIMAPCommand *ic, GError **err);
+
 void spruce_imap_command_reset (SpruceIMAPCommand *ic);
 
 G_END_DECLS
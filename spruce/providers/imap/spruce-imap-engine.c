@@ -26,12 +26,15 @@
 #include <limits.h>
 #include <ctype.h>
 #include <errno.h>
+#include <sys/poll.h>
 
 #include <glib.h>
 #include <glib/gi18n.h>
 
 #include <spruce/spruce-sasl.h>
 #include <spruce/spruce-error.h>
+#include <spruce/spruce-tcp-stream.h>
+#include <spruce/spruce-tcp-stream-ssl.h>
 
 #include "spruce-imap-summary.h"
 #include "spruce-imap-command.h"
@@ -107,6 +110,7 @@ spruce_imap_engine_init (SpruceIMAPEngine *engine, SpruceIMAPEngineClass *klass)
 	engine->authtypes = g_hash_table_new (g_str_hash, g_str_equal);
 	
 	engine->capa = 0;
+	engine->qresync = FALSE;
 	
 	/* this is the suggested default, impacts the max command line length we'll send */
 	engine->maxlentype = SPRUCE_IMAP_ENGINE_MAXLEN_LINE;
@@ -127,6 +131,18 @@ spruce_imap_engine_init (SpruceIMAPEngine *engine, SpruceIMAPEngineClass *klass)
 	engine->folder = NULL;
 	
 	spruce_list_init (&engine->queue);
+	
+	engine->pipeline = FALSE;
+	spruce_list_init (&engine->sent);
+	engine->tags = g_hash_table_new (g_str_hash, g_str_equal);
+	engine->nsent = 0;
+	
+	engine->idle = NULL;
+	engine->idle_resume = FALSE;
+	
+	engine->owner = NULL;
+	engine->leases = 0;
+	engine->affinity = NULL;
 }
 
 static void
@@ -167,12 +183,27 @@ spruce_imap_engine_finalize (GObject *object)
 	if (engine->folder)
 		g_object_unref (engine->folder);
 	
+	if (engine->affinity)
+		g_object_unref (engine->affinity);
+	
 	while ((node = spruce_list_unlink_head (&engine->queue))) {
 		node->next = NULL;
 		node->prev = NULL;
 		
 		spruce_imap_command_unref ((SpruceIMAPCommand *) node);
 	}
+	
+	while ((node = spruce_list_unlink_head (&engine->sent))) {
+		node->next = NULL;
+		node->prev = NULL;
+		
+		spruce_imap_command_unref ((SpruceIMAPCommand *) node);
+	}
+	
+	g_hash_table_destroy (engine->tags);
+	
+	if (engine->idle)
+		spruce_imap_command_unref (engine->idle);
 }
 
 
@@ -269,6 +300,12 @@ void
 spruce_imap_engine_disconnect (SpruceIMAPEngine *engine)
 {
 	engine->state = SPRUCE_IMAP_ENGINE_DISCONNECTED;
+	engine->idle_resume = FALSE;
+	
+	if (engine->idle) {
+		spruce_imap_command_unref (engine->idle);
+		engine->idle = NULL;
+	}
 	
 	if (engine->istream) {
 		g_object_unref (engine->istream);
@@ -395,9 +432,65 @@ spruce_imap_engine_namespace (SpruceIMAPEngine *engine, GError **err)
 }
 
 
+static int
+untagged_enabled (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic, guint32 index, spruce_imap_token_t *token, GError **err)
+{
+	do {
+		if (spruce_imap_engine_next_token (engine, token, err) == -1)
+			return -1;
+		
+		if (token->token == SPRUCE_IMAP_TOKEN_ATOM && !g_ascii_strcasecmp (token->v.atom, "QRESYNC"))
+			engine->qresync = TRUE;
+	} while (token->token != '\n');
+	
+	return 0;
+}
+
+
+/**
+ * spruce_imap_engine_enable_qresync:
+ * @engine: IMAP engine
+ * @err: GError
+ *
+ * Enables the rfc5162 QRESYNC extension if the IMAP server supports
+ * it. This must be called after authenticating.
+ *
+ * Returns %0 on success or %-1 on fail.
+ **/
+int
+spruce_imap_engine_enable_qresync (SpruceIMAPEngine *engine, GError **err)
+{
+	SpruceIMAPCommand *ic;
+	int id, retval = 0;
+	
+	engine->qresync = FALSE;
+	
+	if (!(engine->capa & SPRUCE_IMAP_CAPABILITY_ENABLE) ||
+	    !(engine->capa & SPRUCE_IMAP_CAPABILITY_QRESYNC))
+		return 0;
+	
+	ic = spruce_imap_engine_prequeue (engine, NULL, "ENABLE QRESYNC\r\n");
+	spruce_imap_command_register_untagged (ic, "ENABLED", untagged_enabled);
+	
+	while ((id = spruce_imap_engine_iterate (engine)) < ic->id && id != -1)
+		;
+	
+	if (id == -1 || ic->status != SPRUCE_IMAP_COMMAND_COMPLETE) {
+		g_propagate_error (err, ic->err);
+		ic->err = NULL;
+		retval = -1;
+	}
+	
+	spruce_imap_command_unref (ic);
+	
+	return retval;
+}
+
+
 int
 spruce_imap_engine_select_folder (SpruceIMAPEngine *engine, SpruceFolder *folder, GError **err)
 {
+	guint64 highestmodseq = 0;
 	SpruceIMAPRespCode *resp;
 	SpruceIMAPCommand *ic;
 	int id, retval = 0;
@@ -445,6 +538,9 @@ spruce_imap_engine_select_folder (SpruceIMAPEngine *engine, SpruceFolder *folder
 			case SPRUCE_IMAP_RESP_CODE_UNSEEN:
 				spruce_imap_summary_set_unseen (folder->summary, resp->v.unseen);
 				break;
+			case SPRUCE_IMAP_RESP_CODE_HIGHESTMODSEQ:
+				highestmodseq = resp->v.highestmodseq;
+				break;
 			default:
 				break;
 			}
@@ -455,6 +551,9 @@ spruce_imap_engine_select_folder (SpruceIMAPEngine *engine, SpruceFolder *folder
 			g_warning ("Expected to find [READ-ONLY] or [READ-WRITE] in SELECT response");
 		}
 		
+		/* 0 if the folder doesn't support mod-sequences (NOMODSEQ) */
+		spruce_imap_summary_set_highestmodseq (folder->summary, highestmodseq);
+		
 		break;
 	case SPRUCE_IMAP_RESULT_NO:
 		/* FIXME: would be good to save the NO reason into the err message */
@@ -495,6 +594,8 @@ static struct {
 	{ "UNSELECT",      SPRUCE_IMAP_CAPABILITY_UNSELECT      }, /* rfc3691 */
 	{ "CONDSTORE",     SPRUCE_IMAP_CAPABILITY_CONDSTORE     }, /* rfc4551 */
 	{ "IDLE",          SPRUCE_IMAP_CAPABILITY_IDLE          }, /* rfc2177 */
+	{ "ENABLE",        SPRUCE_IMAP_CAPABILITY_ENABLE        }, /* rfc5161 */
+	{ "QRESYNC",       SPRUCE_IMAP_CAPABILITY_QRESYNC       }, /* rfc5162 */
 	{ "XGWEXTENSIONS", SPRUCE_IMAP_CAPABILITY_XGWEXTENSIONS }, /* GroupWise extensions */
 };
 
@@ -1001,14 +1102,18 @@ spruce_imap_engine_parse_resp_code (SpruceIMAPEngine *engine, GError **err)
 		if (spruce_imap_engine_next_token (engine, &token, err) == -1)
 			goto exception;
 		
-		if (token.token != SPRUCE_IMAP_TOKEN_NUMBER) {
+		if (token.token != SPRUCE_IMAP_TOKEN_NUMBER && token.token != SPRUCE_IMAP_TOKEN_NUMBER64) {
 			d(fprintf (stderr, "Expected an nz_number token as an argument to the HIGHESTMODSEQ RESP-CODE\n"));
 			spruce_imap_utils_set_unexpected_token_error (err, engine, &token);
 			goto exception;
 		}
 		
-		if (resp != NULL)
-			resp->v.highestmodseq = token.v.number;
+		if (resp != NULL) {
+			if (token.token == SPRUCE_IMAP_TOKEN_NUMBER64)
+				resp->v.highestmodseq = token.v.number64;
+			else
+				resp->v.highestmodseq = token.v.number;
+		}
 		
 		break;
 	case SPRUCE_IMAP_RESP_CODE_NOMODSEQ:
@@ -1070,6 +1175,91 @@ spruce_imap_engine_parse_resp_code (SpruceIMAPEngine *engine, GError **err)
 }
 
 
+/* finds the command which registered an untagged handler for @atom,
+ * checking the current command first and then any other pipelined
+ * commands still awaiting a response (oldest first) */
+static SpruceIMAPCommand *
+engine_untagged_handler (SpruceIMAPEngine *engine, const char *atom, SpruceIMAPUntaggedCallback *untagged)
+{
+	SpruceIMAPCommand *ic = engine->current;
+	SpruceListNode *node;
+	
+	if (ic && (*untagged = g_hash_table_lookup (ic->untagged, atom)))
+		return ic;
+	
+	node = engine->sent.head;
+	while (node->next) {
+		ic = (SpruceIMAPCommand *) node;
+		
+		if (ic->status == SPRUCE_IMAP_COMMAND_ACTIVE &&
+		    (*untagged = g_hash_table_lookup (ic->untagged, atom)))
+			return ic;
+		
+		node = node->next;
+	}
+	
+	return NULL;
+}
+
+
+/* parses the remainder of a "* VANISHED [(EARLIER)] <uid-set>" response */
+static int
+engine_parse_vanished (SpruceIMAPEngine *engine, spruce_imap_token_t *token, GError **err)
+{
+	gboolean earlier = FALSE;
+	SpruceFolder *folder;
+	const char *set;
+	char uid[16];
+	
+	if (spruce_imap_engine_next_token (engine, token, err) == -1)
+		return -1;
+	
+	if (token->token == '(') {
+		if (spruce_imap_engine_next_token (engine, token, err) == -1)
+			return -1;
+		
+		if (token->token != SPRUCE_IMAP_TOKEN_ATOM || g_ascii_strcasecmp (token->v.atom, "EARLIER") != 0)
+			goto unexpected;
+		
+		if (spruce_imap_engine_next_token (engine, token, err) == -1)
+			return -1;
+		
+		if (token->token != ')')
+			goto unexpected;
+		
+		earlier = TRUE;
+		
+		if (spruce_imap_engine_next_token (engine, token, err) == -1)
+			return -1;
+	}
+	
+	if (token->token == SPRUCE_IMAP_TOKEN_NUMBER) {
+		sprintf (uid, "%u", token->v.number);
+		set = uid;
+	} else if (token->token == SPRUCE_IMAP_TOKEN_ATOM) {
+		set = token->v.atom;
+	} else {
+		goto unexpected;
+	}
+	
+	/* which folder are these messages vanishing from? */
+	if (engine->current && engine->current->folder)
+		folder = (SpruceFolder *) engine->current->folder;
+	else
+		folder = (SpruceFolder *) engine->folder;
+	
+	if (folder != NULL)
+		spruce_imap_summary_vanished (folder->summary, set, earlier);
+	
+	return spruce_imap_engine_eat_line (engine, err);
+	
+ unexpected:
+	
+	spruce_imap_utils_set_unexpected_token_error (err, engine, token);
+	
+	return -1;
+}
+
 
 /* returns -1 on error, or one of SPRUCE_IMAP_UNTAGGED_[OK,NO,BAD,PREAUTH,HANDLED] on success */
 int
@@ -1081,6 +1271,9 @@ spruce_imap_engine_handle_untagged_1 (SpruceIMAPEngine *engine, spruce_imap_toke
 	SpruceFolder *folder;
 	unsigned int v;
 	
+	/* strings handed out for the previous response are no longer needed */
+	spruce_imap_stream_arena_reset (engine->istream);
+	
 	if (spruce_imap_engine_next_token (engine, token, err) == -1)
 		return -1;
 	
@@ -1172,7 +1365,11 @@ spruce_imap_engine_handle_untagged_1 (SpruceIMAPEngine *engine, spruce_imap_toke
 			
 			if (spruce_imap_engine_parse_resp_code (engine, err) == -1)
 				return -1;
-		} else if (ic && (untagged = g_hash_table_lookup (ic->untagged, token->v.atom))) {
+		} else if (!strcmp ("VANISHED", token->v.atom)) {
+			/* rfc5162: replaces EXPUNGE once QRESYNC has been enabled */
+			if (engine_parse_vanished (engine, token, err) == -1)
+				return -1;
+		} else if ((ic = engine_untagged_handler (engine, token->v.atom, &untagged))) {
 			/* registered untagged handler for imap command */
 			if (untagged (engine, ic, 0, token, err) == -1)
 				return -1;
@@ -1210,7 +1407,7 @@ spruce_imap_engine_handle_untagged_1 (SpruceIMAPEngine *engine, spruce_imap_toke
 			spruce_imap_summary_expunge (folder->summary, (int) v);
 		} else if (!strcmp ("RECENT", token->v.atom)) {
 			spruce_imap_summary_set_recent (folder->summary, v);
-		} else if (ic && (untagged = g_hash_table_lookup (ic->untagged, token->v.atom))) {
+		} else if ((ic = engine_untagged_handler (engine, token->v.atom, &untagged))) {
 			/* registered untagged handler for imap command */
 			if (untagged (engine, ic, v, token, err) == -1)
 				return -1;
@@ -1277,6 +1474,37 @@ imap_process_command (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic)
 }
 
 
+/* the folder which will be selected once the pipelined commands
+ * still awaiting a response have completed */
+static SpruceIMAPFolder *
+engine_selected_folder (SpruceIMAPEngine *engine)
+{
+	SpruceIMAPFolder *folder = NULL;
+	SpruceListNode *node;
+	SpruceIMAPCommand *ic;
+	const char *cmd;
+	
+	if (engine->state == SPRUCE_IMAP_ENGINE_SELECTED)
+		folder = engine->folder;
+	
+	node = engine->sent.head;
+	while (node->next) {
+		ic = (SpruceIMAPCommand *) node;
+		cmd = ic->parts->buffer;
+		
+		if (ic->status == SPRUCE_IMAP_COMMAND_ACTIVE) {
+			if (!strncmp (cmd, "SELECT ", 7) || !strncmp (cmd, "EXAMINE ", 8))
+				folder = ic->folder;
+			else if (!strncmp (cmd, "UNSELECT", 8) || !strncmp (cmd, "CLOSE", 5))
+				folder = NULL;
+		}
+		
+		node = node->next;
+	}
+	
+	return folder;
+}
+
 static void
 engine_prequeue_folder_select (SpruceIMAPEngine *engine)
 {
@@ -1287,7 +1515,7 @@ engine_prequeue_folder_select (SpruceIMAPEngine *engine)
 	cmd = (const char *) ic->parts->buffer;
 	
 	if (!ic->folder || (!strncmp (cmd, "SELECT ", 7) || !strncmp (cmd, "EXAMINE ", 8)) ||
-	    (engine->state == SPRUCE_IMAP_ENGINE_SELECTED && (ic->folder == engine->folder))) {
+	    ic->folder == engine_selected_folder (engine)) {
 		/* no need to pre-queue a SELECT */
 		return;
 	}
@@ -1309,6 +1537,10 @@ engine_state_change (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic)
 	cmd = ic->parts->buffer;
 	if (!strncmp (cmd, "SELECT ", 7) || !strncmp (cmd, "EXAMINE ", 8)) {
 		if (ic->result == SPRUCE_IMAP_RESULT_OK) {
+			/* an IDLE interrupted on another folder is no longer wanted */
+			if (engine->folder != ic->folder)
+				engine->idle_resume = FALSE;
+			
 			/* Update the selected folder */
 			g_object_ref (ic->folder);
 			if (engine->folder)
@@ -1323,6 +1555,7 @@ engine_state_change (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic)
 	} else if (!strncmp (cmd, "UNSELECT", 8) || !strncmp (cmd, "CLOSE", 5)) {
 		if (ic->result == SPRUCE_IMAP_RESULT_OK) {
 			engine->state = SPRUCE_IMAP_ENGINE_AUTHENTICATED;
+			engine->idle_resume = FALSE;
 			if (engine->folder) {
 				g_object_unref (engine->folder);
 				engine->folder = NULL;
@@ -1330,6 +1563,7 @@ engine_state_change (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic)
 		}
 	} else if (!strncmp (cmd, "LOGOUT", 6)) {
 		engine->state = SPRUCE_IMAP_ENGINE_DISCONNECTED;
+		engine->idle_resume = FALSE;
 		if (engine->folder) {
 			g_object_unref (engine->folder);
 			engine->folder = NULL;
@@ -1339,12 +1573,468 @@ engine_state_change (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic)
 	return retval;
 }
 
+/* This can ONLY happen if @ic was the pre-queued SELECT command
+ * and it got a NO or BAD response.
+ *
+ * We have to pop the next imap command or we'll get into an
+ * infinite loop. In order to provide @nic's owner with as much
+ * information as possible, we move all @ic status information
+ * over to @nic and pretend we just processed @nic.
+ **/
+static SpruceIMAPCommand *
+engine_select_failed (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic)
+{
+	SpruceIMAPCommand *nic;
+	GPtrArray *resp_codes;
+	
+	nic = (SpruceIMAPCommand *) spruce_list_unlink_head (&engine->queue);
+	
+	nic->status = ic->status;
+	nic->result = ic->result;
+	resp_codes = nic->resp_codes;
+	nic->resp_codes = ic->resp_codes;
+	ic->resp_codes = resp_codes;
+	g_propagate_error (&nic->err, ic->err);
+	ic->err = NULL;
+	
+	spruce_imap_command_unref (ic);
+	
+	return nic;
+}
+
+
+/* rfc3501 7.4.1: the server may not send EXPUNGE responses while a
+ * FETCH, STORE or SEARCH (by sequence number) is in progress */
+static gboolean
+imap_command_may_expunge (const char *cmd)
+{
+	return strncmp (cmd, "FETCH ", 6) && strncmp (cmd, "STORE ", 6) &&
+		strncmp (cmd, "SEARCH ", 7) && strncmp (cmd, "SELECT ", 7) &&
+		strncmp (cmd, "EXAMINE ", 8);
+}
+
+static gboolean
+imap_command_uses_seqid (const char *cmd)
+{
+	return !strncmp (cmd, "FETCH ", 6) || !strncmp (cmd, "STORE ", 6) ||
+		!strncmp (cmd, "SEARCH ", 7) || !strncmp (cmd, "COPY ", 5);
+}
+
+#define PIPELINE_DEPTH 16
+
+/* checks whether @ic may be sent while the commands in engine->sent
+ * are still awaiting a response */
+static gboolean
+engine_can_pipeline (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic)
+{
+	const char *cmd = ic->parts->buffer;
+	SpruceListNode *node;
+	SpruceIMAPCommand *sic;
+	
+	if (!engine->pipeline || engine->reconnecting || engine->level != SPRUCE_IMAP_LEVEL_IMAP4REV1)
+		return FALSE;
+	
+	if (engine->state != SPRUCE_IMAP_ENGINE_AUTHENTICATED &&
+	    engine->state != SPRUCE_IMAP_ENGINE_SELECTED)
+		return FALSE;
+	
+	if (engine->nsent >= PIPELINE_DEPTH)
+		return FALSE;
+	
+	/* literals and '+' callbacks have to wait for a continuation response */
+	if (ic->parts->next || ic->parts->literal || ic->plus)
+		return FALSE;
+	
+	/* these change the state of the connection itself */
+	if (!strncmp (cmd, "LOGIN ", 6) || !strncmp (cmd, "AUTHENTICATE ", 13) ||
+	    !strncmp (cmd, "STARTTLS", 8) || !strncmp (cmd, "LOGOUT", 6) ||
+	    !strncmp (cmd, "IDLE", 4))
+		return FALSE;
+	
+	node = engine->sent.head;
+	while (node->next) {
+		sic = (SpruceIMAPCommand *) node;
+		
+		/* if a pre-queued SELECT fails, the command following it
+		 * inherits its status so it must not have been sent yet */
+		if (sic->user_data == engine)
+			return FALSE;
+		
+		/* sequence numbers aren't stable if a command ahead of us
+		 * might still get EXPUNGE responses */
+		if (sic->status == SPRUCE_IMAP_COMMAND_ACTIVE && imap_command_uses_seqid (cmd)
+		    && imap_command_may_expunge (sic->parts->buffer))
+			return FALSE;
+		
+		node = node->next;
+	}
+	
+	return TRUE;
+}
+
+
+/* writes as many of the queued commands as possible to the server
+ * without waiting for any responses */
+static int
+engine_pipeline_send (SpruceIMAPEngine *engine)
+{
+	SpruceIMAPCommand *ic;
+	int nsent = 0;
+	
+	while (!spruce_list_is_empty (&engine->queue)) {
+		/* check to see if we need to pre-queue a SELECT, if so do it */
+		engine_prequeue_folder_select (engine);
+		
+		ic = (SpruceIMAPCommand *) engine->queue.head;
+		if (!engine_can_pipeline (engine, ic))
+			break;
+		
+		spruce_list_unlink_head (&engine->queue);
+		spruce_list_append (&engine->sent, (SpruceListNode *) ic);
+		ic->status = SPRUCE_IMAP_COMMAND_ACTIVE;
+		engine->nsent++;
+		
+		if (spruce_imap_command_send (ic) == -1)
+			return -1;
+		
+		g_hash_table_insert (engine->tags, ic->tag, ic);
+		nsent++;
+	}
+	
+	if (nsent > 0 && g_mime_stream_flush (engine->ostream) == -1)
+		return -1;
+	
+	return 0;
+}
+
+
+/* reads responses from the server until the pipelined command @ic
+ * has completed, completing any other pipelined commands along the way */
+static int
+engine_pipeline_wait (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic)
+{
+	spruce_imap_token_t token;
+	SpruceIMAPCommand *tagged;
+	unsigned char *linebuf;
+	SpruceListNode *node;
+	size_t len;
+	int result;
+	
+	while (ic->status == SPRUCE_IMAP_COMMAND_ACTIVE) {
+		/* untagged responses belong to the oldest command still in progress */
+		node = engine->sent.head;
+		while (((SpruceIMAPCommand *) node)->status != SPRUCE_IMAP_COMMAND_ACTIVE)
+			node = node->next;
+		
+		engine->current = (SpruceIMAPCommand *) node;
+		
+		if (spruce_imap_engine_next_token (engine, &token, &ic->err) == -1)
+			return -1;
+		
+		if (token.token == '*') {
+			if (spruce_imap_engine_handle_untagged_1 (engine, &token, &ic->err) == -1)
+				return -1;
+		} else if (token.token == SPRUCE_IMAP_TOKEN_ATOM &&
+			   (tagged = g_hash_table_lookup (engine->tags, token.v.atom))) {
+			/* "<tag> OK/NO/BAD" - resp-codes belong to @tagged */
+			engine->current = tagged;
+			
+			if ((result = spruce_imap_command_parse_result (tagged, &ic->err)) == -1)
+				return -1;
+			
+			g_hash_table_remove (engine->tags, tagged->tag);
+			tagged->status = SPRUCE_IMAP_COMMAND_COMPLETE;
+			tagged->result = result;
+			tagged->part = NULL;
+			
+			/* a failed pre-queued SELECT is dealt with once @tagged is popped */
+			engine_state_change (engine, tagged);
+		} else {
+			if (spruce_imap_engine_line (engine, &linebuf, &len, &ic->err) == -1)
+				return -1;
+			
+			g_set_error (&ic->err, SPRUCE_ERROR, SPRUCE_ERROR_GENERIC,
+				     _("Unexpected response from IMAP server %s: %s"),
+				     engine->url->host, linebuf);
+			
+			g_free (linebuf);
+			
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+
+/* reads a single response from the server while IDLE. A continuation
+ * response means the server is now idling. Returns 1 once the IDLE
+ * command has completed, 0 if it is still active or -1 on error */
+static int
+engine_idle_step (SpruceIMAPEngine *engine, GError **err)
+{
+	SpruceIMAPCommand *ic = engine->idle;
+	spruce_imap_token_t token;
+	unsigned char *linebuf;
+	int result;
+	size_t len;
+	
+	engine->current = ic;
+	
+	if (spruce_imap_engine_next_token (engine, &token, err) == -1)
+		return -1;
+	
+	if (token.token == '*') {
+		if (spruce_imap_engine_handle_untagged_1 (engine, &token, err) == -1)
+			return -1;
+	} else if (token.token == '+') {
+		if (spruce_imap_engine_eat_line (engine, err) == -1)
+			return -1;
+		
+		engine->state = SPRUCE_IMAP_ENGINE_IDLE;
+	} else if (token.token == SPRUCE_IMAP_TOKEN_ATOM && !strcmp (token.v.atom, ic->tag)) {
+		/* "<tag> OK/NO/BAD" - either we sent DONE or the server
+		 * got bored of waiting for us */
+		if ((result = spruce_imap_command_parse_result (ic, err)) == -1)
+			return -1;
+		
+		ic->status = SPRUCE_IMAP_COMMAND_COMPLETE;
+		ic->result = result;
+		
+		engine->state = SPRUCE_IMAP_ENGINE_SELECTED;
+		engine->current = NULL;
+		engine->idle = NULL;
+		
+		spruce_imap_command_unref (ic);
+		
+		return 1;
+	} else {
+		if (spruce_imap_engine_line (engine, &linebuf, &len, err) == -1)
+			return -1;
+		
+		g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_GENERIC,
+			     _("Unexpected response from IMAP server %s: %s"),
+			     engine->url->host, linebuf);
+		
+		g_free (linebuf);
+		
+		return -1;
+	}
+	
+	return 0;
+}
+
+
+/* sends DONE and waits for the IDLE command to complete */
+static int
+engine_idle_done (SpruceIMAPEngine *engine, GError **err)
+{
+	int retval;
+	
+	if (g_mime_stream_write (engine->ostream, "DONE\r\n", 6) == -1 ||
+	    g_mime_stream_flush (engine->ostream) == -1) {
+		g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_SERVICE_UNAVAILABLE,
+			     _("Failed to send command to IMAP server %s: %s"),
+			     engine->url->host, g_strerror (errno));
+		return -1;
+	}
+	
+	while ((retval = engine_idle_step (engine, err)) == 0)
+		;
+	
+	return retval == -1 ? -1 : 0;
+}
+
+
+/**
+ * spruce_imap_engine_idle:
+ * @engine: IMAP engine
+ * @ic: IDLE command
+ * @err: GError
+ *
+ * Sends the rfc2177 IDLE command @ic and waits for the server to
+ * acknowledge it. While IDLE, the server will send untagged responses
+ * as things change, which can be processed by calling
+ * spruce_imap_engine_idle_dispatch() whenever the engine's socket
+ * (see spruce_imap_engine_get_fd()) becomes readable.
+ *
+ * The engine leaves IDLE by itself the next time a queued command is
+ * processed, and sets @idle_resume so that the IDLE can be resumed
+ * once that command is done. The queue must be empty when this is
+ * called.
+ *
+ * Returns %0 on success or %-1 on fail.
+ **/
+int
+spruce_imap_engine_idle (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic, GError **err)
+{
+	int retval;
+	
+	g_return_val_if_fail (SPRUCE_IS_IMAP_ENGINE (engine), -1);
+	g_return_val_if_fail (spruce_list_is_empty (&engine->queue), -1);
+	g_return_val_if_fail (spruce_list_is_empty (&engine->sent), -1);
+	
+	if (engine->state == SPRUCE_IMAP_ENGINE_IDLE)
+		return 0;
+	
+	if (!(engine->capa & SPRUCE_IMAP_CAPABILITY_IDLE) || engine->state != SPRUCE_IMAP_ENGINE_SELECTED) {
+		g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_GENERIC,
+			     _("Cannot IDLE on IMAP server %s: %s"),
+			     engine->url->host, _("Not supported"));
+		return -1;
+	}
+	
+	spruce_imap_command_ref (ic);
+	ic->status = SPRUCE_IMAP_COMMAND_ACTIVE;
+	engine->idle_resume = FALSE;
+	engine->idle = ic;
+	
+	if (spruce_imap_command_send (ic) == -1 || g_mime_stream_flush (engine->ostream) == -1) {
+		g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_SERVICE_UNAVAILABLE,
+			     _("Failed to send command to IMAP server %s: %s"),
+			     engine->url->host, g_strerror (errno));
+		goto exception;
+	}
+	
+	/* wait for the server to tell us that it is idling */
+	while (engine->state != SPRUCE_IMAP_ENGINE_IDLE) {
+		if ((retval = engine_idle_step (engine, err)) == -1)
+			goto exception;
+		
+		if (retval == 1) {
+			g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_GENERIC,
+				     _("Cannot IDLE on IMAP server %s: %s"),
+				     engine->url->host, _("Bad command"));
+			return -1;
+		}
+	}
+	
+	return 0;
+	
+ exception:
+	
+	if (engine->idle) {
+		spruce_imap_command_unref (engine->idle);
+		engine->idle = NULL;
+	}
+	
+	engine->state = SPRUCE_IMAP_ENGINE_DISCONNECTED;
+	engine->current = NULL;
+	
+	return -1;
+}
+
+
+/* checks whether reading from the engine's socket would not block */
+static gboolean
+engine_idle_readable (SpruceIMAPEngine *engine)
+{
+	GMimeStream *stream = engine->istream->stream;
+	struct pollfd ufds;
+	
+	/* data which openssl has already decrypted won't make the
+	 * socket readable again */
+	if (SPRUCE_IS_TCP_STREAM_SSL (stream) && spruce_tcp_stream_ssl_pending ((SpruceTcpStreamSSL *) stream))
+		return TRUE;
+	
+	if ((ufds.fd = spruce_imap_engine_get_fd (engine)) == -1)
+		return FALSE;
+	
+	ufds.events = POLLIN;
+	ufds.revents = 0;
+	
+	return poll (&ufds, 1, 0) == 1 && (ufds.revents & (POLLIN | POLLHUP | POLLERR));
+}
+
+
+/**
+ * spruce_imap_engine_idle_dispatch:
+ * @engine: IMAP engine
+ * @err: GError
+ *
+ * Processes the untagged responses the server has sent while the
+ * engine is IDLE. Only responses whose first line has been received
+ * in full are processed, so this will not wait for the server to
+ * send more unless a response contains a literal which hasn't yet
+ * arrived. EXPUNGE and FETCH responses are passed along to the
+ * selected folder as they would be for any other command.
+ *
+ * Returns %0 on success or %-1 on fail. If the server ended the IDLE
+ * (as servers do after a while), the engine's state will no longer be
+ * #SPRUCE_IMAP_ENGINE_IDLE.
+ **/
+int
+spruce_imap_engine_idle_dispatch (SpruceIMAPEngine *engine, GError **err)
+{
+	SpruceIMAPStream *istream;
+	int retval;
+	
+	g_return_val_if_fail (SPRUCE_IS_IMAP_ENGINE (engine), -1);
+	
+	if (engine->state != SPRUCE_IMAP_ENGINE_IDLE)
+		return 0;
+	
+	istream = engine->istream;
+	
+	do {
+		/* a partial line would have us block waiting for the rest */
+		while (spruce_imap_stream_have_line (istream)) {
+			if ((retval = engine_idle_step (engine, err)) == -1) {
+				engine->state = SPRUCE_IMAP_ENGINE_DISCONNECTED;
+				return -1;
+			}
+			
+			if (retval == 1)
+				return 0;
+		}
+		
+		if (!engine_idle_readable (engine))
+			break;
+		
+		if (spruce_imap_stream_fill (istream) == -1 || istream->disconnected) {
+			g_set_error (err, SPRUCE_ERROR, errno ? errno : SPRUCE_ERROR_GENERIC,
+				     _("IMAP server %s unexpectedly disconnected: %s"),
+				     engine->url->host, errno ? g_strerror (errno) : _("Unknown"));
+			engine->state = SPRUCE_IMAP_ENGINE_DISCONNECTED;
+			return -1;
+		}
+	} while (1);
+	
+	return 0;
+}
+
+
+/**
+ * spruce_imap_engine_get_fd:
+ * @engine: IMAP engine
+ *
+ * Gets the socket the engine is connected with, so that callers can
+ * watch it for readability while the engine is IDLE.
+ *
+ * Returns the socket descriptor or %-1 if the engine isn't connected.
+ **/
+int
+spruce_imap_engine_get_fd (SpruceIMAPEngine *engine)
+{
+	g_return_val_if_fail (SPRUCE_IS_IMAP_ENGINE (engine), -1);
+	
+	if (engine->istream == NULL || !SPRUCE_IS_TCP_STREAM (engine->istream->stream))
+		return -1;
+	
+	return ((SpruceTcpStream *) engine->istream->stream)->sockfd;
+}
+
+
 /**
  * spruce_imap_engine_iterate:
  * @engine: IMAP engine
  *
  * Processes the first command in the queue.
  *
+ * When pipelining is enabled, this may first write any number of the
+ * queued commands to the server. Commands are still processed (and
+ * their ids returned) in the order in which they were queued.
+ *
  * Returns the id of the processed command, %0 if there were no
  * commands to process, or %-1 on error.
  *
@@ -1354,16 +2044,32 @@ engine_state_change (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic)
 int
 spruce_imap_engine_iterate (SpruceIMAPEngine *engine)
 {
-	SpruceIMAPCommand *ic, *nic;
-	GPtrArray *resp_codes;
+	SpruceIMAPCommand *ic;
+	SpruceListNode *node;
 	GError *err = NULL;
+	gboolean active;
 	int retries = 0;
 	int retval;
 	
-	if (spruce_list_is_empty (&engine->queue))
+	if (spruce_list_is_empty (&engine->queue) && spruce_list_is_empty (&engine->sent))
 		return 0;
 	
+	/* leave IDLE before sending anything else; if that fails, we
+	 * reconnect below like we would for any other dropped connection.
+	 * The store resumes the IDLE once the engine is given back */
+	if (engine->state == SPRUCE_IMAP_ENGINE_IDLE) {
+		if (engine_idle_done (engine, &err) == -1) {
+			engine->state = SPRUCE_IMAP_ENGINE_DISCONNECTED;
+			g_clear_error (&err);
+		} else {
+			engine->idle_resume = TRUE;
+		}
+	}
+	
  retry:
+	if (!spruce_list_is_empty (&engine->sent))
+		goto pipeline;
+	
 	/* FIXME: it would be nicer if we didn't have to check the stream's disconnected status */
 	if ((engine->state == SPRUCE_IMAP_ENGINE_DISCONNECTED || engine->istream->disconnected)
 	    && !engine->reconnecting) {
@@ -1384,33 +2090,15 @@ spruce_imap_engine_iterate (SpruceIMAPEngine *engine)
 	/* check to see if we need to pre-queue a SELECT, if so do it */
 	engine_prequeue_folder_select (engine);
 	
+	if (engine_can_pipeline (engine, (SpruceIMAPCommand *) engine->queue.head))
+		goto pipeline;
+	
 	engine->current = ic = (SpruceIMAPCommand *) spruce_list_unlink_head (&engine->queue);
 	ic->status = SPRUCE_IMAP_COMMAND_ACTIVE;
 	
 	if ((retval = imap_process_command (engine, ic)) != -1) {
-		if (engine_state_change (engine, ic) == -1) {
-			/* This can ONLY happen if @ic was the pre-queued SELECT command
-			 * and it got a NO or BAD response.
-			 *
-			 * We have to pop the next imap command or we'll get into an
-			 * infinite loop. In order to provide @nic's owner with as much
-			 * information as possible, we move all @ic status information
-			 * over to @nic and pretend we just processed @nic.
-			 **/
-			
-			nic = (SpruceIMAPCommand *) spruce_list_unlink_head (&engine->queue);
-			
-			nic->status = ic->status;
-			nic->result = ic->result;
-			resp_codes = nic->resp_codes;
-			nic->resp_codes = ic->resp_codes;
-			ic->resp_codes = resp_codes;
-			g_propagate_error (&nic->err, ic->err);
-			ic->err = NULL;
-			
-			spruce_imap_command_unref (ic);
-			ic = nic;
-		}
+		if (engine_state_change (engine, ic) == -1)
+			ic = engine_select_failed (engine, ic);
 		
 		retval = ic->id;
 	} else if (!engine->reconnecting && retries < 3) {
@@ -1429,6 +2117,80 @@ spruce_imap_engine_iterate (SpruceIMAPEngine *engine)
 	spruce_imap_command_unref (ic);
 	
 	return retval;
+	
+ pipeline:
+	
+	if (engine_pipeline_send (engine) == -1)
+		goto failed;
+	
+	ic = (SpruceIMAPCommand *) engine->sent.head;
+	if (ic->status == SPRUCE_IMAP_COMMAND_ACTIVE && engine_pipeline_wait (engine, ic) == -1)
+		goto failed;
+	
+ pop:
+	
+	ic = (SpruceIMAPCommand *) spruce_list_unlink_head (&engine->sent);
+	engine->nsent--;
+	
+	if (ic->status == SPRUCE_IMAP_COMMAND_COMPLETE) {
+		if (ic->user_data == engine && ic->result != SPRUCE_IMAP_RESULT_OK)
+			ic = engine_select_failed (engine, ic);
+		
+		retval = ic->id;
+	} else {
+		retval = -1;
+	}
+	
+	spruce_imap_command_unref (ic);
+	
+	return retval;
+	
+ failed:
+	
+	engine->state = SPRUCE_IMAP_ENGINE_DISCONNECTED;
+	
+	/* if none of the pipelined commands have completed yet, they can
+	 * all be sent again (in order) after reconnecting */
+	active = TRUE;
+	node = engine->sent.head;
+	while (node->next) {
+		if (((SpruceIMAPCommand *) node)->status != SPRUCE_IMAP_COMMAND_ACTIVE)
+			active = FALSE;
+		node = node->next;
+	}
+	
+	if (active && !engine->reconnecting && retries < 3) {
+		while ((node = spruce_list_unlink_tail (&engine->sent))) {
+			ic = (SpruceIMAPCommand *) node;
+			g_hash_table_remove (engine->tags, ic->tag);
+			spruce_imap_command_reset (ic);
+			spruce_list_prepend (&engine->queue, node);
+		}
+		
+		engine->nsent = 0;
+		retries++;
+		goto retry;
+	}
+	
+	node = engine->sent.head;
+	while (node->next) {
+		ic = (SpruceIMAPCommand *) node;
+		
+		if (ic->status == SPRUCE_IMAP_COMMAND_ACTIVE) {
+			g_hash_table_remove (engine->tags, ic->tag);
+			ic->status = SPRUCE_IMAP_COMMAND_ERROR;
+			
+			if (ic->err == NULL)
+				g_set_error (&ic->err, SPRUCE_ERROR, SPRUCE_ERROR_SERVICE_UNAVAILABLE,
+					     _("Failed to send command to IMAP server %s: %s"),
+					     engine->url->host, errno ? g_strerror (errno) :
+					     _("service unavailable"));
+		}
+		
+		node = node->next;
+	}
+	
+	goto pop;
 }
 
 
@@ -1572,6 +2334,10 @@ spruce_imap_engine_dequeue (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic)
 	if (node->next == NULL && node->prev == NULL)
 		return;
 	
+	/* pipelined commands have already been sent to the server */
+	if (ic->status != SPRUCE_IMAP_COMMAND_QUEUED)
+		return;
+	
 	spruce_list_unlink (node);
 	node->next = NULL;
 	node->prev = NULL;
@@ -1705,6 +2471,77 @@ spruce_imap_engine_literal (SpruceIMAPEngine *engine, unsigned char **literal, s
 }
 
 
+/**
+ * spruce_imap_engine_nstring:
+ * @engine: IMAP engine
+ * @nstring: output string pointer
+ * @len: output length or %NULL
+ * @err: a #GError
+ *
+ * Reads the next token as an IMAP nstring (an atom, quoted string,
+ * literal or NIL). The value is copied into the IMAP stream's string
+ * arena rather than the heap, so it stays valid until the engine
+ * moves on to the next untagged response and must not be freed. NIL
+ * sets @nstring to %NULL.
+ *
+ * Returns %0 on success or %-1 on fail.
+ **/
+int
+spruce_imap_engine_nstring (SpruceIMAPEngine *engine, char **nstring, size_t *len, GError **err)
+{
+	spruce_imap_token_t token;
+	unsigned char *buf;
+	size_t buflen, n;
+	char *outptr;
+	int retval;
+	
+	if (spruce_imap_engine_next_token (engine, &token, err) == -1)
+		return -1;
+	
+	switch (token.token) {
+	case SPRUCE_IMAP_TOKEN_NIL:
+		*nstring = NULL;
+		n = 0;
+		break;
+	case SPRUCE_IMAP_TOKEN_ATOM:
+	case SPRUCE_IMAP_TOKEN_QSTRING:
+		n = strlen (token.v.qstring);
+		*nstring = spruce_imap_stream_arena_strndup (engine->istream, token.v.qstring, n);
+		break;
+	case SPRUCE_IMAP_TOKEN_LITERAL:
+		/* read the literal straight into the arena */
+		*nstring = outptr = spruce_imap_stream_arena_alloc (engine->istream, token.v.literal + 1);
+		n = 0;
+		
+		do {
+			if ((retval = spruce_imap_stream_literal (engine->istream, &buf, &buflen)) == -1) {
+				g_set_error (err, SPRUCE_ERROR, errno ? errno : SPRUCE_ERROR_GENERIC,
+					     _("IMAP server %s unexpectedly disconnected: %s"),
+					     engine->url->host, errno ? g_strerror (errno) : _("Unknown"));
+				
+				return -1;
+			}
+			
+			if (buflen > 0) {
+				memcpy (outptr + n, buf, buflen);
+				n += buflen;
+			}
+		} while (retval > 0);
+		
+		outptr[n] = '\0';
+		break;
+	default:
+		spruce_imap_utils_set_unexpected_token_error (err, engine, &token);
+		return -1;
+	}
+	
+	if (len != NULL)
+		*len = n;
+	
+	return 0;
+}
+
+
 void
 spruce_imap_resp_code_free (SpruceIMAPRespCode *rcode)
 {
@@ -72,6 +72,8 @@ enum {
 	SPRUCE_IMAP_CAPABILITY_UNSELECT        = (1 << 8),
 	SPRUCE_IMAP_CAPABILITY_CONDSTORE       = (1 << 9),
 	SPRUCE_IMAP_CAPABILITY_IDLE            = (1 << 10),
+	SPRUCE_IMAP_CAPABILITY_ENABLE          = (1 << 11),
+	SPRUCE_IMAP_CAPABILITY_QRESYNC         = (1 << 12),
 	
 	/* Non-standard extensions */
 	SPRUCE_IMAP_CAPABILITY_XGWEXTENSIONS   = (1 << 14),
@@ -169,6 +171,8 @@ struct _SpruceIMAPEngine {
 	spruce_imap_level_t level;
 	guint32 capa;
 	
+	gboolean qresync;                    /* rfc5162 QRESYNC has been enabled */
+	
 	guint32 maxlen:31;
 	guint32 maxlentype:1;
 	
@@ -186,6 +190,19 @@ struct _SpruceIMAPEngine {
 	
 	SpruceList queue;                    /* queue of waiting commands */
 	struct _SpruceIMAPCommand *current;
+	
+	gboolean pipeline;                   /* send commands without waiting for responses */
+	SpruceList sent;                     /* pipelined commands awaiting completion */
+	GHashTable *tags;                    /* tag -> pipelined command */
+	int nsent;
+	
+	struct _SpruceIMAPCommand *idle;     /* outstanding IDLE command */
+	gboolean idle_resume;                /* IDLE was ended by another command */
+	
+	/* connection pool bookkeeping, protected by the store's lock */
+	GThread *owner;                      /* thread the engine is leased to */
+	guint leases;                        /* number of leases held by the owner */
+	SpruceFolder *affinity;              /* folder selected (or to be selected), referenced */
 };
 
 struct _SpruceIMAPEngineClass {
@@ -206,6 +223,7 @@ void spruce_imap_engine_disconnect (SpruceIMAPEngine *engine);
 
 int spruce_imap_engine_capability (SpruceIMAPEngine *engine, GError **err);
 int spruce_imap_engine_namespace (SpruceIMAPEngine *engine, GError **err);
+int spruce_imap_engine_enable_qresync (SpruceIMAPEngine *engine, GError **err);
 
 int spruce_imap_engine_select_folder (SpruceIMAPEngine *engine, SpruceFolder *folder, GError **err);
 
@@ -223,6 +241,11 @@ void spruce_imap_engine_dequeue (SpruceIMAPEngine *engine, struct _SpruceIMAPCom
 
 int spruce_imap_engine_iterate (SpruceIMAPEngine *engine);
 
+/* rfc2177 IDLE */
+int spruce_imap_engine_idle (SpruceIMAPEngine *engine, struct _SpruceIMAPCommand *ic, GError **err);
+int spruce_imap_engine_idle_dispatch (SpruceIMAPEngine *engine, GError **err);
+int spruce_imap_engine_get_fd (SpruceIMAPEngine *engine);
+
 
 /* untagged response utility functions */
 int spruce_imap_engine_handle_untagged_1 (SpruceIMAPEngine *engine, struct _spruce_imap_token_t *token, GError **err);
@@ -232,6 +255,7 @@ void spruce_imap_engine_handle_untagged (SpruceIMAPEngine *engine, GError **err)
 int spruce_imap_engine_next_token (SpruceIMAPEngine *engine, struct _spruce_imap_token_t *token, GError **err);
 int spruce_imap_engine_line (SpruceIMAPEngine *engine, unsigned char **line, size_t *len, GError **err);
 int spruce_imap_engine_literal (SpruceIMAPEngine *engine, unsigned char **literal, size_t *len, GError **err);
+int spruce_imap_engine_nstring (SpruceIMAPEngine *engine, char **nstring, size_t *len, GError **err);
 int spruce_imap_engine_eat_line (SpruceIMAPEngine *engine, GError **err);
 
 
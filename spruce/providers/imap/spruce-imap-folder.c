@@ -50,9 +50,17 @@
 #include "spruce-imap-stream.h"
 #include "spruce-imap-command.h"
 #include "spruce-imap-summary.h"
+#include "spruce-imap-search.h"
+#include "spruce-imap-part-stream.h"
 
 #define d(x) x
 
+/* messages at least this large are fetched a body part at a time */
+#define IMAP_LAZY_MESSAGE_SIZE  (256 * 1024)
+
+/* largest chunk of a body part to request in one ranged fetch */
+#define IMAP_PARTIAL_CHUNK      (1024 * 1024)
+
 static void spruce_imap_folder_class_init (SpruceIMAPFolderClass *klass);
 static void spruce_imap_folder_init (SpruceIMAPFolder *folder, SpruceIMAPFolderClass *klass);
 static void spruce_imap_folder_finalize (GObject *object);
@@ -70,11 +78,18 @@ static GPtrArray *imap_lsub (SpruceFolder *folder, const char *pattern, GError *
 static int imap_subscribe (SpruceFolder *folder, GError **err);
 static int imap_unsubscribe (SpruceFolder *folder, GError **err);
 static GMimeMessage *imap_get_message (SpruceFolder *folder, const char *uid, GError **err);
+static GMimeMessage *imap_get_message_headers (SpruceFolder *folder, const char *uid, GError **err);
+static GMimeStream *imap_get_message_stream (SpruceFolder *folder, const char *uid, GError **err);
+static GMimeMessage *imap_get_message_lazy (SpruceFolder *folder, const char *uid, GError **err);
 static int imap_append_message (SpruceFolder *folder, GMimeMessage *message,
 				SpruceMessageInfo *info, GError **err);
 static int imap_copy_messages (SpruceFolder *src, GPtrArray *uids, SpruceFolder *dest, GError **err);
 static int imap_move_messages (SpruceFolder *src, GPtrArray *uids, SpruceFolder *dest, GError **err);
 static GPtrArray *imap_search (SpruceFolder *folder, GPtrArray *uids, const char *expression, GError **err);
+static int imap_prefetch_messages (SpruceFolder *folder, GPtrArray *uids, guint64 budget,
+				   SpruceFolderProgressFunc progress, void *user_data, GError **err);
+static int imap_idle (SpruceFolder *folder, GError **err);
+static int imap_idle_dispatch (SpruceFolder *folder, GError **err);
 
 
 static SpruceFolder *parent_class = NULL;
@@ -129,6 +144,12 @@ spruce_imap_folder_class_init (SpruceIMAPFolderClass *klass)
 	folder_class->subscribe = imap_subscribe;
 	folder_class->unsubscribe = imap_unsubscribe;
 	folder_class->get_message = imap_get_message;
+	folder_class->get_message_headers = imap_get_message_headers;
+	folder_class->get_message_stream = imap_get_message_stream;
+	folder_class->get_message_lazy = imap_get_message_lazy;
+	folder_class->prefetch_messages = imap_prefetch_messages;
+	folder_class->idle = imap_idle;
+	folder_class->idle_dispatch = imap_idle_dispatch;
 	folder_class->append_message = imap_append_message;
 	folder_class->copy_messages = imap_copy_messages;
 	folder_class->move_messages = imap_move_messages;
@@ -292,7 +313,7 @@ imap_get_path_delim (SpruceIMAPEngine *engine, const char *full_name)
 static int
 imap_folder_query_properties (SpruceFolder *folder, GError **err)
 {
-	SpruceIMAPEngine *engine = ((SpruceIMAPStore *) folder->store)->engine;
+	SpruceIMAPEngine *engine = spruce_imap_store_get_engine ((SpruceIMAPStore *) folder->store, NULL);
 	spruce_imap_list_t *list = NULL;
 	SpruceIMAPCommand *ic;
 	const char *utf7_name;
@@ -320,6 +341,8 @@ imap_folder_query_properties (SpruceFolder *folder, GError **err)
 		
 		spruce_imap_command_unref (ic);
 		
+		spruce_imap_store_release_engine ((SpruceIMAPStore *) folder->store, engine);
+		
 		return -1;
 	}
 	
@@ -373,14 +396,16 @@ imap_folder_query_properties (SpruceFolder *folder, GError **err)
 	
 	spruce_imap_command_unref (ic);
 	
+	spruce_imap_store_release_engine ((SpruceIMAPStore *) folder->store, engine);
+	
 	return 0;
 }
 
 SpruceFolder *
 spruce_imap_folder_new (SpruceStore *store, const char *full_name, gboolean query, GError **err)
 {
-	SpruceIMAPEngine *engine = ((SpruceIMAPStore *) store)->engine;
 	SpruceFolder *folder, *parent = NULL;
+	SpruceIMAPEngine *engine;
 	SpruceIMAPFolder *imap_folder;
 	char delim, *path, *p;
 	const char *name;
@@ -405,7 +430,9 @@ spruce_imap_folder_new (SpruceStore *store, const char *full_name, gboolean quer
 	
 	if (!parent || parent->full_name[0] == '\0') {
 		/* if our immediate parent is "" then we can't blindly use its separator */
+		engine = spruce_imap_store_get_engine ((SpruceIMAPStore *) store, NULL);
 		delim = imap_get_path_delim (engine, full_name);
+		spruce_imap_store_release_engine ((SpruceIMAPStore *) store, engine);
 	} else
 		delim = parent->separator;
 	
@@ -526,20 +553,26 @@ spruce_imap_folder_utf7_name (SpruceIMAPFolder *folder)
 static int
 imap_open (SpruceFolder *folder, GError **err)
 {
-	SpruceIMAPEngine *engine = ((SpruceIMAPStore *) folder->store)->engine;
+	SpruceIMAPStore *store = (SpruceIMAPStore *) folder->store;
+	SpruceIMAPEngine *engine;
+	int retval;
 	
 	spruce_folder_summary_load (folder->summary);
 	
-	if (spruce_imap_engine_select_folder (engine, folder, err) == -1)
-		return -1;
+	engine = spruce_imap_store_get_engine (store, folder);
+	
+	if ((retval = spruce_imap_engine_select_folder (engine, folder, err)) != -1)
+		retval = spruce_imap_summary_flush_updates (folder->summary, err);
 	
-	return spruce_imap_summary_flush_updates (folder->summary, err);
+	spruce_imap_store_release_engine (store, engine);
+	
+	return retval;
 }
 
 static int
 imap_close (SpruceFolder *folder, gboolean expunge, GError **err)
 {
-	SpruceIMAPEngine *engine = ((SpruceIMAPStore *) folder->store)->engine;
+	SpruceIMAPEngine *engine = spruce_imap_store_get_engine ((SpruceIMAPStore *) folder->store, folder);
 	SpruceIMAPCommand *ic = NULL;
 	GPtrArray *expunged = NULL;
 	SpruceMessageInfo *info;
@@ -615,6 +648,8 @@ imap_close (SpruceFolder *folder, gboolean expunge, GError **err)
 	spruce_folder_summary_unload (folder->summary);
 	folder->mode = 0;
 	
+	spruce_imap_store_release_engine ((SpruceIMAPStore *) folder->store, engine);
+	
 	return 0;
 	
  exception:
@@ -628,13 +663,15 @@ imap_close (SpruceFolder *folder, gboolean expunge, GError **err)
 	if (ic)
 		spruce_imap_command_unref (ic);
 	
+	spruce_imap_store_release_engine ((SpruceIMAPStore *) folder->store, engine);
+	
 	return -1;
 }
 
 static int
 imap_create (SpruceFolder *folder, int type, GError **err)
 {
-	SpruceIMAPEngine *engine = ((SpruceIMAPStore *) folder->store)->engine;
+	SpruceIMAPEngine *engine = spruce_imap_store_get_engine ((SpruceIMAPStore *) folder->store, NULL);
 	SpruceIMAPCommand *ic;
 	int id, retval;
 	char *name;
@@ -656,6 +693,7 @@ imap_create (SpruceFolder *folder, int type, GError **err)
 		g_propagate_error (err, ic->err);
 		ic->err = NULL;
 		spruce_imap_command_unref (ic);
+		spruce_imap_store_release_engine ((SpruceIMAPStore *) folder->store, engine);
 		return -1;
 	}
 	
@@ -684,14 +722,17 @@ imap_create (SpruceFolder *folder, int type, GError **err)
 	
 	spruce_imap_command_unref (ic);
 	
+	spruce_imap_store_release_engine ((SpruceIMAPStore *) folder->store, engine);
+	
 	return retval;
 }
 
 static int
 imap_delete (SpruceFolder *folder, GError **err)
 {
-	SpruceIMAPEngine *engine = ((SpruceIMAPStore *) folder->store)->engine;
+	SpruceIMAPStore *store = (SpruceIMAPStore *) folder->store;
 	SpruceIMAPFolder *imap_folder = (SpruceIMAPFolder *) folder;
+	SpruceIMAPEngine *engine;
 	SpruceIMAPCommand *ic;
 	int id, retval = 0;
 	
@@ -703,6 +744,10 @@ imap_delete (SpruceFolder *folder, GError **err)
 		return -1;
 	}
 	
+	/* if the folder is selected, the engine it is selected on
+	 * needs to know that it's gone */
+	engine = spruce_imap_store_get_engine_for (store, folder);
+	
 	ic = spruce_imap_engine_queue (engine, NULL, "DELETE %F\r\n", folder);
 	while ((id = spruce_imap_engine_iterate (engine)) < ic->id && id != -1)
 		;
@@ -711,6 +756,7 @@ imap_delete (SpruceFolder *folder, GError **err)
 		g_propagate_error (err, ic->err);
 		ic->err = NULL;
 		spruce_imap_command_unref (ic);
+		spruce_imap_store_release_engine (store, engine);
 		return -1;
 	}
 	
@@ -737,6 +783,8 @@ imap_delete (SpruceFolder *folder, GError **err)
 	
 	spruce_imap_command_unref (ic);
 	
+	spruce_imap_store_release_engine (store, engine);
+	
 	return retval;
 }
 
@@ -746,7 +794,6 @@ imap_move_cache (SpruceFolder *folder, const char *newname)
 {
 	SpruceIMAPFolder *imap_folder = (SpruceIMAPFolder *) folder;
 	char *new_cachedir, *new_summary_path, *new_cache;
-	const char *old_summary_path;
 	
 	/* update the cachedir location */
 	new_cachedir = imap_store_build_filename (folder->store, newname);
@@ -767,12 +814,7 @@ imap_move_cache (SpruceFolder *folder, const char *newname)
 		/* rename the summary file */
 		if (folder->summary) {
 			new_summary_path = imap_get_summary_filename (new_cachedir);
-			if ((old_summary_path = spruce_folder_summary_get_filename (folder->summary))) {
-				if (rename (old_summary_path, new_summary_path) == -1 && errno != ENOENT)
-					unlink (old_summary_path);
-			}
-			
-			spruce_folder_summary_set_filename (folder->summary, new_summary_path);
+			spruce_folder_summary_rename (folder->summary, new_summary_path);
 			g_free (new_summary_path);
 		}
 		
@@ -801,8 +843,9 @@ imap_move_cache (SpruceFolder *folder, const char *newname)
 static int
 imap_rename (SpruceFolder *folder, const char *newname, GError **err)
 {
-	SpruceIMAPEngine *engine = ((SpruceIMAPStore *) folder->store)->engine;
+	SpruceIMAPStore *store = (SpruceIMAPStore *) folder->store;
 	SpruceIMAPFolder *imap_folder = (SpruceIMAPFolder *) folder;
+	SpruceIMAPEngine *engine;
 	SpruceIMAPCommand *ic;
 	char *utf7, *new, *p;
 	int id, retval = 0;
@@ -825,6 +868,10 @@ imap_rename (SpruceFolder *folder, const char *newname, GError **err)
 	utf7 = spruce_imap_utf8_utf7 (new);
 	g_free (new);
 	
+	/* if the folder is selected, the engine it is selected on
+	 * needs to know about the new name */
+	engine = spruce_imap_store_get_engine_for (store, folder);
+	
 	ic = spruce_imap_engine_queue (engine, NULL, "RENAME %F %S\r\n", folder, utf7);
 	while ((id = spruce_imap_engine_iterate (engine)) < ic->id && id != -1)
 		;
@@ -833,6 +880,7 @@ imap_rename (SpruceFolder *folder, const char *newname, GError **err)
 		g_propagate_error (err, ic->err);
 		ic->err = NULL;
 		spruce_imap_command_unref (ic);
+		spruce_imap_store_release_engine (store, engine);
 		g_free (utf7);
 		return -1;
 	}
@@ -865,6 +913,8 @@ imap_rename (SpruceFolder *folder, const char *newname, GError **err)
 	spruce_imap_command_unref (ic);
 	g_free (utf7);
 	
+	spruce_imap_store_release_engine (store, engine);
+	
 	return retval;
 }
 
@@ -911,29 +961,136 @@ static struct {
 	{ "Junk",       SPRUCE_MESSAGE_JUNK      },
 };
 
-static int
-imap_sync_flag (SpruceFolder *folder, GPtrArray *infos, char onoff, const char *flag, GError **err)
+/* a set of messages which all need the same flags added and removed */
+struct imap_store_t {
+	guint32 on, off;
+	GPtrArray *infos;
+};
+
+static void
+imap_flags_list (char *buf, guint32 flags)
+{
+	char *p = buf;
+	int i;
+	
+	for (i = 0; i < G_N_ELEMENTS (imap_flags); i++) {
+		if (flags & imap_flags[i].flag) {
+			if (p > buf)
+				*p++ = ' ';
+			p = g_stpcpy (p, imap_flags[i].name);
+		}
+	}
+	
+	*p = '\0';
+}
+
+static void
+imap_queue_store (SpruceIMAPEngine *engine, SpruceFolder *folder, GPtrArray *infos,
+		  char onoff, guint32 flags, GPtrArray *queued)
 {
-	SpruceIMAPEngine *engine = ((SpruceIMAPStore *) folder->store)->engine;
 	SpruceIMAPCommand *ic;
-	int i, id, retval = 0;
-	char *set = NULL;
+	char list[100];
+	char *set;
+	int i;
+	
+	imap_flags_list (list, flags);
 	
 	for (i = 0; i < infos->len; ) {
-		i += spruce_imap_get_uid_set (engine, folder->summary, infos, i, 30 + strlen (flag), &set);
+		i += spruce_imap_get_uid_set (engine, folder->summary, infos, i, 30 + strlen (list), &set);
+		
+		ic = spruce_imap_engine_queue (engine, folder, "UID STORE %s %cFLAGS.SILENT (%s)\r\n", set, onoff, list);
+		g_ptr_array_add (queued, ic);
+		g_free (set);
+	}
+}
+
+static int
+imap_sync_changes (SpruceFolder *folder, GPtrArray *sync, GError **err)
+{
+	SpruceIMAPEngine *engine = spruce_imap_store_get_engine ((SpruceIMAPStore *) folder->store, folder);
+	struct imap_store_t *store;
+	SpruceIMAPMessageInfo *iinfo;
+	guint32 on, off, mask = 0;
+	GPtrArray *groups, *queued;
+	SpruceMessageInfo *info;
+	SpruceIMAPCommand *ic;
+	int i, j, id, retval = 0;
+	flags_diff_t diff;
+	
+	for (i = 0; i < G_N_ELEMENTS (imap_flags); i++)
+		mask |= imap_flags[i].flag;
+	
+	mask &= folder->permanent_flags;
+	
+	/* group the messages by the complete set of flags to add and
+	 * remove so that each group needs only one or two STOREs */
+	groups = g_ptr_array_new ();
+	
+	for (i = 0; i < sync->len; i++) {
+		info = (SpruceMessageInfo *) sync->pdata[i];
+		iinfo = (SpruceIMAPMessageInfo *) info;
+		
+		spruce_imap_flags_diff (&diff, iinfo->server_flags, info->flags);
+		on = diff.changed & diff.bits & mask;
+		off = diff.changed & ~diff.bits & mask;
+		
+		if (on == 0 && off == 0)
+			continue;
+		
+		for (j = 0; j < groups->len; j++) {
+			store = groups->pdata[j];
+			if (store->on == on && store->off == off)
+				break;
+		}
+		
+		if (j == groups->len) {
+			store = g_new (struct imap_store_t, 1);
+			store->infos = g_ptr_array_new ();
+			store->on = on;
+			store->off = off;
+			
+			g_ptr_array_add (groups, store);
+		}
+		
+		g_ptr_array_add (store->infos, info);
+	}
+	
+	/* queue all of the STOREs up front so that the engine can pipeline them */
+	queued = g_ptr_array_new ();
+	
+	for (i = 0; i < groups->len; i++) {
+		store = groups->pdata[i];
+		
+		if (store->on)
+			imap_queue_store (engine, folder, store->infos, '+', store->on, queued);
+		
+		if (store->off)
+			imap_queue_store (engine, folder, store->infos, '-', store->off, queued);
+		
+		g_ptr_array_free (store->infos, TRUE);
+		g_free (store);
+	}
+	
+	g_ptr_array_free (groups, TRUE);
+	
+	for (i = 0; i < queued->len; i++) {
+		ic = queued->pdata[i];
+		
+		if (retval == -1) {
+			spruce_imap_engine_dequeue (engine, ic);
+			spruce_imap_command_unref (ic);
+			continue;
+		}
 		
-		ic = spruce_imap_engine_queue (engine, folder, "UID STORE %s %cFLAGS.SILENT (%s)\r\n", set, onoff, flag);
 		while ((id = spruce_imap_engine_iterate (engine)) < ic->id && id != -1)
 			;
 		
-		g_free (set);
-		
 		if (id == -1 || ic->status != SPRUCE_IMAP_COMMAND_COMPLETE) {
 			g_propagate_error (err, ic->err);
 			ic->err = NULL;
 			spruce_imap_command_unref (ic);
-			
-			return -1;
+			retval = -1;
+			continue;
 		}
 		
 		switch (ic->result) {
@@ -953,72 +1110,21 @@ imap_sync_flag (SpruceFolder *folder, GPtrArray *infos, char onoff, const char *
 		}
 		
 		spruce_imap_command_unref (ic);
-		
-		if (retval == -1)
-			return -1;
 	}
 	
-	return 0;
-}
-
-static int
-imap_sync_changes (SpruceFolder *folder, GPtrArray *sync, GError **err)
-{
-	SpruceIMAPMessageInfo *iinfo;
-	GPtrArray *on_set, *off_set;
-	SpruceMessageInfo *info;
-	flags_diff_t diff;
-	int retval = 0;
-	int i, j;
-	
-	on_set = g_ptr_array_new ();
-	off_set = g_ptr_array_new ();
-	
-	/* construct commands to sync system and user flags */
-	for (i = 0; i < G_N_ELEMENTS (imap_flags); i++) {
-		if (!(imap_flags[i].flag & folder->permanent_flags))
-			continue;
-		
-		for (j = 0; j < sync->len; j++) {
-			info = (SpruceMessageInfo *) sync->pdata[j];
-			iinfo = (SpruceIMAPMessageInfo *) info;
-			
-			spruce_imap_flags_diff (&diff, iinfo->server_flags, info->flags);
-			if (diff.changed & imap_flags[i].flag) {
-				if (diff.bits & imap_flags[i].flag) {
-					g_ptr_array_add (on_set, info);
-				} else {
-					g_ptr_array_add (off_set, info);
-				}
-			}
-		}
-		
-		if (on_set->len > 0) {
-			if ((retval = imap_sync_flag (folder, on_set, '+', imap_flags[i].name, err)) == -1)
-				break;
-			
-			g_ptr_array_set_size (on_set, 0);
-		}
-		
-		if (off_set->len > 0) {
-			if ((retval = imap_sync_flag (folder, off_set, '-', imap_flags[i].name, err)) == -1)
-				break;
-			
-			g_ptr_array_set_size (off_set, 0);
-		}
-	}
+	g_ptr_array_free (queued, TRUE);
 	
-	g_ptr_array_free (on_set, TRUE);
-	g_ptr_array_free (off_set, TRUE);
+	spruce_imap_store_release_engine ((SpruceIMAPStore *) folder->store, engine);
 	
 	if (retval == -1)
-		return-1;
+		return -1;
 	
 	for (i = 0; i < sync->len; i++) {
 		info = (SpruceMessageInfo *) sync->pdata[i];
 		iinfo = (SpruceIMAPMessageInfo *) info;
 		info->flags &= ~SPRUCE_MESSAGE_DIRTY;
 		iinfo->server_flags = info->flags & folder->permanent_flags;
+		spruce_folder_summary_touch_info (folder->summary, info);
 	}
 	
 	return 0;
@@ -1027,7 +1133,7 @@ imap_sync_changes (SpruceFolder *folder, GPtrArray *sync, GError **err)
 static int
 imap_expunge_all (SpruceFolder *folder, GError **err)
 {
-	SpruceIMAPEngine *engine = ((SpruceIMAPStore *) folder->store)->engine;
+	SpruceIMAPEngine *engine = spruce_imap_store_get_engine ((SpruceIMAPStore *) folder->store, folder);
 	SpruceIMAPCommand *ic;
 	int retval = 0;
 	int id;
@@ -1057,13 +1163,16 @@ imap_expunge_all (SpruceFolder *folder, GError **err)
 	
 	spruce_imap_command_unref (ic);
 	
+	spruce_imap_store_release_engine ((SpruceIMAPStore *) folder->store, engine);
+	
 	return retval;
 }
 
 static int
 imap_sync (SpruceFolder *folder, gboolean expunge, GError **err)
 {
-	SpruceIMAPEngine *engine = ((SpruceIMAPStore *) folder->store)->engine;
+	SpruceIMAPEngine *engine = spruce_imap_store_get_engine ((SpruceIMAPStore *) folder->store, folder);
+	const SpruceSummaryColumns *columns;
 	SpruceIMAPMessageInfo *iinfo;
 	SpruceMessageInfo *info;
 	SpruceIMAPCommand *ic;
@@ -1073,24 +1182,24 @@ imap_sync (SpruceFolder *folder, gboolean expunge, GError **err)
 	int count, i;
 	
 	/* gather a list of changes to sync to the server */
-	count = spruce_folder_summary_count (folder->summary);
+	columns = spruce_folder_summary_get_columns (folder->summary);
+	count = columns->len;
 	sync = g_ptr_array_new ();
 	
 	for (i = 0; i < count; i++) {
+		if (!(columns->flags[i] & SPRUCE_MESSAGE_DIRTY))
+			continue;
+		
 		info = spruce_folder_summary_index (folder->summary, i);
 		iinfo = (SpruceIMAPMessageInfo *) info;
-		if (info->flags & SPRUCE_MESSAGE_DIRTY) {
-			spruce_imap_flags_diff (&diff, iinfo->server_flags, info->flags);
-			diff.changed &= folder->permanent_flags;
-			
-			/* weed out flag changes that we can't sync to the server */
-			if (!diff.changed)
-				spruce_folder_summary_info_unref (folder->summary, info);
-			else
-				g_ptr_array_add (sync, info);
-		} else {
+		spruce_imap_flags_diff (&diff, iinfo->server_flags, info->flags);
+		diff.changed &= folder->permanent_flags;
+		
+		/* weed out flag changes that we can't sync to the server */
+		if (!diff.changed)
 			spruce_folder_summary_info_unref (folder->summary, info);
-		}
+		else
+			g_ptr_array_add (sync, info);
 	}
 	
 	if (sync->len > 0) {
@@ -1101,8 +1210,10 @@ imap_sync (SpruceFolder *folder, gboolean expunge, GError **err)
 		
 		g_ptr_array_free (sync, TRUE);
 		
-		if (retval == -1)
+		if (retval == -1) {
+			spruce_imap_store_release_engine ((SpruceIMAPStore *) folder->store, engine);
 			return -1;
+		}
 	} else {
 		g_ptr_array_free (sync, TRUE);
 	}
@@ -1113,6 +1224,8 @@ imap_sync (SpruceFolder *folder, gboolean expunge, GError **err)
 		retval = spruce_imap_summary_flush_updates (folder->summary, err);
 	}
 	
+	spruce_imap_store_release_engine ((SpruceIMAPStore *) folder->store, engine);
+	
 	spruce_folder_summary_save (folder->summary);
 	
 	return retval;
@@ -1121,7 +1234,7 @@ imap_sync (SpruceFolder *folder, gboolean expunge, GError **err)
 static int
 imap_expunge_uids_manual (SpruceFolder *folder, GPtrArray *uids, GError **err)
 {
-	SpruceIMAPEngine *engine = ((SpruceIMAPStore *) folder->store)->engine;
+	SpruceIMAPEngine *engine = spruce_imap_store_get_engine ((SpruceIMAPStore *) folder->store, folder);
 	SpruceMessageInfo *info;
 	SpruceIMAPCommand *ic;
 	GHashTable *uid_hash;
@@ -1147,34 +1260,32 @@ imap_expunge_uids_manual (SpruceFolder *folder, GPtrArray *uids, GError **err)
 		/* temporarily undelete this message */
 		info->flags &= ~SPRUCE_MESSAGE_DELETED;
 		info->flags |= SPRUCE_MESSAGE_DIRTY;
+		spruce_folder_summary_touch_info (folder->summary, info);
 		
 		g_ptr_array_add (undelete, info);
 	}
 	
-	if (undelete->len > 0)
-		spruce_folder_summary_touch (folder->summary);
-	
 	retval = imap_sync (folder, TRUE, err);
 	
-	if (undelete->len > 0)
-		spruce_folder_summary_touch (folder->summary);
-	
 	/* re-delete any temporarily undeleted messages */
 	for (i = 0; i < undelete->len; i++) {
 		info = (SpruceMessageInfo *) undelete->pdata[i];
 		info->flags |= (SPRUCE_MESSAGE_DELETED | SPRUCE_MESSAGE_DIRTY);
+		spruce_folder_summary_touch_info (folder->summary, info);
 		spruce_folder_summary_info_unref (folder->summary, info);
 	}
 	
 	g_ptr_array_free (undelete, TRUE);
 	
+	spruce_imap_store_release_engine ((SpruceIMAPStore *) folder->store, engine);
+	
 	return retval;
 }
 
 static int
 imap_expunge_uids (SpruceFolder *folder, GPtrArray *uids, GError **err)
 {
-	SpruceIMAPEngine *engine = ((SpruceIMAPStore *) folder->store)->engine;
+	SpruceIMAPEngine *engine = spruce_imap_store_get_engine ((SpruceIMAPStore *) folder->store, folder);
 	SpruceMessageInfo *info;
 	SpruceIMAPCommand *ic;
 	GPtrArray *expunge;
@@ -1182,8 +1293,10 @@ imap_expunge_uids (SpruceFolder *folder, GPtrArray *uids, GError **err)
 	char *set = NULL;
 	int i;
 	
-	if (imap_sync (folder, FALSE, err) == -1)
+	if (imap_sync (folder, FALSE, err) == -1) {
+		spruce_imap_store_release_engine ((SpruceIMAPStore *) folder->store, engine);
 		return -1;
+	}
 	
 	expunge = g_ptr_array_new ();
 	for (i = 0; i < uids->len; i++) {
@@ -1240,24 +1353,33 @@ imap_expunge_uids (SpruceFolder *folder, GPtrArray *uids, GError **err)
 	
 	g_ptr_array_free (expunge, TRUE);
 	
+	spruce_imap_store_release_engine ((SpruceIMAPStore *) folder->store, engine);
+	
 	return retval;
 }
 
 static int
 imap_expunge (SpruceFolder *folder, GPtrArray *uids, GError **err)
 {
-	SpruceIMAPEngine *engine = ((SpruceIMAPStore *) folder->store)->engine;
+	SpruceIMAPStore *store = (SpruceIMAPStore *) folder->store;
+	SpruceIMAPEngine *engine;
+	int retval;
 	
 	if (SPRUCE_FOLDER_CLASS (parent_class)->expunge (folder, uids, err) == -1)
 		return -1;
 	
-	if (!uids)
-		return imap_expunge_all (folder, err);
+	engine = spruce_imap_store_get_engine (store, folder);
 	
-	if (!(engine->capa & SPRUCE_IMAP_CAPABILITY_UIDPLUS))
-		return imap_expunge_uids_manual (folder, uids, err);
+	if (!uids)
+		retval = imap_expunge_all (folder, err);
+	else if (!(engine->capa & SPRUCE_IMAP_CAPABILITY_UIDPLUS))
+		retval = imap_expunge_uids_manual (folder, uids, err);
 	else
-		return imap_expunge_uids (folder, uids, err);
+		retval = imap_expunge_uids (folder, uids, err);
+	
+	spruce_imap_store_release_engine (store, engine);
+	
+	return retval;
 }
 
 
@@ -1325,7 +1447,7 @@ imap_glob_match (SpruceFolder *folder, GPtrArray *array, const char *pattern)
 static GPtrArray *
 imap_list_or_lsub (SpruceFolder *folder, const char *cmd, const char *pattern, GError **err)
 {
-	SpruceIMAPEngine *engine = ((SpruceIMAPStore *) folder->store)->engine;
+	SpruceIMAPEngine *engine = spruce_imap_store_get_engine ((SpruceIMAPStore *) folder->store, NULL);
 	GPtrArray *array, *ls = NULL;
 	const char *start, *inptr;
 	spruce_imap_list_t *list;
@@ -1377,6 +1499,7 @@ imap_list_or_lsub (SpruceFolder *folder, const char *cmd, const char *pattern, G
 		
 		g_ptr_array_free (array, TRUE);
 		spruce_imap_command_unref (ic);
+		spruce_imap_store_release_engine ((SpruceIMAPStore *) folder->store, engine);
 		g_free (utf7_pattern);
 		return NULL;
 	}
@@ -1418,6 +1541,8 @@ imap_list_or_lsub (SpruceFolder *folder, const char *cmd, const char *pattern, G
 	
 	spruce_imap_command_unref (ic);
 	
+	spruce_imap_store_release_engine ((SpruceIMAPStore *) folder->store, engine);
+	
 	return ls;
 }
 
@@ -1436,7 +1561,7 @@ imap_lsub (SpruceFolder *folder, const char *pattern, GError **err)
 static int
 imap_subscribe (SpruceFolder *folder, GError **err)
 {
-	SpruceIMAPEngine *engine = ((SpruceIMAPStore *) folder->store)->engine;
+	SpruceIMAPEngine *engine = spruce_imap_store_get_engine ((SpruceIMAPStore *) folder->store, NULL);
 	SpruceIMAPCommand *ic;
 	int id, retval = 0;
 	
@@ -1448,6 +1573,7 @@ imap_subscribe (SpruceFolder *folder, GError **err)
 		g_propagate_error (err, ic->err);
 		ic->err = NULL;
 		spruce_imap_command_unref (ic);
+		spruce_imap_store_release_engine ((SpruceIMAPStore *) folder->store, engine);
 		return -1;
 	}
 	
@@ -1472,13 +1598,15 @@ imap_subscribe (SpruceFolder *folder, GError **err)
 	
 	spruce_imap_command_unref (ic);
 	
+	spruce_imap_store_release_engine ((SpruceIMAPStore *) folder->store, engine);
+	
 	return retval;
 }
 
 static int
 imap_unsubscribe (SpruceFolder *folder, GError **err)
 {
-	SpruceIMAPEngine *engine = ((SpruceIMAPStore *) folder->store)->engine;
+	SpruceIMAPEngine *engine = spruce_imap_store_get_engine ((SpruceIMAPStore *) folder->store, NULL);
 	SpruceIMAPCommand *ic;
 	int id, retval = 0;
 	
@@ -1490,6 +1618,7 @@ imap_unsubscribe (SpruceFolder *folder, GError **err)
 		g_propagate_error (err, ic->err);
 		ic->err = NULL;
 		spruce_imap_command_unref (ic);
+		spruce_imap_store_release_engine ((SpruceIMAPStore *) folder->store, engine);
 		return -1;
 	}
 	
@@ -1514,19 +1643,48 @@ imap_unsubscribe (SpruceFolder *folder, GError **err)
 	
 	spruce_imap_command_unref (ic);
 	
+	spruce_imap_store_release_engine ((SpruceIMAPStore *) folder->store, engine);
+	
 	return retval;
 }
 
-static int
-untagged_fetch (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic, guint32 index, spruce_imap_token_t *token, GError **err)
+static void
+imap_fetch_update_flags (SpruceIMAPEngine *engine, guint32 index, guint32 flags)
 {
 	SpruceFolderSummary *summary = ((SpruceFolder *) engine->folder)->summary;
-	GMimeStream *fstream, *stream = ic->user_data;
 	SpruceFolderChangeInfo *changes;
 	SpruceIMAPMessageInfo *iinfo;
 	SpruceMessageInfo *info;
-	GMimeFilter *crlf;
 	guint32 new_flags;
+	
+	if (!(info = spruce_folder_summary_index (summary, index - 1)))
+		return;
+	
+	iinfo = (SpruceIMAPMessageInfo *) info;
+	new_flags = spruce_imap_merge_flags (iinfo->server_flags, info->flags, flags);
+	iinfo->server_flags = flags;
+	
+	if (info->flags != new_flags) {
+		info->flags = new_flags;
+		changes = spruce_folder_change_info_new ();
+		spruce_folder_change_info_change_uid (changes, info->uid);
+		g_signal_emit_by_name (engine->folder, "folder-changed", changes);
+		spruce_folder_change_info_free (changes);
+	}
+	
+	spruce_folder_summary_touch_info (summary, info);
+	spruce_folder_summary_info_unref (summary, info);
+}
+
+static int
+untagged_fetch (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic, guint32 index, spruce_imap_token_t *token, GError **err)
+{
+	SpruceFolderSummary *summary = ((SpruceFolder *) engine->folder)->summary;
+	SpruceSummaryContentInfo *content = NULL;
+	GMimeStream *stream = ic->user_data;
+	SpruceMessageInfo *info;
+	guint32 uid = 0;
+	char uidstr[12];
 	guint32 flags;
 	
 	if (spruce_imap_engine_next_token (engine, token, err) == -1)
@@ -1548,7 +1706,8 @@ untagged_fetch (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic, guint32 index,
 		if (token->token != SPRUCE_IMAP_TOKEN_ATOM)
 			goto unexpected;
 		
-		if (!strcmp (token->v.atom, "BODY[")) {
+		if (!strncmp (token->v.atom, "BODY[", 5) && stream != NULL) {
+			/* BODY[], BODY[HEADER] or BODY[<section>] */
 			if (spruce_imap_engine_next_token (engine, token, err) == -1)
 				goto exception;
 			
@@ -1558,44 +1717,61 @@ untagged_fetch (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic, guint32 index,
 			if (spruce_imap_engine_next_token (engine, token, err) == -1)
 				goto exception;
 			
-			if (token->token != SPRUCE_IMAP_TOKEN_LITERAL)
+			/* partial fetches are answered with the origin octet, e.g. <0> */
+			if (token->token == SPRUCE_IMAP_TOKEN_ATOM && token->v.atom[0] == '<') {
+				if (spruce_imap_engine_next_token (engine, token, err) == -1)
+					goto exception;
+			}
+			
+			switch (token->token) {
+			case SPRUCE_IMAP_TOKEN_LITERAL:
+				/* write the literal straight out of the engine's read buffer */
+				if (spruce_imap_stream_literal_to_stream (engine->istream, stream, TRUE) == -1) {
+					g_set_error (err, SPRUCE_ERROR, errno ? errno : SPRUCE_ERROR_GENERIC,
+						     _("IMAP server %s unexpectedly disconnected: %s"),
+						     engine->url->host, errno ? g_strerror (errno) : _("Unknown"));
+					goto exception;
+				}
+				break;
+			case SPRUCE_IMAP_TOKEN_QSTRING:
+				g_mime_stream_write_string (stream, token->v.qstring);
+				break;
+			case SPRUCE_IMAP_TOKEN_NIL:
+				break;
+			default:
 				goto unexpected;
+			}
 			
-			fstream = g_mime_stream_filter_new (stream);
-			crlf = g_mime_filter_crlf_new (FALSE, FALSE);
-			g_mime_stream_filter_add ((GMimeStreamFilter *) fstream, crlf);
-			g_object_unref (crlf);
+			g_mime_stream_flush (stream);
+		} else if (!strcmp (token->v.atom, "BODYSTRUCTURE")) {
+			if (content != NULL) {
+				spruce_summary_content_info_free (content);
+				content = NULL;
+			}
 			
-			g_mime_stream_write_to_stream ((GMimeStream *) engine->istream, fstream);
-			g_mime_stream_flush (fstream);
-			g_object_unref (fstream);
+			if (spruce_imap_parse_bodystructure (engine, &content, err) == -1)
+				goto exception;
 		} else if (!strcmp (token->v.atom, "UID")) {
 			if (spruce_imap_engine_next_token (engine, token, err) == -1)
 				goto exception;
 			
 			if (token->token != SPRUCE_IMAP_TOKEN_NUMBER || token->v.number == 0)
 				goto unexpected;
+			
+			uid = token->v.number;
 		} else if (!strcmp (token->v.atom, "FLAGS")) {
 			/* even though we didn't request this bit of information, it might be
 			 * given to us if another client recently changed the flags... */
 			if (spruce_imap_parse_flags_list (engine, &flags, err) == -1)
 				goto exception;
 			
-			if ((info = spruce_folder_summary_index (summary, index - 1))) {
-				iinfo = (SpruceIMAPMessageInfo *) info;
-				new_flags = spruce_imap_merge_flags (iinfo->server_flags, info->flags, flags);
-				iinfo->server_flags = flags;
-				
-				if (info->flags != new_flags) {
-					info->flags = new_flags;
-					changes = spruce_folder_change_info_new ();
-					spruce_folder_change_info_change_uid (changes, info->uid);
-					g_signal_emit_by_name (engine->folder, "folder-changed", changes);
-					spruce_folder_change_info_free (changes);
-				}
-				
-				spruce_folder_summary_info_unref (summary, info);
-			}
+			imap_fetch_update_flags (engine, index, flags);
+		} else if (!strcmp (token->v.atom, "MODSEQ")) {
+			/* sent along with FLAGS once CONDSTORE is in use */
+			guint64 modseq;
+			
+			if (spruce_imap_parse_modseq (engine, &modseq, err) == -1)
+				goto exception;
 		} else {
 			/* wtf? */
 			fprintf (stderr, "huh? %s?...\n", token->v.atom);
@@ -1607,6 +1783,21 @@ untagged_fetch (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic, guint32 index,
 		goto unexpected;
 	}
 	
+	if (content != NULL) {
+		if (uid != 0) {
+			sprintf (uidstr, "%u", uid);
+			info = spruce_folder_summary_uid (summary, uidstr);
+		} else {
+			info = spruce_folder_summary_index (summary, index - 1);
+		}
+		
+		if (info != NULL) {
+			spruce_imap_summary_set_content (summary, info, content);
+			spruce_folder_summary_info_unref (summary, info);
+		} else
+			spruce_summary_content_info_free (content);
+	}
+	
 	return 0;
 	
  unexpected:
@@ -1615,34 +1806,33 @@ untagged_fetch (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic, guint32 index,
 	
  exception:
 	
+	if (content != NULL)
+		spruce_summary_content_info_free (content);
+	
 	return -1;
 }
 
-static GMimeMessage *
-imap_get_message (SpruceFolder *folder, const char *uid, GError **err)
+static GMimeStream *
+imap_get_message_stream (SpruceFolder *folder, const char *uid, GError **err)
 {
-	SpruceIMAPEngine *engine = ((SpruceIMAPStore *) folder->store)->engine;
+	SpruceIMAPStore *store = (SpruceIMAPStore *) folder->store;
 	SpruceCache *cache = ((SpruceIMAPFolder *) folder)->cache;
-	GMimeMessage *message = NULL;
+	GMimeStream *stream = NULL;
+	SpruceIMAPEngine *engine;
 	SpruceIMAPCommand *ic;
-	GMimeParser *parser;
-	GMimeStream *stream;
 	int commit = TRUE;
 	int id;
 	
 	/* try getting the message from the cache first... */
-	if ((stream = spruce_cache_get (cache, uid, NULL))) {
-		parser = g_mime_parser_new_with_stream (stream);
-		message = g_mime_parser_construct_message (parser);
-		g_object_unref (parser);
-		
-		return message;
-	}
+	if ((stream = spruce_cache_get_mapped (cache, uid, NULL)))
+		return stream;
+	
+	engine = spruce_imap_store_get_engine (store, folder);
 	
 	ic = spruce_imap_engine_queue (engine, folder, "UID FETCH %s BODY.PEEK[]\r\n", uid);
 	spruce_imap_command_register_untagged (ic, "FETCH", untagged_fetch);
-	if (!(ic->user_data = stream = spruce_cache_add (cache, uid, NULL))) {
-		ic->user_data = stream = g_mime_stream_mem_new ();
+	if (!(ic->user_data = spruce_cache_add (cache, uid, NULL))) {
+		ic->user_data = g_mime_stream_mem_new ();
 		commit = FALSE;
 	}
 	
@@ -1654,20 +1844,18 @@ imap_get_message (SpruceFolder *folder, const char *uid, GError **err)
 		g_object_unref (ic->user_data);
 		ic->err = NULL;
 		spruce_imap_command_unref (ic);
+		spruce_imap_store_release_engine (store, engine);
 		return NULL;
 	}
 	
 	switch (ic->result) {
 	case SPRUCE_IMAP_RESULT_OK:
-		if (commit) {
-			stream = spruce_cache_stream_commit (ic->user_data);
-			g_object_unref (ic->user_data);
-		}
+		/* the committed stream is mapped straight from the cache
+		 * file; if committing fails, use what we wrote instead */
+		if (!commit || !(stream = spruce_cache_stream_commit (ic->user_data)))
+			stream = g_object_ref (ic->user_data);
 		
 		g_mime_stream_reset (stream);
-		parser = g_mime_parser_new_with_stream (stream);
-		message = g_mime_parser_construct_message (parser);
-		g_object_unref (parser);
 		break;
 	case SPRUCE_IMAP_RESULT_NO:
 		/* FIXME: would be good to save the NO reason into the err message */
@@ -1682,63 +1870,509 @@ imap_get_message (SpruceFolder *folder, const char *uid, GError **err)
 		break;
 	}
 	
+	g_object_unref (ic->user_data);
 	spruce_imap_command_unref (ic);
 	
-	g_object_unref (stream);
+	spruce_imap_store_release_engine (store, engine);
 	
-	return message;
+	return stream;
 }
 
 static void
-imap_append_info (SpruceFolder *folder, GMimeMessage *message, SpruceMessageInfo *info, guint32 auid)
+imap_fetch_part_reset (SpruceIMAPCommand *ic, GMimeStream *chunk)
 {
-	SpruceIMAPMessageInfo *iinfo;
-	SpruceMessageInfo *minfo;
-	char uid[12];
+	/* the command is being resent; throw away what we got so far */
+	g_byte_array_set_size (GMIME_STREAM_MEM (chunk)->buffer, 0);
+	g_mime_stream_reset (chunk);
+}
+
+/**
+ * spruce_imap_folder_get_section:
+ * @folder: a #SpruceIMAPFolder
+ * @uid: message uid
+ * @section: IMAP body section specifier (e.g. "1.2")
+ * @octets: size of the section as reported by BODYSTRUCTURE
+ * @err: a #GError
+ *
+ * Gets the contents of body part @section of message @uid, fetching
+ * it from the server (in ranged chunks if it is large) and adding it
+ * to the folder's cache if it isn't cached already.
+ *
+ * Returns a stream over the decoded-CRLF section contents or %NULL on
+ * error.
+ **/
+GMimeStream *
+spruce_imap_folder_get_section (SpruceFolder *folder, const char *uid, const char *section, size_t octets, GError **err)
+{
+	SpruceIMAPStore *store = (SpruceIMAPStore *) folder->store;
+	SpruceCache *cache = ((SpruceIMAPFolder *) folder)->cache;
+	GMimeStream *stream, *chunk, *committed;
+	SpruceIMAPEngine *engine;
+	SpruceIMAPCommand *ic;
+	gboolean cr = FALSE;
+	int commit = TRUE;
+	size_t offset = 0;
+	GByteArray *buf;
+	size_t len;
+	char *key;
+	int id;
 	
-	sprintf (uid, "%u", auid);
+	key = g_strdup_printf ("%s.%s", uid, section);
 	
-	if ((minfo = spruce_folder_summary_uid (folder->summary, uid))) {
-		/* this should never happen but is here for safety sake */
-		spruce_folder_summary_info_unref (folder->summary, minfo);
-		return;
+	if ((stream = spruce_cache_get_mapped (cache, key, NULL))) {
+		g_free (key);
+		return stream;
 	}
 	
-	minfo = spruce_folder_summary_info_new_from_message (folder->summary, message);
-	iinfo = (SpruceIMAPMessageInfo *) minfo;
-	minfo->uid = g_strdup (uid);
-	
-	minfo->flags = info->flags;
-	iinfo->server_flags = info->flags & folder->permanent_flags;
+	if (!(stream = spruce_cache_add (cache, key, NULL))) {
+		stream = g_mime_stream_mem_new ();
+		commit = FALSE;
+	}
 	
-	spruce_tag_list_copy (&minfo->user_tags, &info->user_tags);
-	spruce_flag_list_copy (&minfo->user_flags, &info->user_flags);
+	g_free (key);
 	
-	spruce_folder_summary_add (folder->summary, minfo);
-}
-
-static char *tm_months[] = {
-	"Jan", "Feb", "Mar", "Apr", "May", "Jun",
-	"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
-};
-
-static int
-imap_append_message (SpruceFolder *folder, GMimeMessage *message, SpruceMessageInfo *info, GError **err)
-{
-	SpruceIMAPEngine *engine = ((SpruceIMAPStore *) folder->store)->engine;
-	SpruceIMAPSummary *summary = (SpruceIMAPSummary *) folder->summary;
-	SpruceIMAPRespCode *resp;
-	SpruceIMAPCommand *ic;
-	GError *lerr = NULL;
-	char flags[100], *p;
-	char date[50];
-	struct tm tm;
-	int retval;
-	int id, i;
+	engine = spruce_imap_store_get_engine (store, folder);
+	chunk = g_mime_stream_mem_new ();
 	
-	/* construct the option flags list */
-	if (info->flags & folder->permanent_flags) {
-		p = g_stpcpy (flags, " (");
+	/* large parts are fetched a chunk at a time so that we never
+	 * have to hold an enormous literal in a single response */
+	do {
+		if (octets > IMAP_PARTIAL_CHUNK)
+			ic = spruce_imap_engine_queue (engine, folder, "UID FETCH %s BODY.PEEK[%s]<%u.%u>\r\n",
+						       uid, section, (unsigned int) offset, IMAP_PARTIAL_CHUNK);
+		else
+			ic = spruce_imap_engine_queue (engine, folder, "UID FETCH %s BODY.PEEK[%s]\r\n", uid, section);
+		
+		spruce_imap_command_register_untagged (ic, "FETCH", untagged_fetch);
+		ic->reset = (SpruceIMAPCommandReset) imap_fetch_part_reset;
+		ic->user_data = chunk;
+		
+		while ((id = spruce_imap_engine_iterate (engine)) < ic->id && id != -1)
+			;
+		
+		if (id == -1 || ic->status != SPRUCE_IMAP_COMMAND_COMPLETE) {
+			g_propagate_error (err, ic->err);
+			ic->err = NULL;
+			spruce_imap_command_unref (ic);
+			goto exception;
+		}
+		
+		switch (ic->result) {
+		case SPRUCE_IMAP_RESULT_OK:
+			break;
+		case SPRUCE_IMAP_RESULT_NO:
+			g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_FOLDER_NO_SUCH_MESSAGE,
+				     _("Cannot get part %s of message %s from folder `%s': No such message"),
+				     section, uid, folder->full_name);
+			spruce_imap_command_unref (ic);
+			goto exception;
+		case SPRUCE_IMAP_RESULT_BAD:
+			g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_GENERIC,
+				     _("Cannot get part %s of message %s from folder `%s': Bad command"),
+				     section, uid, folder->full_name);
+			spruce_imap_command_unref (ic);
+			goto exception;
+		}
+		
+		spruce_imap_command_unref (ic);
+		
+		/* a CRLF pair may have been split across two chunks, in
+		 * which case the chunk's trailing CR is held back */
+		buf = GMIME_STREAM_MEM (chunk)->buffer;
+		len = buf->len;
+		
+		if (cr && (len == 0 || buf->data[0] != '\n'))
+			g_mime_stream_write (stream, "\r", 1);
+		
+		if ((cr = len > 0 && buf->data[len - 1] == '\r'))
+			len--;
+		
+		g_mime_stream_write (stream, (char *) buf->data, len);
+		
+		g_byte_array_set_size (buf, 0);
+		g_mime_stream_reset (chunk);
+		
+		offset += IMAP_PARTIAL_CHUNK;
+	} while (octets > IMAP_PARTIAL_CHUNK && offset < octets);
+	
+	if (cr)
+		g_mime_stream_write (stream, "\r", 1);
+	
+	spruce_imap_store_release_engine (store, engine);
+	g_object_unref (chunk);
+	
+	g_mime_stream_flush (stream);
+	
+	if (commit && (committed = spruce_cache_stream_commit ((SpruceCacheStream *) stream))) {
+		g_object_unref (stream);
+		stream = committed;
+	}
+	
+	g_mime_stream_reset (stream);
+	
+	return stream;
+	
+ exception:
+	
+	spruce_imap_store_release_engine (store, engine);
+	g_object_unref (chunk);
+	g_object_unref (stream);
+	
+	return NULL;
+}
+
+static int
+imap_fetch_bodystructure (SpruceFolder *folder, const char *uid, GError **err)
+{
+	SpruceIMAPEngine *engine = spruce_imap_store_get_engine ((SpruceIMAPStore *) folder->store, folder);
+	SpruceIMAPCommand *ic;
+	int retval = -1;
+	int id;
+	
+	/* the untagged FETCH handler stores it on the message info */
+	ic = spruce_imap_engine_queue (engine, folder, "UID FETCH %s (BODYSTRUCTURE)\r\n", uid);
+	spruce_imap_command_register_untagged (ic, "FETCH", untagged_fetch);
+	
+	while ((id = spruce_imap_engine_iterate (engine)) < ic->id && id != -1)
+		;
+	
+	if (id == -1 || ic->status != SPRUCE_IMAP_COMMAND_COMPLETE) {
+		g_propagate_error (err, ic->err);
+		ic->err = NULL;
+		spruce_imap_command_unref (ic);
+		spruce_imap_store_release_engine ((SpruceIMAPStore *) folder->store, engine);
+		return -1;
+	}
+	
+	switch (ic->result) {
+	case SPRUCE_IMAP_RESULT_OK:
+		retval = 0;
+		break;
+	case SPRUCE_IMAP_RESULT_NO:
+		g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_FOLDER_NO_SUCH_MESSAGE,
+			     _("Cannot get message %s from folder `%s': No such message"),
+			     uid, folder->full_name);
+		break;
+	case SPRUCE_IMAP_RESULT_BAD:
+		g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_GENERIC,
+			     _("Cannot get message %s from folder `%s': Bad command"),
+			     uid, folder->full_name);
+		break;
+	}
+	
+	spruce_imap_command_unref (ic);
+	
+	spruce_imap_store_release_engine ((SpruceIMAPStore *) folder->store, engine);
+	
+	return retval;
+}
+
+static GMimeContentType *
+imap_content_type_copy (GMimeContentType *content_type)
+{
+	const GMimeParam *param;
+	GMimeContentType *copy;
+	
+	copy = g_mime_content_type_new (g_mime_content_type_get_media_type (content_type),
+					g_mime_content_type_get_media_subtype (content_type));
+	
+	param = g_mime_content_type_get_params (content_type);
+	while (param != NULL) {
+		g_mime_content_type_set_parameter (copy, g_mime_param_get_name (param), g_mime_param_get_value (param));
+		param = g_mime_param_next (param);
+	}
+	
+	return copy;
+}
+
+static GMimeObject *
+imap_build_part (SpruceFolder *folder, const char *uid, SpruceSummaryContentInfo *content, const char *section)
+{
+	GMimeContentEncoding encoding = GMIME_CONTENT_ENCODING_DEFAULT;
+	SpruceSummaryContentInfo *child;
+	GMimeContentType *content_type;
+	GMimeDataWrapper *wrapper;
+	GMimeObject *object, *sub;
+	GMimeStream *stream;
+	char *subsection;
+	char *str;
+	int i = 1;
+	
+	content_type = imap_content_type_copy (content->content_type);
+	
+	if (content->children && g_mime_content_type_is_type (content->content_type, "multipart", "*")) {
+		object = (GMimeObject *) g_mime_multipart_new ();
+		g_mime_object_set_content_type (object, content_type);
+		g_object_unref (content_type);
+		
+		/* children of the top-level multipart are 1, 2, ... */
+		child = content->children;
+		while (child != NULL) {
+			if (section != NULL)
+				subsection = g_strdup_printf ("%s.%d", section, i++);
+			else
+				subsection = g_strdup_printf ("%d", i++);
+			
+			sub = imap_build_part (folder, uid, child, subsection);
+			g_mime_multipart_add ((GMimeMultipart *) object, sub);
+			g_object_unref (sub);
+			g_free (subsection);
+			
+			child = child->next;
+		}
+		
+		return object;
+	}
+	
+	/* everything else, including message/rfc822, is a leaf whose
+	 * content gets fetched the first time it is read */
+	object = (GMimeObject *) g_mime_part_new ();
+	g_mime_object_set_content_type (object, content_type);
+	g_object_unref (content_type);
+	
+	if (content->disposition) {
+		str = g_mime_content_disposition_to_string (content->disposition, FALSE);
+		g_mime_object_set_header (object, "Content-Disposition", str);
+		g_free (str);
+	}
+	
+	if (content->content_id) {
+		str = g_mime_utils_decode_message_id (content->content_id);
+		g_mime_object_set_content_id (object, str);
+		g_free (str);
+	}
+	
+	if (content->description)
+		g_mime_part_set_content_description ((GMimePart *) object, content->description);
+	
+	if (content->encoding) {
+		encoding = g_mime_content_encoding_from_string (content->encoding);
+		g_mime_part_set_content_encoding ((GMimePart *) object, encoding);
+	}
+	
+	stream = spruce_imap_part_stream_new (folder, uid, section ? section : "1", content->octets);
+	wrapper = g_mime_data_wrapper_new_with_stream (stream, encoding);
+	g_mime_part_set_content_object ((GMimePart *) object, wrapper);
+	g_object_unref (wrapper);
+	g_object_unref (stream);
+	
+	return object;
+}
+
+/* builds a large multipart message from its BODYSTRUCTURE with
+ * each part backed by a SpruceIMAPPartStream, or returns NULL if the
+ * message would be better off fetched whole */
+static GMimeMessage *
+imap_build_message (SpruceFolder *folder, const char *uid)
+{
+	SpruceIMAPStore *store = (SpruceIMAPStore *) folder->store;
+	SpruceSummaryContentInfo *content;
+	GMimeMessage *message = NULL;
+	SpruceIMAPEngine *engine;
+	SpruceMessageInfo *info;
+	spruce_imap_level_t level;
+	GMimeObject *body;
+	
+	engine = spruce_imap_store_get_engine (store, folder);
+	level = engine->level;
+	spruce_imap_store_release_engine (store, engine);
+	
+	/* partial fetches and BODYSTRUCTURE are IMAP4rev1 */
+	if (level < SPRUCE_IMAP_LEVEL_IMAP4REV1)
+		return NULL;
+	
+	if (!(info = spruce_folder_summary_uid (folder->summary, uid)))
+		return NULL;
+	
+	if (info->size < IMAP_LAZY_MESSAGE_SIZE)
+		goto done;
+	
+	if (!(content = spruce_imap_summary_get_content (folder->summary, info))) {
+		if (imap_fetch_bodystructure (folder, uid, NULL) == -1)
+			goto done;
+		
+		content = spruce_imap_summary_get_content (folder->summary, info);
+	}
+	
+	/* a single part would have to be fetched whole anyway */
+	if (!content || !content->children ||
+	    !g_mime_content_type_is_type (content->content_type, "multipart", "*"))
+		goto done;
+	
+	if (!(message = imap_get_message_headers (folder, uid, NULL)))
+		goto done;
+	
+	body = imap_build_part (folder, uid, content, NULL);
+	g_mime_message_set_mime_part (message, body);
+	g_object_unref (body);
+	
+ done:
+	
+	spruce_folder_summary_info_unref (folder->summary, info);
+	
+	return message;
+}
+
+static GMimeMessage *
+imap_get_message_lazy (SpruceFolder *folder, const char *uid, GError **err)
+{
+	SpruceCache *cache = ((SpruceIMAPFolder *) folder)->cache;
+	GMimeMessage *message;
+	GMimeStream *stream;
+	
+	/* large messages we don't already have get their parts
+	 * fetched on demand rather than all up front */
+	if ((stream = spruce_cache_get (cache, uid, NULL)))
+		g_object_unref (stream);
+	else if ((message = imap_build_message (folder, uid)))
+		return message;
+	
+	return imap_get_message (folder, uid, err);
+}
+
+static GMimeMessage *
+imap_get_message (SpruceFolder *folder, const char *uid, GError **err)
+{
+	SpruceCache *cache = ((SpruceIMAPFolder *) folder)->cache;
+	GMimeMessage *message;
+	GMimeParser *parser;
+	GMimeStream *stream;
+	
+	if (!(stream = spruce_cache_get_mapped (cache, uid, NULL))) {
+		if (!(stream = imap_get_message_stream (folder, uid, err)))
+			return NULL;
+	}
+	
+	parser = g_mime_parser_new_with_stream (stream);
+	g_object_unref (stream);
+	
+	if (!(message = g_mime_parser_construct_message (parser))) {
+		g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_FOLDER_NO_SUCH_MESSAGE,
+			     _("Cannot get message %s from folder `%s': internal parser error"),
+			     uid, folder->full_name);
+	}
+	
+	g_object_unref (parser);
+	
+	return message;
+}
+
+static GMimeMessage *
+imap_get_message_headers (SpruceFolder *folder, const char *uid, GError **err)
+{
+	SpruceIMAPStore *store = (SpruceIMAPStore *) folder->store;
+	SpruceCache *cache = ((SpruceIMAPFolder *) folder)->cache;
+	GMimeMessage *message = NULL;
+	SpruceIMAPEngine *engine;
+	SpruceIMAPCommand *ic;
+	GMimeStream *stream;
+	int id;
+	
+	/* if we already have the whole message, use that */
+	if ((stream = spruce_cache_get (cache, uid, NULL))) {
+		message = spruce_folder_parse_message_headers (stream, FALSE);
+		g_object_unref (stream);
+		
+		return message;
+	}
+	
+	engine = spruce_imap_store_get_engine (store, folder);
+	
+	/* the headers alone don't go into the cache */
+	ic = spruce_imap_engine_queue (engine, folder, "UID FETCH %s BODY.PEEK[HEADER]\r\n", uid);
+	spruce_imap_command_register_untagged (ic, "FETCH", untagged_fetch);
+	ic->user_data = stream = g_mime_stream_mem_new ();
+	
+	while ((id = spruce_imap_engine_iterate (engine)) < ic->id && id != -1)
+		;
+	
+	if (id == -1 || ic->status != SPRUCE_IMAP_COMMAND_COMPLETE) {
+		g_propagate_error (err, ic->err);
+		ic->err = NULL;
+		spruce_imap_command_unref (ic);
+		spruce_imap_store_release_engine (store, engine);
+		g_object_unref (stream);
+		return NULL;
+	}
+	
+	switch (ic->result) {
+	case SPRUCE_IMAP_RESULT_OK:
+		g_mime_stream_reset (stream);
+		message = spruce_folder_parse_message_headers (stream, FALSE);
+		break;
+	case SPRUCE_IMAP_RESULT_NO:
+		/* FIXME: would be good to save the NO reason into the err message */
+		g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_FOLDER_NO_SUCH_MESSAGE,
+			     _("Cannot get message %s from folder `%s': No such message"),
+			     uid, folder->full_name);
+		break;
+	case SPRUCE_IMAP_RESULT_BAD:
+		g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_GENERIC,
+			     _("Cannot get message %s from folder `%s': Bad command"),
+			     uid, folder->full_name);
+		break;
+	}
+	
+	spruce_imap_command_unref (ic);
+	
+	spruce_imap_store_release_engine (store, engine);
+	
+	g_object_unref (stream);
+	
+	return message;
+}
+
+static void
+imap_append_info (SpruceFolder *folder, GMimeMessage *message, SpruceMessageInfo *info, guint32 auid)
+{
+	SpruceIMAPMessageInfo *iinfo;
+	SpruceMessageInfo *minfo;
+	char uid[12];
+	
+	sprintf (uid, "%u", auid);
+	
+	if ((minfo = spruce_folder_summary_uid (folder->summary, uid))) {
+		/* this should never happen but is here for safety sake */
+		spruce_folder_summary_info_unref (folder->summary, minfo);
+		return;
+	}
+	
+	minfo = spruce_folder_summary_info_new_from_message (folder->summary, message);
+	iinfo = (SpruceIMAPMessageInfo *) minfo;
+	minfo->uid = g_strdup (uid);
+	
+	minfo->flags = info->flags;
+	iinfo->server_flags = info->flags & folder->permanent_flags;
+	
+	spruce_tag_list_copy (&minfo->user_tags, &info->user_tags);
+	spruce_flag_list_copy (&minfo->user_flags, &info->user_flags);
+	
+	spruce_folder_summary_add (folder->summary, minfo);
+}
+
+static char *tm_months[] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+	"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+static int
+imap_append_message (SpruceFolder *folder, GMimeMessage *message, SpruceMessageInfo *info, GError **err)
+{
+	SpruceIMAPStore *store = (SpruceIMAPStore *) folder->store;
+	SpruceIMAPSummary *summary = (SpruceIMAPSummary *) folder->summary;
+	SpruceIMAPRespCode *resp;
+	SpruceIMAPEngine *engine;
+	SpruceIMAPCommand *ic;
+	GError *lerr = NULL;
+	char flags[100], *p;
+	char date[50];
+	struct tm tm;
+	int retval;
+	int id, i;
+	
+	/* construct the option flags list */
+	if (info->flags & folder->permanent_flags) {
+		p = g_stpcpy (flags, " (");
 		
 		for (i = 0; i < G_N_ELEMENTS (imap_flags); i++) {
 			if ((info->flags & imap_flags[i].flag) & folder->permanent_flags) {
@@ -1786,6 +2420,10 @@ imap_append_message (SpruceFolder *folder, GMimeMessage *message, SpruceMessageI
 		date[0] = '\0';
 	}
 	
+	/* if the folder is selected, append on the engine it is selected
+	 * on so that the new message shows up in its summary */
+	engine = spruce_imap_store_get_engine_for (store, folder);
+	
  retry:
 	
 	ic = spruce_imap_engine_queue (engine, NULL, "APPEND %F%s%s %L\r\n",
@@ -1797,6 +2435,7 @@ imap_append_message (SpruceFolder *folder, GMimeMessage *message, SpruceMessageI
 		g_propagate_error (err, ic->err);
 		ic->err = NULL;
 		spruce_imap_command_unref (ic);
+		spruce_imap_store_release_engine (store, engine);
 		return -1;
 	}
 	
@@ -1854,6 +2493,8 @@ imap_append_message (SpruceFolder *folder, GMimeMessage *message, SpruceMessageI
 	
 	spruce_imap_command_unref (ic);
 	
+	spruce_imap_store_release_engine (store, engine);
+	
 	return retval;
 }
 
@@ -1874,8 +2515,9 @@ info_uid_sort (const SpruceMessageInfo **info0, const SpruceMessageInfo **info1)
 static int
 imap_xfer_messages (SpruceFolder *src, GPtrArray *uids, SpruceFolder *dest, gboolean move, GError **err)
 {
-	SpruceIMAPEngine *engine = ((SpruceIMAPStore *) src->store)->engine;
+	SpruceIMAPStore *store = (SpruceIMAPStore *) src->store;
 	int i, j, n, id, dest_namelen, retval = 0;
+	SpruceIMAPEngine *engine;
 	SpruceMessageInfo *info;
 	SpruceIMAPCommand *ic;
 	GPtrArray *infos;
@@ -1896,6 +2538,8 @@ imap_xfer_messages (SpruceFolder *src, GPtrArray *uids, SpruceFolder *dest, gboo
 	
 	g_ptr_array_sort (infos, (GCompareFunc) info_uid_sort);
 	
+	engine = spruce_imap_store_get_engine (store, src);
+	
 	dest_namelen = strlen (spruce_imap_folder_utf7_name ((SpruceIMAPFolder *) dest));
 	
 	for (i = 0; i < infos->len; i += n) {
@@ -1961,14 +2605,15 @@ imap_xfer_messages (SpruceFolder *src, GPtrArray *uids, SpruceFolder *dest, gboo
 			for (j = i; j < n; j++) {
 				info = infos->pdata[j];
 				info->flags |= SPRUCE_MESSAGE_DELETED | SPRUCE_MESSAGE_DIRTY;
+				spruce_folder_summary_touch_info (src->summary, info);
 			}
-			
-			spruce_folder_summary_touch (src->summary);
 		}
 	}
 	
  done:
 	
+	spruce_imap_store_release_engine (store, engine);
+	
 	for (i = 0; i < infos->len; i++)
 		spruce_folder_summary_info_unref (src->summary, infos->pdata[i]);
 	g_ptr_array_free (infos, TRUE);
@@ -1988,10 +2633,423 @@ imap_move_messages (SpruceFolder *src, GPtrArray *uids, SpruceFolder *dest, GErr
 	return imap_xfer_messages (src, uids, dest, TRUE, err);
 }
 
+struct imap_prefetch_t {
+	SpruceFolderProgressFunc progress;
+	void *user_data;
+	int total;
+	int done;
+};
+
+static int
+untagged_prefetch (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic, guint32 index, spruce_imap_token_t *token, GError **err)
+{
+	SpruceFolder *folder = (SpruceFolder *) engine->folder;
+	SpruceCache *cache = ((SpruceIMAPFolder *) folder)->cache;
+	struct imap_prefetch_t *prefetch = ic->user_data;
+	GMimeStream *stream = NULL, *cached, *committed;
+	guint32 flags, uid = 0;
+	guint64 modseq;
+	char key[16];
+	
+	if (spruce_imap_engine_next_token (engine, token, err) == -1)
+		return -1;
+	
+	if (token->token != '(') {
+		spruce_imap_utils_set_unexpected_token_error (err, engine, token);
+		return -1;
+	}
+	
+	do {
+		if (spruce_imap_engine_next_token (engine, token, err) == -1)
+			goto exception;
+		
+		if (token->token == ')' || token->token == '\n')
+			break;
+		
+		if (token->token != SPRUCE_IMAP_TOKEN_ATOM)
+			goto unexpected;
+		
+		if (!strcmp (token->v.atom, "BODY[")) {
+			if (spruce_imap_engine_next_token (engine, token, err) == -1)
+				goto exception;
+			
+			if (token->token != ']')
+				goto unexpected;
+			
+			if (spruce_imap_engine_next_token (engine, token, err) == -1)
+				goto exception;
+			
+			if (token->token != SPRUCE_IMAP_TOKEN_LITERAL || stream != NULL)
+				goto unexpected;
+			
+			/* if the UID comes after the literal, we have to hold
+			 * onto the message until we know which one it is */
+			if (uid != 0) {
+				sprintf (key, "%u", uid);
+				stream = spruce_cache_add (cache, key, NULL);
+			}
+			
+			if (stream == NULL)
+				stream = g_mime_stream_mem_new ();
+			
+			if (spruce_imap_stream_literal_to_stream (engine->istream, stream, TRUE) == -1) {
+				g_set_error (err, SPRUCE_ERROR, errno ? errno : SPRUCE_ERROR_GENERIC,
+					     _("IMAP server %s unexpectedly disconnected: %s"),
+					     engine->url->host, errno ? g_strerror (errno) : _("Unknown"));
+				goto exception;
+			}
+		} else if (!strcmp (token->v.atom, "UID")) {
+			if (spruce_imap_engine_next_token (engine, token, err) == -1)
+				goto exception;
+			
+			if (token->token != SPRUCE_IMAP_TOKEN_NUMBER || token->v.number == 0)
+				goto unexpected;
+			
+			uid = token->v.number;
+		} else if (!strcmp (token->v.atom, "FLAGS")) {
+			if (spruce_imap_parse_flags_list (engine, &flags, err) == -1)
+				goto exception;
+			
+			imap_fetch_update_flags (engine, index, flags);
+		} else if (!strcmp (token->v.atom, "MODSEQ")) {
+			if (spruce_imap_parse_modseq (engine, &modseq, err) == -1)
+				goto exception;
+		} else {
+			/* wtf? */
+			fprintf (stderr, "huh? %s?...\n", token->v.atom);
+		}
+	} while (1);
+	
+	if (token->token != ')') {
+		fprintf (stderr, "expected ')' to close untagged FETCH response\n");
+		goto unexpected;
+	}
+	
+	if (stream == NULL)
+		return 0;
+	
+	if (!SPRUCE_IS_CACHE_STREAM (stream) && uid != 0) {
+		sprintf (key, "%u", uid);
+		if ((cached = spruce_cache_add (cache, key, NULL))) {
+			g_mime_stream_reset (stream);
+			g_mime_stream_write_to_stream (stream, cached);
+			g_object_unref (stream);
+			stream = cached;
+		}
+	}
+	
+	if (SPRUCE_IS_CACHE_STREAM (stream)) {
+		g_mime_stream_flush (stream);
+		if ((committed = spruce_cache_stream_commit ((SpruceCacheStream *) stream)))
+			g_object_unref (committed);
+	}
+	
+	g_object_unref (stream);
+	
+	/* our caller has stopped listening if this is a straggler
+	 * from a prefetch that failed */
+	if (prefetch != NULL) {
+		prefetch->done++;
+		if (prefetch->progress)
+			prefetch->progress (folder, prefetch->done, prefetch->total, prefetch->user_data);
+	}
+	
+	return 0;
+	
+ unexpected:
+	
+	spruce_imap_utils_set_unexpected_token_error (err, engine, token);
+	
+ exception:
+	
+	if (stream != NULL)
+		g_object_unref (stream);
+	
+	return -1;
+}
+
+static int
+imap_prefetch_messages (SpruceFolder *folder, GPtrArray *uids, guint64 budget,
+			SpruceFolderProgressFunc progress, void *user_data, GError **err)
+{
+	SpruceIMAPStore *store = (SpruceIMAPStore *) folder->store;
+	SpruceCache *cache = ((SpruceIMAPFolder *) folder)->cache;
+	struct imap_prefetch_t prefetch;
+	GPtrArray *infos, *queued;
+	SpruceIMAPEngine *engine;
+	SpruceMessageInfo *info;
+	SpruceIMAPCommand *ic;
+	GMimeStream *stream;
+	guint64 size = 0;
+	int i, id, retval = 0;
+	char *set;
+	
+	/* there's no point fetching more than the cache will keep */
+	if (budget == 0 || budget > cache->cache_size)
+		budget = cache->cache_size;
+	
+	infos = g_ptr_array_new ();
+	
+	for (i = 0; i < uids->len; i++) {
+		if (!(info = spruce_folder_summary_uid (folder->summary, uids->pdata[i])))
+			continue;
+		
+		/* skip the messages we already have */
+		if ((stream = spruce_cache_get (cache, info->uid, NULL))) {
+			spruce_folder_summary_info_unref (folder->summary, info);
+			g_object_unref (stream);
+			continue;
+		}
+		
+		if (size + info->size > budget) {
+			spruce_folder_summary_info_unref (folder->summary, info);
+			break;
+		}
+		
+		g_ptr_array_add (infos, info);
+		size += info->size;
+	}
+	
+	if (infos->len == 0) {
+		g_ptr_array_free (infos, TRUE);
+		return 0;
+	}
+	
+	g_ptr_array_sort (infos, (GCompareFunc) info_uid_sort);
+	
+	engine = spruce_imap_store_get_engine (store, folder);
+	
+	prefetch.progress = progress;
+	prefetch.user_data = user_data;
+	prefetch.total = infos->len;
+	prefetch.done = 0;
+	
+	/* queue all of the FETCHes up front so that the engine can
+	 * pipeline them; each message is written into its own cache
+	 * entry as it arrives */
+	queued = g_ptr_array_new ();
+	
+	for (i = 0; i < infos->len; ) {
+		i += spruce_imap_get_uid_set (engine, folder->summary, infos, i, 26, &set);
+		
+		ic = spruce_imap_engine_queue (engine, folder, "UID FETCH %s BODY.PEEK[]\r\n", set);
+		spruce_imap_command_register_untagged (ic, "FETCH", untagged_prefetch);
+		ic->user_data = &prefetch;
+		g_ptr_array_add (queued, ic);
+		g_free (set);
+	}
+	
+	for (i = 0; i < queued->len; i++) {
+		ic = queued->pdata[i];
+		
+		if (retval == -1) {
+			/* commands that were pipelined to the server can't be
+			 * dequeued, so wait for them to finish rather than have
+			 * their FETCH responses handled after we've returned */
+			spruce_imap_engine_dequeue (engine, ic);
+			if (ic->status == SPRUCE_IMAP_COMMAND_ACTIVE && id != -1) {
+				while ((id = spruce_imap_engine_iterate (engine)) < ic->id && id != -1)
+					;
+			}
+			
+			ic->user_data = NULL;
+			spruce_imap_command_unref (ic);
+			continue;
+		}
+		
+		while ((id = spruce_imap_engine_iterate (engine)) < ic->id && id != -1)
+			;
+		
+		if (id == -1 || ic->status != SPRUCE_IMAP_COMMAND_COMPLETE) {
+			g_propagate_error (err, ic->err);
+			ic->err = NULL;
+			spruce_imap_command_unref (ic);
+			retval = -1;
+			continue;
+		}
+		
+		switch (ic->result) {
+		case SPRUCE_IMAP_RESULT_NO:
+			/* FIXME: would be good to save the NO reason into the err message */
+			g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_FOLDER_NO_SUCH_MESSAGE,
+				     _("Cannot get messages from folder `%s': No such message"),
+				     folder->full_name);
+			retval = -1;
+			break;
+		case SPRUCE_IMAP_RESULT_BAD:
+			g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_GENERIC,
+				     _("Cannot get messages from folder `%s': Bad command"),
+				     folder->full_name);
+			retval = -1;
+			break;
+		}
+		
+		spruce_imap_command_unref (ic);
+	}
+	
+	g_ptr_array_free (queued, TRUE);
+	
+	spruce_imap_store_release_engine (store, engine);
+	
+	for (i = 0; i < infos->len; i++)
+		spruce_folder_summary_info_unref (folder->summary, infos->pdata[i]);
+	
+	g_ptr_array_free (infos, TRUE);
+	
+	return retval;
+}
+
+/* sends IDLE for @folder, which must be selected on @engine */
+static int
+imap_engine_idle (SpruceIMAPEngine *engine, SpruceFolder *folder, GError **err)
+{
+	SpruceIMAPCommand *ic;
+	int retval;
+	
+	ic = spruce_imap_command_new (engine, (SpruceIMAPFolder *) folder, "IDLE\r\n");
+	spruce_imap_command_register_untagged (ic, "FETCH", untagged_fetch);
+	
+	retval = spruce_imap_engine_idle (engine, ic, err);
+	
+	spruce_imap_command_unref (ic);
+	
+	return retval;
+}
+
+
+/**
+ * spruce_imap_folder_resume_idle:
+ * @engine: IMAP engine
+ * @err: a #GError
+ *
+ * Puts @engine back into IDLE on its selected folder after another
+ * command ended the IDLE, so that the folder keeps getting notified
+ * of changes. The caller must hold a lease on @engine.
+ *
+ * Returns %0 on success or %-1 on fail.
+ **/
+int
+spruce_imap_folder_resume_idle (SpruceIMAPEngine *engine, GError **err)
+{
+	g_return_val_if_fail (SPRUCE_IS_IMAP_ENGINE (engine), -1);
+	
+	if (engine->state != SPRUCE_IMAP_ENGINE_SELECTED || engine->folder == NULL) {
+		engine->idle_resume = FALSE;
+		return 0;
+	}
+	
+	/* wait until the engine has nothing else left to do */
+	if (!spruce_list_is_empty (&engine->queue) || !spruce_list_is_empty (&engine->sent))
+		return 0;
+	
+	return imap_engine_idle (engine, (SpruceFolder *) engine->folder, err);
+}
+
+static int
+imap_idle (SpruceFolder *folder, GError **err)
+{
+	SpruceIMAPStore *store = (SpruceIMAPStore *) folder->store;
+	SpruceIMAPEngine *engine;
+	int retval = -1;
+	
+	engine = spruce_imap_store_get_engine (store, folder);
+	
+	if (!(engine->capa & SPRUCE_IMAP_CAPABILITY_IDLE)) {
+		g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_GENERIC,
+			     _("Cannot watch folder `%s' for changes: not supported"),
+			     folder->full_name);
+		goto done;
+	}
+	
+	if (engine->folder != (SpruceIMAPFolder *) folder || engine->state == SPRUCE_IMAP_ENGINE_DISCONNECTED) {
+		/* IDLE only tells us about the selected folder */
+		if (spruce_imap_engine_select_folder (engine, folder, err) == -1)
+			goto done;
+	} else if (engine->state == SPRUCE_IMAP_ENGINE_IDLE) {
+		retval = spruce_imap_engine_get_fd (engine);
+		goto done;
+	}
+	
+	if (imap_engine_idle (engine, folder, err) != -1)
+		retval = spruce_imap_engine_get_fd (engine);
+	
+ done:
+	
+	spruce_imap_store_release_engine (store, engine);
+	
+	return retval;
+}
+
+static int
+imap_idle_dispatch (SpruceFolder *folder, GError **err)
+{
+	SpruceIMAPSummary *summary = (SpruceIMAPSummary *) folder->summary;
+	SpruceIMAPStore *store = (SpruceIMAPStore *) folder->store;
+	SpruceIMAPEngine *engine;
+	int retval = -1;
+	
+	engine = spruce_imap_store_get_engine (store, folder);
+	
+	if (engine->state != SPRUCE_IMAP_ENGINE_IDLE || engine->folder != (SpruceIMAPFolder *) folder) {
+		/* the connection was needed for something else and
+		 * couldn't be put back into IDLE on this folder */
+		g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_GENERIC,
+			     _("Stopped watching folder `%s' for changes"),
+			     folder->full_name);
+		goto done;
+	}
+	
+	/* EXPUNGE and FETCH responses emit folder-changed as they are handled */
+	if (spruce_imap_engine_idle_dispatch (engine, err) == -1)
+		goto done;
+	
+	/* EXISTS only tells us how many messages there are now, so we
+	 * have to go and fetch the new ones (which ends the IDLE) */
+	if (summary->exists > spruce_folder_summary_count (folder->summary) &&
+	    spruce_imap_summary_flush_updates (folder->summary, err) == -1)
+		goto done;
+	
+	if (engine->state != SPRUCE_IMAP_ENGINE_IDLE && imap_idle (folder, err) == -1)
+		goto done;
+	
+	retval = 0;
+	
+ done:
+	
+	spruce_imap_store_release_engine (store, engine);
+	
+	return retval;
+}
+
 static GPtrArray *
 imap_search (SpruceFolder *folder, GPtrArray *uids, const char *expression, GError **err)
 {
-	/* FIXME: implement me */
+	SpruceFolderSearch *search;
+	GPtrArray *matches, *summary;
+	SpruceMessageInfo *info;
+	int i;
 	
-	return NULL;
+	summary = g_ptr_array_new ();
+	for (i = 0; i < uids->len; i++) {
+		if ((info = spruce_folder_summary_uid (folder->summary, uids->pdata[i])))
+			g_ptr_array_add (summary, info);
+	}
+	
+	/* body-contains goes to the server for messages that aren't
+	 * cached, so this search must not be given any threads */
+	search = spruce_imap_search_new ();
+	spruce_folder_search_set_folder (search, folder);
+	spruce_folder_search_set_summary (search, summary);
+	
+	matches = spruce_folder_search_match_all (search, expression);
+	g_object_unref (search);
+	
+	for (i = 0; i < summary->len; i++) {
+		info = summary->pdata[i];
+		spruce_folder_summary_info_unref (folder->summary, info);
+	}
+	
+	g_ptr_array_free (summary, TRUE);
+	
+	return matches;
 }
@@ -35,6 +35,7 @@ G_BEGIN_DECLS
 #define SPRUCE_IMAP_FOLDER_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), SPRUCE_TYPE_IMAP_FOLDER, SpruceIMAPFolderClass))
 
 struct _spruce_imap_list_t;
+struct _SpruceIMAPEngine;
 
 typedef struct _SpruceIMAPFolder SpruceIMAPFolder;
 typedef struct _SpruceIMAPFolderClass SpruceIMAPFolderClass;
@@ -61,6 +62,11 @@ SpruceFolder *spruce_imap_folder_new_list (SpruceFolder *parent, struct _spruce_
 
 const char *spruce_imap_folder_utf7_name (SpruceIMAPFolder *folder);
 
+int spruce_imap_folder_resume_idle (struct _SpruceIMAPEngine *engine, GError **err);
+
+GMimeStream *spruce_imap_folder_get_section (SpruceFolder *folder, const char *uid, const char *section,
+					     size_t octets, GError **err);
+
 G_END_DECLS
 
 #endif /* __SPRUCE_IMAP_FOLDER_H__ */
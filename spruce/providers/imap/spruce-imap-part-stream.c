@@ -0,0 +1,316 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*  Spruce
+ *  Copyright (C) 1999-2009 Jeffrey Stedfast
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+
+#include "spruce-imap-folder.h"
+#include "spruce-imap-part-stream.h"
+
+
+static void spruce_imap_part_stream_class_init (SpruceIMAPPartStreamClass *klass);
+static void spruce_imap_part_stream_init (SpruceIMAPPartStream *stream, SpruceIMAPPartStreamClass *klass);
+static void spruce_imap_part_stream_finalize (GObject *object);
+
+static ssize_t stream_read (GMimeStream *stream, char *buffer, size_t n);
+static ssize_t stream_write (GMimeStream *stream, const char *buffer, size_t n);
+static int stream_flush (GMimeStream *stream);
+static int stream_close (GMimeStream *stream);
+static gboolean stream_eos (GMimeStream *stream);
+static int stream_reset (GMimeStream *stream);
+static gint64 stream_seek (GMimeStream *stream, gint64 offset, GMimeSeekWhence whence);
+static gint64 stream_tell (GMimeStream *stream);
+static gint64 stream_length (GMimeStream *stream);
+static GMimeStream *stream_substream (GMimeStream *stream, gint64 start, gint64 end);
+
+
+static GMimeStreamClass *parent_class = NULL;
+
+
+GType
+spruce_imap_part_stream_get_type (void)
+{
+	static GType type = 0;
+	
+	if (!type) {
+		static const GTypeInfo info = {
+			sizeof (SpruceIMAPPartStreamClass),
+			NULL, /* base_class_init */
+			NULL, /* base_class_finalize */
+			(GClassInitFunc) spruce_imap_part_stream_class_init,
+			NULL, /* class_finalize */
+			NULL, /* class_data */
+			sizeof (SpruceIMAPPartStream),
+			0,    /* n_preallocs */
+			(GInstanceInitFunc) spruce_imap_part_stream_init,
+		};
+		
+		type = g_type_register_static (GMIME_TYPE_STREAM, "SpruceIMAPPartStream", &info, 0);
+	}
+	
+	return type;
+}
+
+static void
+spruce_imap_part_stream_class_init (SpruceIMAPPartStreamClass *klass)
+{
+	GMimeStreamClass *stream_class = GMIME_STREAM_CLASS (klass);
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+	
+	parent_class = g_type_class_ref (GMIME_TYPE_STREAM);
+	
+	object_class->finalize = spruce_imap_part_stream_finalize;
+	
+	/* virtual method overload */
+	stream_class->read = stream_read;
+	stream_class->write = stream_write;
+	stream_class->flush = stream_flush;
+	stream_class->close = stream_close;
+	stream_class->eos = stream_eos;
+	stream_class->reset = stream_reset;
+	stream_class->seek = stream_seek;
+	stream_class->tell = stream_tell;
+	stream_class->length = stream_length;
+	stream_class->substream = stream_substream;
+}
+
+static void
+spruce_imap_part_stream_init (SpruceIMAPPartStream *part, SpruceIMAPPartStreamClass *klass)
+{
+	part->folder = NULL;
+	part->section = NULL;
+	part->uid = NULL;
+	part->octets = 0;
+	
+	part->source = NULL;
+	part->failed = FALSE;
+	
+	((GMimeStream *) part)->bound_end = -1;
+}
+
+static void
+spruce_imap_part_stream_finalize (GObject *object)
+{
+	SpruceIMAPPartStream *part = (SpruceIMAPPartStream *) object;
+	
+	if (part->source)
+		g_object_unref (part->source);
+	
+	if (part->folder)
+		g_object_unref (part->folder);
+	
+	g_free (part->section);
+	g_free (part->uid);
+	
+	G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+/* fetches the part from the cache or the server the first time it is needed */
+static gboolean
+part_stream_load (SpruceIMAPPartStream *part)
+{
+	GError *err = NULL;
+	
+	if (part->source)
+		return TRUE;
+	
+	/* don't go back to the server on every read */
+	if (part->failed) {
+		errno = EIO;
+		return FALSE;
+	}
+	
+	if (!(part->source = spruce_imap_folder_get_section (part->folder, part->uid, part->section, part->octets, &err))) {
+		g_warning ("Cannot get part %s of message %s: %s", part->section, part->uid,
+			   err ? err->message : "Unknown");
+		if (err != NULL)
+			g_error_free (err);
+		
+		part->failed = TRUE;
+		errno = EIO;
+		
+		return FALSE;
+	}
+	
+	return TRUE;
+}
+
+static ssize_t
+stream_read (GMimeStream *stream, char *buffer, size_t n)
+{
+	SpruceIMAPPartStream *part = (SpruceIMAPPartStream *) stream;
+	ssize_t nread;
+	
+	if (!part_stream_load (part))
+		return -1;
+	
+	if (g_mime_stream_seek (part->source, stream->position, GMIME_STREAM_SEEK_SET) == -1)
+		return -1;
+	
+	if ((nread = g_mime_stream_read (part->source, buffer, n)) > 0)
+		stream->position += nread;
+	
+	return nread;
+}
+
+static ssize_t
+stream_write (GMimeStream *stream, const char *buffer, size_t n)
+{
+	/* read-only */
+	errno = EINVAL;
+	
+	return -1;
+}
+
+static int
+stream_flush (GMimeStream *stream)
+{
+	return 0;
+}
+
+static int
+stream_close (GMimeStream *stream)
+{
+	SpruceIMAPPartStream *part = (SpruceIMAPPartStream *) stream;
+	
+	if (part->source) {
+		g_object_unref (part->source);
+		part->source = NULL;
+	}
+	
+	return 0;
+}
+
+static gboolean
+stream_eos (GMimeStream *stream)
+{
+	SpruceIMAPPartStream *part = (SpruceIMAPPartStream *) stream;
+	
+	if (!part_stream_load (part))
+		return TRUE;
+	
+	return stream->position >= g_mime_stream_length (part->source);
+}
+
+static int
+stream_reset (GMimeStream *stream)
+{
+	return 0;
+}
+
+static gint64
+stream_seek (GMimeStream *stream, gint64 offset, GMimeSeekWhence whence)
+{
+	SpruceIMAPPartStream *part = (SpruceIMAPPartStream *) stream;
+	gint64 real;
+	
+	switch (whence) {
+	case GMIME_STREAM_SEEK_SET:
+		real = offset;
+		break;
+	case GMIME_STREAM_SEEK_CUR:
+		real = stream->position + offset;
+		break;
+	case GMIME_STREAM_SEEK_END:
+		if (!part_stream_load (part))
+			return -1;
+		
+		real = g_mime_stream_length (part->source) + offset;
+		break;
+	default:
+		real = -1;
+		break;
+	}
+	
+	if (real < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	
+	stream->position = real;
+	
+	return real;
+}
+
+static gint64
+stream_tell (GMimeStream *stream)
+{
+	return stream->position;
+}
+
+static gint64
+stream_length (GMimeStream *stream)
+{
+	SpruceIMAPPartStream *part = (SpruceIMAPPartStream *) stream;
+	
+	if (!part_stream_load (part))
+		return -1;
+	
+	return g_mime_stream_length (part->source);
+}
+
+static GMimeStream *
+stream_substream (GMimeStream *stream, gint64 start, gint64 end)
+{
+	SpruceIMAPPartStream *part = (SpruceIMAPPartStream *) stream;
+	
+	if (!part_stream_load (part))
+		return NULL;
+	
+	return g_mime_stream_substream (part->source, start, end);
+}
+
+
+/**
+ * spruce_imap_part_stream_new:
+ * @folder: IMAP folder
+ * @uid: message uid
+ * @section: IMAP body section of the part
+ * @octets: size of the part as reported by the server
+ *
+ * Creates a stream over the content of a single MIME part which isn't
+ * fetched (or looked up in the cache) until something actually needs
+ * to read it.
+ *
+ * Returns a new read-only stream.
+ **/
+GMimeStream *
+spruce_imap_part_stream_new (SpruceFolder *folder, const char *uid, const char *section, size_t octets)
+{
+	SpruceIMAPPartStream *part;
+	
+	g_return_val_if_fail (SPRUCE_IS_IMAP_FOLDER (folder), NULL);
+	g_return_val_if_fail (section != NULL, NULL);
+	g_return_val_if_fail (uid != NULL, NULL);
+	
+	part = g_object_new (SPRUCE_TYPE_IMAP_PART_STREAM, NULL);
+	
+	part->section = g_strdup (section);
+	part->uid = g_strdup (uid);
+	part->octets = octets;
+	
+	part->folder = folder;
+	g_object_ref (folder);
+	
+	return (GMimeStream *) part;
+}
@@ -0,0 +1,65 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*  Spruce
+ *  Copyright (C) 1999-2009 Jeffrey Stedfast
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef __SPRUCE_IMAP_PART_STREAM_H__
+#define __SPRUCE_IMAP_PART_STREAM_H__
+
+#include <gmime/gmime-stream.h>
+
+#include <spruce/spruce-folder.h>
+
+G_BEGIN_DECLS
+
+#define SPRUCE_TYPE_IMAP_PART_STREAM            (spruce_imap_part_stream_get_type ())
+#define SPRUCE_IMAP_PART_STREAM(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), SPRUCE_TYPE_IMAP_PART_STREAM, SpruceIMAPPartStream))
+#define SPRUCE_IMAP_PART_STREAM_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), SPRUCE_TYPE_IMAP_PART_STREAM, SpruceIMAPPartStreamClass))
+#define SPRUCE_IS_IMAP_PART_STREAM(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), SPRUCE_TYPE_IMAP_PART_STREAM))
+#define SPRUCE_IS_IMAP_PART_STREAM_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), SPRUCE_TYPE_IMAP_PART_STREAM))
+#define SPRUCE_IMAP_PART_STREAM_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), SPRUCE_TYPE_IMAP_PART_STREAM, SpruceIMAPPartStreamClass))
+
+typedef struct _SpruceIMAPPartStream SpruceIMAPPartStream;
+typedef struct _SpruceIMAPPartStreamClass SpruceIMAPPartStreamClass;
+
+struct _SpruceIMAPPartStream {
+	GMimeStream parent_object;
+	
+	SpruceFolder *folder;
+	char *section;
+	char *uid;
+	size_t octets;
+	
+	/* the fetched content, once somebody has asked for it */
+	GMimeStream *source;
+	gboolean failed;
+};
+
+struct _SpruceIMAPPartStreamClass {
+	GMimeStreamClass parent_class;
+	
+};
+
+
+GType spruce_imap_part_stream_get_type (void);
+
+GMimeStream *spruce_imap_part_stream_new (SpruceFolder *folder, const char *uid, const char *section, size_t octets);
+
+G_END_DECLS
+
+#endif /* __SPRUCE_IMAP_PART_STREAM_H__ */
@@ -0,0 +1,316 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*  Spruce
+ *  Copyright (C) 1999-2009 Jeffrey Stedfast
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "spruce-imap-store.h"
+#include "spruce-imap-engine.h"
+#include "spruce-imap-folder.h"
+#include "spruce-imap-stream.h"
+#include "spruce-imap-command.h"
+#include "spruce-imap-search.h"
+
+
+static void spruce_imap_search_class_init (SpruceIMAPSearchClass *klass);
+static void spruce_imap_search_init (SpruceIMAPSearch *search, SpruceIMAPSearchClass *klass);
+static void spruce_imap_search_finalize (GObject *object);
+
+static SearchResult *imap_match_all (SearchContext *ctx, int argc, SearchTerm **argv,
+				     SpruceFolderSearch *s);
+static SearchResult *imap_body_contains (SearchContext *ctx, int argc, SearchResult **argv,
+					 SpruceFolderSearch *s);
+
+
+static SpruceFolderSearchClass *parent_class = NULL;
+
+
+GType
+spruce_imap_search_get_type (void)
+{
+	static GType type = 0;
+	
+	if (!type) {
+		static const GTypeInfo info = {
+			sizeof (SpruceIMAPSearchClass),
+			NULL, /* base_class_init */
+			NULL, /* base_class_finalize */
+			(GClassInitFunc) spruce_imap_search_class_init,
+			NULL, /* class_finalize */
+			NULL, /* class_data */
+			sizeof (SpruceIMAPSearch),
+			0,    /* n_preallocs */
+			(GInstanceInitFunc) spruce_imap_search_init,
+		};
+		
+		type = g_type_register_static (SPRUCE_TYPE_FOLDER_SEARCH, "SpruceIMAPSearch", &info, 0);
+	}
+	
+	return type;
+}
+
+static void
+spruce_imap_search_class_init (SpruceIMAPSearchClass *klass)
+{
+	SpruceFolderSearchClass *search_class = SPRUCE_FOLDER_SEARCH_CLASS (klass);
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+	
+	parent_class = g_type_class_ref (SPRUCE_TYPE_FOLDER_SEARCH);
+	
+	object_class->finalize = spruce_imap_search_finalize;
+	
+	search_class->match_all = imap_match_all;
+	search_class->body_contains = imap_body_contains;
+}
+
+static void
+spruce_imap_search_init (SpruceIMAPSearch *search, SpruceIMAPSearchClass *klass)
+{
+	search->body_uids = NULL;
+	search->body_strings = NULL;
+}
+
+static void
+body_strings_free (SpruceIMAPSearch *search)
+{
+	int i;
+	
+	if (search->body_strings) {
+		for (i = 0; i < search->body_strings->len; i++)
+			g_free (search->body_strings->pdata[i]);
+		g_ptr_array_free (search->body_strings, TRUE);
+		search->body_strings = NULL;
+	}
+	
+	if (search->body_uids) {
+		g_hash_table_destroy (search->body_uids);
+		search->body_uids = NULL;
+	}
+}
+
+static void
+body_strings_reset (SpruceFolderSearch *s)
+{
+	int i;
+	
+	body_strings_free ((SpruceIMAPSearch *) s);
+	
+	/* the workers of a threaded search each have their own cache */
+	if (s->workers) {
+		for (i = 0; i < s->workers->len; i++)
+			body_strings_free (s->workers->pdata[i]);
+	}
+}
+
+static void
+spruce_imap_search_finalize (GObject *object)
+{
+	SpruceIMAPSearch *search = (SpruceIMAPSearch *) object;
+	
+	body_strings_free (search);
+	
+	G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+
+/**
+ * spruce_imap_search_new:
+ *
+ * Creates a new IMAP folder search which lets the server do the
+ * body-contains matching for messages that aren't in the local cache.
+ *
+ * Returns a new #SpruceFolderSearch.
+ **/
+SpruceFolderSearch *
+spruce_imap_search_new (void)
+{
+	SpruceFolderSearch *search;
+	
+	search = g_object_new (SPRUCE_TYPE_IMAP_SEARCH, NULL);
+	spruce_folder_search_construct (search);
+	
+	return search;
+}
+
+
+static SearchResult *
+imap_match_all (SearchContext *ctx, int argc, SearchTerm **argv, SpruceFolderSearch *s)
+{
+	/* the server's matches are only good for the one run since
+	 * the folder may have changed since the last one */
+	body_strings_reset (s);
+	
+	return parent_class->match_all (ctx, argc, argv, s);
+}
+
+static int
+untagged_search (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic, guint32 index, spruce_imap_token_t *token, GError **err)
+{
+	GHashTable *uids = ic->user_data;
+	char *uid;
+	
+	do {
+		if (spruce_imap_engine_next_token (engine, token, err) == -1)
+			return -1;
+		
+		if (token->token == SPRUCE_IMAP_TOKEN_NUMBER) {
+			uid = g_strdup_printf ("%u", token->v.number);
+			g_hash_table_replace (uids, uid, uid);
+		}
+	} while (token->token != '\n');
+	
+	return 0;
+}
+
+static gboolean
+string_is_ascii (const char *str)
+{
+	register const unsigned char *inptr = (const unsigned char *) str;
+	
+	while (*inptr != '\0') {
+		if (*inptr++ > 127)
+			return FALSE;
+	}
+	
+	return TRUE;
+}
+
+/* asks the server which messages contain any of the strings */
+static GHashTable *
+imap_search_body (SpruceFolder *folder, int argc, SearchResult **argv)
+{
+	SpruceIMAPStore *store = (SpruceIMAPStore *) folder->store;
+	SpruceIMAPEngine *engine;
+	SpruceIMAPCommand *ic;
+	GHashTable *uids;
+	const char *str;
+	int id, i;
+	
+	if (!(engine = spruce_imap_store_get_engine (store, folder)))
+		return NULL;
+	
+	uids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	
+	for (i = 0; i < argc; i++) {
+		str = argv[i]->value.string;
+		
+		if (string_is_ascii (str))
+			ic = spruce_imap_engine_queue (engine, folder, "UID SEARCH BODY %S\r\n", str);
+		else
+			ic = spruce_imap_engine_queue (engine, folder, "UID SEARCH CHARSET UTF-8 BODY %S\r\n", str);
+		
+		spruce_imap_command_register_untagged (ic, "SEARCH", untagged_search);
+		ic->user_data = uids;
+		
+		while ((id = spruce_imap_engine_iterate (engine)) < ic->id && id != -1)
+			;
+		
+		/* on failure (e.g. NO [BADCHARSET]) the messages get
+		 * scanned locally instead */
+		if (id == -1 || ic->status != SPRUCE_IMAP_COMMAND_COMPLETE ||
+		    ic->result != SPRUCE_IMAP_RESULT_OK) {
+			spruce_imap_command_unref (ic);
+			spruce_imap_store_release_engine (store, engine);
+			g_hash_table_destroy (uids);
+			return NULL;
+		}
+		
+		spruce_imap_command_unref (ic);
+	}
+	
+	spruce_imap_store_release_engine (store, engine);
+	
+	return uids;
+}
+
+static gboolean
+body_strings_equal (GPtrArray *strings, int argc, SearchResult **argv)
+{
+	int i;
+	
+	if (strings->len != argc)
+		return FALSE;
+	
+	for (i = 0; i < argc; i++) {
+		if (strcmp (strings->pdata[i], argv[i]->value.string) != 0)
+			return FALSE;
+	}
+	
+	return TRUE;
+}
+
+static gboolean
+imap_message_is_cached (SpruceFolder *folder, const char *uid)
+{
+	GMimeStream *stream;
+	
+	if (!(stream = spruce_cache_get (((SpruceIMAPFolder *) folder)->cache, uid, NULL)))
+		return FALSE;
+	
+	g_object_unref (stream);
+	
+	return TRUE;
+}
+
+static SearchResult *
+imap_body_contains (SearchContext *ctx, int argc, SearchResult **argv, SpruceFolderSearch *s)
+{
+	SpruceIMAPSearch *search = (SpruceIMAPSearch *) s;
+	SearchResult *res;
+	int i;
+	
+	/* let the generic implementation complain about bad arguments */
+	for (i = 0; i < argc; i++) {
+		if (argv[i]->type != SEARCH_RESULT_STRING)
+			break;
+	}
+	
+	if (argc < 1 || i < argc || s->folder == NULL || s->current == NULL)
+		return parent_class->body_contains (ctx, argc, argv, s);
+	
+	/* messages we already have are scanned locally, which is
+	 * cheaper than a round trip and works while offline */
+	if (imap_message_is_cached (s->folder, s->current->uid))
+		return parent_class->body_contains (ctx, argc, argv, s);
+	
+	/* the server searches the whole folder once per set of
+	 * strings and the result is used for the rest of the run */
+	if (search->body_strings == NULL || !body_strings_equal (search->body_strings, argc, argv)) {
+		body_strings_free (search);
+		
+		search->body_strings = g_ptr_array_new ();
+		for (i = 0; i < argc; i++)
+			g_ptr_array_add (search->body_strings, g_strdup (argv[i]->value.string));
+		
+		search->body_uids = imap_search_body (s->folder, argc, argv);
+	}
+	
+	if (search->body_uids == NULL)
+		return parent_class->body_contains (ctx, argc, argv, s);
+	
+	res = search_result_new (SEARCH_RESULT_BOOL);
+	res->value.bool = g_hash_table_lookup (search->body_uids, s->current->uid) != NULL;
+	
+	return res;
+}
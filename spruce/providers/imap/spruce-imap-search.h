@@ -0,0 +1,60 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*  Spruce
+ *  Copyright (C) 1999-2009 Jeffrey Stedfast
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef __SPRUCE_IMAP_SEARCH_H__
+#define __SPRUCE_IMAP_SEARCH_H__
+
+#include <spruce/spruce-folder-search.h>
+
+G_BEGIN_DECLS
+
+#define SPRUCE_TYPE_IMAP_SEARCH            (spruce_imap_search_get_type ())
+#define SPRUCE_IMAP_SEARCH(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), SPRUCE_TYPE_IMAP_SEARCH, SpruceIMAPSearch))
+#define SPRUCE_IMAP_SEARCH_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), SPRUCE_TYPE_IMAP_SEARCH, SpruceIMAPSearchClass))
+#define SPRUCE_IS_IMAP_SEARCH(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), SPRUCE_TYPE_IMAP_SEARCH))
+#define SPRUCE_IS_IMAP_SEARCH_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), SPRUCE_TYPE_IMAP_SEARCH))
+#define SPRUCE_IMAP_SEARCH_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), SPRUCE_TYPE_IMAP_SEARCH, SpruceIMAPSearchClass))
+
+typedef struct _SpruceIMAPSearch SpruceIMAPSearch;
+typedef struct _SpruceIMAPSearchClass SpruceIMAPSearchClass;
+
+struct _SpruceIMAPSearch {
+	SpruceFolderSearch parent_object;
+	
+	/* the uids the server matched for the last set of
+	 * body-contains strings, or NULL if the server couldn't
+	 * do the search and the messages have to be scanned */
+	GHashTable *body_uids;
+	GPtrArray *body_strings;
+};
+
+struct _SpruceIMAPSearchClass {
+	SpruceFolderSearchClass parent_class;
+	
+};
+
+
+GType spruce_imap_search_get_type (void);
+
+SpruceFolderSearch *spruce_imap_search_new (void);
+
+G_END_DECLS
+
+#endif /* __SPRUCE_IMAP_SEARCH_H__ */
@@ -23,6 +23,7 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 
@@ -40,6 +41,9 @@
 #include "spruce-imap-stream.h"
 #include "spruce-imap-command.h"
 
+/* upper bound on the "connections" url param */
+#define IMAP_MAX_CONNECTIONS  8
+
 
 static void spruce_imap_store_class_init (SpruceIMAPStoreClass *klass);
 static void spruce_imap_store_init (SpruceIMAPStore *store, SpruceIMAPStoreClass *klass);
@@ -112,16 +116,31 @@ spruce_imap_store_class_init (SpruceIMAPStoreClass *klass)
 static void
 spruce_imap_store_init (SpruceIMAPStore *store, SpruceIMAPStoreClass *klass)
 {
+	store->engines = g_ptr_array_new ();
+	store->max_engines = 1;
 	store->engine = NULL;
+	
+	store->lock = g_mutex_new ();
+	store->cond = g_cond_new ();
+	store->disconnecting = FALSE;
 }
 
 static void
 spruce_imap_store_finalize (GObject *object)
 {
 	SpruceIMAPStore *store = (SpruceIMAPStore *) object;
+	guint i;
+	
+	for (i = 0; i < store->engines->len; i++)
+		g_object_unref (store->engines->pdata[i]);
+	
+	g_ptr_array_free (store->engines, TRUE);
+	
+	if (store->lock)
+		g_mutex_free (store->lock);
 	
-	if (store->engine)
-		g_object_unref (store->engine);
+	if (store->cond)
+		g_cond_free (store->cond);
 	
 	G_OBJECT_CLASS (parent_class)->finalize (object);
 }
@@ -136,10 +155,9 @@ enum {
 #define SSL_PORT_FLAGS (SPRUCE_TCP_STREAM_SSL_ENABLE_SSL3 | SPRUCE_TCP_STREAM_SSL_ENABLE_SSL_CONNECT)
 
 static gboolean
-connect_to_server (SpruceService *service, struct addrinfo *ai, int mode, GError **err)
+connect_to_server (SpruceIMAPEngine *engine, struct addrinfo *ai, int mode, GError **err)
 {
-	SpruceIMAPStore *store = (SpruceIMAPStore *) service;
-	SpruceIMAPEngine *engine = store->engine;
+	SpruceService *service = engine->service;
 	GMimeStream *tcp_stream;
 	SpruceIMAPCommand *ic;
 	GError *lerr = NULL;
@@ -285,7 +303,7 @@ connect_to_server_wrapper (SpruceIMAPEngine *engine, GError **err)
 	if (!(ai = spruce_getaddrinfo (service->url->host, serv, port, &hints, err)))
 		return FALSE;
 	
-	ret = connect_to_server (service, ai, mode, err);
+	ret = connect_to_server (engine, ai, mode, err);
 	
 	spruce_freeaddrinfo (ai);
 	
@@ -331,9 +349,9 @@ sasl_auth (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic, const unsigned char
 }
 
 static int
-imap_try_authenticate (SpruceService *service, const char *key, gboolean reprompt, const char *errmsg, GError **err)
+imap_try_authenticate (SpruceIMAPEngine *engine, const char *key, gboolean reprompt, const char *errmsg, GError **err)
 {
-	SpruceIMAPStore *store = (SpruceIMAPStore *) service;
+	SpruceService *service = engine->service;
 	SpruceSession *session = service->session;
 	SpruceSASL *sasl = NULL;
 	SpruceIMAPCommand *ic;
@@ -363,19 +381,19 @@ imap_try_authenticate (SpruceService *service, const char *key, gboolean repromp
 	if (service->url->auth) {
 		SpruceServiceAuthType *mech;
 		
-		mech = g_hash_table_lookup (store->engine->authtypes, service->url->auth);
+		mech = g_hash_table_lookup (engine->authtypes, service->url->auth);
 		sasl = spruce_sasl_new ("imap", mech->authproto, service);
 		
-		ic = spruce_imap_engine_prequeue (store->engine, NULL, "AUTHENTICATE %s\r\n",
+		ic = spruce_imap_engine_prequeue (engine, NULL, "AUTHENTICATE %s\r\n",
 						  service->url->auth);
 		ic->plus = sasl_auth;
 		ic->user_data = sasl;
 	} else {
-		ic = spruce_imap_engine_prequeue (store->engine, NULL, "LOGIN %S %S\r\n",
+		ic = spruce_imap_engine_prequeue (engine, NULL, "LOGIN %S %S\r\n",
 						  service->url->user, service->url->passwd);
 	}
 	
-	while ((id = spruce_imap_engine_iterate (store->engine)) < ic->id && id != -1)
+	while ((id = spruce_imap_engine_iterate (engine)) < ic->id && id != -1)
 		;
 	
 	if (sasl != NULL)
@@ -408,7 +426,6 @@ imap_try_authenticate (SpruceService *service, const char *key, gboolean repromp
 static int
 imap_reconnect (SpruceIMAPEngine *engine, GError **err)
 {
-	SpruceIMAPStore *store = (SpruceIMAPStore *) engine->service;
 	SpruceService *service = engine->service;
 	SpruceServiceAuthType *mech;
 	gboolean reprompt = FALSE;
@@ -422,7 +439,7 @@ imap_reconnect (SpruceIMAPEngine *engine, GError **err)
 		return -1;
 	
 	if (engine->state != SPRUCE_IMAP_ENGINE_AUTHENTICATED) {
-#define CANT_USE_AUTHMECH (!(mech = g_hash_table_lookup (store->engine->authtypes, service->url->auth)))
+#define CANT_USE_AUTHMECH (!(mech = g_hash_table_lookup (engine->authtypes, service->url->auth)))
 		if (service->url->auth && CANT_USE_AUTHMECH) {
 			/* Oops. We can't AUTH using the requested mechanism */
 			g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_SERVICE_CANT_AUTHENTICATE,
@@ -433,7 +450,7 @@ imap_reconnect (SpruceIMAPEngine *engine, GError **err)
 		}
 		
 		key = spruce_url_to_string (service->url, SPRUCE_URL_HIDE_ALL);
-		while (imap_try_authenticate (service, key, reprompt, errmsg, &lerr)) {
+		while (imap_try_authenticate (engine, key, reprompt, errmsg, &lerr)) {
 			g_free (service->url->passwd);
 			service->url->passwd = NULL;
 			g_free (errmsg);
@@ -450,44 +467,378 @@ imap_reconnect (SpruceIMAPEngine *engine, GError **err)
 		}
 	}
 	
-	if (spruce_imap_engine_namespace (store->engine, err) == -1)
+	if (spruce_imap_engine_namespace (engine, err) == -1)
+		return -1;
+	
+	if (spruce_imap_engine_enable_qresync (engine, err) == -1)
 		return -1;
 	
 	return 0;
 }
 
+static SpruceIMAPEngine *
+imap_engine_new (SpruceService *service)
+{
+	SpruceIMAPEngine *engine;
+	const char *pipeline;
+	
+	engine = spruce_imap_engine_new (service, imap_reconnect);
+	
+	/* pipeline commands unless the user has disabled it */
+	engine->pipeline = TRUE;
+	if ((pipeline = spruce_url_get_param (service->url, "pipeline"))) {
+		if (!strcmp (pipeline, "no") || !strcmp (pipeline, "false"))
+			engine->pipeline = FALSE;
+	}
+	
+	return engine;
+}
+
 static int
 imap_connect (SpruceService *service, GError **err)
 {
 	SpruceIMAPStore *store = (SpruceIMAPStore *) service;
+	const char *connections;
+	guint max;
+	
+	g_mutex_lock (store->lock);
+	
+	if (!store->engine) {
+		store->engine = imap_engine_new (service);
+		g_ptr_array_add (store->engines, store->engine);
+		
+		/* how many connections we may open to the server */
+		store->max_engines = 1;
+		if ((connections = spruce_url_get_param (service->url, "connections"))) {
+			max = strtoul (connections, NULL, 10);
+			store->max_engines = CLAMP (max, 1, IMAP_MAX_CONNECTIONS);
+		}
+	}
 	
-	if (!store->engine)
-		store->engine = spruce_imap_engine_new (service, imap_reconnect);
+	g_mutex_unlock (store->lock);
 	
 	return imap_reconnect (store->engine, err);
 }
 
+static void
+imap_engine_logout (SpruceIMAPEngine *engine)
+{
+	SpruceIMAPCommand *ic;
+	int id;
+	
+	if (!engine->istream || engine->istream->disconnected)
+		return;
+	
+	ic = spruce_imap_engine_queue (engine, NULL, "LOGOUT\r\n");
+	while ((id = spruce_imap_engine_iterate (engine)) < ic->id && id != -1)
+		;
+	
+	spruce_imap_command_unref (ic);
+}
+
+/* whether any of the engines is leased to a thread other than @self */
+static gboolean
+imap_store_leased_elsewhere (SpruceIMAPStore *store, GThread *self)
+{
+	SpruceIMAPEngine *engine;
+	guint i;
+	
+	for (i = 0; i < store->engines->len; i++) {
+		engine = store->engines->pdata[i];
+		
+		if (engine->owner != NULL && engine->owner != self)
+			return TRUE;
+	}
+	
+	return FALSE;
+}
+
 static int
 imap_disconnect (SpruceService *service, gboolean clean, GError **err)
 {
 	SpruceIMAPStore *store = (SpruceIMAPStore *) service;
-	SpruceIMAPCommand *ic;
-	int id;
+	GThread *self = g_thread_self ();
+	SpruceIMAPEngine *engine;
+	guint i;
+	
+	g_mutex_lock (store->lock);
+	
+	/* stop handing out engines (waking anyone waiting for one so
+	 * that they give up) and wait for the threads which are using
+	 * one to give it back; their nested leases still succeed */
+	store->disconnecting = TRUE;
+	g_cond_broadcast (store->cond);
 	
-	if (clean && store->engine && store->engine->istream && !store->engine->istream->disconnected) {
-		ic = spruce_imap_engine_queue (store->engine, NULL, "LOGOUT\r\n");
-		while ((id = spruce_imap_engine_iterate (store->engine)) < ic->id && id != -1)
-			;
+	while (imap_store_leased_elsewhere (store, self))
+		g_cond_wait (store->cond, store->lock);
+	
+	for (i = 0; i < store->engines->len; i++) {
+		engine = store->engines->pdata[i];
 		
-		spruce_imap_command_unref (ic);
+		/* an engine the caller itself is using gets freed when
+		 * its lease is released */
+		if (engine->owner == self)
+			continue;
+		
+		if (clean)
+			imap_engine_logout (engine);
+		
+		g_object_unref (engine);
 	}
 	
-	g_object_unref (store->engine);
+	g_ptr_array_set_size (store->engines, 0);
 	store->engine = NULL;
+	store->disconnecting = FALSE;
+	
+	g_mutex_unlock (store->lock);
 	
 	return 0;
 }
 
+static SpruceIMAPEngine *
+imap_store_lease_engine (SpruceIMAPStore *store, SpruceFolder *folder, gboolean select)
+{
+	SpruceIMAPEngine *engine, *idle, *unused, *idling;
+	GThread *self = g_thread_self ();
+	SpruceFolder *affinity = NULL;
+	GError *err = NULL;
+	guint i;
+	
+	g_mutex_lock (store->lock);
+	
+	/* a thread which already holds an engine (e.g. because we were
+	 * called from one of its untagged response handlers) keeps
+	 * using that one rather than wait on another */
+	for (i = 0; i < store->engines->len; i++) {
+		engine = store->engines->pdata[i];
+		
+		if (engine->owner == self)
+			goto leased;
+	}
+	
+ retry:
+	
+	if (store->engines->len == 0 || store->disconnecting) {
+		/* not connected */
+		g_mutex_unlock (store->lock);
+		return NULL;
+	}
+	
+	idle = unused = idling = NULL;
+	
+	for (i = 0; i < store->engines->len; i++) {
+		engine = store->engines->pdata[i];
+		
+		if (folder != NULL && engine->affinity == folder) {
+			if (engine->owner == NULL)
+				goto lease;
+			
+			/* wait for whoever is using it to finish */
+			g_cond_wait (store->cond, store->lock);
+			goto retry;
+		}
+		
+		/* the owner may be changing the engine's state, but
+		 * nobody touches an engine that isn't leased */
+		if (engine->owner != NULL)
+			continue;
+		
+		if (engine->state == SPRUCE_IMAP_ENGINE_IDLE) {
+			/* another folder is waiting on it for changes */
+			if (idling == NULL)
+				idling = engine;
+		} else if (unused == NULL && engine->folder == NULL) {
+			unused = engine;
+		} else if (idle == NULL) {
+			idle = engine;
+		}
+	}
+	
+	if (unused != NULL) {
+		engine = unused;
+		goto lease;
+	}
+	
+	if ((folder == NULL || !select) && idle != NULL) {
+		/* not worth a new connection */
+		engine = idle;
+		goto lease;
+	}
+	
+	if (store->engines->len < store->max_engines) {
+		/* open another connection, without keeping everyone else
+		 * waiting on the pool while we do */
+		engine = imap_engine_new ((SpruceService *) store);
+		engine->affinity = select && folder ? g_object_ref (folder) : NULL;
+		engine->owner = self;
+		engine->leases = 1;
+		
+		g_ptr_array_add (store->engines, engine);
+		g_mutex_unlock (store->lock);
+		
+		if (imap_reconnect (engine, &err) != -1)
+			return engine;
+		
+		/* the server may limit the number of connections per
+		 * user, so don't try to grow the pool any further */
+		g_warning ("Failed to open additional connection to IMAP server %s: %s",
+			   ((SpruceService *) store)->url->host, err->message);
+		g_error_free (err);
+		
+		g_mutex_lock (store->lock);
+		g_ptr_array_remove (store->engines, engine);
+		store->max_engines = MAX (store->engines->len, 1);
+		g_object_unref (engine);
+		
+		goto retry;
+	}
+	
+	if (idle != NULL || idling != NULL) {
+		/* an engine leaves IDLE by itself when we use it */
+		engine = idle ? idle : idling;
+		goto lease;
+	}
+	
+	/* every engine is in use */
+	g_cond_wait (store->cond, store->lock);
+	goto retry;
+	
+ lease:
+	
+	if (folder != NULL && select && engine->affinity != folder) {
+		affinity = engine->affinity;
+		engine->affinity = g_object_ref (folder);
+	}
+	
+	engine->owner = self;
+	
+ leased:
+	
+	engine->leases++;
+	
+	g_mutex_unlock (store->lock);
+	
+	/* dropped outside of the lock in case it's the last reference */
+	if (affinity != NULL)
+		g_object_unref (affinity);
+	
+	return engine;
+}
+
+
+/**
+ * spruce_imap_store_get_engine:
+ * @store: IMAP store
+ * @folder: the folder the caller is going to send commands for or %NULL
+ *
+ * Leases the engine from @store's connection pool that commands for
+ * @folder should be queued on. A folder that is selected on one of
+ * the engines stays on that engine, waiting for it if another thread
+ * is using it. Otherwise an unused engine without a selected folder
+ * is preferred, then a new connection if the pool has not yet reached
+ * the size given by the "connections" url param, then any other free
+ * engine. If every engine is in use, this waits for one to be
+ * released.
+ *
+ * Pass %NULL for @folder for commands that don't need a selected
+ * folder, such as LIST or CREATE. These go to any free engine before
+ * a new connection is opened for them.
+ *
+ * The engine must be given back with spruce_imap_store_release_engine()
+ * once the caller's commands have completed. Leases nest, so a thread
+ * which already holds an engine always gets that engine back.
+ *
+ * Returns the engine to use, or %NULL if @store is not connected.
+ **/
+SpruceIMAPEngine *
+spruce_imap_store_get_engine (SpruceIMAPStore *store, SpruceFolder *folder)
+{
+	g_return_val_if_fail (SPRUCE_IS_IMAP_STORE (store), NULL);
+	
+	return imap_store_lease_engine (store, folder, TRUE);
+}
+
+
+/**
+ * spruce_imap_store_get_engine_for:
+ * @store: IMAP store
+ * @folder: the folder the caller's commands refer to
+ *
+ * Like spruce_imap_store_get_engine() but for commands which name
+ * @folder without needing it to be selected, such as APPEND, RENAME
+ * or DELETE. If @folder is selected on one of the engines, that
+ * engine is used so that it sees the changes (e.g. the EXISTS
+ * response to an APPEND), otherwise any free engine will do.
+ *
+ * Returns the engine to use, or %NULL if @store is not connected.
+ **/
+SpruceIMAPEngine *
+spruce_imap_store_get_engine_for (SpruceIMAPStore *store, SpruceFolder *folder)
+{
+	g_return_val_if_fail (SPRUCE_IS_IMAP_STORE (store), NULL);
+	
+	return imap_store_lease_engine (store, folder, FALSE);
+}
+
+
+/**
+ * spruce_imap_store_release_engine:
+ * @store: IMAP store
+ * @engine: an engine leased from @store or %NULL
+ *
+ * Gives back an engine leased with spruce_imap_store_get_engine(),
+ * letting other threads use it once the owner's outermost lease is
+ * released.
+ **/
+void
+spruce_imap_store_release_engine (SpruceIMAPStore *store, SpruceIMAPEngine *engine)
+{
+	SpruceFolder *affinity = NULL;
+	gboolean pooled = TRUE;
+	guint i;
+	
+	g_return_if_fail (SPRUCE_IS_IMAP_STORE (store));
+	
+	if (engine == NULL)
+		return;
+	
+	/* if one of the owner's commands ended an IDLE, put the engine
+	 * back into IDLE before anyone else gets to use it; only the
+	 * owner changes the lease count, so it is safe to look at */
+	if (engine->leases == 1 && engine->idle_resume)
+		spruce_imap_folder_resume_idle (engine, NULL);
+	
+	g_mutex_lock (store->lock);
+	
+	if (--engine->leases == 0) {
+		if (engine->affinity != (SpruceFolder *) engine->folder) {
+			affinity = engine->affinity;
+			engine->affinity = engine->folder ? g_object_ref (engine->folder) : NULL;
+		}
+		
+		engine->owner = NULL;
+		
+		/* the store may have been disconnected while the owner
+		 * was still using the engine (see imap_disconnect()) */
+		for (i = 0; i < store->engines->len; i++) {
+			if (store->engines->pdata[i] == engine)
+				break;
+		}
+		
+		pooled = i < store->engines->len;
+		
+		g_cond_broadcast (store->cond);
+	}
+	
+	g_mutex_unlock (store->lock);
+	
+	if (affinity != NULL)
+		g_object_unref (affinity);
+	
+	if (!pooled)
+		g_object_unref (engine);
+}
+
 extern SpruceServiceAuthType spruce_imap_password_authtype;
 
 static GList *
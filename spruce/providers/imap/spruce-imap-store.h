@@ -40,7 +40,13 @@ struct _SpruceIMAPEngine;
 struct _SpruceIMAPStore {
 	SpruceStore parent_object;
 	
-	struct _SpruceIMAPEngine *engine;
+	struct _SpruceIMAPEngine *engine;    /* primary engine, always engines[0] */
+	
+	GPtrArray *engines;                  /* pool of engines */
+	guint max_engines;                   /* pool size limit */
+	GMutex *lock;                        /* protects the pool */
+	GCond *cond;                         /* signalled when an engine is released */
+	gboolean disconnecting;              /* no new leases are handed out */
 };
 
 struct _SpruceIMAPStoreClass {
@@ -51,6 +57,10 @@ struct _SpruceIMAPStoreClass {
 
 GType spruce_imap_store_get_type (void);
 
+struct _SpruceIMAPEngine *spruce_imap_store_get_engine (SpruceIMAPStore *store, SpruceFolder *folder);
+struct _SpruceIMAPEngine *spruce_imap_store_get_engine_for (SpruceIMAPStore *store, SpruceFolder *folder);
+void spruce_imap_store_release_engine (SpruceIMAPStore *store, struct _SpruceIMAPEngine *engine);
+
 G_END_DECLS
 
 #endif /* __SPRUCE_IMAP_STORE_H__ */
@@ -44,6 +44,18 @@
 
 #define IMAP_TOKEN_LEN  128
 
+/* size of the buffer used to read large literals around our own */
+#define IMAP_LITERAL_CHUNK  (64 * 1024)
+
+/* size of a string arena block; larger requests get a block of their own */
+#define IMAP_ARENA_BLOCK_SIZE  4096
+
+struct _SpruceIMAPArenaBlock {
+	SpruceIMAPArenaBlock *next;
+	size_t size, used;
+	char data[1];
+};
+
 static void spruce_imap_stream_class_init (SpruceIMAPStreamClass *klass);
 static void spruce_imap_stream_init (SpruceIMAPStream *stream, SpruceIMAPStreamClass *klass);
 static void spruce_imap_stream_finalize (GObject *object);
@@ -120,6 +132,8 @@ spruce_imap_stream_init (SpruceIMAPStream *imap, SpruceIMAPStreamClass *klass)
 	imap->tokenptr = imap->tokenbuf;
 	imap->tokenleft = IMAP_TOKEN_LEN;
 	
+	imap->arena = NULL;
+	
 	((GMimeStream *) imap)->bound_end = -1;
 }
 
@@ -133,6 +147,9 @@ spruce_imap_stream_finalize (GObject *object)
 	
 	g_free (imap->tokenbuf);
 	
+	spruce_imap_stream_arena_reset (imap);
+	g_free (imap->arena);
+	
 	G_OBJECT_CLASS (parent_class)->finalize (object);
 }
 
@@ -554,7 +571,7 @@ spruce_imap_stream_next_token (SpruceIMAPStream *stream, spruce_imap_token_t *to
 				if (inptr == inend)
 					goto refill;
 				
-				if (*inptr >= '0' || *inptr <= '9') {
+				if (*inptr >= '0' && *inptr <= '9') {
 					/* integer overflow */
 					token->token = SPRUCE_IMAP_TOKEN_ERROR;
 					d(fprintf (stderr, "token: Error: integer overflow\n"));
@@ -740,6 +757,52 @@ spruce_imap_stream_line (SpruceIMAPStream *stream, unsigned char **line, size_t
 }
 
 
+/**
+ * spruce_imap_stream_have_line:
+ * @stream: imap stream
+ *
+ * Checks whether the rest of the current line has already been read
+ * into @stream's buffer, meaning that it can be tokenized without
+ * blocking. A buffer filled by a single line too long to fit also
+ * counts.
+ *
+ * Returns %TRUE if a complete line is buffered or %FALSE otherwise.
+ **/
+gboolean
+spruce_imap_stream_have_line (SpruceIMAPStream *stream)
+{
+	size_t inlen;
+	
+	g_return_val_if_fail (SPRUCE_IS_IMAP_STREAM (stream), FALSE);
+	
+	inlen = stream->inend - stream->inptr;
+	
+	return inlen >= IMAP_READ_BUFLEN || memchr (stream->inptr, '\n', inlen) != NULL;
+}
+
+
+/**
+ * spruce_imap_stream_fill:
+ * @stream: imap stream
+ *
+ * Reads whatever more the underlying stream has to offer into
+ * @stream's buffer. This makes a single read and so only blocks if
+ * there is nothing at all to be read.
+ *
+ * Returns the number of bytes buffered or %-1 on error.
+ **/
+ssize_t
+spruce_imap_stream_fill (SpruceIMAPStream *stream)
+{
+	g_return_val_if_fail (SPRUCE_IS_IMAP_STREAM (stream), -1);
+	
+	if ((stream->inend - stream->inptr) >= IMAP_READ_BUFLEN)
+		return stream->inend - stream->inptr;
+	
+	return imap_fill (stream);
+}
+
+
 int
 spruce_imap_stream_literal (SpruceIMAPStream *stream, unsigned char **literal, size_t *len)
 {
@@ -782,3 +845,255 @@ spruce_imap_stream_literal (SpruceIMAPStream *stream, unsigned char **literal, s
 	
 	return 1;
 }
+
+
+/* strips the CR from each CRLF pair in place; a CR at the very end of
+ * @buf is held back (and @cr set) until we know what follows it */
+static size_t
+literal_strip_cr (unsigned char *buf, size_t len, gboolean *cr)
+{
+	register unsigned char *inptr = buf;
+	unsigned char *inend = buf + len;
+	unsigned char *outptr = buf;
+	
+	while (inptr < inend) {
+		if (*inptr == '\r') {
+			if (inptr + 1 == inend) {
+				*cr = TRUE;
+				break;
+			}
+			
+			if (inptr[1] == '\n') {
+				inptr++;
+				continue;
+			}
+		}
+		
+		*outptr++ = *inptr++;
+	}
+	
+	return outptr - buf;
+}
+
+
+/**
+ * spruce_imap_stream_literal_to_stream:
+ * @stream: imap stream
+ * @ostream: output stream
+ * @crlf: %TRUE if CRLF sequences should be converted to LF
+ *
+ * Writes the remainder of the current literal to @ostream. Whatever
+ * is already buffered is written straight out of the read buffer and
+ * the rest of a large literal is read in big chunks which are handed
+ * directly to @ostream rather than being copied through the read
+ * buffer (or a filter stream) first.
+ *
+ * Note: if writing to @ostream fails, the rest of the literal is
+ * still consumed so that the stream stays in sync with the server.
+ *
+ * Returns the number of bytes written to @ostream or %-1 if reading
+ * the literal failed.
+ **/
+ssize_t
+spruce_imap_stream_literal_to_stream (SpruceIMAPStream *stream, GMimeStream *ostream, gboolean crlf)
+{
+	unsigned char *chunk, *buf = NULL;
+	gboolean cr = FALSE;
+	gboolean werr = FALSE;
+	ssize_t nwritten = 0;
+	ssize_t nread;
+	size_t n;
+	
+	g_return_val_if_fail (SPRUCE_IS_IMAP_STREAM (stream), -1);
+	g_return_val_if_fail (stream->mode == SPRUCE_IMAP_STREAM_MODE_LITERAL, -1);
+	g_return_val_if_fail (GMIME_IS_STREAM (ostream), -1);
+	
+	while (!stream->eol) {
+		if (stream->inptr == stream->inend && stream->literal > IMAP_READ_BUFLEN) {
+			/* nothing buffered and plenty left to read: bypass the read buffer */
+			if (buf == NULL)
+				buf = g_malloc (IMAP_LITERAL_CHUNK);
+			
+			n = MIN (stream->literal, IMAP_LITERAL_CHUNK);
+			if ((nread = g_mime_stream_read (stream->stream, (char *) buf, n)) <= 0) {
+				if (nread == 0)
+					stream->disconnected = TRUE;
+				
+				g_free (buf);
+				
+				return -1;
+			}
+			
+			if ((stream->literal -= nread) == 0) {
+				stream->mode = SPRUCE_IMAP_STREAM_MODE_TOKEN;
+				stream->eol = TRUE;
+			}
+			
+			n = (size_t) nread;
+			chunk = buf;
+		} else if (spruce_imap_stream_literal (stream, &chunk, &n) == -1) {
+			g_free (buf);
+			
+			return -1;
+		}
+		
+		if (n == 0 || werr)
+			continue;
+		
+		if (crlf) {
+			/* the CR held back from the last chunk wasn't part of a CRLF pair */
+			if (cr && chunk[0] != '\n') {
+				if (g_mime_stream_write (ostream, "\r", 1) == -1) {
+					werr = TRUE;
+					continue;
+				}
+				
+				nwritten++;
+			}
+			
+			cr = FALSE;
+			n = literal_strip_cr (chunk, n, &cr);
+		}
+		
+		if (n > 0) {
+			if (g_mime_stream_write (ostream, (char *) chunk, n) == -1)
+				werr = TRUE;
+			else
+				nwritten += n;
+		}
+	}
+	
+	if (cr && !werr && g_mime_stream_write (ostream, "\r", 1) != -1)
+		nwritten++;
+	
+	g_free (buf);
+	
+	return nwritten;
+}
+
+
+static SpruceIMAPArenaBlock *
+arena_block_new (size_t size)
+{
+	SpruceIMAPArenaBlock *block;
+	
+	block = g_malloc (G_STRUCT_OFFSET (SpruceIMAPArenaBlock, data) + size);
+	block->size = size;
+	block->used = 0;
+	block->next = NULL;
+	
+	return block;
+}
+
+
+/**
+ * spruce_imap_stream_arena_alloc:
+ * @stream: imap stream
+ * @size: number of bytes needed
+ *
+ * Allocates @size bytes from @stream's string arena. Unlike token
+ * values, which are only valid until the next token is read, arena
+ * memory stays valid until the next call to
+ * spruce_imap_stream_arena_reset() and must not be freed by the
+ * caller.
+ *
+ * Returns a pointer to @size bytes of uninitialized memory.
+ **/
+char *
+spruce_imap_stream_arena_alloc (SpruceIMAPStream *stream, size_t size)
+{
+	SpruceIMAPArenaBlock *block;
+	char *mem;
+	
+	g_return_val_if_fail (SPRUCE_IS_IMAP_STREAM (stream), NULL);
+	
+	size = (size + 7) & ~((size_t) 7);
+	
+	if (size > IMAP_ARENA_BLOCK_SIZE / 4) {
+		/* big strings get their own block so we don't waste
+		 * what's left of the current one */
+		block = arena_block_new (size);
+		block->used = size;
+		
+		if (stream->arena != NULL) {
+			block->next = stream->arena->next;
+			stream->arena->next = block;
+		} else {
+			stream->arena = block;
+		}
+		
+		return block->data;
+	}
+	
+	if (stream->arena == NULL || (stream->arena->size - stream->arena->used) < size) {
+		block = arena_block_new (IMAP_ARENA_BLOCK_SIZE);
+		block->next = stream->arena;
+		stream->arena = block;
+	}
+	
+	mem = stream->arena->data + stream->arena->used;
+	stream->arena->used += size;
+	
+	return mem;
+}
+
+
+/**
+ * spruce_imap_stream_arena_strndup:
+ * @stream: imap stream
+ * @str: string
+ * @len: length of @str
+ *
+ * Copies the first @len bytes of @str into @stream's string arena
+ * and nul-terminates the copy. See spruce_imap_stream_arena_alloc()
+ * for the lifetime of the result.
+ *
+ * Returns the arena copy of @str.
+ **/
+char *
+spruce_imap_stream_arena_strndup (SpruceIMAPStream *stream, const char *str, size_t len)
+{
+	char *mem;
+	
+	if (!(mem = spruce_imap_stream_arena_alloc (stream, len + 1)))
+		return NULL;
+	
+	memcpy (mem, str, len);
+	mem[len] = '\0';
+	
+	return mem;
+}
+
+
+/**
+ * spruce_imap_stream_arena_reset:
+ * @stream: imap stream
+ *
+ * Releases everything allocated from @stream's string arena. One
+ * block is kept around so that parsing the next response doesn't
+ * have to go back to malloc.
+ **/
+void
+spruce_imap_stream_arena_reset (SpruceIMAPStream *stream)
+{
+	SpruceIMAPArenaBlock *block, *keep = NULL, *next;
+	
+	g_return_if_fail (SPRUCE_IS_IMAP_STREAM (stream));
+	
+	block = stream->arena;
+	while (block != NULL) {
+		next = block->next;
+		
+		if (keep == NULL && block->size == IMAP_ARENA_BLOCK_SIZE) {
+			keep = block;
+			keep->next = NULL;
+			keep->used = 0;
+		} else {
+			g_free (block);
+		}
+		
+		block = next;
+	}
+	
+	stream->arena = keep;
+}
@@ -32,6 +32,7 @@ G_BEGIN_DECLS
 
 typedef struct _SpruceIMAPStream SpruceIMAPStream;
 typedef struct _SpruceIMAPStreamClass SpruceIMAPStreamClass;
+typedef struct _SpruceIMAPArenaBlock SpruceIMAPArenaBlock;
 
 #define IMAP_READ_PRELEN   128
 #define IMAP_READ_BUFLEN   4096
@@ -96,6 +97,10 @@ struct _SpruceIMAPStream {
 	unsigned char *tokenptr;
 	unsigned int tokenleft;
 	
+	/* scratch space for strings that must outlive the next token;
+	 * reset at the start of each untagged response */
+	SpruceIMAPArenaBlock *arena;
+	
 	spruce_imap_token_t unget;
 };
 
@@ -115,8 +120,16 @@ int spruce_imap_stream_next_token (SpruceIMAPStream *stream, spruce_imap_token_t
 int spruce_imap_stream_unget_token (SpruceIMAPStream *stream, spruce_imap_token_t *token);
 
 int spruce_imap_stream_line (SpruceIMAPStream *stream, unsigned char **line, size_t *len);
+gboolean spruce_imap_stream_have_line (SpruceIMAPStream *stream);
+ssize_t spruce_imap_stream_fill (SpruceIMAPStream *stream);
 int spruce_imap_stream_literal (SpruceIMAPStream *stream, unsigned char **literal, size_t *len);
 
+ssize_t spruce_imap_stream_literal_to_stream (SpruceIMAPStream *stream, GMimeStream *ostream, gboolean crlf);
+
+char *spruce_imap_stream_arena_alloc (SpruceIMAPStream *stream, size_t size);
+char *spruce_imap_stream_arena_strndup (SpruceIMAPStream *stream, const char *str, size_t len);
+void spruce_imap_stream_arena_reset (SpruceIMAPStream *stream);
+
 G_END_DECLS
 
 #endif /* __SPRUCE_IMAP_STREAM_H__ */
@@ -50,7 +50,7 @@
 #include "spruce-imap-summary.h"
 
 
-#define IMAP_SUMMARY_VERSION  1
+#define IMAP_SUMMARY_VERSION  3
 
 #define IMAP_SAVE_INCREMENT 1024
 
@@ -65,6 +65,10 @@ static int imap_summary_save (SpruceFolderSummary *summary);
 static SpruceMessageInfo *imap_message_info_new (SpruceFolderSummary *summary);
 static SpruceMessageInfo *imap_message_info_load (SpruceFolderSummary *summary, GMimeStream *stream);
 static int imap_message_info_save (SpruceFolderSummary *summary, GMimeStream *stream, SpruceMessageInfo *info);
+static void imap_message_info_free (SpruceFolderSummary *summary, SpruceMessageInfo *info);
+static SpruceSummaryContentInfo *imap_message_info_get_content (SpruceMessageInfo *info);
+static SpruceMessageInfo *imap_message_info_load_record (SpruceFolderSummary *summary, SpruceSummaryRecord *record);
+static int imap_message_info_save_record (SpruceFolderSummary *summary, SpruceSummaryRecord *record, SpruceMessageInfo *info);
 
 
 static SpruceFolderSummaryClass *parent_class = NULL;
@@ -112,6 +116,9 @@ spruce_imap_summary_class_init (SpruceIMAPSummaryClass *klass)
 	summary_class->message_info_new = imap_message_info_new;
 	summary_class->message_info_load = imap_message_info_load;
 	summary_class->message_info_save = imap_message_info_save;
+	summary_class->message_info_free = imap_message_info_free;
+	summary_class->message_info_load_record = imap_message_info_load_record;
+	summary_class->message_info_save_record = imap_message_info_save_record;
 }
 
 static void
@@ -125,6 +132,9 @@ spruce_imap_summary_init (SpruceIMAPSummary *summary, SpruceIMAPSummaryClass *kl
 	
 	folder_summary->message_info_size = sizeof (SpruceIMAPMessageInfo);
 	
+	summary->highestmodseq = 0;
+	summary->modseq = 0;
+	
 	summary->uidvalidity_changed = FALSE;
 	summary->update_flags = TRUE;
 }
@@ -158,6 +168,9 @@ imap_header_load (SpruceFolderSummary *summary, GMimeStream *stream)
 	if (spruce_file_util_decode_uint32 (stream, &imap_summary->uidvalidity) == -1)
 		return -1;
 	
+	if (spruce_file_util_decode_uint64 (stream, &imap_summary->highestmodseq) == -1)
+		return -1;
+	
 	return 0;
 }
 
@@ -172,19 +185,43 @@ imap_header_save (SpruceFolderSummary *summary, GMimeStream *stream)
 	if (spruce_file_util_encode_uint32 (stream, imap_summary->uidvalidity) == -1)
 		return -1;
 	
+	if (spruce_file_util_encode_uint64 (stream, imap_summary->highestmodseq) == -1)
+		return -1;
+	
 	return 0;
 }
 
+/* whether @str needs rfc2047 decoding or charset conversion */
+static gboolean
+envelope_needs_decode (const char *str)
+{
+	return strstr (str, "=?") != NULL || !g_utf8_validate (str, -1, NULL);
+}
+
+/* whether a display name is a single word that gmime would write as-is */
+static gboolean
+envelope_plain_phrase (const char *name)
+{
+	register const unsigned char *inptr = (const unsigned char *) name;
+	
+	if (*inptr == '\0')
+		return FALSE;
+	
+	while (*inptr) {
+		if (!isalnum ((int) *inptr) && !strchr ("-_'", *inptr))
+			return FALSE;
+		inptr++;
+	}
+	
+	return TRUE;
+}
+
 static int
 envelope_decode_address (SpruceIMAPEngine *engine, GString *addrs, GError **err)
 {
-	char *addr, *name = NULL, *user = NULL;
-	unsigned char *literal = NULL;
+	char *addr, *name, *user, *domain, *phrase;
 	spruce_imap_token_t token;
-	const char *domain = NULL;
 	InternetAddress *ia;
-	int part = 0;
-	size_t n;
 	
 	if (spruce_imap_engine_next_token (engine, &token, err) == -1)
 		return -1;
@@ -196,70 +233,43 @@ envelope_decode_address (SpruceIMAPEngine *engine, GString *addrs, GError **err)
 		return -1;
 	}
 	
-	if (addrs->len > 0)
-		g_string_append (addrs, ", ");
+	/* the parts are read into the stream's arena; only the
+	 * address list we're building gets to keep them */
+	if (spruce_imap_engine_nstring (engine, &name, NULL, err) == -1)
+		return -1;
 	
-	do {
-		if (spruce_imap_engine_next_token (engine, &token, err) == -1)
-			goto exception;
-		
-		literal = NULL;
-		switch (token.token) {
-		case SPRUCE_IMAP_TOKEN_NIL:
-			break;
-		case SPRUCE_IMAP_TOKEN_ATOM:
-		case SPRUCE_IMAP_TOKEN_QSTRING:
-			switch (part) {
-			case 0:
-				name = g_mime_utils_header_decode_phrase (token.v.qstring);
-				break;
-			case 2:
-				user = g_strdup (token.v.qstring);
-				break;
-			case 3:
-				domain = token.v.qstring;
-				break;
-			}
-			break;
-		case SPRUCE_IMAP_TOKEN_LITERAL:
-			if (spruce_imap_engine_literal (engine, &literal, &n, err) == -1)
-				goto exception;
-			
-			switch (part) {
-			case 0:
-				name = g_mime_utils_header_decode_phrase ((char *) literal);
-				g_free (literal);
-				break;
-			case 2:
-				user = (char *) literal;
-				break;
-			case 3:
-				domain = (char *) literal;
-				break;
-			}
-			
-			break;
-		default:
-			spruce_imap_utils_set_unexpected_token_error (err, engine, &token);
-			goto exception;
-		}
-		
-		part++;
-	} while (part < 4);
+	/* skip the at-domain-list */
+	if (spruce_imap_engine_nstring (engine, &user, NULL, err) == -1)
+		return -1;
 	
-	addr = g_strdup_printf ("%s@%s", user, domain);
-	g_free (literal);
-	g_free (user);
+	if (spruce_imap_engine_nstring (engine, &user, NULL, err) == -1)
+		return -1;
 	
-	ia = internet_address_mailbox_new (name, addr);
-	g_free (name);
-	g_free (addr);
+	if (spruce_imap_engine_nstring (engine, &domain, NULL, err) == -1)
+		return -1;
 	
-	addr = internet_address_to_string (ia, FALSE);
-	g_object_unref (ia);
+	if (addrs->len > 0)
+		g_string_append (addrs, ", ");
 	
-	g_string_append (addrs, addr);
-	g_free (addr);
+	if (name == NULL) {
+		g_string_append_printf (addrs, "%s@%s", user, domain);
+	} else if (!envelope_needs_decode (name) && envelope_plain_phrase (name)) {
+		g_string_append_printf (addrs, "%s <%s@%s>", name, user, domain);
+	} else {
+		/* needs decoding and/or quoting, let gmime handle it */
+		phrase = g_mime_utils_header_decode_phrase (name);
+		addr = g_strdup_printf ("%s@%s", user, domain);
+		
+		ia = internet_address_mailbox_new (phrase, addr);
+		g_free (phrase);
+		g_free (addr);
+		
+		addr = internet_address_to_string (ia, FALSE);
+		g_object_unref (ia);
+		
+		g_string_append (addrs, addr);
+		g_free (addr);
+	}
 	
 	if (spruce_imap_engine_next_token (engine, &token, err) == -1)
 		return -1;
@@ -270,20 +280,12 @@ envelope_decode_address (SpruceIMAPEngine *engine, GString *addrs, GError **err)
 	}
 	
 	return 0;
-	
- exception:
-	
-	g_free (name);
-	g_free (user);
-	
-	return -1;
 }
 
 static int
-envelope_decode_addresses (SpruceIMAPEngine *engine, char **addrlist, GError **err)
+envelope_decode_addresses (SpruceIMAPEngine *engine, SpruceFolderSummary *summary, GString *addrs, char **addrlist, GError **err)
 {
 	spruce_imap_token_t token;
-	GString *addrs;
 	
 	if (spruce_imap_engine_next_token (engine, &token, err) == -1)
 		return -1;
@@ -296,21 +298,17 @@ envelope_decode_addresses (SpruceIMAPEngine *engine, char **addrlist, GError **e
 		return -1;
 	}
 	
-	addrs = g_string_new ("");
+	g_string_truncate (addrs, 0);
 	
 	do {
-		if (spruce_imap_engine_next_token (engine, &token, err) == -1) {
-			g_string_free (addrs, TRUE);
+		if (spruce_imap_engine_next_token (engine, &token, err) == -1)
 			return -1;
-		}
 		
 		if (token.token == '(') {
 			spruce_imap_stream_unget_token (engine->istream, &token);
 			
-			if (envelope_decode_address (engine, addrs, err) == -1) {
-				g_string_free (addrs, TRUE);
+			if (envelope_decode_address (engine, addrs, err) == -1)
 				return -1;
-			}
 		} else if (token.token == ')') {
 			break;
 		} else {
@@ -319,8 +317,7 @@ envelope_decode_addresses (SpruceIMAPEngine *engine, char **addrlist, GError **e
 		}
 	} while (1);
 	
-	*addrlist = addrs->str;
-	g_string_free (addrs, FALSE);
+	*addrlist = spruce_folder_summary_string_intern (summary, addrs->str);
 	
 	return 0;
 }
@@ -328,82 +325,33 @@ envelope_decode_addresses (SpruceIMAPEngine *engine, char **addrlist, GError **e
 static int
 envelope_decode_date (SpruceIMAPEngine *engine, time_t *date, GError **err)
 {
-	unsigned char *literal = NULL;
-	spruce_imap_token_t token;
-	const char *nstring;
-	size_t n;
+	char *nstring;
 	
-	if (spruce_imap_engine_next_token (engine, &token, err) == -1)
+	if (spruce_imap_engine_nstring (engine, &nstring, NULL, err) == -1)
 		return -1;
 	
-	switch (token.token) {
-	case SPRUCE_IMAP_TOKEN_NIL:
+	if (nstring != NULL)
+		*date = g_mime_utils_header_decode_date (nstring, NULL);
+	else
 		*date = (time_t) -1;
-		return 0;
-	case SPRUCE_IMAP_TOKEN_ATOM:
-		nstring = token.v.atom;
-		break;
-	case SPRUCE_IMAP_TOKEN_QSTRING:
-		nstring = token.v.qstring;
-		break;
-	case SPRUCE_IMAP_TOKEN_LITERAL:
-		if (spruce_imap_engine_literal (engine, &literal, &n, err) == -1)
-			return -1;
-		
-		nstring = (char *) literal;
-		break;
-	default:
-		spruce_imap_utils_set_unexpected_token_error (err, engine, &token);
-		return -1;
-	}
-	
-	*date = g_mime_utils_header_decode_date (nstring, NULL);
-	
-	g_free (literal);
 	
 	return 0;
 }
 
 static int
-envelope_decode_nstring (SpruceIMAPEngine *engine, char **nstring, gboolean rfc2047, GError **err)
+envelope_decode_subject (SpruceIMAPEngine *engine, SpruceFolderSummary *summary, char **subject, GError **err)
 {
-	spruce_imap_token_t token;
-	unsigned char *literal;
-	size_t n;
+	char *nstring, *decoded;
 	
-	if (spruce_imap_engine_next_token (engine, &token, err) == -1)
+	if (spruce_imap_engine_nstring (engine, &nstring, NULL, err) == -1)
 		return -1;
 	
-	switch (token.token) {
-	case SPRUCE_IMAP_TOKEN_NIL:
-		*nstring = NULL;
-		break;
-	case SPRUCE_IMAP_TOKEN_ATOM:
-		if (rfc2047)
-			*nstring = g_mime_utils_header_decode_text (token.v.atom);
-		else
-			*nstring = g_strdup (token.v.atom);
-		break;
-	case SPRUCE_IMAP_TOKEN_QSTRING:
-		if (rfc2047)
-			*nstring = g_mime_utils_header_decode_text (token.v.qstring);
-		else
-			*nstring = g_strdup (token.v.qstring);
-		break;
-	case SPRUCE_IMAP_TOKEN_LITERAL:
-		if (spruce_imap_engine_literal (engine, &literal, &n, err) == -1)
-			return -1;
-		
-		if (rfc2047) {
-			*nstring = g_mime_utils_header_decode_text ((char *) literal);
-			g_free (literal);
-		} else
-			*nstring = (char *) literal;
-		
-		break;
-	default:
-		spruce_imap_utils_set_unexpected_token_error (err, engine, &token);
-		return -1;
+	if (nstring != NULL && envelope_needs_decode (nstring)) {
+		decoded = g_mime_utils_header_decode_text (nstring);
+		*subject = spruce_folder_summary_string_intern (summary, decoded);
+		g_free (decoded);
+	} else {
+		*subject = spruce_folder_summary_string_intern (summary, nstring);
 	}
 	
 	return 0;
@@ -448,12 +396,13 @@ decode_references (const char *string)
 }
 
 static int
-decode_envelope (SpruceIMAPEngine *engine, SpruceMessageInfo *info, spruce_imap_token_t *token, GError **err)
+decode_envelope (SpruceIMAPEngine *engine, SpruceFolderSummary *summary, SpruceMessageInfo *info, spruce_imap_token_t *token, GError **err)
 {
 	unsigned char md5sum[16];
 	char *nstring, *msgid;
 	GChecksum *checksum;
 	size_t len = 16;
+	GString *addrs;
 	
 	if (spruce_imap_engine_next_token (engine, token, err) == -1)
 		return -1;
@@ -463,39 +412,44 @@ decode_envelope (SpruceIMAPEngine *engine, SpruceMessageInfo *info, spruce_imap_
 		return -1;
 	}
 	
+	addrs = g_string_sized_new (256);
+	
 	if (envelope_decode_date (engine, &info->date_sent, err) == -1)
 		goto exception;
 	
-	if (envelope_decode_nstring (engine, &info->subject, TRUE, err) == -1)
+	if (envelope_decode_subject (engine, summary, &info->subject, err) == -1)
 		goto exception;
 	
-	if (envelope_decode_addresses (engine, &info->from, err) == -1)
+	if (envelope_decode_addresses (engine, summary, addrs, &info->from, err) == -1)
 		goto exception;
 	
-	if (envelope_decode_addresses (engine, &info->sender, err) == -1)
+	if (envelope_decode_addresses (engine, summary, addrs, &info->sender, err) == -1)
 		goto exception;
 	
-	if (envelope_decode_addresses (engine, &info->reply_to, err) == -1)
+	if (envelope_decode_addresses (engine, summary, addrs, &info->reply_to, err) == -1)
 		goto exception;
 	
-	if (envelope_decode_addresses (engine, &info->to, err) == -1)
+	if (envelope_decode_addresses (engine, summary, addrs, &info->to, err) == -1)
 		goto exception;
 	
-	if (envelope_decode_addresses (engine, &info->cc, err) == -1)
+	if (envelope_decode_addresses (engine, summary, addrs, &info->cc, err) == -1)
 		goto exception;
 	
-	if (envelope_decode_addresses (engine, &info->bcc, err) == -1)
+	if (envelope_decode_addresses (engine, summary, addrs, &info->bcc, err) == -1)
 		goto exception;
 	
-	if (envelope_decode_nstring (engine, &nstring, FALSE, err) == -1)
+	g_string_free (addrs, TRUE);
+	addrs = NULL;
+	
+	/* in-reply-to and message-id are only hashed, so they can be
+	 * used straight out of the stream's arena */
+	if (spruce_imap_engine_nstring (engine, &nstring, NULL, err) == -1)
 		goto exception;
 	
-	if (nstring != NULL) {
+	if (nstring != NULL)
 		info->references = decode_references (nstring);
-		g_free (nstring);
-	}
 	
-	if (envelope_decode_nstring (engine, &nstring, FALSE, err) == -1)
+	if (spruce_imap_engine_nstring (engine, &nstring, NULL, err) == -1)
 		goto exception;
 	
 	if (nstring != NULL) {
@@ -508,7 +462,6 @@ decode_envelope (SpruceIMAPEngine *engine, SpruceMessageInfo *info, spruce_imap_
 			memcpy (info->message_id.id.hash, md5sum, sizeof (info->message_id.id.hash));
 			g_free (msgid);
 		}
-		g_free (nstring);
 	}
 	
 	if (spruce_imap_engine_next_token (engine, token, err) == -1)
@@ -523,6 +476,9 @@ decode_envelope (SpruceIMAPEngine *engine, SpruceMessageInfo *info, spruce_imap_
 	
  exception:
 	
+	if (addrs != NULL)
+		g_string_free (addrs, TRUE);
+	
 	return -1;
 }
 
@@ -674,6 +630,8 @@ struct imap_fetch_all_t {
 	guint32 first;
 	guint8 need;
 	guint8 all;
+	guint8 changed_only;
+	guint64 modseq;
 };
 
 static void
@@ -698,6 +656,42 @@ imap_fetch_all_free (struct imap_fetch_all_t *fetch)
 	g_free (fetch);
 }
 
+static void
+imap_cache_expire_parts (SpruceCache *cache, const char *uid, SpruceSummaryContentInfo *content, const char *section)
+{
+	SpruceSummaryContentInfo *child;
+	char *key, *sub;
+	int i = 1;
+	
+	if (content->children && g_mime_content_type_is_type (content->content_type, "multipart", "*")) {
+		for (child = content->children; child != NULL; child = child->next, i++) {
+			if (section != NULL)
+				sub = g_strdup_printf ("%s.%d", section, i);
+			else
+				sub = g_strdup_printf ("%d", i);
+			
+			imap_cache_expire_parts (cache, uid, child, sub);
+			g_free (sub);
+		}
+	} else {
+		key = g_strdup_printf ("%s.%s", uid, section ? section : "1");
+		spruce_cache_expire_key (cache, key, NULL);
+		g_free (key);
+	}
+}
+
+/* expires the message as well as any parts of it from the cache */
+static void
+imap_cache_expire (SpruceCache *cache, SpruceMessageInfo *info)
+{
+	SpruceSummaryContentInfo *content;
+	
+	spruce_cache_expire_key (cache, info->uid, NULL);
+	
+	if ((content = imap_message_info_get_content (info)))
+		imap_cache_expire_parts (cache, info->uid, content, NULL);
+}
+
 static void
 courier_imap_is_a_piece_of_shit (SpruceFolderSummary *summary, guint32 msg)
 {
@@ -807,8 +801,14 @@ imap_fetch_all_update (struct imap_fetch_all_t *fetch)
 	for (i = 0; i < total; i++) {
 		info = spruce_folder_summary_index (fetch->summary, i);
 		if (!(envelope = g_hash_table_lookup (fetch->uid_hash, info->uid))) {
+			if (fetch->changed_only) {
+				/* unchanged since our last sync */
+				spruce_folder_summary_info_unref (fetch->summary, info);
+				continue;
+			}
+			
 			/* this message has been expunged from the server */
-			spruce_cache_expire_key (cache, info->uid, NULL);
+			imap_cache_expire (cache, info);
 			spruce_folder_change_info_remove_uid (changes, info->uid);
 			spruce_folder_summary_remove (fetch->summary, info);
 			total--;
@@ -823,6 +823,8 @@ imap_fetch_all_update (struct imap_fetch_all_t *fetch)
 			iinfo->server_flags = new_iinfo->server_flags;
 			if (info->flags != flags)
 				spruce_folder_change_info_change_uid (changes, info->uid);
+			
+			spruce_folder_summary_touch_info (fetch->summary, info);
 		}
 		
 		spruce_folder_summary_info_unref (fetch->summary, info);
@@ -830,7 +832,8 @@ imap_fetch_all_update (struct imap_fetch_all_t *fetch)
 	
 	for (i = 0; i < fetch->added->len; i++) {
 		if (!(envelope = fetch->added->pdata[i])) {
-			courier_imap_is_a_piece_of_shit (fetch->summary, fetch->first + i);
+			if (!fetch->changed_only)
+				courier_imap_is_a_piece_of_shit (fetch->summary, fetch->first + i);
 			continue;
 		}
 		
@@ -868,7 +871,7 @@ untagged_fetch_all (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic, guint32 ind
 		 * before fetch->first in the period between
 		 * our previous attempt and now. */
 		size_t movelen = added->len * sizeof (void *);
-		size_t extra = index - fetch->first;
+		size_t extra = fetch->first - index;
 		void *dest;
 		
 		g_assert (fetch->all);
@@ -876,6 +879,7 @@ untagged_fetch_all (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic, guint32 ind
 		g_ptr_array_set_size (added, added->len + extra);
 		dest = ((char *) added->pdata) + (extra * sizeof (void *));
 		memmove (dest, added->pdata, movelen);
+		memset (added->pdata, 0, extra * sizeof (void *));
 		fetch->total += extra;
 		fetch->first = index;
 	} else if (index > (added->len + (fetch->first - 1))) {
@@ -917,7 +921,7 @@ untagged_fetch_all (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic, guint32 ind
 		
 		if (!strcmp (token->v.atom, "ENVELOPE")) {
 			if (envelope) {
-				if (decode_envelope (engine, info, token, err) == -1)
+				if (decode_envelope (engine, summary, info, token, err) == -1)
 					goto exception;
 				
 				changed |= IMAP_FETCH_ENVELOPE;
@@ -928,7 +932,7 @@ untagged_fetch_all (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic, guint32 ind
 				g_warning ("Hmmm, server is sending us ENVELOPE data for a message we didn't ask for (message %u)\n",
 					   index);
 				tmp = spruce_folder_summary_info_new (summary);
-				rv = decode_envelope (engine, tmp, token, err);
+				rv = decode_envelope (engine, summary, tmp, token, err);
 				spruce_folder_summary_info_unref (summary, tmp);
 				
 				if (rv == -1)
@@ -944,6 +948,14 @@ untagged_fetch_all (SpruceIMAPEngine *engine, SpruceIMAPCommand *ic, guint32 ind
 			iinfo->server_flags = server_flags;
 			
 			changed |= IMAP_FETCH_FLAGS;
+		} else if (!strcmp (token->v.atom, "MODSEQ")) {
+			guint64 modseq;
+			
+			if (spruce_imap_parse_modseq (engine, &modseq, err) == -1)
+				goto exception;
+			
+			if (modseq > fetch->modseq)
+				fetch->modseq = modseq;
 		} else if (!strcmp (token->v.atom, "INTERNALDATE")) {
 			if (spruce_imap_engine_next_token (engine, token, err) == -1)
 				goto exception;
@@ -1102,17 +1114,14 @@ imap_fetch_all_reset (SpruceIMAPCommand *ic, struct imap_fetch_all_t *fetch)
 }
 
 static SpruceIMAPCommand *
-imap_summary_fetch_all (SpruceFolderSummary *summary, guint32 seqid, const char *uid)
+imap_summary_fetch_all (SpruceIMAPEngine *engine, SpruceFolderSummary *summary, guint32 seqid, const char *uid)
 {
 	SpruceIMAPSummary *imap_summary = (SpruceIMAPSummary *) summary;
 	SpruceFolder *folder = imap_summary->folder;
 	struct imap_fetch_all_t *fetch;
-	SpruceIMAPEngine *engine;
 	SpruceIMAPCommand *ic;
 	guint32 total;
 	
-	engine = ((SpruceIMAPStore *) folder->store)->engine;
-	
 	total = (imap_summary->exists - seqid) + 1;
 	fetch = g_new (struct imap_fetch_all_t, 1);
 	fetch->uid_hash = g_hash_table_new (g_str_hash, g_str_equal);
@@ -1124,6 +1133,8 @@ imap_summary_fetch_all (SpruceFolderSummary *summary, guint32 seqid, const char
 	fetch->total = total;
 	fetch->count = 0;
 	fetch->all = TRUE;
+	fetch->changed_only = FALSE;
+	fetch->modseq = 0;
 	
 	ic = spruce_imap_engine_queue (engine, folder, "UID FETCH %s:* (ALL)\r\n", uid);
 	
@@ -1134,19 +1145,26 @@ imap_summary_fetch_all (SpruceFolderSummary *summary, guint32 seqid, const char
 	return ic;
 }
 
+/* if @changedsince is non-zero, only the flags of messages whose
+ * modseq is greater are requested (rfc4551) and, if QRESYNC has been
+ * enabled, the server also reports expunged messages via VANISHED */
 static SpruceIMAPCommand *
-imap_summary_fetch_flags (SpruceFolderSummary *summary)
+imap_summary_fetch_flags (SpruceIMAPEngine *engine, SpruceFolderSummary *summary, guint64 changedsince)
 {
 	SpruceIMAPSummary *imap_summary = (SpruceIMAPSummary *) summary;
 	SpruceFolder *folder = imap_summary->folder;
 	struct imap_fetch_all_t *fetch;
 	SpruceMessageInfo *info[2];
-	SpruceIMAPEngine *engine;
+	char modifier[64];
 	SpruceIMAPCommand *ic;
 	guint32 total;
 	int scount;
 	
-	engine = ((SpruceIMAPStore *) folder->store)->engine;
+	if (changedsince > 0)
+		sprintf (modifier, " (CHANGEDSINCE %" G_GUINT64_FORMAT "%s)", changedsince,
+			 engine->qresync ? " VANISHED" : "");
+	else
+		modifier[0] = '\0';
 	
 	scount = spruce_folder_summary_count (summary);
 	g_assert (scount > 0);
@@ -1168,14 +1186,16 @@ imap_summary_fetch_flags (SpruceFolderSummary *summary)
 	fetch->total = total;
 	fetch->count = 0;
 	fetch->all = FALSE;
+	fetch->changed_only = changedsince > 0;
+	fetch->modseq = 0;
 	
 	if (info[1] != NULL) {
-		ic = spruce_imap_engine_queue (engine, folder, "UID FETCH %s:%s (FLAGS)\r\n",
-					       info[0]->uid, info[1]->uid);
+		ic = spruce_imap_engine_queue (engine, folder, "UID FETCH %s:%s (FLAGS)%s\r\n",
+					       info[0]->uid, info[1]->uid, modifier);
 		spruce_folder_summary_info_unref (summary, info[1]);
 	} else {
-		ic = spruce_imap_engine_queue (engine, folder, "UID FETCH %s (FLAGS)\r\n",
-					       info[0]->uid);
+		ic = spruce_imap_engine_queue (engine, folder, "UID FETCH %s (FLAGS)%s\r\n",
+					       info[0]->uid, modifier);
 	}
 	
 	spruce_folder_summary_info_unref (summary, info[0]);
@@ -1206,10 +1226,25 @@ imap_message_info_new (SpruceFolderSummary *summary)
 	info = SPRUCE_FOLDER_SUMMARY_CLASS (parent_class)->message_info_new (summary);
 	
 	((SpruceIMAPMessageInfo *) info)->server_flags = 0;
+	((SpruceIMAPMessageInfo *) info)->bodystructure = NULL;
+	((SpruceIMAPMessageInfo *) info)->bodystructure_mapped = FALSE;
 	
 	return info;
 }
 
+/* decodes the saved BODYSTRUCTURE (if any) into info->content the
+ * first time it is needed */
+static SpruceSummaryContentInfo *
+imap_message_info_get_content (SpruceMessageInfo *info)
+{
+	SpruceIMAPMessageInfo *minfo = (SpruceIMAPMessageInfo *) info;
+	
+	if (info->content == NULL && minfo->bodystructure != NULL)
+		info->content = spruce_imap_bodystructure_decode (minfo->bodystructure);
+	
+	return info->content;
+}
+
 static SpruceMessageInfo *
 imap_message_info_load (SpruceFolderSummary *summary, GMimeStream *stream)
 {
@@ -1224,6 +1259,14 @@ imap_message_info_load (SpruceFolderSummary *summary, GMimeStream *stream)
 	if (spruce_file_util_decode_uint32 (stream, &minfo->server_flags) == -1)
 		goto exception;
 	
+	if (spruce_file_util_decode_string (stream, &minfo->bodystructure) == -1)
+		goto exception;
+	
+	if (minfo->bodystructure && *minfo->bodystructure == '\0') {
+		g_free (minfo->bodystructure);
+		minfo->bodystructure = NULL;
+	}
+	
 	return info;
 	
  exception:
@@ -1244,9 +1287,72 @@ imap_message_info_save (SpruceFolderSummary *summary, GMimeStream *stream, Spruc
 	if (spruce_file_util_encode_uint32 (stream, minfo->server_flags) == -1)
 		return -1;
 	
+	if (spruce_file_util_encode_string (stream, minfo->bodystructure) == -1)
+		return -1;
+	
+	return 0;
+}
+
+static SpruceMessageInfo *
+imap_message_info_load_record (SpruceFolderSummary *summary, SpruceSummaryRecord *record)
+{
+	SpruceIMAPMessageInfo *minfo;
+	SpruceMessageInfo *info;
+	char *bodystructure;
+	
+	if (!(info = SPRUCE_FOLDER_SUMMARY_CLASS (parent_class)->message_info_load_record (summary, record)))
+		return NULL;
+	
+	minfo = (SpruceIMAPMessageInfo *) info;
+	
+	if (spruce_summary_record_decode_uint32 (record, &minfo->server_flags) == -1)
+		goto exception;
+	
+	if (spruce_summary_record_decode_string (record, &bodystructure) == -1)
+		goto exception;
+	
+	if (*bodystructure != '\0') {
+		minfo->bodystructure = bodystructure;
+		minfo->bodystructure_mapped = TRUE;
+	}
+	
+	return info;
+	
+ exception:
+	
+	spruce_folder_summary_info_unref (summary, info);
+	
+	return NULL;
+}
+
+static int
+imap_message_info_save_record (SpruceFolderSummary *summary, SpruceSummaryRecord *record, SpruceMessageInfo *info)
+{
+	SpruceIMAPMessageInfo *minfo = (SpruceIMAPMessageInfo *) info;
+	
+	if (SPRUCE_FOLDER_SUMMARY_CLASS (parent_class)->message_info_save_record (summary, record, info) == -1)
+		return -1;
+	
+	if (spruce_summary_record_encode_uint32 (record, minfo->server_flags) == -1)
+		return -1;
+	
+	if (spruce_summary_record_encode_string (record, minfo->bodystructure) == -1)
+		return -1;
+	
 	return 0;
 }
 
+static void
+imap_message_info_free (SpruceFolderSummary *summary, SpruceMessageInfo *info)
+{
+	SpruceIMAPMessageInfo *minfo = (SpruceIMAPMessageInfo *) info;
+	
+	if (!minfo->bodystructure_mapped)
+		g_free (minfo->bodystructure);
+	
+	SPRUCE_FOLDER_SUMMARY_CLASS (parent_class)->message_info_free (summary, info);
+}
+
 
 void
 spruce_imap_summary_set_exists (SpruceFolderSummary *summary, guint32 exists)
@@ -1321,10 +1427,25 @@ spruce_imap_summary_set_uidvalidity (SpruceFolderSummary *summary, guint32 uidva
 	spruce_cache_expire_all (cache, NULL);
 	
 	imap_summary->uidvalidity = uidvalidity;
+	imap_summary->highestmodseq = 0;
 	
 	imap_summary->uidvalidity_changed = TRUE;
 }
 
+void
+spruce_imap_summary_set_highestmodseq (SpruceFolderSummary *summary, guint64 highestmodseq)
+{
+	SpruceIMAPSummary *imap_summary = (SpruceIMAPSummary *) summary;
+	
+	g_return_if_fail (SPRUCE_IS_IMAP_SUMMARY (summary));
+	
+	/* the folder does not support mod-sequences */
+	if (highestmodseq == 0)
+		imap_summary->highestmodseq = 0;
+	
+	imap_summary->modseq = highestmodseq;
+}
+
 void
 spruce_imap_summary_expunge (SpruceFolderSummary *summary, int seqid)
 {
@@ -1344,7 +1465,7 @@ spruce_imap_summary_expunge (SpruceFolderSummary *summary, int seqid)
 	changes = spruce_folder_change_info_new ();
 	spruce_folder_change_info_remove_uid (changes, info->uid);
 	
-	spruce_cache_expire_key (cache, info->uid, NULL);
+	imap_cache_expire (cache, info);
 	
 	spruce_folder_summary_info_unref (summary, info);
 	spruce_folder_summary_remove_index (summary, seqid);
@@ -1353,6 +1474,146 @@ spruce_imap_summary_expunge (SpruceFolderSummary *summary, int seqid)
 	spruce_folder_change_info_free (changes);
 }
 
+/**
+ * spruce_imap_summary_vanished:
+ * @summary: IMAP summary
+ * @uidset: set of UIDs which have been expunged
+ * @earlier: %TRUE if the messages were expunged before the folder was selected
+ *
+ * Handles an rfc5162 VANISHED response. Unless @earlier is set, the
+ * messages are also removed from the EXISTS count like with EXPUNGE.
+ **/
+void
+spruce_imap_summary_vanished (SpruceFolderSummary *summary, const char *uidset, gboolean earlier)
+{
+	SpruceIMAPSummary *imap_summary = (SpruceIMAPSummary *) summary;
+	SpruceCache *cache = ((SpruceIMAPFolder *) imap_summary->folder)->cache;
+	SpruceFolderChangeInfo *changes;
+	guint32 first, last, maxuid, n;
+	SpruceMessageInfo *info;
+	const char *inptr;
+	char uid[16];
+	guint32 expunged;
+	int count;
+	char *end;
+	
+	g_return_if_fail (SPRUCE_IS_IMAP_SUMMARY (summary));
+	
+	/* no need to look for anything past the last message we know about */
+	if ((count = spruce_folder_summary_count (summary)) > 0) {
+		info = spruce_folder_summary_index (summary, count - 1);
+		maxuid = strtoul (info->uid, NULL, 10);
+		spruce_folder_summary_info_unref (summary, info);
+	} else {
+		maxuid = 0;
+	}
+	
+	changes = spruce_folder_change_info_new ();
+	
+	inptr = uidset;
+	while (*inptr) {
+		first = strtoul (inptr, &end, 10);
+		if (end == inptr)
+			break;
+		
+		inptr = end;
+		if (*inptr == ':') {
+			inptr++;
+			last = strtoul (inptr, &end, 10);
+			if (end == inptr)
+				break;
+			
+			inptr = end;
+			
+			if (last < first) {
+				n = first;
+				first = last;
+				last = n;
+			}
+		} else {
+			last = first;
+		}
+		
+		if (!earlier) {
+			/* every UID in the set was in the mailbox, whether or
+			 * not our summary had caught up with it yet */
+			expunged = last - first + 1;
+			imap_summary->exists -= MIN (imap_summary->exists, expunged);
+		}
+		
+		if (last > maxuid)
+			last = maxuid;
+		
+		for (n = first; n <= last; n++) {
+			sprintf (uid, "%u", n);
+			if (!(info = spruce_folder_summary_uid (summary, uid)))
+				continue;
+			
+			imap_cache_expire (cache, info);
+			spruce_folder_change_info_remove_uid (changes, info->uid);
+			spruce_folder_summary_remove (summary, info);
+			spruce_folder_summary_info_unref (summary, info);
+		}
+		
+		if (*inptr == ',')
+			inptr++;
+	}
+	
+	if (spruce_folder_change_info_changed (changes))
+		g_signal_emit_by_name (imap_summary->folder, "folder-changed", changes);
+	spruce_folder_change_info_free (changes);
+}
+
+/**
+ * spruce_imap_summary_get_content:
+ * @summary: IMAP summary
+ * @info: message info
+ *
+ * Gets the MIME structure of the message, decoding the one saved in
+ * the summary if this is the first time it is needed.
+ *
+ * Returns: the MIME structure or %NULL if it isn't known.
+ **/
+SpruceSummaryContentInfo *
+spruce_imap_summary_get_content (SpruceFolderSummary *summary, SpruceMessageInfo *info)
+{
+	g_return_val_if_fail (SPRUCE_IS_IMAP_SUMMARY (summary), NULL);
+	
+	return imap_message_info_get_content (info);
+}
+
+/**
+ * spruce_imap_summary_set_content:
+ * @summary: IMAP summary
+ * @info: message info
+ * @content: MIME structure of the message
+ *
+ * Sets the MIME structure (as given to us in a BODYSTRUCTURE) of the
+ * message so that it is saved along with the rest of its info. The
+ * summary takes ownership of @content.
+ **/
+void
+spruce_imap_summary_set_content (SpruceFolderSummary *summary, SpruceMessageInfo *info,
+				 SpruceSummaryContentInfo *content)
+{
+	SpruceIMAPMessageInfo *minfo = (SpruceIMAPMessageInfo *) info;
+	
+	g_return_if_fail (SPRUCE_IS_IMAP_SUMMARY (summary));
+	g_return_if_fail (content != NULL);
+	
+	if (info->content)
+		spruce_summary_content_info_free (info->content);
+	
+	if (!minfo->bodystructure_mapped)
+		g_free (minfo->bodystructure);
+	
+	minfo->bodystructure = spruce_imap_bodystructure_encode (content);
+	minfo->bodystructure_mapped = FALSE;
+	info->content = content;
+	
+	spruce_folder_summary_touch_info (summary, info);
+}
+
 #if 0
 static int
 info_uid_sort (const SpruceMessageInfo **info0, const SpruceMessageInfo **info1)
@@ -1369,48 +1630,100 @@ info_uid_sort (const SpruceMessageInfo **info0, const SpruceMessageInfo **info1)
 }
 #endif
 
+/* fetches the flags of the messages in the summary (only those
+ * which have changed since @changedsince if non-zero) and updates
+ * the summary accordingly */
+static int
+imap_summary_update_flags (SpruceFolderSummary *summary, guint64 changedsince, GError **err)
+{
+	SpruceIMAPSummary *imap_summary = (SpruceIMAPSummary *) summary;
+	SpruceIMAPStore *store = (SpruceIMAPStore *) imap_summary->folder->store;
+	SpruceIMAPEngine *engine;
+	SpruceIMAPCommand *ic;
+	int id;
+	
+	engine = spruce_imap_store_get_engine (store, imap_summary->folder);
+	
+	ic = imap_summary_fetch_flags (engine, summary, changedsince);
+	
+	while ((id = spruce_imap_engine_iterate (engine)) < ic->id && id != -1)
+		;
+	
+	spruce_imap_store_release_engine (store, engine);
+	
+	if (id == -1 || ic->status != SPRUCE_IMAP_COMMAND_COMPLETE) {
+		imap_fetch_all_free (ic->user_data);
+		g_propagate_error (err, ic->err);
+		ic->err = NULL;
+		spruce_imap_command_unref (ic);
+		return -1;
+	}
+	
+	/* we've now seen every change up to the greatest MODSEQ */
+	if (changedsince > 0 && ((struct imap_fetch_all_t *) ic->user_data)->modseq > imap_summary->highestmodseq)
+		imap_summary->highestmodseq = ((struct imap_fetch_all_t *) ic->user_data)->modseq;
+	
+	imap_fetch_all_update (ic->user_data);
+	spruce_imap_command_unref (ic);
+	
+	return 0;
+}
+
 int
 spruce_imap_summary_flush_updates (SpruceFolderSummary *summary, GError **err)
 {
 	SpruceIMAPSummary *imap_summary = (SpruceIMAPSummary *) summary;
+	SpruceIMAPStore *store;
 	SpruceIMAPEngine *engine;
 	SpruceMessageInfo *info;
 	SpruceIMAPCommand *ic;
 	guint32 iuid, seqid = 0;
+	gboolean resync = FALSE;
+	gboolean synced = TRUE;
 	int scount, id;
 	char uid[16];
 	
 	g_return_val_if_fail (SPRUCE_IS_IMAP_SUMMARY (summary), -1);
 	
-	engine = ((SpruceIMAPStore *) imap_summary->folder->store)->engine;
+	store = (SpruceIMAPStore *) imap_summary->folder->store;
+	engine = spruce_imap_store_get_engine (store, imap_summary->folder);
 	if ((scount = spruce_folder_summary_count (summary))== 0)
 		imap_summary->update_flags = FALSE;
 	
-	/* FIXME: take advantage of rfc4551's CHANGEDSINCE resync features */
-	
 	if (imap_summary->uidvalidity_changed) {
 		/* need to refetch everything */
 		g_assert (scount == 0);
 		seqid = 1;
+	} else if ((imap_summary->update_flags || imap_summary->exists < scount) &&
+		   (engine->capa & SPRUCE_IMAP_CAPABILITY_CONDSTORE) && imap_summary->highestmodseq > 0 &&
+		   (imap_summary->modseq == 0 || imap_summary->modseq >= imap_summary->highestmodseq)) {
+		/* rfc4551: only fetch the flags which have changed since
+		 * our last sync. With QRESYNC, the server also tells us
+		 * which messages have been expunged since then.
+		 *
+		 * Note: modseq is 0 if the folder hasn't been SELECTed
+		 * since our last sync, in which case we have to ask. */
+		if (imap_summary->modseq != imap_summary->highestmodseq &&
+		    imap_summary_update_flags (summary, imap_summary->highestmodseq, err) == -1)
+			goto exception;
+		
+		/* without VANISHED, the only way to notice that other
+		 * clients expunged messages is to compare the counts
+		 * once any new messages have been fetched. Since an
+		 * expunge and a new message cancel each other out, the
+		 * counts can't tell us whether there is anything new, so
+		 * always ask for everything past the last UID we know
+		 * of (new messages come last, so this sequence number
+		 * is where they start at the latest). */
+		scount = spruce_folder_summary_count (summary);
+		seqid = MIN ((guint32) scount + 1, imap_summary->exists);
+		resync = TRUE;
 	} else if (imap_summary->update_flags || imap_summary->exists < scount) {
 		/* this both updates flags and removes messages which
 		 * have since been expunged from the server by another
 		 * client */
-		ic = imap_summary_fetch_flags (summary);
-		
-		while ((id = spruce_imap_engine_iterate (engine)) < ic->id && id != -1)
-			;
-		
-		if (id == -1 || ic->status != SPRUCE_IMAP_COMMAND_COMPLETE) {
-			imap_fetch_all_free (ic->user_data);
-			g_propagate_error (err, ic->err);
-			ic->err = NULL;
-			spruce_imap_command_unref (ic);
-			return -1;
-		}
-		
-		imap_fetch_all_update (ic->user_data);
-		spruce_imap_command_unref (ic);
+		if (imap_summary_update_flags (summary, 0, err) == -1)
+			goto exception;
 		
 		scount = spruce_folder_summary_count (summary);
 		if (imap_summary->exists < scount) {
@@ -1418,7 +1731,7 @@ spruce_imap_summary_flush_updates (SpruceFolderSummary *summary, GError **err)
 			g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_SERVICE_PROTOCOL_ERROR,
 				     _("IMAP server %s is in an inconsistant state."),
 				     engine->url->host);
-			return -1;
+			goto exception;
 		} else if (imap_summary->exists > scount) {
 			/* need to fetch new envelopes */
 			seqid = scount + 1;
@@ -1429,6 +1742,9 @@ spruce_imap_summary_flush_updates (SpruceFolderSummary *summary, GError **err)
 	} else {
 		/* need to fetch new envelopes */
 		seqid = scount + 1;
+		
+		/* the flags have not been checked */
+		synced = scount == 0;
 	}
 	
 	if (seqid != 0 && seqid <= imap_summary->exists) {
@@ -1441,7 +1757,7 @@ spruce_imap_summary_flush_updates (SpruceFolderSummary *summary, GError **err)
 			strcpy (uid, "1");
 		}
 		
-		ic = imap_summary_fetch_all (summary, seqid, uid);
+		ic = imap_summary_fetch_all (engine, summary, seqid, uid);
 		
 		while ((id = spruce_imap_engine_iterate (engine)) < ic->id && id != -1)
 			;
@@ -1451,15 +1767,40 @@ spruce_imap_summary_flush_updates (SpruceFolderSummary *summary, GError **err)
 			g_propagate_error (err, ic->err);
 			ic->err = NULL;
 			spruce_imap_command_unref (ic);
-			return -1;
+			goto exception;
 		}
 		
 		imap_fetch_all_add (ic->user_data, TRUE);
 		spruce_imap_command_unref (ic);
 	}
 	
+	if (resync && imap_summary->exists != spruce_folder_summary_count (summary)) {
+		/* now that we have every UID past the ones we knew of,
+		 * any difference means messages have been expunged; fall
+		 * back to fetching all the flags in order to find out
+		 * which */
+		if (spruce_folder_summary_count (summary) > 0 &&
+		    imap_summary_update_flags (summary, 0, err) == -1)
+			goto exception;
+	}
+	
+	/* the summary is now in sync with the HIGHESTMODSEQ the
+	 * server gave us when the folder was SELECTed */
+	if (synced && imap_summary->modseq > 0) {
+		imap_summary->highestmodseq = imap_summary->modseq;
+		imap_summary->modseq = 0;
+	}
+	
 	imap_summary->update_flags = FALSE;
 	imap_summary->uidvalidity_changed = FALSE;
 	
+	spruce_imap_store_release_engine (store, engine);
+	
 	return 0;
+	
+ exception:
+	
+	spruce_imap_store_release_engine (store, engine);
+	
+	return -1;
 }
@@ -43,6 +43,11 @@ struct _SpruceIMAPMessageInfo {
 	SpruceMessageInfo parent_info;
 	
 	guint32 server_flags;
+	
+	/* encoded info->content, as saved in the summary; only
+	 * decoded once it is needed (see spruce_imap_summary_get_content) */
+	char *bodystructure;
+	gboolean bodystructure_mapped;  /* points into the mmap'd summary */
 };
 
 struct _SpruceIMAPSummary {
@@ -56,6 +61,9 @@ struct _SpruceIMAPSummary {
 	
 	guint32 uidvalidity;
 	
+	guint64 highestmodseq;          /* rfc4551 HIGHESTMODSEQ the summary is synced to */
+	guint64 modseq;                 /* HIGHESTMODSEQ reported when the folder was selected */
+	
 	guint uidvalidity_changed:1;
 	guint update_flags:1;
 };
@@ -76,8 +84,14 @@ void spruce_imap_summary_set_unseen (SpruceFolderSummary *summary, guint32 unsee
 void spruce_imap_summary_set_uidnext (SpruceFolderSummary *summary, guint32 uidnext);
 
 void spruce_imap_summary_set_uidvalidity (SpruceFolderSummary *summary, guint32 uidvalidity);
+void spruce_imap_summary_set_highestmodseq (SpruceFolderSummary *summary, guint64 highestmodseq);
 
 void spruce_imap_summary_expunge (SpruceFolderSummary *summary, int seqid);
+void spruce_imap_summary_vanished (SpruceFolderSummary *summary, const char *uidset, gboolean earlier);
+
+SpruceSummaryContentInfo *spruce_imap_summary_get_content (SpruceFolderSummary *summary, SpruceMessageInfo *info);
+void spruce_imap_summary_set_content (SpruceFolderSummary *summary, SpruceMessageInfo *info,
+				      SpruceSummaryContentInfo *content);
 
 int spruce_imap_summary_flush_updates (SpruceFolderSummary *summary, GError **err);
 
@@ -24,11 +24,15 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 
 #include <glib.h>
 #include <glib/gi18n.h>
 
+#include <gmime/gmime-stream-mem.h>
+
 #include <spruce/spruce-error.h>
+#include <spruce/spruce-folder-summary.h>
 
 #include "spruce-imap-engine.h"
 #include "spruce-imap-stream.h"
@@ -303,145 +307,142 @@ spruce_imap_merge_flags (guint32 original, guint32 local, guint32 server)
 }
 
 
-struct _uidset_range {
-	struct _uidset_range *next;
-	guint32 first, last;
-	uint8_t buflen;
-	char buf[24];
-};
-
+/* IMAP UID sets are built a range at a time; a range can be extended
+ * either by the next UID numerically or by the next message in the
+ * summary (any UIDs in between no longer exist on the server) */
 struct _uidset {
-	SpruceFolderSummary *summary;
-	struct _uidset_range *ranges;
-	struct _uidset_range *tail;
-	size_t maxlen, setlen;
+	GPtrArray *messages;
+	GString *string;
+	size_t maxlen;
+	
+	/* the range currently being built, not yet in @string */
+	const char *first;
+	const char *last;
+	guint32 last_uid;
+	int last_index;
 };
 
-static void
-uidset_range_free (struct _uidset_range *range)
+/* finds @uid in the summary, trying the message after @hint first */
+static int
+uidset_index (GPtrArray *messages, guint32 uid, int hint)
 {
-	struct _uidset_range *next;
+	int min = 0, max = messages->len;
+	SpruceMessageInfo *info;
+	guint32 iuid;
+	int mid;
+	
+	if (hint + 1 < messages->len) {
+		info = messages->pdata[hint + 1];
+		if (strtoul (info->uid, NULL, 10) == uid)
+			return hint + 1;
+	}
 	
-	while (range != NULL) {
-		next = range->next;
-		g_free (range);
-		range = next;
+	/* messages in an IMAP summary are in UID order */
+	while (min < max) {
+		mid = min + ((max - min) / 2);
+		info = messages->pdata[mid];
+		iuid = strtoul (info->uid, NULL, 10);
+		
+		if (iuid == uid)
+			return mid;
+		else if (iuid < uid)
+			min = mid + 1;
+		else
+			max = mid;
 	}
+	
+	return -1;
+}
+
+/* the length of @string once the current range has been appended */
+static size_t
+uidset_range_len (struct _uidset *uidset, const char *last)
+{
+	size_t len = uidset->string->len;
+	
+	if (len > 0)
+		len++;
+	
+	len += strlen (uidset->first);
+	if (last != uidset->first)
+		len += 1 + strlen (last);
+	
+	return len;
 }
 
 static void
-uidset_init (struct _uidset *uidset, SpruceFolderSummary *summary, size_t maxlen)
+uidset_flush (struct _uidset *uidset)
 {
-	uidset->ranges = g_new (struct _uidset_range, 1);
-	uidset->ranges->first = (guint32) -1;
-	uidset->ranges->last = (guint32) -1;
-	uidset->ranges->next = NULL;
-	uidset->ranges->buflen = 0;
+	if (uidset->first == NULL)
+		return;
+	
+	if (uidset->string->len > 0)
+		g_string_append_c (uidset->string, ',');
 	
-	uidset->tail = uidset->ranges;
-	uidset->summary = summary;
-	uidset->maxlen = maxlen;
-	uidset->setlen = 0;
+	g_string_append (uidset->string, uidset->first);
+	if (uidset->last != uidset->first) {
+		g_string_append_c (uidset->string, ':');
+		g_string_append (uidset->string, uidset->last);
+	}
 }
 
-/* returns: -1 on full-and-not-added, 0 on added-and-not-full or 1 on added-and-full */
+/* returns: 0 if added or -1 if the set is full */
 static int
 uidset_add (struct _uidset *uidset, SpruceMessageInfo *info)
 {
-	GPtrArray *messages = uidset->summary->messages;
-	struct _uidset_range *node, *tail = uidset->tail;
-	size_t uidlen, len;
-	guint32 index;
-	char *colon;
-	
-	/* Note: depends on integer overflow for initial 'add' */
-	for (index = tail->last + 1; index < messages->len; index++) {
-		if (info == messages->pdata[index])
-			break;
-	}
-	
-	g_assert (index < messages->len);
-	
-	uidlen = strlen (info->uid);
-	
-	if (tail->buflen == 0) {
-		/* first add */
-		tail->first = tail->last = index;
-		strcpy (tail->buf, info->uid);
-		uidset->setlen = uidlen;
-		tail->buflen = uidlen;
-	} else if (index == (tail->last + 1)) {
-		/* add to last range */
-		if (tail->last == tail->first) {
-			/* make sure we've got enough room to add this one... */
-			if ((uidset->setlen + uidlen + 1) > uidset->maxlen)
+	guint32 uid = strtoul (info->uid, NULL, 10);
+	int index;
+	
+	index = uidset_index (uidset->messages, uid, uidset->last_index);
+	
+	/* the last UID may not have been in the summary at all, in
+	 * which case no message can follow it in the summary */
+	if (uidset->first != NULL &&
+	    (uid == uidset->last_uid + 1 ||
+	     (index != -1 && uidset->last_index != -1 && index == uidset->last_index + 1))) {
+		/* extend the current range */
+		if (uidset_range_len (uidset, info->uid) > uidset->maxlen)
+			return -1;
+	} else {
+		/* the beginning of a new range */
+		if (uidset->first != NULL) {
+			if (uidset_range_len (uidset, uidset->last) + 1 + strlen (info->uid) > uidset->maxlen)
 				return -1;
 			
-			tail->buf[tail->buflen++] = ':';
-			uidset->setlen++;
-		} else {
-			colon = strchr (tail->buf, ':') + 1;
-			
-			len = strlen (colon);
-			uidset->setlen -= len;
-			tail->buflen -= len;
+			uidset_flush (uidset);
 		}
 		
-		strcpy (tail->buf + tail->buflen, info->uid);
-		uidset->setlen += uidlen;
-		tail->buflen += uidlen;
-		
-		tail->last = index;
-	} else if ((uidset->setlen + uidlen + 1) < uidset->maxlen) {
-		/* the beginning of a new range */
-		tail->next = node = g_new (struct _uidset_range, 1);
-		node->first = node->last = index;
-		strcpy (node->buf, info->uid);
-		uidset->setlen += uidlen + 1;
-		node->buflen = uidlen;
-		uidset->tail = node;
-		node->next = NULL;
-	} else {
-		/* can't add this one... */
-		return -1;
-	}
-	
-	if (uidset->setlen < uidset->maxlen)
-		return 0;
-	
-	return 1;
-}
-
-static char *
-uidset_to_string (struct _uidset *uidset)
-{
-	struct _uidset_range *range;
-	GString *string;
-	char *str;
-	
-	string = g_string_new ("");
-	
-	range = uidset->ranges;
-	while (range != NULL) {
-		g_string_append (string, range->buf);
-		range = range->next;
-		if (range)
-			g_string_append_c (string, ',');
+		uidset->first = info->uid;
 	}
 	
-	str = string->str;
-	g_string_free (string, FALSE);
+	uidset->last = info->uid;
+	uidset->last_uid = uid;
+	uidset->last_index = index;
 	
-	return str;
+	return 0;
 }
 
 
+/**
+ * spruce_imap_get_uid_set:
+ * @engine: IMAP engine
+ * @summary: folder summary
+ * @infos: message infos, sorted by UID
+ * @cur: index of the first info in @infos to add
+ * @linelen: length of the rest of the command line
+ * @set: return location for the UID set string
+ *
+ * Builds a compact UID set (e.g. "1:5,8,10:12") from as many of the
+ * message infos starting at @cur as will fit on the command line,
+ * in a single pass.
+ *
+ * Returns the number of infos in *@set.
+ **/
 int
 spruce_imap_get_uid_set (SpruceIMAPEngine *engine, SpruceFolderSummary *summary, GPtrArray *infos, int cur, size_t linelen, char **set)
 {
 	struct _uidset uidset;
 	size_t maxlen;
-	int rv = 0;
 	int i;
 	
 	if (engine->maxlentype == SPRUCE_IMAP_ENGINE_MAXLEN_LINE)
@@ -449,17 +450,25 @@ spruce_imap_get_uid_set (SpruceIMAPEngine *engine, SpruceFolderSummary *summary,
 	else
 		maxlen = engine->maxlen;
 	
-	uidset_init (&uidset, summary, maxlen);
+	uidset.messages = summary->messages;
+	uidset.string = g_string_new ("");
+	uidset.maxlen = maxlen;
+	uidset.first = NULL;
+	uidset.last = NULL;
+	uidset.last_uid = 0;
+	uidset.last_index = -1;
 	
-	for (i = cur; i < infos->len && rv != 1; i++) {
-		if ((rv = uidset_add (&uidset, infos->pdata[i])) == -1)
+	for (i = cur; i < infos->len; i++) {
+		if (uidset_add (&uidset, infos->pdata[i]) == -1)
 			break;
 	}
 	
-	if (i > cur)
-		*set = uidset_to_string (&uidset);
+	uidset_flush (&uidset);
 	
-	uidset_range_free (uidset.ranges);
+	if (i > cur)
+		*set = g_string_free (uidset.string, FALSE);
+	else
+		g_string_free (uidset.string, TRUE);
 	
 	return (i - cur);
 }
@@ -579,6 +588,573 @@ spruce_imap_parse_flags_list (SpruceIMAPEngine *engine, guint32 *flags, GError *
 }
 
 
+/* parses the "(<mod-sequence-value>)" following a FETCH MODSEQ item */
+int
+spruce_imap_parse_modseq (SpruceIMAPEngine *engine, guint64 *modseq, GError **err)
+{
+	spruce_imap_token_t token;
+	
+	if (spruce_imap_engine_next_token (engine, &token, err) == -1)
+		return -1;
+	
+	if (token.token != '(') {
+		spruce_imap_utils_set_unexpected_token_error (err, engine, &token);
+		return -1;
+	}
+	
+	if (spruce_imap_engine_next_token (engine, &token, err) == -1)
+		return -1;
+	
+	if (token.token == SPRUCE_IMAP_TOKEN_NUMBER64) {
+		*modseq = token.v.number64;
+	} else if (token.token == SPRUCE_IMAP_TOKEN_NUMBER) {
+		*modseq = token.v.number;
+	} else {
+		spruce_imap_utils_set_unexpected_token_error (err, engine, &token);
+		return -1;
+	}
+	
+	if (spruce_imap_engine_next_token (engine, &token, err) == -1)
+		return -1;
+	
+	if (token.token != ')') {
+		spruce_imap_utils_set_unexpected_token_error (err, engine, &token);
+		return -1;
+	}
+	
+	return 0;
+}
+
+
+/* BODYSTRUCTURE parsing (rfc3501 section 7.4.2). The parser reads
+ * directly from a SpruceIMAPStream so that the same code can decode
+ * BODYSTRUCTUREs saved in the summary. On error, @token is left
+ * holding the offending token (or SPRUCE_IMAP_TOKEN_ERROR if the
+ * stream could not be read). */
+
+typedef void (* BodyParamFunc) (gpointer object, const char *name, const char *value);
+
+static int
+body_next_token (SpruceIMAPStream *stream, spruce_imap_token_t *token)
+{
+	if (spruce_imap_stream_next_token (stream, token) == -1)
+		return -1;
+	
+	if (token->token == SPRUCE_IMAP_TOKEN_NO_DATA)
+		return -1;
+	
+	return 0;
+}
+
+static int
+body_skip_literal (SpruceIMAPStream *stream, spruce_imap_token_t *token)
+{
+	unsigned char *literal;
+	size_t n;
+	int ret;
+	
+	while ((ret = spruce_imap_stream_literal (stream, &literal, &n)) == 1)
+		;
+	
+	if (ret == -1) {
+		token->token = SPRUCE_IMAP_TOKEN_ERROR;
+		return -1;
+	}
+	
+	return 0;
+}
+
+/* reads an nstring (which some servers send as an atom) */
+static int
+body_parse_nstring (SpruceIMAPStream *stream, spruce_imap_token_t *token, char **value)
+{
+	unsigned char *literal;
+	GString *str;
+	size_t n;
+	int ret;
+	
+	*value = NULL;
+	
+	if (body_next_token (stream, token) == -1)
+		return -1;
+	
+	switch (token->token) {
+	case SPRUCE_IMAP_TOKEN_NIL:
+		return 0;
+	case SPRUCE_IMAP_TOKEN_ATOM:
+	case SPRUCE_IMAP_TOKEN_QSTRING:
+		*value = g_strdup (token->v.qstring);
+		return 0;
+	case SPRUCE_IMAP_TOKEN_LITERAL:
+		str = g_string_new ("");
+		while ((ret = spruce_imap_stream_literal (stream, &literal, &n)) == 1)
+			g_string_append_len (str, (char *) literal, n);
+		
+		if (ret == -1) {
+			token->token = SPRUCE_IMAP_TOKEN_ERROR;
+			g_string_free (str, TRUE);
+			return -1;
+		}
+		
+		g_string_append_len (str, (char *) literal, n);
+		*value = g_string_free (str, FALSE);
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+static int
+body_parse_number (SpruceIMAPStream *stream, spruce_imap_token_t *token, size_t *value)
+{
+	if (body_next_token (stream, token) == -1)
+		return -1;
+	
+	if (token->token != SPRUCE_IMAP_TOKEN_NUMBER)
+		return -1;
+	
+	*value = token->v.number;
+	
+	return 0;
+}
+
+/* body-fld-param: "(" string SP string *(SP string SP string) ")" / nil */
+static int
+body_parse_params (SpruceIMAPStream *stream, spruce_imap_token_t *token, BodyParamFunc set_param, gpointer object)
+{
+	char *name, *value;
+	
+	if (body_next_token (stream, token) == -1)
+		return -1;
+	
+	if (token->token == SPRUCE_IMAP_TOKEN_NIL)
+		return 0;
+	
+	if (token->token != '(')
+		return -1;
+	
+	do {
+		if (body_next_token (stream, token) == -1)
+			return -1;
+		
+		if (token->token == ')')
+			break;
+		
+		spruce_imap_stream_unget_token (stream, token);
+		
+		if (body_parse_nstring (stream, token, &name) == -1)
+			return -1;
+		
+		if (body_parse_nstring (stream, token, &value) == -1) {
+			g_free (name);
+			return -1;
+		}
+		
+		if (name && value)
+			set_param (object, name, value);
+		
+		g_free (value);
+		g_free (name);
+	} while (1);
+	
+	return 0;
+}
+
+/* skips everything up to and including the ')' closing the current body */
+static int
+body_skip_to_end (SpruceIMAPStream *stream, spruce_imap_token_t *token)
+{
+	int depth = 0;
+	
+	do {
+		if (body_next_token (stream, token) == -1)
+			return -1;
+		
+		switch (token->token) {
+		case '(':
+			depth++;
+			break;
+		case ')':
+			depth--;
+			break;
+		case '\n':
+			return -1;
+		case SPRUCE_IMAP_TOKEN_LITERAL:
+			if (body_skip_literal (stream, token) == -1)
+				return -1;
+			break;
+		}
+	} while (depth >= 0);
+	
+	return 0;
+}
+
+/* body-fld-dsp [SP body-fld-lang [SP body-fld-loc *(SP body-extension)]] ")" */
+static int
+body_parse_extensions (SpruceIMAPStream *stream, spruce_imap_token_t *token, SpruceSummaryContentInfo *content)
+{
+	GMimeContentDisposition *disposition;
+	char *value;
+	
+	if (body_next_token (stream, token) == -1)
+		return -1;
+	
+	if (token->token == ')')
+		return 0;
+	
+	if (token->token == '(') {
+		if (body_parse_nstring (stream, token, &value) == -1)
+			return -1;
+		
+		disposition = g_mime_content_disposition_new ();
+		if (value != NULL)
+			g_mime_content_disposition_set_disposition (disposition, value);
+		g_free (value);
+		
+		content->disposition = disposition;
+		
+		if (body_parse_params (stream, token, (BodyParamFunc) g_mime_content_disposition_set_parameter, disposition) == -1)
+			return -1;
+		
+		if (body_next_token (stream, token) == -1)
+			return -1;
+		
+		if (token->token != ')')
+			return -1;
+	} else if (token->token != SPRUCE_IMAP_TOKEN_NIL) {
+		return -1;
+	}
+	
+	/* we don't care about the language, location or any future extensions */
+	return body_skip_to_end (stream, token);
+}
+
+static SpruceSummaryContentInfo *
+body_parse (SpruceIMAPStream *stream, spruce_imap_token_t *token)
+{
+	SpruceSummaryContentInfo *content, *child, **tail;
+	char *type, *subtype, *md5;
+	
+	if (body_next_token (stream, token) == -1)
+		return NULL;
+	
+	if (token->token != '(')
+		return NULL;
+	
+	if (body_next_token (stream, token) == -1)
+		return NULL;
+	
+	content = spruce_summary_content_info_new ();
+	
+	if (token->token == '(') {
+		/* body-type-mpart: 1*body SP media-subtype [SP body-ext-mpart] */
+		tail = &content->children;
+		
+		do {
+			spruce_imap_stream_unget_token (stream, token);
+			
+			if (!(child = body_parse (stream, token)))
+				goto exception;
+			
+			child->parent = content;
+			*tail = child;
+			tail = &child->next;
+			
+			if (body_next_token (stream, token) == -1)
+				goto exception;
+		} while (token->token == '(');
+		
+		spruce_imap_stream_unget_token (stream, token);
+		
+		if (body_parse_nstring (stream, token, &subtype) == -1)
+			goto exception;
+		
+		content->content_type = g_mime_content_type_new ("multipart", subtype ? subtype : "mixed");
+		g_free (subtype);
+		
+		if (body_next_token (stream, token) == -1)
+			goto exception;
+		
+		if (token->token == ')')
+			return content;
+		
+		/* body-ext-mpart: body-fld-param [SP body-fld-dsp ...] */
+		spruce_imap_stream_unget_token (stream, token);
+		
+		if (body_parse_params (stream, token, (BodyParamFunc) g_mime_content_type_set_parameter, content->content_type) == -1)
+			goto exception;
+		
+		if (body_parse_extensions (stream, token, content) == -1)
+			goto exception;
+		
+		return content;
+	}
+	
+	/* body-type-1part: media-type SP body-fields ... */
+	spruce_imap_stream_unget_token (stream, token);
+	
+	if (body_parse_nstring (stream, token, &type) == -1)
+		goto exception;
+	
+	if (body_parse_nstring (stream, token, &subtype) == -1) {
+		g_free (type);
+		goto exception;
+	}
+	
+	content->content_type = g_mime_content_type_new (type ? type : "application", subtype ? subtype : "octet-stream");
+	g_free (subtype);
+	g_free (type);
+	
+	if (body_parse_params (stream, token, (BodyParamFunc) g_mime_content_type_set_parameter, content->content_type) == -1)
+		goto exception;
+	
+	if (body_parse_nstring (stream, token, &content->content_id) == -1)
+		goto exception;
+	
+	if (body_parse_nstring (stream, token, &content->description) == -1)
+		goto exception;
+	
+	if (body_parse_nstring (stream, token, &content->encoding) == -1)
+		goto exception;
+	
+	if (body_parse_number (stream, token, &content->octets) == -1)
+		goto exception;
+	
+	if (g_mime_content_type_is_type (content->content_type, "message", "rfc822")) {
+		/* body-type-msg: ... SP envelope SP body SP body-fld-lines */
+		if (body_next_token (stream, token) == -1)
+			goto exception;
+		
+		if (token->token == '(') {
+			if (body_skip_to_end (stream, token) == -1)
+				goto exception;
+		} else if (token->token != SPRUCE_IMAP_TOKEN_NIL) {
+			goto exception;
+		}
+		
+		if (!(child = body_parse (stream, token)))
+			goto exception;
+		
+		child->parent = content;
+		content->children = child;
+		
+		if (body_parse_number (stream, token, &content->lines) == -1)
+			goto exception;
+	} else if (g_mime_content_type_is_type (content->content_type, "text", "*")) {
+		/* body-type-text: ... SP body-fld-lines */
+		if (body_parse_number (stream, token, &content->lines) == -1)
+			goto exception;
+	}
+	
+	if (body_next_token (stream, token) == -1)
+		goto exception;
+	
+	if (token->token == ')')
+		return content;
+	
+	/* body-ext-1part: body-fld-md5 [SP body-fld-dsp ...] */
+	spruce_imap_stream_unget_token (stream, token);
+	
+	if (body_parse_nstring (stream, token, &md5) == -1)
+		goto exception;
+	
+	g_free (md5);
+	
+	if (body_parse_extensions (stream, token, content) == -1)
+		goto exception;
+	
+	return content;
+	
+ exception:
+	
+	spruce_summary_content_info_free (content);
+	
+	return NULL;
+}
+
+
+/**
+ * spruce_imap_parse_bodystructure:
+ * @engine: IMAP engine
+ * @content: return location for the MIME structure
+ * @err: a #GError
+ *
+ * Parses the body structure following a FETCH BODYSTRUCTURE item.
+ *
+ * Returns: %0 on success or %-1 on fail.
+ **/
+int
+spruce_imap_parse_bodystructure (SpruceIMAPEngine *engine, SpruceSummaryContentInfo **content, GError **err)
+{
+	spruce_imap_token_t token;
+	
+	if ((*content = body_parse (engine->istream, &token)))
+		return 0;
+	
+	if (token.token == SPRUCE_IMAP_TOKEN_ERROR) {
+		g_set_error (err, SPRUCE_ERROR, errno ? errno : SPRUCE_ERROR_GENERIC,
+			     _("IMAP server %s unexpectedly disconnected: %s"),
+			     engine->url->host, errno ? g_strerror (errno) : _("Unknown"));
+	} else {
+		spruce_imap_utils_set_unexpected_token_error (err, engine, &token);
+	}
+	
+	return -1;
+}
+
+
+static void
+body_encode_string (GString *out, const char *str)
+{
+	register const char *inptr = str;
+	
+	if (str == NULL) {
+		g_string_append (out, "NIL");
+		return;
+	}
+	
+	g_string_append_c (out, '"');
+	while (*inptr) {
+		if (*inptr == '"' || *inptr == '\\')
+			g_string_append_c (out, '\\');
+		g_string_append_c (out, *inptr++);
+	}
+	g_string_append_c (out, '"');
+}
+
+static void
+body_encode_params (GString *out, const GMimeParam *param)
+{
+	if (param == NULL) {
+		g_string_append (out, "NIL");
+		return;
+	}
+	
+	g_string_append_c (out, '(');
+	while (param != NULL) {
+		body_encode_string (out, g_mime_param_get_name (param));
+		g_string_append_c (out, ' ');
+		body_encode_string (out, g_mime_param_get_value (param));
+		
+		if ((param = g_mime_param_next (param)))
+			g_string_append_c (out, ' ');
+	}
+	g_string_append_c (out, ')');
+}
+
+static void
+body_encode_disposition (GString *out, GMimeContentDisposition *disposition)
+{
+	if (disposition == NULL) {
+		g_string_append (out, "NIL");
+		return;
+	}
+	
+	g_string_append_c (out, '(');
+	body_encode_string (out, g_mime_content_disposition_get_disposition (disposition));
+	g_string_append_c (out, ' ');
+	body_encode_params (out, g_mime_content_disposition_get_params (disposition));
+	g_string_append_c (out, ')');
+}
+
+static void
+body_encode (GString *out, SpruceSummaryContentInfo *content)
+{
+	GMimeContentType *type = content->content_type;
+	SpruceSummaryContentInfo *child;
+	
+	g_string_append_c (out, '(');
+	
+	if (content->children && g_mime_content_type_is_type (type, "multipart", "*")) {
+		for (child = content->children; child != NULL; child = child->next)
+			body_encode (out, child);
+		
+		g_string_append_c (out, ' ');
+		body_encode_string (out, g_mime_content_type_get_media_subtype (type));
+		g_string_append_c (out, ' ');
+		body_encode_params (out, g_mime_content_type_get_params (type));
+		g_string_append_c (out, ' ');
+		body_encode_disposition (out, content->disposition);
+		g_string_append_c (out, ')');
+		return;
+	}
+	
+	body_encode_string (out, g_mime_content_type_get_media_type (type));
+	g_string_append_c (out, ' ');
+	body_encode_string (out, g_mime_content_type_get_media_subtype (type));
+	g_string_append_c (out, ' ');
+	body_encode_params (out, g_mime_content_type_get_params (type));
+	g_string_append_c (out, ' ');
+	body_encode_string (out, content->content_id);
+	g_string_append_c (out, ' ');
+	body_encode_string (out, content->description);
+	g_string_append_c (out, ' ');
+	body_encode_string (out, content->encoding);
+	g_string_append_printf (out, " %zu", content->octets);
+	
+	if (content->children && g_mime_content_type_is_type (type, "message", "rfc822")) {
+		/* we don't keep the envelope */
+		g_string_append (out, " NIL ");
+		body_encode (out, content->children);
+		g_string_append_printf (out, " %zu", content->lines);
+	} else if (g_mime_content_type_is_type (type, "text", "*")) {
+		g_string_append_printf (out, " %zu", content->lines);
+	}
+	
+	/* no md5 */
+	g_string_append (out, " NIL ");
+	body_encode_disposition (out, content->disposition);
+	g_string_append_c (out, ')');
+}
+
+
+/**
+ * spruce_imap_bodystructure_encode:
+ * @content: MIME structure
+ *
+ * Encodes @content in the same syntax as an IMAP BODYSTRUCTURE (less
+ * the details we don't keep) for saving in the summary.
+ *
+ * Returns: the encoded BODYSTRUCTURE string.
+ **/
+char *
+spruce_imap_bodystructure_encode (SpruceSummaryContentInfo *content)
+{
+	GString *out;
+	
+	out = g_string_new ("");
+	body_encode (out, content);
+	
+	return g_string_free (out, FALSE);
+}
+
+
+/**
+ * spruce_imap_bodystructure_decode:
+ * @bodystructure: a string encoded by spruce_imap_bodystructure_encode()
+ *
+ * Decodes a BODYSTRUCTURE string saved in the summary.
+ *
+ * Returns: the MIME structure or %NULL on error.
+ **/
+SpruceSummaryContentInfo *
+spruce_imap_bodystructure_decode (const char *bodystructure)
+{
+	SpruceSummaryContentInfo *content;
+	spruce_imap_token_t token;
+	GMimeStream *stream, *mem;
+	
+	mem = g_mime_stream_mem_new_with_buffer (bodystructure, strlen (bodystructure));
+	stream = spruce_imap_stream_new (mem);
+	g_object_unref (mem);
+	
+	content = body_parse ((SpruceIMAPStream *) stream, &token);
+	g_object_unref (stream);
+	
+	return content;
+}
+
+
 struct {
 	const char *name;
 	guint32 flag;
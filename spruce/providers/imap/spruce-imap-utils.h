@@ -43,6 +43,7 @@ guint32 spruce_imap_merge_flags (guint32 original, guint32 local, guint32 server
 struct _SpruceIMAPEngine;
 struct _SpruceIMAPCommand;
 struct _SpruceFolderSummary;
+struct _SpruceSummaryContentInfo;
 struct _spruce_imap_token_t;
 
 int spruce_imap_get_uid_set (struct _SpruceIMAPEngine *engine, struct _SpruceFolderSummary *summary, GPtrArray *infos, int cur, size_t linelen, char **set);
@@ -51,6 +52,12 @@ void spruce_imap_utils_set_unexpected_token_error (GError **err, struct _SpruceI
 
 int spruce_imap_parse_flags_list (struct _SpruceIMAPEngine *engine, guint32 *flags, GError **err);
 
+int spruce_imap_parse_modseq (struct _SpruceIMAPEngine *engine, guint64 *modseq, GError **err);
+
+int spruce_imap_parse_bodystructure (struct _SpruceIMAPEngine *engine, struct _SpruceSummaryContentInfo **content, GError **err);
+char *spruce_imap_bodystructure_encode (struct _SpruceSummaryContentInfo *content);
+struct _SpruceSummaryContentInfo *spruce_imap_bodystructure_decode (const char *bodystructure);
+
 enum {
 	SPRUCE_IMAP_FOLDER_MARKED          = (1 << 0),
 	SPRUCE_IMAP_FOLDER_UNMARKED        = (1 << 1),
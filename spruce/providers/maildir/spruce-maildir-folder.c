@@ -63,6 +63,8 @@ static void maildir_newname (SpruceFolder *folder, const char *parent, const cha
 static int maildir_expunge (SpruceFolder *folder, GPtrArray *uids, GError **err);
 static GPtrArray *maildir_list (SpruceFolder *folder, const char *pattern, GError **err);
 static GMimeMessage *maildir_get_message (SpruceFolder *folder, const char *uid, GError **err);
+static GMimeMessage *maildir_get_message_headers (SpruceFolder *folder, const char *uid, GError **err);
+static GMimeStream *maildir_get_message_stream (SpruceFolder *folder, const char *uid, GError **err);
 static int maildir_append_message (SpruceFolder *folder, GMimeMessage *message,
 				   SpruceMessageInfo *info, GError **err);
 static GPtrArray *maildir_search (SpruceFolder *folder, GPtrArray *uids, const char *expression, GError **err);
@@ -115,6 +117,8 @@ spruce_maildir_folder_class_init (SpruceMaildirFolderClass *klass)
 	folder_class->expunge = maildir_expunge;
 	folder_class->list = maildir_list;
 	folder_class->get_message = maildir_get_message;
+	folder_class->get_message_headers = maildir_get_message_headers;
+	folder_class->get_message_stream = maildir_get_message_stream;
 	folder_class->append_message = maildir_append_message;
 	folder_class->search = maildir_search;
 }
@@ -823,15 +827,13 @@ maildir_list (SpruceFolder *folder, const char *pattern, GError **err)
 	return list;
 }
 
-static GMimeMessage *
-maildir_get_message (SpruceFolder *folder, const char *uid, GError **err)
+/* opens the file of message @uid, moving it into cur/ if it was new */
+static int
+maildir_message_open (SpruceFolder *folder, const char *uid, GError **err)
 {
 	SpruceMaildirFolder *maildir = (SpruceMaildirFolder *) folder;
 	char *filename, *cur, *new, *subdir, *p;
 	SpruceMessageInfo *info;
-	GMimeMessage *message;
-	GMimeStream *stream;
-	GMimeParser *parser;
 	struct dirent *dent;
 	int fd, i = 0;
 	DIR *dir;
@@ -860,13 +862,15 @@ maildir_get_message (SpruceFolder *folder, const char *uid, GError **err)
 		closedir (dir);
 	}
 	
+	spruce_folder_summary_info_unref (folder->summary, info);
+	
  not_found:
 	
 	g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_FOLDER_NO_SUCH_MESSAGE,
 		     _("Cannot get message %s from folder `%s': no such message"),
 		     uid, folder->full_name);
 	
-	return NULL;
+	return -1;
 	
  found:
 	
@@ -891,11 +895,25 @@ maildir_get_message (SpruceFolder *folder, const char *uid, GError **err)
 		g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_FOLDER_NO_SUCH_MESSAGE,
 			     _("Cannot get message %s from folder `%s': %s"),
 			     uid, folder->full_name, g_strerror (errno));
-		
-		g_free (filename);
-		return NULL;
 	}
 	
+	spruce_folder_summary_info_unref (folder->summary, info);
+	g_free (filename);
+	
+	return fd;
+}
+
+static GMimeMessage *
+maildir_get_message (SpruceFolder *folder, const char *uid, GError **err)
+{
+	GMimeMessage *message;
+	GMimeStream *stream;
+	GMimeParser *parser;
+	int fd;
+	
+	if ((fd = maildir_message_open (folder, uid, err)) == -1)
+		return NULL;
+	
 	stream = g_mime_stream_fs_new (fd);
 	
 	parser = g_mime_parser_new ();
@@ -910,11 +928,44 @@ maildir_get_message (SpruceFolder *folder, const char *uid, GError **err)
 	
 	g_object_unref (parser);
 	
-	spruce_folder_summary_info_unref (folder->summary, info);
+	return message;
+}
+
+static GMimeMessage *
+maildir_get_message_headers (SpruceFolder *folder, const char *uid, GError **err)
+{
+	GMimeMessage *message;
+	GMimeStream *stream;
+	int fd;
+	
+	if ((fd = maildir_message_open (folder, uid, err)) == -1)
+		return NULL;
+	
+	/* only read as far as the end of the headers */
+	stream = g_mime_stream_fs_new (fd);
+	
+	if (!(message = spruce_folder_parse_message_headers (stream, FALSE))) {
+		g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_FOLDER_NO_SUCH_MESSAGE,
+			     _("Cannot get message %s from folder `%s': internal parser error"),
+			     uid, folder->full_name);
+	}
+	
+	g_object_unref (stream);
 	
 	return message;
 }
 
+static GMimeStream *
+maildir_get_message_stream (SpruceFolder *folder, const char *uid, GError **err)
+{
+	int fd;
+	
+	if ((fd = maildir_message_open (folder, uid, err)) == -1)
+		return NULL;
+	
+	return g_mime_stream_fs_new (fd);
+}
+
 static int
 maildir_append_message (SpruceFolder *folder, GMimeMessage *message, SpruceMessageInfo *info, GError **err)
 {
@@ -987,7 +1038,6 @@ maildir_append_message (SpruceFolder *folder, GMimeMessage *message, SpruceMessa
 	
 	spruce_folder_summary_add (folder->summary, minfo);
 	spruce_folder_summary_info_unref (folder->summary, minfo);
-	spruce_folder_summary_touch (folder->summary);
 	
 	return 0;
 	
@@ -379,37 +379,39 @@ maildir_summary_save_cb (const char *maildir, const char *subdir, const char *d_
 	
 	if ((info = spruce_folder_summary_uid (summary, uid))) {
 		char *oldname, *newname, *str;
-		gboolean sync_flags = FALSE;
+		gboolean synced = TRUE;
+		guint32 old = info->flags;
 		
 		/* if the flags are not identical... */
 		if (flags != (info->flags & ~SPRUCE_MESSAGE_DIRTY)) {
 			/* and our flags are dirty... */
 			if (info->flags & SPRUCE_MESSAGE_DIRTY) {
 				/* sync our flags to disk */
-				sync_flags = TRUE;
+				str = spruce_maildir_summary_flags_encode (info);
+				oldname = g_strdup_printf ("%s/%s/%s", maildir, subdir, d_name);
+				newname = g_strdup_printf ("%s/%s/%s:2,%s", maildir, subdir, info->uid, str);
+				g_free (str);
+				
+				/* rename the message file to reflect the new flags */
+				synced = rename (oldname, newname) == 0;
+				
+				g_free (oldname);
+				g_free (newname);
 			} else {
 				/* update our flags */
 				info->flags = flags;
 			}
 		}
 		
-		if (sync_flags) {
-			str = spruce_maildir_summary_flags_encode (info);
-			oldname = g_strdup_printf ("%s/%s/%s", maildir, subdir, d_name);
-			newname = g_strdup_printf ("%s/%s/%s:2,%s", maildir, subdir, info->uid, str);
-			g_free (str);
-			
-			/* rename the message file to reflect the new flags */
-			if (rename (oldname, newname) == 0)
-				ret = 1;
-			
-			g_free (oldname);
-			g_free (newname);
-		}
-		
 		/* clear the dirty bit */
-		if (ret != -1)
+		if (synced)
 			info->flags &= ~SPRUCE_MESSAGE_DIRTY;
+		
+		/* log the change so that a journal-only commit keeps it */
+		if (info->flags != old)
+			spruce_folder_summary_touch_info (summary, info);
+		
+		spruce_folder_summary_info_unref (summary, info);
 	} else {
 		/* our summary seems to not know about this message,
 		   may have been delivered by another client */
@@ -39,6 +39,7 @@
 #include <gmime/gmime.h>
 #include <spruce/spruce-error.h>
 #include <spruce/spruce-file-utils.h>
+#include <spruce/spruce-lock.h>
 #include <spruce/spruce-folder-search.h>
 
 #include "spruce-mbox-store.h"
@@ -52,6 +53,7 @@ static struct {
 } ignore_names[] = {
 	{ "~",                 1 },
 	{ ".summary",          8 },
+	{ ".expunge",          8 },
 	
 	/* evolution specials */
 	{ ".cmeta",            6 },
@@ -75,8 +77,10 @@ static int mbox_delete (SpruceFolder *folder, GError **err);
 static int mbox_rename (SpruceFolder *folder, const char *newname, GError **err);
 static void mbox_newname (SpruceFolder *folder, const char *parent, const char *name);
 static int mbox_expunge (SpruceFolder *folder, GPtrArray *uids, GError **err);
+static int mbox_expunge_recover (SpruceMboxFolder *mbox, int fd);
 static GPtrArray *mbox_list (SpruceFolder *folder, const char *pattern, GError **err);
 static GMimeMessage *mbox_get_message (SpruceFolder *folder, const char *uid, GError **err);
+static GMimeMessage *mbox_get_message_headers (SpruceFolder *folder, const char *uid, GError **err);
 static int mbox_append_message (SpruceFolder *folder, GMimeMessage *message,
 				SpruceMessageInfo *info, GError **err);
 static GPtrArray *mbox_search (SpruceFolder *folder, GPtrArray *uids, const char *expression, GError **err);
@@ -134,6 +138,7 @@ spruce_mbox_folder_class_init (SpruceMboxFolderClass *klass)
 	folder_class->expunge = mbox_expunge;
 	folder_class->list = mbox_list;
 	folder_class->get_message = mbox_get_message;
+	folder_class->get_message_headers = mbox_get_message_headers;
 	folder_class->append_message = mbox_append_message;
 	folder_class->search = mbox_search;
 }
@@ -165,6 +170,21 @@ spruce_mbox_folder_finalize (GObject *object)
 }
 
 
+/* mbox locks are only held around the operations that actually touch
+ * the mbox so that the MDA isn't kept from delivering new mail */
+static int
+mbox_lock (SpruceMboxFolder *mbox, SpruceLockType type, GError **err)
+{
+	return spruce_lock (mbox->path, ((GMimeStreamFs *) mbox->stream)->fd, type, err);
+}
+
+static void
+mbox_unlock (SpruceMboxFolder *mbox, SpruceLockType type)
+{
+	spruce_unlock (mbox->path, ((GMimeStreamFs *) mbox->stream)->fd, type, NULL);
+}
+
+
 static char *
 mbox_get_summary_filename (const char *mbox)
 {
@@ -177,6 +197,18 @@ mbox_get_summary_filename (const char *mbox)
 		return g_strdup_printf (".%s.summary", mbox);
 }
 
+static char *
+mbox_get_journal_filename (const char *mbox)
+{
+	/* /path/to/.mbox.expunge */
+	const char *filename;
+	
+	if ((filename = strrchr (mbox, '/')))
+		return g_strdup_printf ("%.*s/.%s.expunge", (int) (filename - mbox), mbox, filename + 1);
+	else
+		return g_strdup_printf (".%s.expunge", mbox);
+}
+
 static char *
 mbox_build_filename (const char *toplevel_dir, const char *full_name)
 {
@@ -355,7 +387,12 @@ mbox_open (SpruceFolder *folder, GError **err)
 		return -1;
 	}
 	
-	/* FIXME: perform some file locking... */
+	if (mode == SPRUCE_FOLDER_MODE_READ_WRITE && mbox_expunge_recover (mbox, fd) == -1) {
+		g_set_error (err, SPRUCE_ERROR, errno, _("Cannot open folder `%s': failed to finish interrupted expunge: %s"),
+			     folder->full_name, g_strerror (errno));
+		close (fd);
+		return -1;
+	}
 	
 	folder->mode = mode;
 	
@@ -369,8 +406,9 @@ mbox_open (SpruceFolder *folder, GError **err)
 		g_free (summary);
 	}
 	
-	/* load the summary */
-	spruce_folder_summary_load (folder->summary);
+	/* load the summary and pick up any newly delivered mail */
+	if (spruce_folder_summary_load (folder->summary) == 0)
+		spruce_mbox_summary_update ((SpruceMboxSummary *) folder->summary);
 	
 	return 0;
 }
@@ -387,8 +425,6 @@ mbox_close (SpruceFolder *folder, gboolean expunge, GError **err)
 	g_object_unref (mbox->stream);
 	mbox->stream = NULL;
 	
-	/* FIXME: unlock the mbox */
-	
 	return 0;
 }
 
@@ -446,7 +482,7 @@ static int
 mbox_delete (SpruceFolder *folder, GError **err)
 {
 	SpruceMboxFolder *mbox = (SpruceMboxFolder *) folder;
-	char *path;
+	char *path, *journal;
 	
 	if (folder->type & SPRUCE_FOLDER_CAN_HOLD_FOLDERS) {
 		path = g_strdup_printf ("%s.sbd", mbox->path);
@@ -462,6 +498,9 @@ mbox_delete (SpruceFolder *folder, GError **err)
 	}
 	
 	if (folder->type & SPRUCE_FOLDER_CAN_HOLD_MESSAGES) {
+		if (folder->summary)
+			spruce_folder_summary_set_indexed (folder->summary, FALSE);
+		
 		path = mbox_get_summary_filename (mbox->path);
 		if (unlink (path) == -1 && errno != ENOENT) {
 			g_set_error (err, SPRUCE_ERROR, errno, _("Cannot delete folder `%s': %s"),
@@ -470,6 +509,13 @@ mbox_delete (SpruceFolder *folder, GError **err)
 			return -1;
 		}
 		
+		/* a journal left behind would otherwise be replayed
+		 * against the summary of a new folder by this name */
+		journal = g_strdup_printf ("%s.journal", path);
+		unlink (journal);
+		g_free (journal);
+		g_free (path);
+		
 		if (unlink (mbox->path) == -1 && errno != ENOENT) {
 			g_set_error (err, SPRUCE_ERROR, errno, _("Cannot delete folder `%s': %s"),
 				     folder->full_name, g_strerror (errno));
@@ -492,7 +538,7 @@ mbox_rename (SpruceFolder *folder, const char *newname, GError **err)
 {
 	SpruceMboxFolder *mbox = (SpruceMboxFolder *) folder;
 	char *summary, *newpath, *olddir, *newdir;
-	const char *oldsum, *basename;
+	const char *basename;
 	
 	if (!(basename = strrchr (newname, '/')))
 		basename = newname;
@@ -541,13 +587,8 @@ mbox_rename (SpruceFolder *folder, const char *newname, GError **err)
 	if (folder->summary) {
 		/* the summary file is renamed last in case any of the above renames fails */
 		summary = mbox_get_summary_filename (newpath);
-		if ((oldsum = spruce_folder_summary_get_filename (folder->summary))) {
-			if (rename (oldsum, summary) == -1 && errno != ENOENT)
-				unlink (oldsum);
-		}
-		
 		spruce_mbox_summary_set_mbox ((SpruceMboxSummary *) folder->summary, newpath);
-		spruce_folder_summary_set_filename (folder->summary, summary);
+		spruce_folder_summary_rename (folder->summary, summary);
 		g_free (summary);
 	}
 	
@@ -571,7 +612,6 @@ static void
 mbox_newname (SpruceFolder *folder, const char *parent, const char *name)
 {
 	SpruceMboxFolder *mbox = (SpruceMboxFolder *) folder;
-	const char *oldsum;
 	char *summary;
 	
 	SPRUCE_FOLDER_CLASS (parent_class)->newname (folder, parent, name);
@@ -582,28 +622,558 @@ mbox_newname (SpruceFolder *folder, const char *parent, const char *name)
 	if (folder->summary) {
 		/* the summary file is renamed last in case any of the above renames fails */
 		summary = mbox_get_summary_filename (mbox->path);
-		if ((oldsum = spruce_folder_summary_get_filename (folder->summary))) {
-			if (rename (oldsum, summary) == -1 && errno != ENOENT)
-				unlink (oldsum);
-		}
-		
 		spruce_mbox_summary_set_mbox ((SpruceMboxSummary *) folder->summary, mbox->path);
-		spruce_folder_summary_set_filename (folder->summary, summary);
+		spruce_folder_summary_rename (folder->summary, summary);
 		g_free (summary);
 	}
 }
 
+/* In-place expunging: rather than writing out a new copy of the mbox,
+ * the messages following the first expunged message are slid down
+ * over the gaps and the file is truncated. Since that destroys the
+ * original data as it goes, progress is recorded in a journal next
+ * to the mbox so that an interrupted expunge can be finished by
+ * mbox_expunge_recover() the next time the folder is opened.
+ *
+ * Journal layout (host byte order):
+ *
+ *   magic[16] newsize nruns runs[nruns] progress block-data
+ */
+
+#define MBOX_JOURNAL_MAGIC      "spruce-expunge1\n"
+#define MBOX_JOURNAL_MAGIC_LEN  16
+
+/* size of the blocks messages are moved in */
+#define MBOX_EXPUNGE_BLOCK  (1024 * 1024)
+
+typedef struct {
+	gint64 src;        /* offset of a run of surviving messages */
+	gint64 dst;        /* offset it gets moved to */
+	gint64 len;
+} MboxRun;
+
+typedef struct {
+	gint64 src;        /* everything before src has been moved to before dst */
+	gint64 dst;
+	gint64 blkdst;     /* if blklen != 0, the block of data following */
+	gint64 blklen;     /* the progress record must be (re)written at blkdst */
+} MboxProgress;
+
+typedef struct {
+	const char *path;  /* mbox */
+	int fd;            /* mbox */
+	int jfd;           /* journal */
+	off_t progress;    /* offset of the progress record in the journal */
+	gint64 committed;  /* source data from here on is still intact */
+} MboxMover;
+
+static int
+mbox_pread (int fd, char *buf, size_t n, gint64 offset)
+{
+	ssize_t nread;
+	size_t done = 0;
+	
+	while (done < n) {
+		do {
+			nread = pread (fd, buf + done, n - done, (off_t) (offset + done));
+		} while (nread == -1 && errno == EINTR);
+		
+		if (nread <= 0) {
+			if (nread == 0)
+				errno = EIO;
+			return -1;
+		}
+		
+		done += nread;
+	}
+	
+	return 0;
+}
+
+static int
+mbox_pwrite (int fd, const char *buf, size_t n, gint64 offset)
+{
+	ssize_t nwritten;
+	size_t done = 0;
+	
+	while (done < n) {
+		do {
+			nwritten = pwrite (fd, buf + done, n - done, (off_t) (offset + done));
+		} while (nwritten == -1 && errno == EINTR);
+		
+		if (nwritten == -1)
+			return -1;
+		
+		done += nwritten;
+	}
+	
+	return 0;
+}
+
+static int
+mbox_journal_create (const char *path, MboxRun *runs, guint32 nruns, gint64 newsize, MboxMover *mover)
+{
+	MboxProgress progress;
+	gint64 offset;
+	int fd;
+	
+	if ((fd = open (path, O_CREAT | O_TRUNC | O_RDWR, 0600)) == -1)
+		return -1;
+	
+	memset (&progress, 0, sizeof (progress));
+	progress.src = runs[0].src;
+	progress.dst = runs[0].dst;
+	
+	offset = MBOX_JOURNAL_MAGIC_LEN;
+	if (mbox_pwrite (fd, (char *) &newsize, sizeof (newsize), offset) == -1)
+		goto exception;
+	
+	offset += sizeof (newsize);
+	if (mbox_pwrite (fd, (char *) &nruns, sizeof (nruns), offset) == -1)
+		goto exception;
+	
+	offset += sizeof (nruns);
+	if (mbox_pwrite (fd, (char *) runs, sizeof (MboxRun) * nruns, offset) == -1)
+		goto exception;
+	
+	offset += sizeof (MboxRun) * nruns;
+	if (mbox_pwrite (fd, (char *) &progress, sizeof (progress), offset) == -1)
+		goto exception;
+	
+	/* the magic goes on last so that a journal which didn't make
+	 * it to disk in its entirety is never mistaken for a valid one */
+	if (fsync (fd) == -1)
+		goto exception;
+	
+	if (mbox_pwrite (fd, MBOX_JOURNAL_MAGIC, MBOX_JOURNAL_MAGIC_LEN, 0) == -1)
+		goto exception;
+	
+	if (fsync (fd) == -1)
+		goto exception;
+	
+	mover->jfd = fd;
+	mover->progress = (off_t) offset;
+	mover->committed = progress.src;
+	
+	return 0;
+	
+ exception:
+	
+	close (fd);
+	unlink (path);
+	
+	return -1;
+}
+
+/* makes everything written to the mbox so far durable and then
+ * records @progress (and @block, if any) in the journal */
+static int
+mbox_journal_commit (MboxMover *mover, MboxProgress *progress, const char *block)
+{
+	if (fsync (mover->fd) == -1)
+		return -1;
+	
+	/* the block has to be on disk before the record pointing to it */
+	if (progress->blklen > 0 && (mbox_pwrite (mover->jfd, block, progress->blklen,
+						  mover->progress + sizeof (MboxProgress)) == -1 ||
+				     fsync (mover->jfd) == -1))
+		return -1;
+	
+	if (mbox_pwrite (mover->jfd, (char *) progress, sizeof (MboxProgress), mover->progress) == -1)
+		return -1;
+	
+	if (fsync (mover->jfd) == -1)
+		return -1;
+	
+	mover->committed = progress->src;
+	
+	return 0;
+}
+
+/* moves the remainder of @runs, starting where @progress left off */
+static int
+mbox_journal_move (MboxMover *mover, MboxRun *runs, guint32 nruns, MboxProgress *progress)
+{
+	MboxProgress commit;
+	gint64 end, len;
+	char *buf;
+	guint32 i;
+	
+	buf = g_malloc (MBOX_EXPUNGE_BLOCK);
+	
+	for (i = 0; i < nruns; i++) {
+		end = runs[i].src + runs[i].len;
+		
+		if (progress->src >= end)
+			continue;
+		
+		if (progress->src < runs[i].src) {
+			progress->src = runs[i].src;
+			progress->dst = runs[i].dst;
+		}
+		
+		while (progress->src < end) {
+			len = MIN (end - progress->src, MBOX_EXPUNGE_BLOCK);
+			
+			if (mbox_pread (mover->fd, buf, len, progress->src) == -1)
+				goto exception;
+			
+			if (progress->dst + len > mover->committed) {
+				/* this write would clobber source data that
+				 * resuming from the last commit would need */
+				commit.src = progress->src;
+				commit.dst = progress->dst;
+				commit.blklen = 0;
+				
+				if (progress->dst + len > progress->src) {
+					/* the block even overlaps its own source,
+					 * so the journal needs a copy of the part
+					 * of it that this write destroys; the rest
+					 * can still be moved from the mbox */
+					commit.blkdst = progress->dst;
+					commit.blklen = progress->dst + len - progress->src;
+					commit.src += commit.blklen;
+					commit.dst += commit.blklen;
+				}
+				
+				if (mbox_journal_commit (mover, &commit, buf) == -1)
+					goto exception;
+			}
+			
+			if (mbox_pwrite (mover->fd, buf, len, progress->dst) == -1)
+				goto exception;
+			
+			progress->src += len;
+			progress->dst += len;
+			
+			/* moving a large mbox can take longer than
+			 * other processes wait before breaking a dot lock */
+			spruce_lock_refresh (mover->path, mover->fd);
+		}
+	}
+	
+	g_free (buf);
+	
+	return 0;
+	
+ exception:
+	
+	g_free (buf);
+	
+	return -1;
+}
+
+static int
+mbox_journal_finish (MboxMover *mover, const char *path, gint64 newsize)
+{
+	if (ftruncate (mover->fd, (off_t) newsize) == -1 || fsync (mover->fd) == -1)
+		return -1;
+	
+	close (mover->jfd);
+	mover->jfd = -1;
+	
+	return unlink (path);
+}
+
+/* finishes an in-place expunge that was interrupted */
+static int
+mbox_expunge_recover (SpruceMboxFolder *mbox, int fd)
+{
+	char magic[MBOX_JOURNAL_MAGIC_LEN];
+	MboxRun *runs = NULL;
+	MboxProgress progress;
+	MboxMover mover;
+	gint64 newsize;
+	char *path, *buf;
+	guint32 nruns;
+	off_t offset;
+	int errnosave, ret = -1;
+	struct stat st;
+	
+	path = mbox_get_journal_filename (mbox->path);
+	
+	if ((mover.jfd = open (path, O_RDWR)) == -1) {
+		g_free (path);
+		return errno == ENOENT ? 0 : -1;
+	}
+	
+	if (spruce_lock (mbox->path, fd, SPRUCE_LOCK_WRITE, NULL) == -1) {
+		close (mover.jfd);
+		g_free (path);
+		return -1;
+	}
+	
+	mover.path = mbox->path;
+	mover.fd = fd;
+	
+	if (fstat (mover.jfd, &st) == -1)
+		goto exception;
+	
+	offset = MBOX_JOURNAL_MAGIC_LEN + sizeof (newsize) + sizeof (nruns);
+	if (st.st_size < offset ||
+	    mbox_pread (mover.jfd, magic, MBOX_JOURNAL_MAGIC_LEN, 0) == -1 ||
+	    memcmp (magic, MBOX_JOURNAL_MAGIC, MBOX_JOURNAL_MAGIC_LEN) != 0) {
+		/* the expunge never got as far as touching the mbox */
+		goto discard;
+	}
+	
+	if (mbox_pread (mover.jfd, (char *) &newsize, sizeof (newsize), MBOX_JOURNAL_MAGIC_LEN) == -1 ||
+	    mbox_pread (mover.jfd, (char *) &nruns, sizeof (nruns), MBOX_JOURNAL_MAGIC_LEN + sizeof (newsize)) == -1)
+		goto exception;
+	
+	if ((gint64) nruns > ((gint64) st.st_size - offset) / (gint64) sizeof (MboxRun))
+		goto exception;
+	
+	runs = g_new (MboxRun, nruns);
+	if (mbox_pread (mover.jfd, (char *) runs, sizeof (MboxRun) * nruns, offset) == -1)
+		goto exception;
+	
+	mover.progress = offset + sizeof (MboxRun) * nruns;
+	if (mbox_pread (mover.jfd, (char *) &progress, sizeof (progress), mover.progress) == -1)
+		goto exception;
+	
+	if (progress.blklen > 0) {
+		/* redo the write of the journaled block */
+		if (progress.blklen > MBOX_EXPUNGE_BLOCK)
+			goto exception;
+		
+		buf = g_malloc (progress.blklen);
+		if (mbox_pread (mover.jfd, buf, progress.blklen, mover.progress + sizeof (progress)) == -1 ||
+		    mbox_pwrite (fd, buf, progress.blklen, progress.blkdst) == -1) {
+			g_free (buf);
+			goto exception;
+		}
+		
+		g_free (buf);
+	}
+	
+	mover.committed = progress.src;
+	
+	if (mbox_journal_move (&mover, runs, nruns, &progress) == -1)
+		goto exception;
+	
+	ret = mbox_journal_finish (&mover, path, newsize);
+	spruce_unlock (mbox->path, fd, SPRUCE_LOCK_WRITE, NULL);
+	g_free (runs);
+	g_free (path);
+	
+	return ret;
+	
+ discard:
+	
+	spruce_unlock (mbox->path, fd, SPRUCE_LOCK_WRITE, NULL);
+	close (mover.jfd);
+	ret = unlink (path);
+	g_free (path);
+	
+	return ret;
+	
+ exception:
+	
+	errnosave = errno;
+	spruce_unlock (mbox->path, fd, SPRUCE_LOCK_WRITE, NULL);
+	
+	if (mover.jfd != -1)
+		close (mover.jfd);
+	
+	g_free (runs);
+	g_free (path);
+	
+	errno = errnosave;
+	
+	return -1;
+}
+
+/* Expunges the messages in place if that is possible, that is if
+ * the position of every message is known.
+ *
+ * Returns %1 if the messages were expunged, %0 if the caller should
+ * fall back to rewriting the mbox or %-1 on error. */
+static int
+mbox_expunge_in_place (SpruceFolder *folder, GHashTable *uid_hash, GError **err)
+{
+	SpruceMboxFolder *mbox = (SpruceMboxFolder *) folder;
+	SpruceFolderSummary *summary = folder->summary;
+	gint64 end, dst, newsize, shift, scanned, moved;
+	SpruceMboxMessageInfo *minfo;
+	int i, first = -1, max, ret;
+	SpruceMessageInfo *info;
+	MboxProgress progress;
+	GArray *runs, *expunged;
+	MboxMover mover;
+	struct stat st;
+	char *path;
+	MboxRun run;
+	guint r;
+	
+	if (folder->mode != SPRUCE_FOLDER_MODE_READ_WRITE || !GMIME_IS_STREAM_FS (mbox->stream))
+		return 0;
+	
+	mover.path = mbox->path;
+	mover.fd = ((GMimeStreamFs *) mbox->stream)->fd;
+	mover.jfd = -1;
+	
+	if (fstat (mover.fd, &st) == -1)
+		return 0;
+	
+	/* the last message in the summary ends where the scan did,
+	 * anything after that was appended since */
+	scanned = ((SpruceMboxSummary *) summary)->scanned;
+	if (scanned == -1 || scanned > st.st_size)
+		return 0;
+	
+	max = summary->messages->len;
+	runs = g_array_new (FALSE, FALSE, sizeof (MboxRun));
+	expunged = g_array_new (FALSE, FALSE, sizeof (int));
+	run.len = 0;
+	dst = 0;
+	
+	for (i = 0; i < max; i++) {
+		info = summary->messages->pdata[i];
+		minfo = (SpruceMboxMessageInfo *) info;
+		
+		/* where this message ends */
+		if (i + 1 < max)
+			end = ((SpruceMboxMessageInfo *) summary->messages->pdata[i + 1])->frompos;
+		else
+			end = scanned;
+		
+		if (minfo->frompos == -1 || end <= minfo->frompos || end > scanned)
+			goto fallback;
+		
+		if ((info->flags & SPRUCE_MESSAGE_DELETED) &&
+		    (!uid_hash || g_hash_table_lookup (uid_hash, info->uid))) {
+			if (first == -1) {
+				first = i;
+				dst = minfo->frompos;
+			}
+			
+			if (run.len > 0) {
+				g_array_append_val (runs, run);
+				dst += run.len;
+				run.len = 0;
+			}
+			
+			g_array_append_val (expunged, i);
+		} else if (first != -1) {
+			if (run.len == 0) {
+				run.src = minfo->frompos;
+				run.dst = dst;
+			}
+			
+			run.len = end - run.src;
+		}
+	}
+	
+	if (first == -1)
+		goto fallback;
+	
+	/* where the end of the scan moves to */
+	moved = run.len > 0 ? run.dst + run.len : dst;
+	
+	/* the unscanned mail has to be moved along as well */
+	if (st.st_size > scanned) {
+		if (run.len == 0) {
+			run.src = scanned;
+			run.dst = dst;
+		}
+		
+		run.len = st.st_size - run.src;
+	}
+	
+	if (run.len > 0) {
+		g_array_append_val (runs, run);
+		dst += run.len;
+	}
+	
+	newsize = dst;
+	path = mbox_get_journal_filename (mbox->path);
+	
+	if (runs->len > 0) {
+		if (mbox_journal_create (path, (MboxRun *) runs->data, runs->len, newsize, &mover) == -1) {
+			/* can't journal, so don't risk it */
+			g_free (path);
+			goto fallback;
+		}
+		
+		memset (&progress, 0, sizeof (progress));
+		progress.src = g_array_index (runs, MboxRun, 0).src;
+		progress.dst = g_array_index (runs, MboxRun, 0).dst;
+		
+		if (mbox_journal_move (&mover, (MboxRun *) runs->data, runs->len, &progress) == -1)
+			goto exception;
+		
+		if (mbox_journal_finish (&mover, path, newsize) == -1)
+			goto exception;
+	} else if (ftruncate (mover.fd, (off_t) newsize) == -1 || fsync (mover.fd) == -1) {
+		/* only messages at the end of the mbox were expunged */
+		goto exception;
+	}
+	
+	g_free (path);
+	
+	/* update the positions of the messages that moved */
+	for (i = first, r = 0, shift = 0; i < max; i++) {
+		minfo = summary->messages->pdata[i];
+		
+		if (r < runs->len && minfo->frompos == g_array_index (runs, MboxRun, r).src) {
+			shift = minfo->frompos - g_array_index (runs, MboxRun, r).dst;
+			r++;
+		}
+		
+		minfo->frompos -= shift;
+		if (minfo->flagspos != -1)
+			minfo->flagspos -= shift;
+	}
+	
+	/* and drop the expunged ones, last first so that the removals
+	 * don't have to shift the rest of the array around */
+	for (i = expunged->len - 1; i >= 0; i--)
+		spruce_folder_summary_remove_index (summary, g_array_index (expunged, int, i));
+	
+	((SpruceMboxSummary *) summary)->scanned = moved;
+	spruce_folder_summary_touch (summary);
+	
+	g_array_free (expunged, TRUE);
+	g_array_free (runs, TRUE);
+	
+	return 1;
+	
+ fallback:
+	
+	g_array_free (expunged, TRUE);
+	g_array_free (runs, TRUE);
+	
+	return 0;
+	
+ exception:
+	
+	/* the journal is left behind for mbox_expunge_recover() */
+	g_set_error (err, SPRUCE_ERROR, errno, _("Cannot expunge folder `%s': %s"),
+		     folder->full_name, g_strerror (errno));
+	
+	if (mover.jfd != -1)
+		close (mover.jfd);
+	
+	g_array_free (expunged, TRUE);
+	g_array_free (runs, TRUE);
+	g_free (path);
+	
+	return -1;
+}
+
 static int
 mbox_expunge (SpruceFolder *folder, GPtrArray *uids, GError **err)
 {
 	SpruceMboxFolder *mbox = (SpruceMboxFolder *) folder;
+	GMimeStream *stream, *substream;
 	char *filename, *from, *flags;
 	SpruceMboxMessageInfo *minfo;
 	gboolean expunge = FALSE;
 	SpruceMessageInfo *info;
 	GMimeMessage *message;
 	GHashTable *uid_hash;
-	GMimeStream *stream;
+	gint64 scanned, end;
 	GMimeParser *parser;
 	GPtrArray *summary;
 	int fd, max, i, j;
@@ -659,12 +1229,30 @@ mbox_expunge (SpruceFolder *folder, GPtrArray *uids, GError **err)
 		return -1;
 	}
 	
+	if (mbox_lock (mbox, SPRUCE_LOCK_WRITE, err) == -1) {
+		if (uid_hash)
+			g_hash_table_destroy (uid_hash);
+		
+		return -1;
+	}
+	
+	/* try to avoid rewriting the entire mbox */
+	if ((i = mbox_expunge_in_place (folder, uid_hash, err)) != 0) {
+		mbox_unlock (mbox, SPRUCE_LOCK_WRITE);
+		
+		if (uid_hash)
+			g_hash_table_destroy (uid_hash);
+		
+		return i == 1 ? 0 : -1;
+	}
+	
  retry:
 	
 	filename = g_strdup_printf ("%s.%u.XXXXXX", mbox->path, getpid ());
 	if (mktemp (filename) == NULL) {
 		g_set_error (err, SPRUCE_ERROR, errno, _("Cannot expunge folder `%s': %s"),
 			     folder->full_name, g_strerror (errno));
+		mbox_unlock (mbox, SPRUCE_LOCK_WRITE);
 		g_free (filename);
 		
 		if (uid_hash)
@@ -682,6 +1270,7 @@ mbox_expunge (SpruceFolder *folder, GPtrArray *uids, GError **err)
 		
 		g_set_error (err, SPRUCE_ERROR, errno, _("Cannot expunge folder `%s': %s"),
 			     folder->full_name, g_strerror (errno));
+		mbox_unlock (mbox, SPRUCE_LOCK_WRITE);
 		
 		if (uid_hash)
 			g_hash_table_destroy (uid_hash);
@@ -727,6 +1316,21 @@ mbox_expunge (SpruceFolder *folder, GPtrArray *uids, GError **err)
 		
 		g_object_unref (message);
 		g_free (from);
+		
+		spruce_lock_refresh (mbox->path, ((GMimeStreamFs *) mbox->stream)->fd);
+	}
+	
+	/* mail appended since the last scan isn't in the summary, so
+	 * copy it over as-is */
+	scanned = ((SpruceMboxSummary *) folder->summary)->scanned;
+	if (scanned != -1 && (end = g_mime_stream_length (mbox->stream)) > scanned) {
+		substream = g_mime_stream_substream (mbox->stream, scanned, end);
+		if (g_mime_stream_write_to_stream (substream, stream) == -1) {
+			g_object_unref (substream);
+			goto exception;
+		}
+		
+		g_object_unref (substream);
 	}
 	
 	if (g_mime_stream_flush (stream) == -1)
@@ -738,6 +1342,9 @@ mbox_expunge (SpruceFolder *folder, GPtrArray *uids, GError **err)
 	if (rename (filename, mbox->path) == -1)
 		goto exception;
 	
+	/* the summary reload opens the mbox itself, so unlock first */
+	mbox_unlock (mbox, SPRUCE_LOCK_WRITE);
+	
 	if (uid_hash)
 		g_hash_table_destroy (uid_hash);
 	
@@ -751,8 +1358,6 @@ mbox_expunge (SpruceFolder *folder, GPtrArray *uids, GError **err)
 	else
 		fd = open (mbox->path, O_RDONLY);
 	
-	/* FIXME: unlock the old fd and lock the new */
-	
 	g_object_unref (mbox->stream);
 	
 	if (fd != -1)
@@ -767,6 +1372,8 @@ mbox_expunge (SpruceFolder *folder, GPtrArray *uids, GError **err)
 	g_set_error (err, SPRUCE_ERROR, errno, _("Cannot expunge folder `%s': %s"),
 		     folder->full_name, g_strerror (errno));
 	
+	mbox_unlock (mbox, SPRUCE_LOCK_WRITE);
+	
 	if (uid_hash)
 		g_hash_table_destroy (uid_hash);
 	
@@ -887,6 +1494,11 @@ mbox_get_message (SpruceFolder *folder, const char *uid, GError **err)
 	
 	g_assert (info->frompos > -1);
 	
+	if (mbox_lock (mbox, SPRUCE_LOCK_READ, err) == -1) {
+		spruce_folder_summary_info_unref (folder->summary, (SpruceMessageInfo *) info);
+		return NULL;
+	}
+	
 	stream = mbox->stream;
 	offset = info->frompos;
 	
@@ -895,6 +1507,7 @@ mbox_get_message (SpruceFolder *folder, const char *uid, GError **err)
 			     _("Cannot get message %s from folder `%s': %s"),
 			     uid, folder->full_name, g_strerror (errno));
 		spruce_folder_summary_info_unref (folder->summary, (SpruceMessageInfo *) info);
+		mbox_unlock (mbox, SPRUCE_LOCK_READ);
 		return NULL;
 	}
 	
@@ -903,6 +1516,10 @@ mbox_get_message (SpruceFolder *folder, const char *uid, GError **err)
 	g_mime_parser_set_scan_from (parser, TRUE);
 	g_mime_parser_set_header_regex (parser, "^X-Spruce$", parser_got_xspruce, &info);
 	
+	/* the message must not refer back to the mbox: an in-place
+	 * expunge moves the bytes of the messages around within it */
+	g_mime_parser_set_persist_stream (parser, FALSE);
+	
 	if (!(message = g_mime_parser_construct_message (parser))) {
 		g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_FOLDER_NO_SUCH_MESSAGE,
 			     _("Cannot get message %s from folder `%s': internal parser error"),
@@ -911,6 +1528,52 @@ mbox_get_message (SpruceFolder *folder, const char *uid, GError **err)
 	
 	g_object_unref (parser);
 	
+	mbox_unlock (mbox, SPRUCE_LOCK_READ);
+	
+	spruce_folder_summary_info_unref (folder->summary, (SpruceMessageInfo *) info);
+	
+	return message;
+}
+
+static GMimeMessage *
+mbox_get_message_headers (SpruceFolder *folder, const char *uid, GError **err)
+{
+	SpruceMboxFolder *mbox = (SpruceMboxFolder *) folder;
+	SpruceMboxMessageInfo *info;
+	GMimeMessage *message;
+	
+	if (!(info = (SpruceMboxMessageInfo *) spruce_folder_summary_uid (folder->summary, uid))) {
+		g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_FOLDER_NO_SUCH_MESSAGE,
+			     _("Cannot get message %s from folder `%s': no such message"),
+			     uid, folder->full_name);
+		return NULL;
+	}
+	
+	g_assert (info->frompos > -1);
+	
+	if (mbox_lock (mbox, SPRUCE_LOCK_READ, err) == -1) {
+		spruce_folder_summary_info_unref (folder->summary, (SpruceMessageInfo *) info);
+		return NULL;
+	}
+	
+	if (g_mime_stream_seek (mbox->stream, info->frompos, SEEK_SET) == -1) {
+		g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_FOLDER_NO_SUCH_MESSAGE,
+			     _("Cannot get message %s from folder `%s': %s"),
+			     uid, folder->full_name, g_strerror (errno));
+		spruce_folder_summary_info_unref (folder->summary, (SpruceMessageInfo *) info);
+		mbox_unlock (mbox, SPRUCE_LOCK_READ);
+		return NULL;
+	}
+	
+	/* only read as far as the end of the headers */
+	if (!(message = spruce_folder_parse_message_headers (mbox->stream, TRUE))) {
+		g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_FOLDER_NO_SUCH_MESSAGE,
+			     _("Cannot get message %s from folder `%s': internal parser error"),
+			     uid, folder->full_name);
+	}
+	
+	mbox_unlock (mbox, SPRUCE_LOCK_READ);
+	
 	spruce_folder_summary_info_unref (folder->summary, (SpruceMessageInfo *) info);
 	
 	return message;
@@ -1006,14 +1669,19 @@ mbox_append_message (SpruceFolder *folder, GMimeMessage *message, SpruceMessageI
 	SpruceMboxFolder *mbox = (SpruceMboxFolder *) folder;
 	SpruceMboxMessageInfo *mbox_info = NULL;
 	GMimeStream *filtered_stream = NULL;
+	SpruceMboxSummary *msummary;
 	GMimeFilter *from_filter;
 	char *xspruce, *from;
 	gint64 offset;
 	int fd;
 	
+	if (mbox_lock (mbox, SPRUCE_LOCK_WRITE, err) == -1)
+		return -1;
+	
 	if ((offset = g_mime_stream_seek (mbox->stream, 0, SEEK_END)) == -1) {
 		g_set_error (err, SPRUCE_ERROR, errno, _("Cannot append to folder `%s': %s"),
 			     folder->full_name, g_strerror (errno));
+		mbox_unlock (mbox, SPRUCE_LOCK_WRITE);
 		return -1;
 	}
 	
@@ -1051,8 +1719,18 @@ mbox_append_message (SpruceFolder *folder, GMimeMessage *message, SpruceMessageI
 	
 	g_object_unref (filtered_stream);
 	
+	/* if somebody else appended to the mbox since it was scanned,
+	 * the new message gets picked up along with their mail by the
+	 * next scan rather than skipping over it */
+	msummary = (SpruceMboxSummary *) folder->summary;
+	if (msummary->scanned == offset)
+		msummary->scanned = g_mime_stream_tell (mbox->stream);
+	else
+		spruce_folder_summary_remove (folder->summary, (SpruceMessageInfo *) mbox_info);
+	
+	mbox_unlock (mbox, SPRUCE_LOCK_WRITE);
+	
 	spruce_folder_summary_info_unref (folder->summary, (SpruceMessageInfo *) mbox_info);
-	spruce_folder_summary_touch (folder->summary);
 	
 	return 0;
 	
@@ -1080,6 +1758,8 @@ mbox_append_message (SpruceFolder *folder, GMimeMessage *message, SpruceMessageI
 	while (ftruncate (fd, offset) == -1 && errno == EINTR)
 		;
 	
+	mbox_unlock (mbox, SPRUCE_LOCK_WRITE);
+	
 	return -1;
 }
 
@@ -26,30 +26,44 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <limits.h>
 #include <utime.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <errno.h>
 
 #include <gmime/gmime.h>
 #include <spruce/spruce-file-utils.h>
+#include <spruce/spruce-lock.h>
 
 #include "spruce-mbox-summary.h"
 
 
-#define MBOX_SUMMARY_VERSION  1
+#define MBOX_SUMMARY_VERSION  2
+
+/* number of bytes at the end of the mbox covered by the tail checksum */
+#define MBOX_TAIL_LEN  4096
+
+/* number of bytes of the mbox mapped at a time while scanning it */
+#define MBOX_SCAN_WINDOW  (32 * 1024 * 1024)
 
 static void spruce_mbox_summary_class_init (SpruceMboxSummaryClass *klass);
 static void spruce_mbox_summary_init (SpruceMboxSummary *summary, SpruceMboxSummaryClass *klass);
 static void spruce_mbox_summary_finalize (GObject *object);
 
 static int mbox_header_load (SpruceFolderSummary *summary, GMimeStream *stream);
+static int mbox_header_save (SpruceFolderSummary *summary, GMimeStream *stream);
 static int mbox_summary_load (SpruceFolderSummary *summary);
 static int mbox_summary_save (SpruceFolderSummary *summary);
 static SpruceMessageInfo *mbox_message_info_new (SpruceFolderSummary *summary);
 static SpruceMessageInfo *mbox_message_info_load (SpruceFolderSummary *summary, GMimeStream *stream);
 static int mbox_message_info_save (SpruceFolderSummary *summary, GMimeStream *stream, SpruceMessageInfo *info);
+static SpruceMessageInfo *mbox_message_info_load_record (SpruceFolderSummary *summary, SpruceSummaryRecord *record);
+static int mbox_message_info_save_record (SpruceFolderSummary *summary, SpruceSummaryRecord *record, SpruceMessageInfo *info);
+static int mbox_message_info_sync_flags (SpruceMboxSummary *mbox_summary, SpruceMboxMessageInfo *minfo);
+static void mbox_summary_sync_flags (SpruceMboxSummary *mbox_summary);
 
 
 static SpruceFolderSummaryClass *parent_class = NULL;
@@ -91,11 +105,14 @@ spruce_mbox_summary_class_init (SpruceMboxSummaryClass *klass)
 	object_class->finalize = spruce_mbox_summary_finalize;
 	
 	summary_class->header_load = mbox_header_load;
+	summary_class->header_save = mbox_header_save;
 	summary_class->summary_load = mbox_summary_load;
 	summary_class->summary_save = mbox_summary_save;
 	summary_class->message_info_new = mbox_message_info_new;
 	summary_class->message_info_load = mbox_message_info_load;
 	summary_class->message_info_save = mbox_message_info_save;
+	summary_class->message_info_load_record = mbox_message_info_load_record;
+	summary_class->message_info_save_record = mbox_message_info_save_record;
 }
 
 static void
@@ -111,6 +128,9 @@ spruce_mbox_summary_init (SpruceMboxSummary *summary, SpruceMboxSummaryClass *kl
 	
 	summary->mbox = NULL;
 	summary->fd = -1;
+	
+	summary->appended = -1;
+	summary->scanned = -1;
 }
 
 static void
@@ -192,11 +212,86 @@ spruce_mbox_summary_flags_decode (const char *in, char **uidstr, guint32 *flags)
 }
 
 
+/* md5 of the (up to) MBOX_TAIL_LEN bytes preceding @size */
+static char *
+mbox_tail_checksum (int fd, gint64 size)
+{
+	char buf[MBOX_TAIL_LEN];
+	GChecksum *checksum;
+	size_t n;
+	char *sum;
+	
+	n = (size_t) MIN (size, (gint64) MBOX_TAIL_LEN);
+	
+	if (lseek (fd, (off_t) (size - n), SEEK_SET) == -1)
+		return NULL;
+	
+	if (spruce_read (fd, buf, n) != (ssize_t) n)
+		return NULL;
+	
+	checksum = g_checksum_new (G_CHECKSUM_MD5);
+	g_checksum_update (checksum, (unsigned char *) buf, n);
+	sum = g_strdup (g_checksum_get_string (checksum));
+	g_checksum_free (checksum);
+	
+	return sum;
+}
+
+static gboolean
+mbox_from_line_at (int fd, gint64 offset)
+{
+	char buf[5];
+	
+	if (lseek (fd, (off_t) offset, SEEK_SET) == -1)
+		return FALSE;
+	
+	return spruce_read (fd, buf, 5) == 5 && !strncmp (buf, "From ", 5);
+}
+
+/* checks whether the mbox has only had messages appended to it
+ * since it was @size bytes long and ended with a tail matching
+ * @tail, the last message starting at @lastpos */
+static gboolean
+mbox_only_appended (SpruceMboxSummary *mbox, struct stat *st, gint64 size, gint64 lastpos, const char *tail)
+{
+	gboolean appended = FALSE;
+	char *sum;
+	int fd;
+	
+	if ((gint64) st->st_size <= size)
+		return FALSE;
+	
+	if ((fd = open (mbox->mbox, O_LARGEFILE | O_RDONLY)) == -1)
+		return FALSE;
+	
+	if (spruce_lock (mbox->mbox, fd, SPRUCE_LOCK_READ, NULL) == -1) {
+		close (fd);
+		return FALSE;
+	}
+	
+	if ((lastpos == -1 || mbox_from_line_at (fd, lastpos)) && mbox_from_line_at (fd, size)) {
+		if ((sum = mbox_tail_checksum (fd, size))) {
+			appended = !strcmp (sum, tail);
+			g_free (sum);
+		}
+	}
+	
+	spruce_unlock (mbox->mbox, fd, SPRUCE_LOCK_READ, NULL);
+	close (fd);
+	
+	return appended;
+}
+
 static int
 mbox_header_load (SpruceFolderSummary *summary, GMimeStream *stream)
 {
 	SpruceMboxSummary *mbox = (SpruceMboxSummary *) summary;
+	gint64 size, lastpos;
 	struct stat st;
+	char *tail;
+	int ret = 0;
+	
+	mbox->appended = -1;
 	
 	if (stat (mbox->mbox, &st) == -1 || !S_ISREG (st.st_mode))
 		return -1;
@@ -204,10 +299,84 @@ mbox_header_load (SpruceFolderSummary *summary, GMimeStream *stream)
 	if (SPRUCE_FOLDER_SUMMARY_CLASS (parent_class)->header_load (summary, stream) == -1)
 		return -1;
 	
-	if (st.st_mtime > summary->timestamp)
+	if (spruce_file_util_decode_int64 (stream, &size) == -1)
 		return -1;
 	
-	return 0;
+	if (spruce_file_util_decode_int64 (stream, &lastpos) == -1)
+		return -1;
+	
+	if (spruce_file_util_decode_string (stream, &tail) == -1)
+		return -1;
+	
+	mbox->scanned = size;
+	
+	/* the mtime gets reset to the summary's timestamp when it is
+	 * saved, so mail delivered after the last scan only shows up
+	 * in the size */
+	if (st.st_mtime > summary->timestamp || (gint64) st.st_size != size) {
+		/* if new mail was simply appended to the mbox, the
+		 * summary can be brought up to date by scanning the
+		 * new messages rather than rebuilding it */
+		if (!summary->loaded && tail != NULL && mbox_only_appended (mbox, &st, size, lastpos, tail))
+			mbox->appended = size;
+		else
+			ret = -1;
+	}
+	
+	g_free (tail);
+	
+	return ret;
+}
+
+static int
+mbox_header_save (SpruceFolderSummary *summary, GMimeStream *stream)
+{
+	SpruceMboxSummary *mbox = (SpruceMboxSummary *) summary;
+	gint64 size = mbox->scanned, lastpos = -1;
+	SpruceMessageInfo *info;
+	char *tail = NULL;
+	int fd, ret;
+	
+	if (SPRUCE_FOLDER_SUMMARY_CLASS (parent_class)->header_save (summary, stream) == -1)
+		return -1;
+	
+	/* record where the scan left off rather than the current size
+	 * of the mbox, anything past that has yet to be scanned (with
+	 * no scan to vouch for, the next load rebuilds the summary) */
+	if (size != -1 && mbox->fd != -1) {
+		/* mbox_summary_save() already has the mbox locked and
+		 * closing another fd would drop its fcntl() lock */
+		tail = mbox_tail_checksum (mbox->fd, size);
+	} else if (size != -1 && mbox->mbox && (fd = open (mbox->mbox, O_LARGEFILE | O_RDONLY)) != -1) {
+		if (spruce_lock (mbox->mbox, fd, SPRUCE_LOCK_READ, NULL) != -1) {
+			tail = mbox_tail_checksum (fd, size);
+			spruce_unlock (mbox->mbox, fd, SPRUCE_LOCK_READ, NULL);
+		}
+		
+		close (fd);
+	}
+	
+	if (summary->messages->len > 0) {
+		info = summary->messages->pdata[summary->messages->len - 1];
+		lastpos = ((SpruceMboxMessageInfo *) info)->frompos;
+	}
+	
+	if (spruce_file_util_encode_int64 (stream, size) == -1)
+		goto exception;
+	
+	if (spruce_file_util_encode_int64 (stream, lastpos) == -1)
+		goto exception;
+	
+	ret = spruce_file_util_encode_string (stream, tail);
+	g_free (tail);
+	
+	return ret;
+	
+ exception:
+	
+	g_free (tail);
+	
+	return -1;
 }
 
 
@@ -270,30 +439,92 @@ parser_got_status (GMimeParser *parser, const char *header, const char *value,
 	}
 }
 
+/* returns the start of the next From-line at or after @inptr, or
+ * @inend if there are no more; @inptr must be at the start of a line */
+static const char *
+mbox_next_from (const char *inptr, const char *inend)
+{
+	while ((inend - inptr) >= 5) {
+		if (!strncmp (inptr, "From ", 5))
+			return inptr;
+		
+		if (!(inptr = memchr (inptr, '\n', inend - inptr)))
+			break;
+		
+		inptr++;
+	}
+	
+	return inend;
+}
+
+/* returns the start of the first From-line following a newline at or
+ * after @inptr, or @inend if there is none; in that case @resume is
+ * set to where the search has to pick up again once the rest of the
+ * mbox has been mapped */
+static const char *
+mbox_next_from_nl (const char *inptr, const char *inend, const char **resume)
+{
+	while ((inptr = memchr (inptr, '\n', inend - inptr))) {
+		if ((inend - inptr) <= 5) {
+			/* the line is cut off by the end of the window */
+			*resume = inptr;
+			return inend;
+		}
+		
+		if (!strncmp (inptr + 1, "From ", 5))
+			return inptr + 1;
+		
+		inptr++;
+	}
+	
+	*resume = inend;
+	
+	return inend;
+}
+
+/* returns the end of the header block starting at @inptr (i.e. the
+ * start of the body), or @inend if the message has no body */
+static const char *
+mbox_header_end (const char *inptr, const char *inend)
+{
+	while (inptr < inend) {
+		if (*inptr == '\n')
+			return inptr + 1;
+		
+		if (*inptr == '\r' && (inptr + 1) < inend && inptr[1] == '\n')
+			return inptr + 2;
+		
+		if (!(inptr = memchr (inptr, '\n', inend - inptr)))
+			break;
+		
+		inptr++;
+	}
+	
+	return inend;
+}
+
+/* scans the messages in the mbox starting at @start by running all
+ * of it through the parser in scan-from mode; this is the slow path,
+ * used when the mbox can't be mapped */
 static int
-mbox_summary_load (SpruceFolderSummary *summary)
+mbox_summary_scan_stream (SpruceFolderSummary *summary, int fd, gint64 start)
 {
-	SpruceMboxSummary *mbox_summary = (SpruceMboxSummary *) summary;
+	gint64 offset, begin, end;
 	SpruceMessageInfo *info;
 	GMimeMessage *message;
 	struct status status;
 	GMimeParser *parser;
 	GMimeStream *stream;
-	gint64 offset;
 	size_t n = 0;
-	int fd = -1;
-	
-	if (!mbox_summary->mbox) {
-		errno = ENOENT;
-		return -1;
-	}
 	
-	if ((fd = open (mbox_summary->mbox, O_LARGEFILE | O_RDONLY)) == -1)
+	/* the stream closes its fd when it gets finalized */
+	if ((fd = dup (fd)) == -1)
 		return -1;
 	
-	stream = g_mime_stream_fs_new (fd);
+	stream = g_mime_stream_fs_new_with_bounds (fd, start, -1);
 	parser = g_mime_parser_new ();
 	g_mime_parser_init_with_stream (parser, stream);
+	g_mime_parser_set_persist_stream (parser, FALSE);
 	g_object_unref (stream);
 	
 	g_mime_parser_set_scan_from (parser, TRUE);
@@ -305,43 +536,351 @@ mbox_summary_load (SpruceFolderSummary *summary)
 		status.flags = 0;
 		status.uid = NULL;
 		
-		if (!(message = g_mime_parser_construct_message (parser)))
+		if (!(message = g_mime_parser_construct_message (parser))) {
+			g_free (status.uid);
 			goto fail;
+		}
+		
+		offset = g_mime_parser_get_from_offset (parser);
+		begin = g_mime_parser_get_headers_begin (parser);
+		end = g_mime_parser_tell (parser);
+		
+		if (offset == -1 || (n == 0 && offset != start)) {
+			g_object_unref (message);
+			g_free (status.uid);
+			goto fail;
+		}
 		
 		info = spruce_folder_summary_info_new_from_message (summary, message);
 		g_object_unref (message);
-		if (info == NULL)
+		if (info == NULL) {
+			g_free (status.uid);
 			goto fail;
+		}
 		
 		info->uid = status.uid;
 		info->flags |= status.flags;
 		
-		if ((offset = g_mime_parser_get_from_offset (parser)) == -1)
-			goto fail;
+		/* the blank line preceding a From-line belongs to the mbox */
+		if (!g_mime_parser_eos (parser) && end > begin)
+			end--;
 		
-		if (n == 0 && offset != 0)
-			goto fail;
+		info->size = end - begin;
 		
 		((SpruceMboxMessageInfo *) info)->frompos = offset;
-		((SpruceMboxMessageInfo *) info)->flagspos = status.offset;
+		if (status.offset != -1) {
+			((SpruceMboxMessageInfo *) info)->flagspos = status.offset;
+			
+			/* only dirty messages get their X-Spruce header synced */
+			if ((info->flags & 0xffff) != (status.flags & 0xffff))
+				info->flags |= SPRUCE_MESSAGE_DIRTY;
+		}
 		
 		spruce_folder_summary_add (summary, info);
 		n++;
 	}
 	
+	((SpruceMboxSummary *) summary)->scanned = g_mime_parser_tell (parser);
+	g_object_unref (parser);
+	
+	return 0;
+	
+ fail:
+	
+	g_object_unref (parser);
+	
+	spruce_folder_summary_clear (summary);
+	((SpruceMboxSummary *) summary)->scanned = -1;
+	
+	return -1;
+}
+
+/* the part of the mbox that is currently mapped */
+struct window {
+	gint64 offset;
+	gint64 size;
+	size_t len;
+	char *base;
+	int fd;
+};
+
+/* replaces the mapping in @win with one of the window of the mbox
+ * starting at @pos; returns a pointer to @pos within the new mapping
+ * or %NULL on error */
+static const char *
+mbox_window_map (struct window *win, gint64 pos)
+{
+	struct stat st;
+	
+	if (win->base != NULL) {
+		munmap (win->base, win->len);
+		win->base = NULL;
+	}
+	
+	/* a truncated mbox must not be mapped past its new end, since
+	 * touching those pages would raise SIGBUS */
+	if (fstat (win->fd, &st) == -1)
+		return NULL;
+	
+	if ((gint64) st.st_size < win->size)
+		win->size = st.st_size;
+	
+	if (pos >= win->size) {
+		errno = EINVAL;
+		return NULL;
+	}
+	
+	/* the mapping has to start on a page boundary */
+	win->offset = pos - (pos % getpagesize ());
+	win->len = (size_t) MIN (win->size - win->offset, MBOX_SCAN_WINDOW);
+	
+	win->base = mmap (NULL, win->len, PROT_READ, MAP_PRIVATE, win->fd, (off_t) win->offset);
+	if (win->base == MAP_FAILED) {
+		win->base = NULL;
+		return NULL;
+	}
+	
+	madvise (win->base, win->len, MADV_SEQUENTIAL);
+	
+	return win->base + (pos - win->offset);
+}
+
+/* scans the messages in the mbox starting at @start, which must be
+ * the offset of a From-line, and adds them to the summary.
+ *
+ * Only the header block of each message is handed to the parser;
+ * the bodies are skipped over by searching the mmap'd mbox for the
+ * next From-line. The mbox is mapped MBOX_SCAN_WINDOW bytes at a
+ * time so that it doesn't have to fit in the address space, and if
+ * it can't be mapped at all the scan is finished off by
+ * mbox_summary_scan_stream(). */
+static int
+mbox_summary_scan_fd (SpruceFolderSummary *summary, int fd, gint64 start)
+{
+	const char *inptr, *inend, *headers, *body, *next, *resume;
+	gint64 pos, hdrpos, bodypos, nextpos, end;
+	SpruceMessageInfo *info;
+	GMimeMessage *message;
+	struct status status;
+	GMimeParser *parser;
+	GMimeStream *stream;
+	struct window win;
+	struct stat st;
+	
+	if (fstat (fd, &st) == -1)
+		return -1;
+	
+	if ((gint64) st.st_size <= start) {
+		/* nothing to scan */
+		((SpruceMboxSummary *) summary)->scanned = start;
+		return 0;
+	}
+	
+	win.size = st.st_size;
+	win.base = NULL;
+	win.fd = fd;
+	
+	if (!(inptr = mbox_window_map (&win, start)))
+		return mbox_summary_scan_stream (summary, fd, start);
+	
+	inend = win.base + win.len;
+	
+	if (mbox_next_from (inptr, inend) != inptr) {
+		munmap (win.base, win.len);
+		errno = EINVAL;
+		return -1;
+	}
+	
+	parser = g_mime_parser_new ();
+	g_mime_parser_set_header_regex (parser, "^X-Spruce$|^Status$|^X-Status$",
+					parser_got_status, &status);
+	
+	pos = start;
+	
+	while (pos < win.size) {
+		inptr = win.base + (pos - win.offset);
+		inend = win.base + win.len;
+		
+		/* skip past the From-line */
+		if ((headers = memchr (inptr, '\n', inend - inptr))) {
+			next = mbox_next_from_nl (headers, inend, &resume);
+			body = mbox_header_end (headers + 1, next);
+			headers++;
+		}
+		
+		if ((headers == NULL || body == inend) && win.offset + (gint64) win.len < win.size) {
+			/* the header block runs past the end of the window */
+			if ((inptr - win.base) < getpagesize ()) {
+				/* ...even though the window starts here */
+				goto fallback;
+			}
+			
+			if (!mbox_window_map (&win, pos))
+				goto fallback;
+			
+			continue;
+		}
+		
+		if (headers == NULL)
+			goto fail;
+		
+		hdrpos = win.offset + (headers - win.base);
+		bodypos = win.offset + (body - win.base);
+		
+		status.offset = -1;
+		status.flags = 0;
+		status.uid = NULL;
+		
+		stream = g_mime_stream_mem_new_with_buffer (headers, body - headers);
+		g_mime_parser_init_with_stream (parser, stream);
+		g_object_unref (stream);
+		
+		if (!(message = g_mime_parser_construct_message (parser))) {
+			g_free (status.uid);
+			goto fail;
+		}
+		
+		info = spruce_folder_summary_info_new_from_message (summary, message);
+		g_object_unref (message);
+		if (info == NULL) {
+			g_free (status.uid);
+			goto fail;
+		}
+		
+		info->uid = status.uid;
+		info->flags |= status.flags;
+		
+		((SpruceMboxMessageInfo *) info)->frompos = pos;
+		if (status.offset != -1) {
+			((SpruceMboxMessageInfo *) info)->flagspos = hdrpos + status.offset;
+			
+			/* only dirty messages get their X-Spruce header synced */
+			if ((info->flags & 0xffff) != (status.flags & 0xffff))
+				info->flags |= SPRUCE_MESSAGE_DIRTY;
+		}
+		
+		/* slide the window along the body until the next
+		 * From-line (or the end of the mbox) turns up */
+		while (next == inend && win.offset + (gint64) win.len < win.size) {
+			if (!(resume = mbox_window_map (&win, win.offset + (resume - win.base)))) {
+				spruce_folder_summary_info_unref (summary, info);
+				goto fallback;
+			}
+			
+			inend = win.base + win.len;
+			next = mbox_next_from_nl (resume, inend, &resume);
+		}
+		
+		nextpos = win.offset + (next - win.base);
+		
+		/* the parser only saw the headers, so work out the size
+		 * of the message from where the next one starts; the
+		 * blank line preceding a From-line belongs to the mbox */
+		end = nextpos;
+		if (nextpos < win.size && end > bodypos)
+			end--;
+		
+		info->size = end - hdrpos;
+		
+		spruce_folder_summary_add (summary, info);
+		
+		pos = nextpos;
+	}
+	
+	((SpruceMboxSummary *) summary)->scanned = win.size;
 	g_object_unref (parser);
+	munmap (win.base, win.len);
 	
 	return 0;
 	
+ fallback:
+	
+	g_object_unref (parser);
+	if (win.base != NULL)
+		munmap (win.base, win.len);
+	
+	return mbox_summary_scan_stream (summary, fd, pos);
+	
  fail:
 	
 	g_object_unref (parser);
+	if (win.base != NULL)
+		munmap (win.base, win.len);
 	
 	spruce_folder_summary_clear (summary);
+	((SpruceMboxSummary *) summary)->scanned = -1;
 	
 	return -1;
 }
 
+static int
+mbox_summary_scan (SpruceFolderSummary *summary, gint64 start)
+{
+	SpruceMboxSummary *mbox_summary = (SpruceMboxSummary *) summary;
+	int fd, ret;
+	
+	if (!mbox_summary->mbox) {
+		errno = ENOENT;
+		return -1;
+	}
+	
+	if ((fd = open (mbox_summary->mbox, O_LARGEFILE | O_RDONLY)) == -1)
+		return -1;
+	
+	/* the mbox has to stay locked for as long as it is mapped
+	 * since a concurrent expunge could truncate it under us */
+	if (spruce_lock (mbox_summary->mbox, fd, SPRUCE_LOCK_READ, NULL) == -1) {
+		close (fd);
+		return -1;
+	}
+	
+	ret = mbox_summary_scan_fd (summary, fd, start);
+	
+	spruce_unlock (mbox_summary->mbox, fd, SPRUCE_LOCK_READ, NULL);
+	close (fd);
+	
+	return ret;
+}
+
+static int
+mbox_summary_load (SpruceFolderSummary *summary)
+{
+	((SpruceMboxSummary *) summary)->appended = -1;
+	
+	return mbox_summary_scan (summary, 0);
+}
+
+
+/**
+ * spruce_mbox_summary_update:
+ * @summary: a #SpruceMboxSummary
+ *
+ * Adds the messages that were appended to the mbox since the summary
+ * was last saved, if loading the summary found any. Falls back to
+ * rebuilding the summary from scratch if they cannot be parsed.
+ *
+ * Returns %0 on success or %-1 on fail.
+ **/
+int
+spruce_mbox_summary_update (SpruceMboxSummary *summary)
+{
+	SpruceFolderSummary *folder_summary = (SpruceFolderSummary *) summary;
+	gint64 appended = summary->appended;
+	
+	g_return_val_if_fail (SPRUCE_IS_MBOX_SUMMARY (summary), -1);
+	
+	if (appended == -1 || !folder_summary->loaded)
+		return 0;
+	
+	summary->appended = -1;
+	
+	/* on failure the scan will have cleared the summary */
+	if (mbox_summary_scan (folder_summary, appended) == -1)
+		return mbox_summary_load (folder_summary);
+	
+	return 0;
+}
+
 static int
 mbox_summary_save (SpruceFolderSummary *summary)
 {
@@ -349,11 +888,20 @@ mbox_summary_save (SpruceFolderSummary *summary)
 	struct utimbuf mtime;
 	int ret;
 	
-	if (mbox_summary->mbox) {
-		mbox_summary->fd = open (mbox_summary->mbox, O_LARGEFILE | O_WRONLY, 0666);
-		/* FIXME: lock the mbox file */
+	if (mbox_summary->mbox && (mbox_summary->fd = open (mbox_summary->mbox, O_LARGEFILE | O_RDWR, 0666)) != -1) {
+		if (spruce_lock (mbox_summary->mbox, mbox_summary->fd, SPRUCE_LOCK_WRITE, NULL) == -1) {
+			/* save the summary anyway, the flags stay dirty */
+			close (mbox_summary->fd);
+			mbox_summary->fd = -1;
+		}
 	}
 	
+	/* sync the flags to the mbox file here rather than while
+	 * saving each message-info since the summary may only need
+	 * to commit its journal */
+	if (mbox_summary->fd != -1)
+		mbox_summary_sync_flags (mbox_summary);
+	
 	ret = SPRUCE_FOLDER_SUMMARY_CLASS (parent_class)->summary_save (summary);
 	
 	if (mbox_summary->fd != -1) {
@@ -364,8 +912,7 @@ mbox_summary_save (SpruceFolderSummary *summary)
 		
 		utime (mbox_summary->mbox, &mtime);
 		
-		/* FIXME: unlock mbox file */
-		
+		spruce_unlock (mbox_summary->mbox, mbox_summary->fd, SPRUCE_LOCK_WRITE, NULL);
 		close (mbox_summary->fd);
 		mbox_summary->fd = -1;
 	}
@@ -412,14 +959,81 @@ mbox_message_info_load (SpruceFolderSummary *summary, GMimeStream *stream)
 	return NULL;
 }
 
+static int
+mbox_message_info_sync_flags (SpruceMboxSummary *mbox_summary, SpruceMboxMessageInfo *minfo)
+{
+	gint64 offset = minfo->flagspos + strlen ("X-Spruce: ");
+	ssize_t nwritten;
+	size_t len, n = 0;
+	char *flags;
+	
+	/* the encoded flags are fixed-width for a given uid, so they
+	 * can simply be overwritten in place */
+	flags = spruce_mbox_summary_flags_encode (minfo);
+	len = strlen (flags);
+	
+	do {
+		do {
+			nwritten = pwrite (mbox_summary->fd, flags + n, len - n, (off_t) (offset + n));
+		} while (nwritten == -1 && errno == EINTR);
+		
+		if (nwritten > 0)
+			n += nwritten;
+	} while (nwritten > 0 && n < len);
+	
+	g_free (flags);
+	
+	return n == len ? 0 : -1;
+}
+
+static int
+flagspos_sort (gconstpointer a, gconstpointer b)
+{
+	const SpruceMboxMessageInfo *minfo_a = *((SpruceMboxMessageInfo **) a);
+	const SpruceMboxMessageInfo *minfo_b = *((SpruceMboxMessageInfo **) b);
+	
+	if (minfo_a->flagspos < minfo_b->flagspos)
+		return -1;
+	
+	return minfo_a->flagspos > minfo_b->flagspos ? 1 : 0;
+}
+
+static void
+mbox_summary_sync_flags (SpruceMboxSummary *mbox_summary)
+{
+	SpruceFolderSummary *summary = (SpruceFolderSummary *) mbox_summary;
+	SpruceMboxMessageInfo *minfo;
+	SpruceMessageInfo *info;
+	GPtrArray *dirty;
+	guint i;
+	
+	/* only the messages whose flags changed need to be written
+	 * and writing them in file order keeps the seeks short */
+	dirty = g_ptr_array_new ();
+	for (i = 0; i < summary->messages->len; i++) {
+		info = summary->messages->pdata[i];
+		minfo = (SpruceMboxMessageInfo *) info;
+		
+		if ((info->flags & SPRUCE_MESSAGE_DIRTY) && minfo->flagspos != -1)
+			g_ptr_array_add (dirty, minfo);
+	}
+	
+	g_ptr_array_sort (dirty, flagspos_sort);
+	
+	for (i = 0; i < dirty->len; i++) {
+		minfo = dirty->pdata[i];
+		
+		if (mbox_message_info_sync_flags (mbox_summary, minfo) == 0)
+			((SpruceMessageInfo *) minfo)->flags &= ~SPRUCE_MESSAGE_DIRTY;
+	}
+	
+	g_ptr_array_free (dirty, TRUE);
+}
+
 static int
 mbox_message_info_save (SpruceFolderSummary *summary, GMimeStream *stream, SpruceMessageInfo *info)
 {
-	SpruceMboxSummary *mbox_summary = (SpruceMboxSummary *) summary;
 	SpruceMboxMessageInfo *minfo = (SpruceMboxMessageInfo *) info;
-	gint64 offset = minfo->flagspos;
-	char *flags;
-	int fd;
 	
 	if (SPRUCE_FOLDER_SUMMARY_CLASS (parent_class)->message_info_save (summary, stream, info) == -1)
 		return -1;
@@ -430,18 +1044,48 @@ mbox_message_info_save (SpruceFolderSummary *summary, GMimeStream *stream, Spruc
 	if (spruce_file_util_encode_int64 (stream, minfo->flagspos) == -1)
 		return -1;
 	
-	if (offset != -1 && mbox_summary->fd != -1) {
-		/* attempt to sync the flags to the mbox file too */
-		
-		offset += strlen ("X-Spruce: ");
-		fd = mbox_summary->fd;
-		
-		if (lseek (fd, (off_t) offset, SEEK_SET) != -1) {
-			flags = spruce_mbox_summary_flags_encode (minfo);
-			spruce_write (fd, flags, strlen (flags));
-			g_free (flags);
-		}
-	}
+	return 0;
+}
+
+static SpruceMessageInfo *
+mbox_message_info_load_record (SpruceFolderSummary *summary, SpruceSummaryRecord *record)
+{
+	SpruceMboxMessageInfo *minfo;
+	SpruceMessageInfo *info;
+	
+	if (!(info = SPRUCE_FOLDER_SUMMARY_CLASS (parent_class)->message_info_load_record (summary, record)))
+		return NULL;
+	
+	minfo = (SpruceMboxMessageInfo *) info;
+	
+	if (spruce_summary_record_decode_int64 (record, &minfo->frompos) == -1)
+		goto exception;
+	
+	if (spruce_summary_record_decode_int64 (record, &minfo->flagspos) == -1)
+		goto exception;
+	
+	return info;
+	
+ exception:
+	
+	spruce_folder_summary_info_unref (summary, info);
+	
+	return NULL;
+}
+
+static int
+mbox_message_info_save_record (SpruceFolderSummary *summary, SpruceSummaryRecord *record, SpruceMessageInfo *info)
+{
+	SpruceMboxMessageInfo *minfo = (SpruceMboxMessageInfo *) info;
+	
+	if (SPRUCE_FOLDER_SUMMARY_CLASS (parent_class)->message_info_save_record (summary, record, info) == -1)
+		return -1;
+	
+	if (spruce_summary_record_encode_int64 (record, minfo->frompos) == -1)
+		return -1;
+	
+	if (spruce_summary_record_encode_int64 (record, minfo->flagspos) == -1)
+		return -1;
 	
 	return 0;
 }
@@ -50,6 +50,9 @@ struct _SpruceMboxSummary {
 	
 	char *mbox;
 	int fd;
+	
+	gint64 appended;   /* offset of messages appended since the last save or -1 */
+	gint64 scanned;    /* end of the last message in the summary or -1 */
 };
 
 struct _SpruceMboxSummaryClass {
@@ -64,6 +67,8 @@ SpruceFolderSummary *spruce_mbox_summary_new (const char *mbox);
 
 void spruce_mbox_summary_set_mbox (SpruceMboxSummary *summary, const char *mbox);
 
+int spruce_mbox_summary_update (SpruceMboxSummary *summary);
+
 char *spruce_mbox_summary_flags_encode (SpruceMboxMessageInfo *info);
 int spruce_mbox_summary_flags_decode (const char *in, char **uid, guint32 *flags);
 
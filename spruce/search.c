@@ -40,6 +40,12 @@ struct _SearchStack {
 
 static SearchResult *search_term_and (SearchContext *ctx, int argc, SearchTerm **argv, void *user_data);
 static SearchResult *search_term_or (SearchContext *ctx, int argc, SearchTerm **argv, void *user_data);
+static SearchResult *search_term_and_continue (SearchContext *ctx, SearchResult *res, int argc,
+					       SearchTerm **argv, void *user_data);
+static SearchResult *search_term_or_continue (SearchContext *ctx, SearchResult *res, int argc,
+					      SearchTerm **argv, void *user_data);
+static SearchResult *search_term_bitmap_continue (SearchContext *ctx, SearchResult *res, int argc,
+						  SearchTerm **argv, gboolean and, void *user_data);
 static SearchResult *search_term_not (SearchContext *ctx, int argc, SearchResult **argv, void *user_data);
 static SearchResult *search_term_lt (SearchContext *ctx, int argc, SearchTerm **argv, void *user_data);
 static SearchResult *search_term_gt (SearchContext *ctx, int argc, SearchTerm **argv, void *user_data);
@@ -56,6 +62,11 @@ static SearchResult *search_term_cast_int (SearchContext *ctx, int argc, SearchR
 static SearchResult *search_term_cast_float (SearchContext *ctx, int argc, SearchResult **argv, void *user_data);
 static SearchResult *search_term_cast_string (SearchContext *ctx, int argc, SearchResult **argv, void *user_data);
 
+static SearchProgram *search_program_compile (SearchContext *ctx, SearchTerm *term);
+static void search_programs_free (SearchContext *ctx);
+static void search_programs_abort (SearchContext *ctx);
+static void search_result_clear (SearchResult *result);
+
 struct {
 	char *name;
 	SearchFunc func;
@@ -168,10 +179,12 @@ search_context_new (void)
 	int i;
 	
 	ctx = g_new (SearchContext, 1);
+	ctx->programs = g_ptr_array_new ();
 	ctx->exception = NULL;
 	ctx->ref_count = 1;
 	ctx->stack = NULL;
 	ctx->tree = NULL;
+	ctx->last = NULL;
 	
 	for (i = 0; i < G_N_ELEMENTS (symbols); i++) {
 		if (symbols[i].type == 1)
@@ -195,7 +208,12 @@ search_context_ref (SearchContext *ctx)
 static SearchTerm *
 search_term_new (void)
 {
-	return g_new (SearchTerm, 1);
+	SearchTerm *term;
+	
+	term = g_new (SearchTerm, 1);
+	term->program = NULL;
+	
+	return term;
 }
 
 static void
@@ -236,7 +254,15 @@ search_context_unref (SearchContext *ctx)
 		while (ctx->stack)
 			search_stack_pop (ctx);
 		
-		search_term_free (ctx->tree);
+		search_programs_free (ctx);
+		g_ptr_array_free (ctx->programs, TRUE);
+		
+		if (ctx->tree)
+			search_term_free (ctx->tree);
+		
+		if (ctx->last)
+			search_result_free (ctx->last);
+		
 		g_free (ctx->exception);
 		g_free (ctx);
 	}
@@ -284,6 +310,24 @@ search_context_add_ifunction (SearchContext *ctx, const char *name, SearchIFunc
 }
 
 
+void
+search_context_add_vfunction (SearchContext *ctx, const char *name, SearchVFunc vfunc)
+{
+	SearchStack *stack = ctx->stack;
+	SearchSymbol *sym;
+	
+	if (!ctx->stack)
+		stack = ctx->stack = search_stack_new ();
+	
+	sym = search_symbol_new ();
+	sym->type = SEARCH_SYMBOL_VFUNCTION;
+	sym->name = g_strdup (name);
+	sym->value.vfunc = vfunc;
+	
+	g_hash_table_insert (stack->symbols, sym->name, sym);
+}
+
+
 static SearchResult *
 search_result_copy (SearchResult *result)
 {
@@ -319,6 +363,9 @@ search_result_copy (SearchResult *result)
 			g_ptr_array_add (res->value.array, r);
 		}
 		break;
+	case SEARCH_RESULT_BITMAP:
+		res->value.bitmap = search_bitmap_copy (result->value.bitmap);
+		break;
 	case SEARCH_RESULT_VOID:
 		break;
 	}
@@ -366,6 +413,67 @@ search_context_remove_symbol (SearchContext *ctx, const char *name)
 }
 
 
+static void
+search_symbol_clone (gpointer key, gpointer value, gpointer user_data)
+{
+	SearchSymbol *sym = value, *clone;
+	SearchStack *stack = user_data;
+	
+	/* symbols in inner scopes shadow the outer ones */
+	if (g_hash_table_lookup (stack->symbols, sym->name))
+		return;
+	
+	clone = search_symbol_new ();
+	clone->type = sym->type;
+	clone->name = g_strdup (sym->name);
+	
+	if (sym->type == SEARCH_SYMBOL_VARIABLE)
+		clone->value.var = search_result_copy (sym->value.var);
+	else
+		clone->value = sym->value;
+	
+	g_hash_table_insert (stack->symbols, clone->name, clone);
+}
+
+
+/**
+ * search_context_clone:
+ * @ctx: search context
+ *
+ * Creates a new context with the same functions and variables as
+ * @ctx. The expression has to be built separately.
+ *
+ * A context keeps its evaluation state in the compiled expression, so
+ * it can only be run by one thread at a time; clones of it can be
+ * run concurrently (as long as the functions themselves are
+ * thread-safe).
+ *
+ * Returns: a new search context.
+ **/
+SearchContext *
+search_context_clone (SearchContext *ctx)
+{
+	SearchContext *clone;
+	SearchStack *stack;
+	
+	clone = g_new (SearchContext, 1);
+	clone->programs = g_ptr_array_new ();
+	clone->stack = search_stack_new ();
+	clone->exception = NULL;
+	clone->ref_count = 1;
+	clone->tree = NULL;
+	clone->last = NULL;
+	
+	stack = ctx->stack;
+	while (stack) {
+		g_hash_table_foreach (stack->symbols, search_symbol_clone, clone->stack);
+		stack = stack->parent;
+	}
+	
+	return clone;
+}
+
+
 static void
 decode_lwsp (const char **in)
 {
@@ -484,6 +592,8 @@ decode_symbol (SearchContext *ctx, const char **in)
 				sym->value.func = symbol->value.func;
 			else if (symbol->type == SEARCH_SYMBOL_IFUNCTION)
 				sym->value.ifunc = symbol->value.ifunc;
+			else if (symbol->type == SEARCH_SYMBOL_VFUNCTION)
+				sym->value.vfunc = symbol->value.vfunc;
 			else
 				sym->value.var = search_result_copy (symbol->value.var);
 		} else {
@@ -571,7 +681,7 @@ decode_term (SearchContext *ctx, const char **in)
 			
 			search_symbol_free (sym);
 		}
-	} else if (sym->type == SEARCH_SYMBOL_FUNCTION) {
+	} else if (sym->type == SEARCH_SYMBOL_FUNCTION || sym->type == SEARCH_SYMBOL_VFUNCTION) {
 		term->type = SEARCH_TERM_FUNCTION;
 		term->value.func.sym = sym;
 	} else {
@@ -721,7 +831,7 @@ decode_tree (SearchContext *ctx, const char **in)
 			for (i = 0; i < terms->len; i++)
 				g_ptr_array_add (array, terms->pdata[i]);
 			
-			root = g_new (SearchTerm, 1);
+			root = search_term_new ();
 			root->type = SEARCH_TERM_LIST;
 			root->value.array = array;
 		}
@@ -750,6 +860,8 @@ search_context_build (SearchContext *ctx, const char *expression)
 {
 	const char *inptr = expression;
 	
+	search_programs_free (ctx);
+	
 	if (ctx->tree) {
 		search_term_free (ctx->tree);
 		ctx->tree = NULL;
@@ -774,6 +886,8 @@ search_context_build (SearchContext *ctx, const char *expression)
 			goto exception;
 	}
 	
+	search_program_compile (ctx, ctx->tree);
+	
 	return 0;
 	
  exception:
@@ -792,6 +906,8 @@ search_symbol_eval (SearchContext *ctx, SearchSymbol *sym, void *user_data)
 		return sym->value.func (ctx, 0, NULL, user_data);
 	case SEARCH_SYMBOL_IFUNCTION:
 		return sym->value.ifunc (ctx, 0, NULL, user_data);
+	case SEARCH_SYMBOL_VFUNCTION:
+		return search_vfunction_call (ctx, sym->value.vfunc, 0, NULL, user_data);
 	case SEARCH_SYMBOL_VARIABLE:
 		return search_result_copy (sym->value.var);
 	}
@@ -801,8 +917,8 @@ search_symbol_eval (SearchContext *ctx, SearchSymbol *sym, void *user_data)
 	return NULL;
 }
 
-SearchResult *
-search_term_eval (SearchContext *ctx, SearchTerm *term, void *user_data)
+static SearchResult *
+search_term_walk (SearchContext *ctx, SearchTerm *term, void *user_data)
 {
 	SearchResult *r, *res = NULL;
 	SearchSymbol *sym;
@@ -852,7 +968,9 @@ search_term_eval (SearchContext *ctx, SearchTerm *term, void *user_data)
 		for (i = 0; i < term->value.func.argc; i++)
 			g_ptr_array_add (argv, search_term_eval (ctx, term->value.func.argv[i], user_data));
 		
-		if (sym->value.func)
+		if (sym->type == SEARCH_SYMBOL_VFUNCTION)
+			res = search_vfunction_call (ctx, sym->value.vfunc, argv->len, (SearchResult **) argv->pdata, user_data);
+		else if (sym->value.func)
 			res = sym->value.func (ctx, argv->len, (SearchResult **) argv->pdata, user_data);
 		
 		for (i = 0; i < argv->len; i++)
@@ -938,8 +1056,11 @@ search_context_run (SearchContext *ctx, void *user_data)
 	g_free (ctx->exception);
 	ctx->exception = NULL;
 	
-	if (setjmp (ctx->env) == 0)
+	if (setjmp (ctx->env) == 0) {
 		res = search_term_eval (ctx, ctx->tree, user_data);
+	} else {
+		search_programs_abort (ctx);
+	}
 	
 	return res;
 }
@@ -981,12 +1102,89 @@ search_context_exception (SearchContext *ctx)
 }
 
 
+/**
+ * search_context_eval:
+ * @ctx: search context
+ * @term: term to evaluate
+ * @value: value to fill in
+ * @user_data: user data
+ *
+ * Evaluates @term (which must belong to the expression @ctx was
+ * built with) like search_term_eval_value(), catching any exception
+ * thrown along the way. This is for evaluating part of an expression
+ * outside of search_context_run().
+ *
+ * Returns: %0 on success or %-1 if an exception was thrown (see
+ * search_context_exception()).
+ **/
+int
+search_context_eval (SearchContext *ctx, SearchTerm *term, SearchResult *value, void *user_data)
+{
+	g_free (ctx->exception);
+	ctx->exception = NULL;
+	
+	if (setjmp (ctx->env) == 0) {
+		search_term_eval_value (ctx, term, value, user_data);
+	} else {
+		search_programs_abort (ctx);
+		value->type = SEARCH_RESULT_VOID;
+		return -1;
+	}
+	
+	return 0;
+}
+
+
+static SearchTerm *
+search_term_lookup (SearchTerm *term, SearchTerm *clone, SearchTerm *target)
+{
+	SearchTerm *match;
+	int i;
+	
+	if (term == target)
+		return clone;
+	
+	if (term->type != SEARCH_TERM_FUNCTION && term->type != SEARCH_TERM_IFUNCTION)
+		return NULL;
+	
+	if (clone->type != term->type || clone->value.func.argc != term->value.func.argc)
+		return NULL;
+	
+	for (i = 0; i < term->value.func.argc; i++) {
+		if ((match = search_term_lookup (term->value.func.argv[i], clone->value.func.argv[i], target)))
+			return match;
+	}
+	
+	return NULL;
+}
+
+
+/**
+ * search_context_lookup_term:
+ * @ctx: search context
+ * @clone: a clone of @ctx built with the same expression
+ * @term: a term of the expression @ctx was built with
+ *
+ * Finds the term of @clone's expression which corresponds to @term.
+ *
+ * Returns: the matching term or %NULL if there isn't one.
+ **/
+SearchTerm *
+search_context_lookup_term (SearchContext *ctx, SearchContext *clone, SearchTerm *term)
+{
+	if (ctx->tree == NULL || clone->tree == NULL)
+		return NULL;
+	
+	return search_term_lookup (ctx->tree, clone->tree, term);
+}
+
+
 static SearchResult *
 search_result_convert (SearchContext *ctx, SearchResult *r, search_result_t type)
 {
 	SearchResult *res;
 	
-	if (r->type == SEARCH_RESULT_ARRAY)
+	if (r->type == SEARCH_RESULT_ARRAY || r->type == SEARCH_RESULT_BITMAP)
 		return NULL;
 	
 	switch (type) {
@@ -1025,6 +1223,201 @@ search_result_new (search_result_t type)
 
 void
 search_result_free (SearchResult *result)
+{
+	search_result_clear (result);
+	g_free (result);
+}
+
+
+/**
+ * search_bitmap_new:
+ * @length: number of bits
+ *
+ * Returns: a new, empty, #SearchBitmap.
+ **/
+SearchBitmap *
+search_bitmap_new (guint length)
+{
+	SearchBitmap *bitmap;
+	
+	bitmap = g_new (SearchBitmap, 1);
+	bitmap->nwords = (length + SEARCH_BITMAP_WORD_BITS - 1) / SEARCH_BITMAP_WORD_BITS;
+	bitmap->words = g_new0 (gulong, bitmap->nwords);
+	bitmap->length = length;
+	
+	return bitmap;
+}
+
+SearchBitmap *
+search_bitmap_copy (const SearchBitmap *bitmap)
+{
+	SearchBitmap *copy;
+	
+	copy = g_new (SearchBitmap, 1);
+	copy->words = g_memdup (bitmap->words, bitmap->nwords * sizeof (gulong));
+	copy->nwords = bitmap->nwords;
+	copy->length = bitmap->length;
+	
+	return copy;
+}
+
+void
+search_bitmap_free (SearchBitmap *bitmap)
+{
+	g_free (bitmap->words);
+	g_free (bitmap);
+}
+
+/* the following operate a word at a time; written as plain loops over
+ * the word arrays so that the compiler is free to vectorize them */
+
+void
+search_bitmap_and (SearchBitmap *bitmap, const SearchBitmap *other)
+{
+	const gulong *src = other->words;
+	gulong *dest = bitmap->words;
+	guint i;
+	
+	g_return_if_fail (bitmap->length == other->length);
+	
+	for (i = 0; i < bitmap->nwords; i++)
+		dest[i] &= src[i];
+}
+
+void
+search_bitmap_or (SearchBitmap *bitmap, const SearchBitmap *other)
+{
+	const gulong *src = other->words;
+	gulong *dest = bitmap->words;
+	guint i;
+	
+	g_return_if_fail (bitmap->length == other->length);
+	
+	for (i = 0; i < bitmap->nwords; i++)
+		dest[i] |= src[i];
+}
+
+void
+search_bitmap_not (SearchBitmap *bitmap)
+{
+	gulong *words = bitmap->words;
+	guint i;
+	
+	for (i = 0; i < bitmap->nwords; i++)
+		words[i] = ~words[i];
+	
+	/* keep the bits past the end clear */
+	if (bitmap->length % SEARCH_BITMAP_WORD_BITS)
+		words[bitmap->nwords - 1] &= (1UL << (bitmap->length % SEARCH_BITMAP_WORD_BITS)) - 1;
+}
+
+gboolean
+search_bitmap_is_empty (const SearchBitmap *bitmap)
+{
+	gulong bits = 0;
+	guint i;
+	
+	for (i = 0; i < bitmap->nwords; i++)
+		bits |= bitmap->words[i];
+	
+	return bits == 0;
+}
+
+
+/**
+ * search_bitmap_next:
+ * @bitmap: bitmap
+ * @index: index to search from (not included), or %-1
+ *
+ * Returns: the index of the next set bit after @index or %-1 if there
+ * are none.
+ **/
+int
+search_bitmap_next (const SearchBitmap *bitmap, int index)
+{
+	guint i;
+	int bit;
+	
+	index++;
+	if (index >= bitmap->length)
+		return -1;
+	
+	i = index / SEARCH_BITMAP_WORD_BITS;
+	if ((bit = g_bit_nth_lsf (bitmap->words[i], (index % SEARCH_BITMAP_WORD_BITS) - 1)) != -1)
+		return i * SEARCH_BITMAP_WORD_BITS + bit;
+	
+	for (i++; i < bitmap->nwords; i++) {
+		if (bitmap->words[i] != 0)
+			return i * SEARCH_BITMAP_WORD_BITS + g_bit_nth_lsf (bitmap->words[i], -1);
+	}
+	
+	return -1;
+}
+
+
+/* Search programs
+ *
+ * search_context_build() compiles the parsed tree into a small
+ * register-based program so that evaluating an expression once per
+ * message doesn't have to allocate (and free) a SearchResult for
+ * every node. Constant sub-expressions made up of the builtin
+ * operators are folded at build time and the builtin logic and
+ * comparison operators are executed inline; everything else is
+ * called through its registered SearchFunc, SearchIFunc or
+ * SearchVFunc. The arguments of an ifunction are compiled into
+ * programs of their own since the ifunction evaluates them. */
+
+enum {
+	OP_LOADK,        /* a = consts[b] */
+	OP_CALL,         /* a = syms[b] (c args starting at register d) */
+	OP_VCALL,        /* a = syms[b] (c args starting at register d) */
+	OP_ICALL,        /* a = ifunction call of terms[b] */
+	OP_EVAL,         /* a = tree evaluation of terms[b] */
+	OP_JUMP,         /* goto b */
+	OP_JUMP_ARRAY,   /* if a is an array, goto b */
+	OP_AND_TEST,     /* c = bool (a); if !c, goto b */
+	OP_OR_TEST,      /* c = bool (a); if c, goto b */
+	OP_AND_ARRAY,    /* a = AND terms[b] given the result of its first term in c */
+	OP_OR_ARRAY,     /* a = OR terms[b] given the result of its first term in c */
+	OP_IF_FALSE,     /* if !bool (a), goto b */
+	OP_NOT,          /* a = !b */
+	OP_LT,           /* a = b < c */
+	OP_GT,           /* a = b > c */
+	OP_EQ,           /* a = b == c */
+};
+
+typedef struct {
+	int op;
+	int a, b, c, d;
+} SearchInstr;
+
+struct _SearchProgram {
+	GArray *code;
+	GPtrArray *consts;  /* owned by the program */
+	GPtrArray *syms;    /* owned by the tree */
+	GPtrArray *terms;   /* owned by the tree */
+	
+	SearchResult *regs;
+	gboolean *owned;
+	int nregs;
+	int active;
+	
+	/* value handed out by search_term_eval_value() */
+	SearchResult result;
+	gboolean result_owned;
+};
+
+typedef struct {
+	SearchContext *ctx;
+	SearchProgram *prog;
+	int next_reg;
+} SearchCompiler;
+
+static void compile_term (SearchCompiler *cc, SearchTerm *term, int dst);
+
+
+static void
+search_result_clear (SearchResult *result)
 {
 	int i;
 	
@@ -1039,83 +1432,878 @@ search_result_free (SearchResult *result)
 		for (i = 0; i < result->value.array->len; i++)
 			search_result_free (result->value.array->pdata[i]);
 		g_ptr_array_free (result->value.array, TRUE);
+		break;
+	case SEARCH_RESULT_BITMAP:
+		search_bitmap_free (result->value.bitmap);
+		break;
 	default:
 		break;
 	}
 	
-	g_free (result);
+	result->type = SEARCH_RESULT_VOID;
 }
 
+/* converts a register into a heap-allocated SearchResult */
+static SearchResult *
+search_result_take (SearchResult *value, gboolean *owned)
+{
+	SearchResult *res;
+	
+	if (!*owned)
+		return search_result_copy (value);
+	
+	res = g_new (SearchResult, 1);
+	*res = *value;
+	
+	value->type = SEARCH_RESULT_VOID;
+	*owned = FALSE;
+	
+	return res;
+}
 
+static SearchProgram *
+search_program_new (void)
+{
+	SearchProgram *prog;
+	
+	prog = g_new (SearchProgram, 1);
+	prog->code = g_array_new (FALSE, FALSE, sizeof (SearchInstr));
+	prog->consts = g_ptr_array_new ();
+	prog->syms = g_ptr_array_new ();
+	prog->terms = g_ptr_array_new ();
+	prog->regs = NULL;
+	prog->owned = NULL;
+	prog->nregs = 0;
+	prog->active = 0;
+	prog->result_owned = FALSE;
+	
+	return prog;
+}
 
-/* Builtin functions */
+static void
+search_program_free (SearchProgram *prog)
+{
+	int i;
+	
+	for (i = 0; i < prog->nregs; i++) {
+		if (prog->owned[i])
+			search_result_clear (&prog->regs[i]);
+	}
+	
+	if (prog->result_owned)
+		search_result_clear (&prog->result);
+	
+	for (i = 0; i < prog->consts->len; i++)
+		search_result_free (prog->consts->pdata[i]);
+	
+	g_array_free (prog->code, TRUE);
+	g_ptr_array_free (prog->consts, TRUE);
+	g_ptr_array_free (prog->syms, TRUE);
+	g_ptr_array_free (prog->terms, TRUE);
+	g_free (prog->owned);
+	g_free (prog->regs);
+	g_free (prog);
+}
 
-struct _intersect {
-	GPtrArray *array;
-	int num;
-};
+static void
+search_programs_free (SearchContext *ctx)
+{
+	int i;
+	
+	for (i = 0; i < ctx->programs->len; i++)
+		search_program_free (ctx->programs->pdata[i]);
+	
+	g_ptr_array_set_size (ctx->programs, 0);
+}
 
+/* called after an exception: the programs that were running never got to finish */
 static void
-and_array_intersect (gpointer key, gpointer val, gpointer user_data)
+search_programs_abort (SearchContext *ctx)
 {
-	struct _intersect *isect = user_data;
+	SearchProgram *prog;
+	int i;
 	
-	if (GPOINTER_TO_INT (val) >= isect->num)
-		g_ptr_array_add (isect->array, key);
+	for (i = 0; i < ctx->programs->len; i++) {
+		prog = ctx->programs->pdata[i];
+		prog->active = 0;
+	}
 }
 
-static SearchResult *
-search_term_and (SearchContext *ctx, int argc, SearchTerm **argv, void *user_data)
+static int
+compiler_reg_alloc (SearchCompiler *cc, int n)
 {
-	search_result_t type = SEARCH_RESULT_BOOL;
-	struct _intersect isect;
-	GHashTable *hash = NULL;
-	SearchResult *res, *r;
-	gboolean bool = TRUE;
-	gpointer okey, oval;
-	GPtrArray *array;
-	int val, num = 1;
-	int i, j;
+	int base = cc->next_reg;
 	
-	if (argc == 0)
-		search_context_throw (ctx, _("No arguments in AND expression"));
+	cc->next_reg += n;
+	if (cc->next_reg > cc->prog->nregs)
+		cc->prog->nregs = cc->next_reg;
 	
-	/* evaluate the first term so we can figure out what type of AND this is... */
-	res = search_term_eval (ctx, argv[0], user_data);
+	return base;
+}
+
+static int
+compiler_emit (SearchCompiler *cc, int op, int a, int b, int c, int d)
+{
+	SearchInstr instr;
 	
-	/* if the type is an array, then we intersect the arrays, every other type is treated as boolean */
-	if (res->type == SEARCH_RESULT_ARRAY) {
-		type = SEARCH_RESULT_ARRAY;
-		hash = g_hash_table_new (g_direct_hash, g_direct_equal);
-		for (j = 0; j < res->value.array->len; j++) {
-			if (g_hash_table_lookup_extended (hash, res->value.array->pdata[j], &okey, &oval)) {
-				val = GPOINTER_TO_INT (oval);
-				oval = GINT_TO_POINTER (val + 1);
-			} else {
-				g_hash_table_insert (hash, res->value.array->pdata[j], GINT_TO_POINTER (1));
-			}
-		}
-	} else {
-		type = SEARCH_RESULT_BOOL;
-		r = search_result_convert (ctx, res, type);
-		bool = r->value.bool;
-		search_result_free (r);
-	}
+	instr.op = op;
+	instr.a = a;
+	instr.b = b;
+	instr.c = c;
+	instr.d = d;
 	
-	search_result_free (res);
+	g_array_append_val (cc->prog->code, instr);
 	
-	for (i = 1; i < argc && bool; i++) {
-		res = search_term_eval (ctx, argv[i], user_data);
-		if (type == SEARCH_RESULT_ARRAY) {
-			if (res->type != SEARCH_RESULT_ARRAY)
-				goto exception;
-			
-			num++;
-			for (j = 0; j < res->value.array->len; j++) {
-				if (g_hash_table_lookup_extended (hash, res->value.array->pdata[j],
-								  &okey, &oval)) {
-					val = GPOINTER_TO_INT (oval);
-					oval = GINT_TO_POINTER (val + 1);
+	return cc->prog->code->len - 1;
+}
+
+/* points the jump at @pc to the next instruction to be emitted */
+static void
+compiler_patch (SearchCompiler *cc, int pc)
+{
+	g_array_index (cc->prog->code, SearchInstr, pc).b = cc->prog->code->len;
+}
+
+static int
+compiler_const (SearchCompiler *cc, SearchResult *value)
+{
+	g_ptr_array_add (cc->prog->consts, value);
+	
+	return cc->prog->consts->len - 1;
+}
+
+static int
+compiler_sym (SearchCompiler *cc, SearchSymbol *sym)
+{
+	g_ptr_array_add (cc->prog->syms, sym);
+	
+	return cc->prog->syms->len - 1;
+}
+
+static int
+compiler_term (SearchCompiler *cc, SearchTerm *term)
+{
+	g_ptr_array_add (cc->prog->terms, term);
+	
+	return cc->prog->terms->len - 1;
+}
+
+static gboolean
+search_symbol_is_builtin (SearchSymbol *sym, SearchFunc func)
+{
+	if (sym->type != SEARCH_SYMBOL_FUNCTION && sym->type != SEARCH_SYMBOL_IFUNCTION)
+		return FALSE;
+	
+	return sym->value.func == func;
+}
+
+/* whether @term can be evaluated at build time */
+static gboolean
+search_term_is_constant (SearchTerm *term)
+{
+	gboolean builtin = FALSE;
+	SearchSymbol *sym;
+	int i;
+	
+	switch (term->type) {
+	case SEARCH_TERM_BOOL:
+	case SEARCH_TERM_INT:
+	case SEARCH_TERM_TIME:
+	case SEARCH_TERM_FLOAT:
+	case SEARCH_TERM_STRING:
+		return TRUE;
+	case SEARCH_TERM_FUNCTION:
+	case SEARCH_TERM_IFUNCTION:
+		sym = term->value.func.sym;
+		for (i = 0; i < G_N_ELEMENTS (symbols) && !builtin; i++)
+			builtin = search_symbol_is_builtin (sym, symbols[i].func);
+		
+		if (!builtin)
+			return FALSE;
+		
+		for (i = 0; i < term->value.func.argc; i++) {
+			if (!search_term_is_constant (term->value.func.argv[i]))
+				return FALSE;
+		}
+		
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/* evaluates a constant term, returns %NULL if it can't be folded */
+static SearchResult *
+search_term_fold (SearchContext *ctx, SearchTerm *term)
+{
+	SearchResult * volatile res = NULL;
+	SearchStack *stack = ctx->stack;
+	jmp_buf env;
+	
+	memcpy (env, ctx->env, sizeof (jmp_buf));
+	
+	if (setjmp (ctx->env) == 0) {
+		res = search_term_walk (ctx, term, NULL);
+	} else {
+		/* leave it to be thrown at run time */
+		while (ctx->stack && ctx->stack != stack)
+			search_stack_pop (ctx);
+		
+		g_free (ctx->exception);
+		ctx->exception = NULL;
+	}
+	
+	memcpy (ctx->env, env, sizeof (jmp_buf));
+	
+	if (res != NULL) {
+		switch (res->type) {
+		case SEARCH_RESULT_ARRAY:
+		case SEARCH_RESULT_LIST:
+		case SEARCH_RESULT_BITMAP:
+		case SEARCH_RESULT_VOID:
+			search_result_free (res);
+			return NULL;
+		default:
+			break;
+		}
+	}
+	
+	return res;
+}
+
+static SearchProgram *
+search_program_compile (SearchContext *ctx, SearchTerm *term)
+{
+	SearchCompiler cc;
+	
+	cc.ctx = ctx;
+	cc.prog = search_program_new ();
+	cc.next_reg = 0;
+	
+	compile_term (&cc, term, compiler_reg_alloc (&cc, 1));
+	
+	cc.prog->regs = g_new0 (SearchResult, cc.prog->nregs);
+	cc.prog->owned = g_new0 (gboolean, cc.prog->nregs);
+	
+	g_ptr_array_add (ctx->programs, cc.prog);
+	term->program = cc.prog;
+	
+	return cc.prog;
+}
+
+static void
+compile_call (SearchCompiler *cc, SearchTerm *term, int dst)
+{
+	SearchSymbol *sym = term->value.func.sym;
+	int argc = term->value.func.argc;
+	int base, i;
+	
+	base = compiler_reg_alloc (cc, argc);
+	for (i = 0; i < argc; i++)
+		compile_term (cc, term->value.func.argv[i], base + i);
+	
+	if (sym->type == SEARCH_SYMBOL_VFUNCTION)
+		compiler_emit (cc, OP_VCALL, dst, compiler_sym (cc, sym), argc, base);
+	else
+		compiler_emit (cc, OP_CALL, dst, compiler_sym (cc, sym), argc, base);
+	
+	cc->next_reg = base;
+}
+
+static void
+compile_icall (SearchCompiler *cc, SearchTerm *term, int dst)
+{
+	int i;
+	
+	/* the ifunction evaluates its own arguments */
+	for (i = 0; i < term->value.func.argc; i++)
+		search_program_compile (cc->ctx, term->value.func.argv[i]);
+	
+	compiler_emit (cc, OP_ICALL, dst, compiler_term (cc, term), 0, 0);
+}
+
+static void
+compile_logic (SearchCompiler *cc, SearchTerm *term, int dst, gboolean and)
+{
+	int argc = term->value.func.argc;
+	int reg, array, done, i;
+	int *tests;
+	
+	reg = compiler_reg_alloc (cc, 1);
+	tests = g_new (int, argc);
+	
+	compile_term (cc, term->value.func.argv[0], reg);
+	array = compiler_emit (cc, OP_JUMP_ARRAY, reg, 0, 0, 0);
+	
+	for (i = 0; i < argc; i++) {
+		if (i > 0)
+			compile_term (cc, term->value.func.argv[i], reg);
+		
+		tests[i] = compiler_emit (cc, and ? OP_AND_TEST : OP_OR_TEST, reg, 0, dst, 0);
+	}
+	
+	for (i = 0; i < argc; i++)
+		compiler_patch (cc, tests[i]);
+	
+	done = compiler_emit (cc, OP_JUMP, 0, 0, 0, 0);
+	
+	/* arrays are intersected (or merged) the old-fashioned way */
+	compiler_patch (cc, array);
+	compiler_emit (cc, and ? OP_AND_ARRAY : OP_OR_ARRAY, dst, compiler_term (cc, term), reg, 0);
+	compiler_patch (cc, done);
+	
+	cc->next_reg = reg;
+	g_free (tests);
+}
+
+static void
+compile_compare (SearchCompiler *cc, SearchTerm *term, int dst, int op)
+{
+	int base;
+	
+	base = compiler_reg_alloc (cc, 2);
+	compile_term (cc, term->value.func.argv[0], base);
+	compile_term (cc, term->value.func.argv[1], base + 1);
+	compiler_emit (cc, op, dst, base, base + 1, 0);
+	cc->next_reg = base;
+}
+
+static void
+compile_if (SearchCompiler *cc, SearchTerm *term, int dst)
+{
+	SearchResult *res;
+	int reg, test, done;
+	
+	reg = compiler_reg_alloc (cc, 1);
+	compile_term (cc, term->value.func.argv[0], reg);
+	cc->next_reg = reg;
+	
+	test = compiler_emit (cc, OP_IF_FALSE, reg, 0, 0, 0);
+	compile_term (cc, term->value.func.argv[1], dst);
+	done = compiler_emit (cc, OP_JUMP, 0, 0, 0, 0);
+	
+	compiler_patch (cc, test);
+	if (term->value.func.argc == 3) {
+		compile_term (cc, term->value.func.argv[2], dst);
+	} else {
+		res = search_result_new (SEARCH_RESULT_BOOL);
+		res->value.bool = FALSE;
+		compiler_emit (cc, OP_LOADK, dst, compiler_const (cc, res), 0, 0);
+	}
+	
+	compiler_patch (cc, done);
+}
+
+static void
+compile_term (SearchCompiler *cc, SearchTerm *term, int dst)
+{
+	SearchSymbol *sym;
+	SearchResult *res;
+	int argc, reg, i;
+	
+	switch (term->type) {
+	case SEARCH_TERM_BOOL:
+		res = search_result_new (SEARCH_RESULT_BOOL);
+		res->value.bool = term->value.bool;
+		break;
+	case SEARCH_TERM_INT:
+		res = search_result_new (SEARCH_RESULT_INT);
+		res->value.integer = term->value.integer;
+		break;
+	case SEARCH_TERM_TIME:
+		res = search_result_new (SEARCH_RESULT_TIME);
+		res->value.time = term->value.time;
+		break;
+	case SEARCH_TERM_FLOAT:
+		res = search_result_new (SEARCH_RESULT_FLOAT);
+		res->value.decimal = term->value.decimal;
+		break;
+	case SEARCH_TERM_STRING:
+		res = search_result_new (SEARCH_RESULT_STRING);
+		res->value.string = g_strdup (term->value.string);
+		break;
+	case SEARCH_TERM_VARIABLE:
+		res = search_result_copy (term->value.var->value.var);
+		break;
+	case SEARCH_TERM_FUNCTION:
+	case SEARCH_TERM_IFUNCTION:
+		if (search_term_is_constant (term) && (res = search_term_fold (cc->ctx, term)))
+			break;
+		
+		sym = term->value.func.sym;
+		argc = term->value.func.argc;
+		
+		if (term->type == SEARCH_TERM_FUNCTION) {
+			if (search_symbol_is_builtin (sym, (SearchFunc) search_term_not) && argc == 1) {
+				reg = compiler_reg_alloc (cc, 1);
+				compile_term (cc, term->value.func.argv[0], reg);
+				compiler_emit (cc, OP_NOT, dst, reg, 0, 0);
+				cc->next_reg = reg;
+			} else {
+				compile_call (cc, term, dst);
+			}
+		} else if (search_symbol_is_builtin (sym, (SearchFunc) search_term_and) && argc > 0) {
+			compile_logic (cc, term, dst, TRUE);
+		} else if (search_symbol_is_builtin (sym, (SearchFunc) search_term_or) && argc > 0) {
+			compile_logic (cc, term, dst, FALSE);
+		} else if (search_symbol_is_builtin (sym, (SearchFunc) search_term_lt) && argc == 2) {
+			compile_compare (cc, term, dst, OP_LT);
+		} else if (search_symbol_is_builtin (sym, (SearchFunc) search_term_gt) && argc == 2) {
+			compile_compare (cc, term, dst, OP_GT);
+		} else if (search_symbol_is_builtin (sym, (SearchFunc) search_term_eq) && argc == 2) {
+			compile_compare (cc, term, dst, OP_EQ);
+		} else if (search_symbol_is_builtin (sym, (SearchFunc) search_term_if) && argc >= 2 && argc <= 3) {
+			compile_if (cc, term, dst);
+		} else if (search_symbol_is_builtin (sym, (SearchFunc) search_term_begin) && argc > 0) {
+			for (i = 0; i < argc; i++)
+				compile_term (cc, term->value.func.argv[i], dst);
+		} else {
+			compile_icall (cc, term, dst);
+		}
+		
+		return;
+	default:
+		/* lists and arrays are evaluated as trees */
+		compiler_emit (cc, OP_EVAL, dst, compiler_term (cc, term), 0, 0);
+		return;
+	}
+	
+	compiler_emit (cc, OP_LOADK, dst, compiler_const (cc, res), 0, 0);
+}
+
+
+static gboolean
+search_value_bool (SearchResult *value)
+{
+	switch (value->type) {
+	case SEARCH_RESULT_BOOL:
+		return value->value.bool;
+	case SEARCH_RESULT_INT:
+		return value->value.integer ? TRUE : FALSE;
+	case SEARCH_RESULT_FLOAT:
+		return ((int) value->value.decimal) ? TRUE : FALSE;
+	case SEARCH_RESULT_STRING:
+		return !strcmp (value->value.string, "true") || !strcmp (value->value.string, "#t");
+	default:
+		return FALSE;
+	}
+}
+
+static gboolean
+search_value_compare (SearchContext *ctx, int op, SearchResult *v1, SearchResult *v2)
+{
+	SearchResult *a = v1, *b = v2, *conv = NULL;
+	search_result_t type;
+	int cmp;
+	
+	if (v1->type != v2->type) {
+		type = MAX (v1->type, v2->type);
+		if (v1->type == type) {
+			if (!(conv = search_result_convert (ctx, v2, type)))
+				goto exception;
+			b = conv;
+		} else {
+			if (!(conv = search_result_convert (ctx, v1, type)))
+				goto exception;
+			a = conv;
+		}
+	}
+	
+	switch (a->type) {
+	case SEARCH_RESULT_BOOL:
+		cmp = (a->value.bool ? 1 : 0) - (b->value.bool ? 1 : 0);
+		break;
+	case SEARCH_RESULT_INT:
+		cmp = a->value.integer < b->value.integer ? -1 : a->value.integer > b->value.integer;
+		break;
+	case SEARCH_RESULT_TIME:
+		cmp = a->value.time < b->value.time ? -1 : a->value.time > b->value.time;
+		break;
+	case SEARCH_RESULT_FLOAT:
+		cmp = a->value.decimal < b->value.decimal ? -1 : a->value.decimal > b->value.decimal;
+		break;
+	case SEARCH_RESULT_STRING:
+		cmp = strcmp (a->value.string, b->value.string);
+		break;
+	default:
+		goto exception;
+	}
+	
+	if (conv != NULL)
+		search_result_free (conv);
+	
+	switch (op) {
+	case OP_LT:
+		return cmp < 0;
+	case OP_GT:
+		return cmp > 0;
+	default:
+		return cmp == 0;
+	}
+	
+ exception:
+	
+	if (conv != NULL)
+		search_result_free (conv);
+	
+	search_context_throw (ctx, _("Incompatable types in comparison (%s)"),
+			      op == OP_LT ? "<" : (op == OP_GT ? ">" : "="));
+	
+	return FALSE;
+}
+
+static void
+frame_set (SearchResult *regs, gboolean *owned, int reg, SearchResult *value, gboolean take)
+{
+	if (owned[reg])
+		search_result_clear (&regs[reg]);
+	
+	regs[reg] = *value;
+	owned[reg] = take;
+}
+
+static void
+frame_set_bool (SearchResult *regs, gboolean *owned, int reg, gboolean bool)
+{
+	if (owned[reg]) {
+		search_result_clear (&regs[reg]);
+		owned[reg] = FALSE;
+	}
+	
+	regs[reg].type = SEARCH_RESULT_BOOL;
+	regs[reg].value.bool = bool;
+}
+
+static void
+search_program_exec (SearchContext *ctx, SearchProgram *prog, void *user_data,
+		     SearchResult *result, gboolean *result_owned)
+{
+	SearchResult *regs, *res, *argbuf[8], **args;
+	SearchInstr *code, *instr;
+	gboolean *owned, bool;
+	SearchSymbol *sym;
+	SearchTerm *term;
+	int pc, n, i;
+	
+	if (prog->active == 0) {
+		regs = prog->regs;
+		owned = prog->owned;
+		
+		/* release anything left behind by an exception */
+		for (i = 0; i < prog->nregs; i++) {
+			if (owned[i]) {
+				search_result_clear (&regs[i]);
+				owned[i] = FALSE;
+			}
+		}
+	} else {
+		/* re-entered, e.g. by an ifunction evaluating its argument recursively */
+		regs = g_new0 (SearchResult, prog->nregs);
+		owned = g_new0 (gboolean, prog->nregs);
+	}
+	
+	prog->active++;
+	
+	code = (SearchInstr *) prog->code->data;
+	n = prog->code->len;
+	pc = 0;
+	
+	while (pc < n) {
+		instr = &code[pc++];
+		
+		switch (instr->op) {
+		case OP_LOADK:
+			frame_set (regs, owned, instr->a, prog->consts->pdata[instr->b], FALSE);
+			break;
+		case OP_CALL:
+			sym = prog->syms->pdata[instr->b];
+			args = instr->c > G_N_ELEMENTS (argbuf) ? g_new (SearchResult *, instr->c) : argbuf;
+			for (i = 0; i < instr->c; i++)
+				args[i] = &regs[instr->d + i];
+			
+			res = sym->value.func ? sym->value.func (ctx, instr->c, args, user_data) : NULL;
+			
+			if (args != argbuf)
+				g_free (args);
+			
+			if (res == NULL)
+				res = search_result_new (SEARCH_RESULT_VOID);
+			
+			frame_set (regs, owned, instr->a, res, TRUE);
+			g_free (res);
+			break;
+		case OP_VCALL:
+			sym = prog->syms->pdata[instr->b];
+			if (owned[instr->a]) {
+				search_result_clear (&regs[instr->a]);
+				owned[instr->a] = FALSE;
+			}
+			
+			regs[instr->a].type = SEARCH_RESULT_VOID;
+			sym->value.vfunc (ctx, instr->c, &regs[instr->d], &regs[instr->a], user_data);
+			break;
+		case OP_ICALL:
+			term = prog->terms->pdata[instr->b];
+			sym = term->value.func.sym;
+			res = sym->value.ifunc (ctx, term->value.func.argc, term->value.func.argv, user_data);
+			frame_set (regs, owned, instr->a, res, TRUE);
+			g_free (res);
+			break;
+		case OP_EVAL:
+			res = search_term_walk (ctx, prog->terms->pdata[instr->b], user_data);
+			frame_set (regs, owned, instr->a, res, TRUE);
+			g_free (res);
+			break;
+		case OP_JUMP:
+			pc = instr->b;
+			break;
+		case OP_JUMP_ARRAY:
+			if (regs[instr->a].type == SEARCH_RESULT_ARRAY || regs[instr->a].type == SEARCH_RESULT_BITMAP)
+				pc = instr->b;
+			break;
+		case OP_AND_TEST:
+			if (regs[instr->a].type == SEARCH_RESULT_ARRAY || regs[instr->a].type == SEARCH_RESULT_BITMAP)
+				search_context_throw (ctx, _("Invalid types in AND"));
+			
+			bool = search_value_bool (&regs[instr->a]);
+			frame_set_bool (regs, owned, instr->c, bool);
+			if (!bool)
+				pc = instr->b;
+			break;
+		case OP_OR_TEST:
+			if (regs[instr->a].type == SEARCH_RESULT_ARRAY || regs[instr->a].type == SEARCH_RESULT_BITMAP)
+				search_context_throw (ctx, _("Invalid types in OR"));
+			
+			bool = search_value_bool (&regs[instr->a]);
+			frame_set_bool (regs, owned, instr->c, bool);
+			if (bool)
+				pc = instr->b;
+			break;
+		case OP_AND_ARRAY:
+		case OP_OR_ARRAY:
+			term = prog->terms->pdata[instr->b];
+			res = search_result_take (&regs[instr->c], &owned[instr->c]);
+			
+			if (instr->op == OP_AND_ARRAY)
+				res = search_term_and_continue (ctx, res, term->value.func.argc, term->value.func.argv, user_data);
+			else
+				res = search_term_or_continue (ctx, res, term->value.func.argc, term->value.func.argv, user_data);
+			
+			frame_set (regs, owned, instr->a, res, TRUE);
+			g_free (res);
+			break;
+		case OP_IF_FALSE:
+			if (!search_value_bool (&regs[instr->a]))
+				pc = instr->b;
+			break;
+		case OP_NOT:
+			if (regs[instr->b].type == SEARCH_RESULT_BITMAP) {
+				res = search_result_copy (&regs[instr->b]);
+				search_bitmap_not (res->value.bitmap);
+				frame_set (regs, owned, instr->a, res, TRUE);
+				g_free (res);
+			} else if (regs[instr->b].type == SEARCH_RESULT_ARRAY) {
+				if (owned[instr->a]) {
+					search_result_clear (&regs[instr->a]);
+					owned[instr->a] = FALSE;
+				}
+				
+				regs[instr->a].type = SEARCH_RESULT_VOID;
+			} else {
+				frame_set_bool (regs, owned, instr->a, !search_value_bool (&regs[instr->b]));
+			}
+			break;
+		case OP_LT:
+		case OP_GT:
+		case OP_EQ:
+			bool = search_value_compare (ctx, instr->op, &regs[instr->b], &regs[instr->c]);
+			frame_set_bool (regs, owned, instr->a, bool);
+			break;
+		}
+	}
+	
+	/* the result is always left in the first register */
+	*result = regs[0];
+	*result_owned = owned[0];
+	owned[0] = FALSE;
+	
+	for (i = 1; i < prog->nregs; i++) {
+		if (owned[i]) {
+			search_result_clear (&regs[i]);
+			owned[i] = FALSE;
+		}
+	}
+	
+	if (regs != prog->regs) {
+		g_free (owned);
+		g_free (regs);
+	}
+	
+	prog->active--;
+}
+
+
+SearchResult *
+search_term_eval (SearchContext *ctx, SearchTerm *term, void *user_data)
+{
+	SearchResult value;
+	gboolean owned;
+	
+	if (term->program == NULL)
+		return search_term_walk (ctx, term, user_data);
+	
+	search_program_exec (ctx, term->program, user_data, &value, &owned);
+	
+	return search_result_take (&value, &owned);
+}
+
+
+/**
+ * search_term_eval_value:
+ * @ctx: search context
+ * @term: term to evaluate
+ * @value: value to fill in
+ * @user_data: user data
+ *
+ * Evaluates @term like search_term_eval() but without allocating a
+ * new #SearchResult. Any string or array in @value belongs to @term
+ * and is only valid until @term is evaluated again.
+ **/
+void
+search_term_eval_value (SearchContext *ctx, SearchTerm *term, SearchResult *value, void *user_data)
+{
+	SearchProgram *prog = term->program;
+	
+	if (prog == NULL) {
+		if (ctx->last)
+			search_result_free (ctx->last);
+		
+		ctx->last = search_term_walk (ctx, term, user_data);
+		*value = *ctx->last;
+		return;
+	}
+	
+	if (prog->result_owned) {
+		search_result_clear (&prog->result);
+		prog->result_owned = FALSE;
+	}
+	
+	search_program_exec (ctx, prog, user_data, &prog->result, &prog->result_owned);
+	*value = prog->result;
+}
+
+
+/**
+ * search_vfunction_call:
+ * @ctx: search context
+ * @vfunc: function to call
+ * @argc: number of arguments
+ * @argv: arguments
+ * @user_data: user data
+ *
+ * Calls @vfunc the way a #SearchFunc would be called.
+ *
+ * Returns: a newly allocated #SearchResult.
+ **/
+SearchResult *
+search_vfunction_call (SearchContext *ctx, SearchVFunc vfunc, int argc, SearchResult **argv, void *user_data)
+{
+	SearchResult *args, value;
+	int i;
+	
+	args = g_new (SearchResult, argc + 1);
+	for (i = 0; i < argc; i++)
+		args[i] = *argv[i];
+	
+	value.type = SEARCH_RESULT_VOID;
+	vfunc (ctx, argc, args, &value, user_data);
+	g_free (args);
+	
+	return search_result_copy (&value);
+}
+
+
+
+/* Builtin functions */
+
+struct _intersect {
+	GPtrArray *array;
+	int num;
+};
+
+static void
+and_array_intersect (gpointer key, gpointer val, gpointer user_data)
+{
+	struct _intersect *isect = user_data;
+	
+	if (GPOINTER_TO_INT (val) >= isect->num)
+		g_ptr_array_add (isect->array, key);
+}
+
+static SearchResult *
+search_term_and (SearchContext *ctx, int argc, SearchTerm **argv, void *user_data)
+{
+	SearchResult *res;
+	
+	if (argc == 0)
+		search_context_throw (ctx, _("No arguments in AND expression"));
+	
+	/* evaluate the first term so we can figure out what type of AND this is... */
+	res = search_term_eval (ctx, argv[0], user_data);
+	
+	return search_term_and_continue (ctx, res, argc, argv, user_data);
+}
+
+/* finishes an AND expression given the result of its first term */
+static SearchResult *
+search_term_and_continue (SearchContext *ctx, SearchResult *res, int argc, SearchTerm **argv, void *user_data)
+{
+	search_result_t type = SEARCH_RESULT_BOOL;
+	struct _intersect isect;
+	GHashTable *hash = NULL;
+	gboolean bool = TRUE;
+	gpointer okey, oval;
+	GPtrArray *array;
+	SearchResult *r;
+	int val, num = 1;
+	int i, j;
+	
+	if (res->type == SEARCH_RESULT_BITMAP)
+		return search_term_bitmap_continue (ctx, res, argc, argv, TRUE, user_data);
+	
+	/* if the type is an array, then we intersect the arrays, every other type is treated as boolean */
+	if (res->type == SEARCH_RESULT_ARRAY) {
+		type = SEARCH_RESULT_ARRAY;
+		hash = g_hash_table_new (g_direct_hash, g_direct_equal);
+		for (j = 0; j < res->value.array->len; j++) {
+			if (g_hash_table_lookup_extended (hash, res->value.array->pdata[j], &okey, &oval)) {
+				val = GPOINTER_TO_INT (oval);
+				oval = GINT_TO_POINTER (val + 1);
+			} else {
+				g_hash_table_insert (hash, res->value.array->pdata[j], GINT_TO_POINTER (1));
+			}
+		}
+	} else {
+		type = SEARCH_RESULT_BOOL;
+		r = search_result_convert (ctx, res, type);
+		bool = r->value.bool;
+		search_result_free (r);
+	}
+	
+	search_result_free (res);
+	
+	for (i = 1; i < argc && bool; i++) {
+		res = search_term_eval (ctx, argv[i], user_data);
+		if (type == SEARCH_RESULT_ARRAY) {
+			if (res->type != SEARCH_RESULT_ARRAY)
+				goto exception;
+			
+			num++;
+			for (j = 0; j < res->value.array->len; j++) {
+				if (g_hash_table_lookup_extended (hash, res->value.array->pdata[j],
+								  &okey, &oval)) {
+					val = GPOINTER_TO_INT (oval);
+					oval = GINT_TO_POINTER (val + 1);
 				} else {
 					g_hash_table_insert (hash, res->value.array->pdata[j],
 							     GINT_TO_POINTER (1));
@@ -1156,21 +2344,68 @@ search_term_and (SearchContext *ctx, int argc, SearchTerm **argv, void *user_dat
 	return NULL;
 }
 
+/* finishes an AND or OR expression of bitmaps */
+static SearchResult *
+search_term_bitmap_continue (SearchContext *ctx, SearchResult *res, int argc, SearchTerm **argv,
+			     gboolean and, void *user_data)
+{
+	SearchResult *r;
+	int i;
+	
+	for (i = 1; i < argc; i++) {
+		/* nothing left to intersect with */
+		if (and && search_bitmap_is_empty (res->value.bitmap))
+			break;
+		
+		r = search_term_eval (ctx, argv[i], user_data);
+		if (r->type != SEARCH_RESULT_BITMAP || r->value.bitmap->length != res->value.bitmap->length) {
+			search_result_free (r);
+			search_result_free (res);
+			
+			if (and)
+				search_context_throw (ctx, _("Invalid types in AND"));
+			else
+				search_context_throw (ctx, _("Invalid types in OR"));
+		}
+		
+		if (and)
+			search_bitmap_and (res->value.bitmap, r->value.bitmap);
+		else
+			search_bitmap_or (res->value.bitmap, r->value.bitmap);
+		
+		search_result_free (r);
+	}
+	
+	return res;
+}
+
 static SearchResult *
 search_term_or (SearchContext *ctx, int argc, SearchTerm **argv, void *user_data)
+{
+	SearchResult *res;
+	
+	if (argc == 0)
+		search_context_throw (ctx, _("No arguments in OR expression"));
+	
+	/* evaluate the first term so we can figure out what type of OR this is... */
+	res = search_term_eval (ctx, argv[0], user_data);
+	
+	return search_term_or_continue (ctx, res, argc, argv, user_data);
+}
+
+/* finishes an OR expression given the result of its first term */
+static SearchResult *
+search_term_or_continue (SearchContext *ctx, SearchResult *res, int argc, SearchTerm **argv, void *user_data)
 {
 	search_result_t type = SEARCH_RESULT_BOOL;
 	GHashTable *hash = NULL;
 	GPtrArray *array = NULL;
 	gboolean bool = FALSE;
-	SearchResult *res, *r;
+	SearchResult *r;
 	int i, j;
 	
-	if (argc == 0)
-		search_context_throw (ctx, _("No arguments in OR expression"));
-	
-	/* evaluate the first term so we can figure out what type of AND this is... */
-	res = search_term_eval (ctx, argv[0], user_data);
+	if (res->type == SEARCH_RESULT_BITMAP)
+		return search_term_bitmap_continue (ctx, res, argc, argv, FALSE, user_data);
 	
 	/* if the type is an array, then we union the arrays, every other type is treated as boolean */
 	if (res->type == SEARCH_RESULT_ARRAY) {
@@ -1193,7 +2428,7 @@ search_term_or (SearchContext *ctx, int argc, SearchTerm **argv, void *user_data
 	
 	search_result_free (res);
 	
-	for (i = 1; i < argc && bool; i++) {
+	for (i = 1; i < argc && (type == SEARCH_RESULT_ARRAY || !bool); i++) {
 		res = search_term_eval (ctx, argv[i], user_data);
 		if (type == SEARCH_RESULT_ARRAY) {
 			if (res->type != SEARCH_RESULT_ARRAY)
@@ -1245,7 +2480,10 @@ search_term_not (SearchContext *ctx, int argc, SearchResult **argv, void *user_d
 	if (argc != 1)
 		search_context_throw (ctx, _("Incorrect number of arguments in NOT expression"));
 	
-	if (argv[0]->type == SEARCH_RESULT_ARRAY) {
+	if (argv[0]->type == SEARCH_RESULT_BITMAP) {
+		res = search_result_copy (argv[0]);
+		search_bitmap_not (res->value.bitmap);
+	} else if (argv[0]->type == SEARCH_RESULT_ARRAY) {
 		/* FIXME: invert the array? */
 		res = search_result_new (SEARCH_RESULT_VOID);
 	} else {
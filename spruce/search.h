@@ -33,6 +33,8 @@ typedef struct _SearchSymbol SearchSymbol;
 typedef struct _SearchTerm SearchTerm;
 typedef struct _SearchStack SearchStack;
 typedef struct _SearchContext SearchContext;
+typedef struct _SearchProgram SearchProgram;
+typedef struct _SearchBitmap SearchBitmap;
 
 typedef SearchResult * (*SearchFunc) (SearchContext *ctx, int argc, SearchResult **argv,
 				      void *user_data);
@@ -40,6 +42,12 @@ typedef SearchResult * (*SearchFunc) (SearchContext *ctx, int argc, SearchResult
 typedef SearchResult * (*SearchIFunc) (SearchContext *ctx, int argc, SearchTerm **argv,
 				       void *user_data);
 
+/* like a SearchFunc but the arguments are passed by value and the
+ * result is written into @result rather than allocated. Strings and
+ * arrays set on @result are not freed by the caller. */
+typedef void (*SearchVFunc) (SearchContext *ctx, int argc, SearchResult *argv,
+			     SearchResult *result, void *user_data);
+
 typedef enum {
 	SEARCH_RESULT_BOOL,
 	SEARCH_RESULT_INT,
@@ -49,6 +57,7 @@ typedef enum {
 	SEARCH_RESULT_ARRAY,
 	SEARCH_RESULT_LIST,  /* list of SearchResults */
 	SEARCH_RESULT_VOID,
+	SEARCH_RESULT_BITMAP,
 } search_result_t;
 
 struct _SearchResult {
@@ -60,13 +69,29 @@ struct _SearchResult {
 		double decimal;
 		char *string;
 		GPtrArray *array;
+		SearchBitmap *bitmap;
 	} value;
 };
 
+/* a set of indexes (e.g. into a folder summary), one bit each */
+struct _SearchBitmap {
+	gulong *words;
+	guint nwords;
+	guint length;
+};
+
+#define SEARCH_BITMAP_WORD_BITS (sizeof (gulong) * 8)
+
+#define search_bitmap_set(bitmap, index) \
+	((bitmap)->words[(index) / SEARCH_BITMAP_WORD_BITS] |= 1UL << ((index) % SEARCH_BITMAP_WORD_BITS))
+#define search_bitmap_test(bitmap, index) \
+	(((bitmap)->words[(index) / SEARCH_BITMAP_WORD_BITS] >> ((index) % SEARCH_BITMAP_WORD_BITS)) & 1)
+
 typedef enum {
 	SEARCH_SYMBOL_FUNCTION,
 	SEARCH_SYMBOL_IFUNCTION,
 	SEARCH_SYMBOL_VARIABLE,
+	SEARCH_SYMBOL_VFUNCTION,
 } search_symbol_t;
 
 struct _SearchSymbol {
@@ -75,6 +100,7 @@ struct _SearchSymbol {
 	union {
 		SearchFunc func;
 		SearchIFunc ifunc;
+		SearchVFunc vfunc;
 		SearchResult *var;
 	} value;
 };
@@ -108,6 +134,9 @@ struct _SearchTerm {
 		} func;
 		SearchSymbol *var;
 	} value;
+	
+	/* compiled form of this term, if any */
+	SearchProgram *program;
 };
 
 struct _SearchContext {
@@ -116,6 +145,11 @@ struct _SearchContext {
 	SearchStack *stack;
 	SearchTerm *tree;
 	
+	/* compiled programs for the tree and the arguments of any
+	 * ifunctions (which evaluate their arguments themselves) */
+	GPtrArray *programs;
+	SearchResult *last;
+	
 	char *exception;
 	jmp_buf env;
 };
@@ -123,12 +157,14 @@ struct _SearchContext {
 
 /* Search Context */
 SearchContext *search_context_new (void);
+SearchContext *search_context_clone (SearchContext *ctx);
 
 void search_context_ref (SearchContext *ctx);
 void search_context_unref (SearchContext *ctx);
 
 void search_context_add_function (SearchContext *ctx, const char *name, SearchFunc func);
 void search_context_add_ifunction (SearchContext *ctx, const char *name, SearchIFunc ifunc);
+void search_context_add_vfunction (SearchContext *ctx, const char *name, SearchVFunc vfunc);
 void search_context_add_variable (SearchContext *ctx, const char *name, SearchResult *var);
 
 void search_context_remove_symbol (SearchContext *ctx, const char *name);
@@ -139,12 +175,31 @@ SearchResult *search_context_run (SearchContext *ctx, void *user_data);
 void search_context_throw (SearchContext *ctx, const char *exception, ...);
 const char *search_context_exception (SearchContext *ctx);
 
+int search_context_eval (SearchContext *ctx, SearchTerm *term, SearchResult *value, void *user_data);
+SearchTerm *search_context_lookup_term (SearchContext *ctx, SearchContext *clone, SearchTerm *term);
+
 /* Search Result */
 SearchResult *search_result_new (search_result_t type);
 void search_result_free (SearchResult *result);
 
+/* Search Bitmap */
+SearchBitmap *search_bitmap_new (guint length);
+SearchBitmap *search_bitmap_copy (const SearchBitmap *bitmap);
+void search_bitmap_free (SearchBitmap *bitmap);
+
+void search_bitmap_and (SearchBitmap *bitmap, const SearchBitmap *other);
+void search_bitmap_or (SearchBitmap *bitmap, const SearchBitmap *other);
+void search_bitmap_not (SearchBitmap *bitmap);
+
+gboolean search_bitmap_is_empty (const SearchBitmap *bitmap);
+int search_bitmap_next (const SearchBitmap *bitmap, int index);
+
 /* Search Term */
 SearchResult *search_term_eval (SearchContext *ctx, SearchTerm *term, void *user_data);
+void search_term_eval_value (SearchContext *ctx, SearchTerm *term, SearchResult *value, void *user_data);
+
+SearchResult *search_vfunction_call (SearchContext *ctx, SearchVFunc vfunc, int argc,
+				     SearchResult **argv, void *user_data);
 
 G_END_DECLS
 
@@ -174,7 +174,8 @@ cache_stream_commit (SpruceCacheStream *cstream)
 	if (spruce_cache_commit (priv->cache, priv->key, NULL) == -1)
 		return NULL;
 	
-	return spruce_cache_get (priv->cache, priv->key, NULL);
+	/* committed items are never modified, so map it */
+	return spruce_cache_get_mapped (priv->cache, priv->key, NULL);
 }
 
 
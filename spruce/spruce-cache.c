@@ -27,6 +27,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <fcntl.h>
@@ -37,6 +38,7 @@
 #include <glib/gstdio.h>
 
 #include <gmime/gmime-stream-fs.h>
+#include <gmime/gmime-stream-mmap.h>
 
 #include <spruce/spruce-error.h>
 #include <spruce/spruce-cache.h>
@@ -284,6 +286,51 @@ spruce_cache_get (SpruceCache *cache, const char *key, GError **err)
 }
 
 
+/**
+ * spruce_cache_get_mapped:
+ * @cache: a #SpruceCache object
+ * @key: stream key
+ * @err: a #GError
+ *
+ * Gets the #GMimeStream referenced by @key, mapping the cached item
+ * into memory if possible so that readers (such as #GMimeParser) can
+ * consume it without read()ing it into buffers of their own. Only
+ * committed items should be mapped as they are never modified.
+ *
+ * Returns a read-only #GMimeStream or %NULL on error.
+ **/
+GMimeStream *
+spruce_cache_get_mapped (SpruceCache *cache, const char *key, GError **err)
+{
+	GMimeStream *stream;
+	struct stat st;
+	char *path;
+	int fd;
+	
+	g_return_val_if_fail (SPRUCE_IS_CACHE (cache), NULL);
+	g_return_val_if_fail (key != NULL, NULL);
+	
+	path = cache_path (cache, key, FALSE);
+	fd = open (path, O_RDONLY);
+	g_free (path);
+	
+	if (fd == -1) {
+		g_set_error (err, SPRUCE_ERROR, errno,
+			     _("Cannot get cached item `%s': %s."),
+			     key, g_strerror (errno));
+		return NULL;
+	}
+	
+	/* empty files can't be mapped */
+	if (fstat (fd, &st) == 0 && st.st_size > 0) {
+		if ((stream = g_mime_stream_mmap_new (fd, PROT_READ, MAP_PRIVATE)))
+			return stream;
+	}
+	
+	return g_mime_stream_fs_new (fd);
+}
+
+
 /**
  * spruce_cache_commit:
  * @cache: a #SpruceCache object
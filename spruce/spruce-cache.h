@@ -56,6 +56,7 @@ SpruceCache *spruce_cache_new (const char *basedir, guint64 cache_size);
 
 GMimeStream *spruce_cache_add (SpruceCache *cache, const char *key, GError **err);
 GMimeStream *spruce_cache_get (SpruceCache *cache, const char *key, GError **err);
+GMimeStream *spruce_cache_get_mapped (SpruceCache *cache, const char *key, GError **err);
 
 int spruce_cache_commit (SpruceCache *cache, const char *key, GError **err);
 
@@ -0,0 +1,866 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*  Spruce
+ *  Copyright (C) 1999-2009 Jeffrey Stedfast
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <gmime/gmime-stream-fs.h>
+#include <gmime/gmime-stream-buffer.h>
+
+#include "spruce-folder-index.h"
+#include "spruce-file-utils.h"
+
+
+/* The index maps every (case-folded) 3-byte sequence found in a
+ * field of a message to the list of messages containing it. A
+ * message which contains a string must then contain each of the
+ * string's trigrams, so a lookup can rule messages out without
+ * reading them; it can't prove a match since the trigrams may be
+ * scattered, so the caller still has to check the messages which
+ * weren't ruled out.
+ *
+ * Messages are numbered (docids) in the order they were added to the
+ * index and the posting lists are stored as deltas between docids
+ * encoded as zigzag varints, so that they stay small even when the
+ * messages get indexed out of order. */
+
+#define INDEX_MAGIC      "SpruceIx"
+#define INDEX_MAGIC_LEN  8
+#define INDEX_VERSION    1
+
+/* how much memory the posting lists decoded for lookups may use
+ * before they get thrown away and decoded again as needed */
+#define INDEX_DECODED_MAX  (4 * 1024 * 1024)
+
+#define INDEX_KEY(field, a, b, c) (((field) << 24) | ((a) << 16) | ((b) << 8) | (c))
+
+typedef struct {
+	char *uid;        /* NULL once removed */
+	guint32 fields;   /* bitmask of the fields which have been indexed */
+} IndexDoc;
+
+typedef struct {
+	GByteArray *data;
+	guint32 count;
+	guint32 last;
+	gboolean sorted;
+	
+	/* sorted docids, decoded on the first lookup */
+	GArray *docids;
+} IndexPostings;
+
+struct _SpruceFolderIndex {
+	char *filename;
+	
+	GArray *docs;
+	GHashTable *uids;
+	GHashTable *terms;
+	guint removed;
+	gboolean dirty;
+	
+	/* bytes of docids decoded for lookups */
+	gsize decoded;
+	
+	/* state of the field being written */
+	gboolean writing;
+	guint32 docid;
+	guint32 field;
+	unsigned char tail[2];
+	guint ntail;
+};
+
+
+static IndexPostings *
+postings_new (void)
+{
+	IndexPostings *postings;
+	
+	postings = g_new (IndexPostings, 1);
+	postings->data = g_byte_array_new ();
+	postings->count = 0;
+	postings->last = 0;
+	postings->sorted = TRUE;
+	postings->docids = NULL;
+	
+	return postings;
+}
+
+static void
+postings_free (IndexPostings *postings)
+{
+	if (postings->docids)
+		g_array_free (postings->docids, TRUE);
+	
+	g_byte_array_free (postings->data, TRUE);
+	g_free (postings);
+}
+
+static void
+postings_append (IndexPostings *postings, guint32 docid)
+{
+	unsigned char buf[10];
+	guint64 zigzag;
+	gint64 delta;
+	int n = 0;
+	
+	/* a document's terms are all written before the next one's */
+	if (postings->count > 0 && postings->last == docid)
+		return;
+	
+	if (postings->count > 0 && docid < postings->last)
+		postings->sorted = FALSE;
+	
+	delta = (gint64) docid - (gint64) postings->last;
+	zigzag = (guint64) ((delta << 1) ^ (delta >> 63));
+	
+	do {
+		buf[n] = zigzag & 0x7f;
+		zigzag >>= 7;
+		if (zigzag != 0)
+			buf[n] |= 0x80;
+		n++;
+	} while (zigzag != 0);
+	
+	g_byte_array_append (postings->data, buf, n);
+	postings->last = docid;
+	postings->count++;
+}
+
+static int
+postings_decode (IndexPostings *postings, GArray *docids)
+{
+	const unsigned char *inptr = postings->data->data;
+	const unsigned char *inend = inptr + postings->data->len;
+	gint64 docid = 0;
+	guint64 zigzag;
+	guint32 value;
+	int shift;
+	
+	while (inptr < inend) {
+		zigzag = 0;
+		shift = 0;
+		
+		do {
+			if (inptr == inend || shift > 63)
+				return -1;
+			
+			zigzag |= ((guint64) (*inptr & 0x7f)) << shift;
+			shift += 7;
+		} while (*inptr++ & 0x80);
+		
+		docid += (gint64) (zigzag >> 1) ^ -((gint64) (zigzag & 1));
+		value = (guint32) docid;
+		g_array_append_val (docids, value);
+	}
+	
+	return 0;
+}
+
+static int
+docid_cmp (const void *v1, const void *v2)
+{
+	guint32 a = *((guint32 *) v1);
+	guint32 b = *((guint32 *) v2);
+	
+	return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+/* re-encodes @postings in ascending order, renumbering the docids
+ * through @remap (if given) and dropping the ones mapped to -1 */
+static void
+postings_rewrite (IndexPostings *postings, const guint32 *remap)
+{
+	GArray *docids;
+	guint32 docid;
+	guint i;
+	
+	docids = g_array_sized_new (FALSE, FALSE, sizeof (guint32), postings->count);
+	postings_decode (postings, docids);
+	
+	g_byte_array_set_size (postings->data, 0);
+	postings->count = 0;
+	postings->last = 0;
+	postings->sorted = TRUE;
+	
+	if (remap != NULL) {
+		for (i = 0; i < docids->len; i++) {
+			docid = g_array_index (docids, guint32, i);
+			g_array_index (docids, guint32, i) = remap[docid];
+		}
+	}
+	
+	qsort (docids->data, docids->len, sizeof (guint32), docid_cmp);
+	
+	for (i = 0; i < docids->len; i++) {
+		docid = g_array_index (docids, guint32, i);
+		if (docid != (guint32) -1)
+			postings_append (postings, docid);
+	}
+	
+	g_array_free (docids, TRUE);
+}
+
+static void
+postings_uncache (SpruceFolderIndex *index, IndexPostings *postings)
+{
+	if (postings->docids) {
+		index->decoded -= postings->docids->len * sizeof (guint32);
+		g_array_free (postings->docids, TRUE);
+		postings->docids = NULL;
+	}
+}
+
+/* throws away all of the decoded posting lists */
+static void
+index_uncache (SpruceFolderIndex *index)
+{
+	GHashTableIter iter;
+	gpointer value;
+	
+	g_hash_table_iter_init (&iter, index->terms);
+	while (g_hash_table_iter_next (&iter, NULL, &value))
+		postings_uncache (index, value);
+	
+	index->decoded = 0;
+}
+
+static gboolean
+postings_contain (SpruceFolderIndex *index, IndexPostings *postings, guint32 docid)
+{
+	GArray *docids;
+	
+	if (postings->docids == NULL) {
+		if (index->decoded + postings->count * sizeof (guint32) > INDEX_DECODED_MAX)
+			index_uncache (index);
+		
+		docids = g_array_sized_new (FALSE, FALSE, sizeof (guint32), postings->count);
+		postings_decode (postings, docids);
+		
+		if (!postings->sorted)
+			qsort (docids->data, docids->len, sizeof (guint32), docid_cmp);
+		
+		index->decoded += docids->len * sizeof (guint32);
+		postings->docids = docids;
+	}
+	
+	docids = postings->docids;
+	
+	return bsearch (&docid, docids->data, docids->len, sizeof (guint32), docid_cmp) != NULL;
+}
+
+
+/**
+ * spruce_folder_index_new:
+ * @filename: path of the index file
+ *
+ * Creates a new (empty) index. Use spruce_folder_index_load() to
+ * read in a previously saved index.
+ *
+ * Returns: a new #SpruceFolderIndex.
+ **/
+SpruceFolderIndex *
+spruce_folder_index_new (const char *filename)
+{
+	SpruceFolderIndex *index;
+	
+	index = g_new (SpruceFolderIndex, 1);
+	index->filename = g_strdup (filename);
+	index->docs = g_array_new (FALSE, FALSE, sizeof (IndexDoc));
+	index->uids = g_hash_table_new (g_str_hash, g_str_equal);
+	index->terms = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+					      (GDestroyNotify) postings_free);
+	index->removed = 0;
+	index->dirty = TRUE;
+	index->writing = FALSE;
+	index->decoded = 0;
+	
+	return index;
+}
+
+static void
+index_reset (SpruceFolderIndex *index)
+{
+	IndexDoc *doc;
+	guint i;
+	
+	for (i = 0; i < index->docs->len; i++) {
+		doc = &g_array_index (index->docs, IndexDoc, i);
+		g_free (doc->uid);
+	}
+	
+	g_array_set_size (index->docs, 0);
+	g_hash_table_remove_all (index->uids);
+	g_hash_table_remove_all (index->terms);
+	index->writing = FALSE;
+	index->removed = 0;
+	index->decoded = 0;
+}
+
+
+/**
+ * spruce_folder_index_free:
+ * @index: a #SpruceFolderIndex
+ *
+ * Frees the in-memory index (without saving it).
+ **/
+void
+spruce_folder_index_free (SpruceFolderIndex *index)
+{
+	index_reset (index);
+	
+	g_array_free (index->docs, TRUE);
+	g_hash_table_destroy (index->uids);
+	g_hash_table_destroy (index->terms);
+	g_free (index->filename);
+	g_free (index);
+}
+
+
+/**
+ * spruce_folder_index_set_filename:
+ * @index: a #SpruceFolderIndex
+ * @filename: new path of the index file
+ *
+ * Changes the path the index gets saved to (and loaded from). The
+ * file itself isn't touched, it's up to the caller to move it.
+ **/
+void
+spruce_folder_index_set_filename (SpruceFolderIndex *index, const char *filename)
+{
+	g_free (index->filename);
+	index->filename = g_strdup (filename);
+}
+
+
+/**
+ * spruce_folder_index_clear:
+ * @index: a #SpruceFolderIndex
+ *
+ * Removes every message from the index and deletes the index file
+ * so that a stale index can never be loaded in its place; the empty
+ * index gets written out on the next save.
+ **/
+void
+spruce_folder_index_clear (SpruceFolderIndex *index)
+{
+	index_reset (index);
+	unlink (index->filename);
+	index->dirty = TRUE;
+}
+
+
+/**
+ * spruce_folder_index_is_dirty:
+ * @index: a #SpruceFolderIndex
+ *
+ * Returns: %TRUE if the index has changed since it was last saved.
+ **/
+gboolean
+spruce_folder_index_is_dirty (SpruceFolderIndex *index)
+{
+	return index->dirty;
+}
+
+
+static guint32
+index_doc (SpruceFolderIndex *index, const char *uid)
+{
+	gpointer value;
+	IndexDoc doc;
+	
+	if ((value = g_hash_table_lookup (index->uids, uid)))
+		return GPOINTER_TO_UINT (value) - 1;
+	
+	doc.uid = g_strdup (uid);
+	doc.fields = 0;
+	g_array_append_val (index->docs, doc);
+	
+	g_hash_table_insert (index->uids, doc.uid, GUINT_TO_POINTER (index->docs->len));
+	index->dirty = TRUE;
+	
+	return index->docs->len - 1;
+}
+
+
+/**
+ * spruce_folder_index_add:
+ * @index: a #SpruceFolderIndex
+ * @uid: message uid
+ *
+ * Adds the message to the index. None of its fields are indexed
+ * until they get written using spruce_folder_index_begin().
+ **/
+void
+spruce_folder_index_add (SpruceFolderIndex *index, const char *uid)
+{
+	index_doc (index, uid);
+}
+
+
+/**
+ * spruce_folder_index_remove:
+ * @index: a #SpruceFolderIndex
+ * @uid: message uid
+ *
+ * Removes the message from the index. Its docid is left unused
+ * until the index is next compacted (on save).
+ **/
+void
+spruce_folder_index_remove (SpruceFolderIndex *index, const char *uid)
+{
+	gpointer value;
+	IndexDoc *doc;
+	
+	if (!(value = g_hash_table_lookup (index->uids, uid)))
+		return;
+	
+	doc = &g_array_index (index->docs, IndexDoc, GPOINTER_TO_UINT (value) - 1);
+	g_hash_table_remove (index->uids, uid);
+	g_free (doc->uid);
+	doc->uid = NULL;
+	doc->fields = 0;
+	
+	index->removed++;
+	index->dirty = TRUE;
+}
+
+
+/**
+ * spruce_folder_index_has_field:
+ * @index: a #SpruceFolderIndex
+ * @uid: message uid
+ * @field: field
+ *
+ * Returns: %TRUE if @field of the message has been indexed.
+ **/
+gboolean
+spruce_folder_index_has_field (SpruceFolderIndex *index, const char *uid, SpruceFolderIndexField field)
+{
+	gpointer value;
+	IndexDoc *doc;
+	
+	if (!(value = g_hash_table_lookup (index->uids, uid)))
+		return FALSE;
+	
+	doc = &g_array_index (index->docs, IndexDoc, GPOINTER_TO_UINT (value) - 1);
+	
+	return (doc->fields & (1 << field)) != 0;
+}
+
+
+/**
+ * spruce_folder_index_begin:
+ * @index: a #SpruceFolderIndex
+ * @uid: message uid
+ * @field: field
+ *
+ * Starts indexing @field of the message, the text of the field is
+ * then passed to spruce_folder_index_write() (in as many pieces as
+ * needed) followed by a call to spruce_folder_index_end().
+ **/
+void
+spruce_folder_index_begin (SpruceFolderIndex *index, const char *uid, SpruceFolderIndexField field)
+{
+	g_return_if_fail (!index->writing);
+	
+	index->docid = index_doc (index, uid);
+	index->field = field;
+	index->ntail = 0;
+	index->writing = TRUE;
+}
+
+
+/**
+ * spruce_folder_index_write:
+ * @index: a #SpruceFolderIndex
+ * @text: text
+ * @len: length of @text
+ *
+ * Indexes the next piece of text of the field being written.
+ **/
+void
+spruce_folder_index_write (SpruceFolderIndex *index, const char *text, size_t len)
+{
+	const unsigned char *inptr = (const unsigned char *) text;
+	const unsigned char *inend = inptr + len;
+	IndexPostings *postings;
+	unsigned char c;
+	guint32 key;
+	
+	g_return_if_fail (index->writing);
+	
+	while (inptr < inend && index->ntail < 2)
+		index->tail[index->ntail++] = g_ascii_tolower (*inptr++);
+	
+	while (inptr < inend) {
+		c = g_ascii_tolower (*inptr++);
+		key = INDEX_KEY (index->field, index->tail[0], index->tail[1], c);
+		
+		if (!(postings = g_hash_table_lookup (index->terms, GUINT_TO_POINTER (key)))) {
+			postings = postings_new ();
+			g_hash_table_insert (index->terms, GUINT_TO_POINTER (key), postings);
+		}
+		
+		postings_uncache (index, postings);
+		postings_append (postings, index->docid);
+		
+		index->tail[0] = index->tail[1];
+		index->tail[1] = c;
+	}
+}
+
+
+/**
+ * spruce_folder_index_end:
+ * @index: a #SpruceFolderIndex
+ *
+ * Finishes indexing the field started by spruce_folder_index_begin().
+ **/
+void
+spruce_folder_index_end (SpruceFolderIndex *index)
+{
+	IndexDoc *doc;
+	
+	g_return_if_fail (index->writing);
+	
+	doc = &g_array_index (index->docs, IndexDoc, index->docid);
+	doc->fields |= 1 << index->field;
+	
+	index->writing = FALSE;
+	index->dirty = TRUE;
+}
+
+
+/**
+ * spruce_folder_index_may_contain:
+ * @index: a #SpruceFolderIndex
+ * @uid: message uid
+ * @field: field
+ * @string: string to look for
+ *
+ * Checks whether @field of the message could contain @string
+ * (ignoring case). Strings shorter than 3 bytes and messages which
+ * haven't been indexed can't be ruled out.
+ *
+ * Returns: %FALSE if @field of the message definitely doesn't contain
+ * @string or %TRUE otherwise.
+ **/
+gboolean
+spruce_folder_index_may_contain (SpruceFolderIndex *index, const char *uid,
+				 SpruceFolderIndexField field, const char *string)
+{
+	const unsigned char *inptr = (const unsigned char *) string;
+	IndexPostings *postings;
+	gpointer value;
+	IndexDoc *doc;
+	guint32 docid;
+	guint32 key;
+	
+	if (!(value = g_hash_table_lookup (index->uids, uid)))
+		return TRUE;
+	
+	docid = GPOINTER_TO_UINT (value) - 1;
+	doc = &g_array_index (index->docs, IndexDoc, docid);
+	if (!(doc->fields & (1 << field)))
+		return TRUE;
+	
+	if (strlen (string) < 3)
+		return TRUE;
+	
+	while (inptr[2] != '\0') {
+		key = INDEX_KEY (field, g_ascii_tolower (inptr[0]), g_ascii_tolower (inptr[1]),
+				 g_ascii_tolower (inptr[2]));
+		
+		if (!(postings = g_hash_table_lookup (index->terms, GUINT_TO_POINTER (key))))
+			return FALSE;
+		
+		if (!postings_contain (index, postings, docid))
+			return FALSE;
+		
+		inptr++;
+	}
+	
+	return TRUE;
+}
+
+
+/* renumbers the documents to get rid of the removed ones */
+static void
+index_compact (SpruceFolderIndex *index)
+{
+	IndexPostings *postings;
+	GHashTableIter iter;
+	gpointer key, value;
+	GArray *docs;
+	guint32 *remap;
+	IndexDoc *doc;
+	guint i;
+	
+	/* the docids are about to be renumbered */
+	index_uncache (index);
+	
+	remap = g_new (guint32, index->docs->len);
+	docs = g_array_new (FALSE, FALSE, sizeof (IndexDoc));
+	g_hash_table_remove_all (index->uids);
+	
+	for (i = 0; i < index->docs->len; i++) {
+		doc = &g_array_index (index->docs, IndexDoc, i);
+		if (doc->uid != NULL) {
+			remap[i] = docs->len;
+			g_array_append_val (docs, *doc);
+			g_hash_table_insert (index->uids, doc->uid, GUINT_TO_POINTER (docs->len));
+		} else {
+			remap[i] = (guint32) -1;
+		}
+	}
+	
+	g_hash_table_iter_init (&iter, index->terms);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		postings = value;
+		postings_rewrite (postings, remap);
+		if (postings->count == 0)
+			g_hash_table_iter_remove (&iter);
+	}
+	
+	g_array_free (index->docs, TRUE);
+	index->docs = docs;
+	index->removed = 0;
+	g_free (remap);
+}
+
+
+/**
+ * spruce_folder_index_load:
+ * @index: a #SpruceFolderIndex
+ *
+ * Loads the index from disk.
+ *
+ * Returns: %0 on success or %-1 on fail (in which case the index is
+ * left empty).
+ **/
+int
+spruce_folder_index_load (SpruceFolderIndex *index)
+{
+	GMimeStream *stream, *buffered;
+	char magic[INDEX_MAGIC_LEN];
+	guint32 version, ndocs, nterms;
+	guint32 key, count, last, len;
+	IndexPostings *postings;
+	struct stat st;
+	IndexDoc doc;
+	guint32 i;
+	int fd;
+	
+	index_reset (index);
+	
+	if ((fd = open (index->filename, O_RDONLY)) == -1)
+		return -1;
+	
+	if (fstat (fd, &st) == -1) {
+		close (fd);
+		return -1;
+	}
+	
+	stream = g_mime_stream_fs_new (fd);
+	buffered = g_mime_stream_buffer_new (stream, GMIME_STREAM_BUFFER_BLOCK_READ);
+	g_object_unref (stream);
+	
+	if (g_mime_stream_read (buffered, magic, INDEX_MAGIC_LEN) != INDEX_MAGIC_LEN
+	    || memcmp (magic, INDEX_MAGIC, INDEX_MAGIC_LEN) != 0)
+		goto exception;
+	
+	if (spruce_file_util_decode_uint32 (buffered, &version) == -1 || version != INDEX_VERSION)
+		goto exception;
+	
+	if (spruce_file_util_decode_uint32 (buffered, &ndocs) == -1)
+		goto exception;
+	
+	for (i = 0; i < ndocs; i++) {
+		if (spruce_file_util_decode_string (buffered, &doc.uid) == -1)
+			goto exception;
+		
+		if (spruce_file_util_decode_uint32 (buffered, &doc.fields) == -1) {
+			g_free (doc.uid);
+			goto exception;
+		}
+		
+		if (*doc.uid == '\0') {
+			g_free (doc.uid);
+			doc.uid = NULL;
+			index->removed++;
+		}
+		
+		g_array_append_val (index->docs, doc);
+		
+		if (doc.uid != NULL)
+			g_hash_table_insert (index->uids, doc.uid, GUINT_TO_POINTER (index->docs->len));
+	}
+	
+	if (spruce_file_util_decode_uint32 (buffered, &nterms) == -1)
+		goto exception;
+	
+	for (i = 0; i < nterms; i++) {
+		if (spruce_file_util_decode_uint32 (buffered, &key) == -1
+		    || spruce_file_util_decode_uint32 (buffered, &count) == -1
+		    || spruce_file_util_decode_uint32 (buffered, &last) == -1
+		    || spruce_file_util_decode_uint32 (buffered, &len) == -1)
+			goto exception;
+		
+		/* don't let a corrupt length or count size an allocation;
+		 * each docid takes at least a byte */
+		if ((gint64) len > (gint64) st.st_size - g_mime_stream_tell (buffered) || count > len)
+			goto exception;
+		
+		postings = postings_new ();
+		g_hash_table_insert (index->terms, GUINT_TO_POINTER (key), postings);
+		
+		g_byte_array_set_size (postings->data, len);
+		if (len > 0 && g_mime_stream_read (buffered, (char *) postings->data->data, len) != len)
+			goto exception;
+		
+		postings->count = count;
+		postings->last = last;
+	}
+	
+	g_object_unref (buffered);
+	index->dirty = FALSE;
+	
+	return 0;
+	
+ exception:
+	
+	g_object_unref (buffered);
+	index_reset (index);
+	
+	return -1;
+}
+
+
+/**
+ * spruce_folder_index_save:
+ * @index: a #SpruceFolderIndex
+ *
+ * Saves the index to disk if it has changed.
+ *
+ * Returns: %0 on success or %-1 on fail.
+ **/
+int
+spruce_folder_index_save (SpruceFolderIndex *index)
+{
+	GMimeStream *stream, *buffered;
+	IndexPostings *postings;
+	GHashTableIter iter;
+	gpointer key, value;
+	IndexDoc *doc;
+	char *path;
+	guint i;
+	int fd;
+	
+	if (!index->dirty || index->writing)
+		return 0;
+	
+	if (index->removed > 0 && index->removed * 2 >= index->docs->len)
+		index_compact (index);
+	
+	path = g_strdup_printf ("%s.tmp", index->filename);
+	if ((fd = open (path, O_CREAT | O_TRUNC | O_WRONLY, 0666)) == -1) {
+		g_free (path);
+		return -1;
+	}
+	
+	stream = g_mime_stream_fs_new (fd);
+	buffered = g_mime_stream_buffer_new (stream, GMIME_STREAM_BUFFER_BLOCK_WRITE);
+	
+	if (g_mime_stream_write (buffered, INDEX_MAGIC, INDEX_MAGIC_LEN) == -1)
+		goto exception;
+	
+	if (spruce_file_util_encode_uint32 (buffered, INDEX_VERSION) == -1)
+		goto exception;
+	
+	if (spruce_file_util_encode_uint32 (buffered, index->docs->len) == -1)
+		goto exception;
+	
+	for (i = 0; i < index->docs->len; i++) {
+		doc = &g_array_index (index->docs, IndexDoc, i);
+		if (spruce_file_util_encode_string (buffered, doc->uid) == -1)
+			goto exception;
+		
+		if (spruce_file_util_encode_uint32 (buffered, doc->fields) == -1)
+			goto exception;
+	}
+	
+	if (spruce_file_util_encode_uint32 (buffered, g_hash_table_size (index->terms)) == -1)
+		goto exception;
+	
+	g_hash_table_iter_init (&iter, index->terms);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		postings = value;
+		
+		/* messages indexed out of order leave the postings
+		 * unsorted, which costs a byte or two per delta */
+		if (!postings->sorted)
+			postings_rewrite (postings, NULL);
+		
+		if (spruce_file_util_encode_uint32 (buffered, GPOINTER_TO_UINT (key)) == -1
+		    || spruce_file_util_encode_uint32 (buffered, postings->count) == -1
+		    || spruce_file_util_encode_uint32 (buffered, postings->last) == -1
+		    || spruce_file_util_encode_uint32 (buffered, postings->data->len) == -1)
+			goto exception;
+		
+		if (postings->data->len > 0 &&
+		    g_mime_stream_write (buffered, (char *) postings->data->data, postings->data->len) == -1)
+			goto exception;
+	}
+	
+	if (g_mime_stream_flush (buffered) == -1 || fsync (fd) == -1)
+		goto exception;
+	
+	g_object_unref (buffered);
+	g_object_unref (stream);
+	
+	if (rename (path, index->filename) == -1) {
+		unlink (path);
+		g_free (path);
+		return -1;
+	}
+	
+	index->dirty = FALSE;
+	g_free (path);
+	
+	return 0;
+	
+ exception:
+	
+	g_object_unref (buffered);
+	g_object_unref (stream);
+	unlink (path);
+	g_free (path);
+	
+	return -1;
+}
@@ -0,0 +1,60 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*  Spruce
+ *  Copyright (C) 1999-2009 Jeffrey Stedfast
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef __SPRUCE_FOLDER_INDEX_H__
+#define __SPRUCE_FOLDER_INDEX_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _SpruceFolderIndex SpruceFolderIndex;
+
+typedef enum {
+	SPRUCE_FOLDER_INDEX_BODY,
+	SPRUCE_FOLDER_INDEX_HEADERS,
+} SpruceFolderIndexField;
+
+SpruceFolderIndex *spruce_folder_index_new (const char *filename);
+void spruce_folder_index_free (SpruceFolderIndex *index);
+
+void spruce_folder_index_set_filename (SpruceFolderIndex *index, const char *filename);
+
+int spruce_folder_index_load (SpruceFolderIndex *index);
+int spruce_folder_index_save (SpruceFolderIndex *index);
+void spruce_folder_index_clear (SpruceFolderIndex *index);
+
+gboolean spruce_folder_index_is_dirty (SpruceFolderIndex *index);
+
+void spruce_folder_index_add (SpruceFolderIndex *index, const char *uid);
+void spruce_folder_index_remove (SpruceFolderIndex *index, const char *uid);
+
+gboolean spruce_folder_index_has_field (SpruceFolderIndex *index, const char *uid, SpruceFolderIndexField field);
+
+void spruce_folder_index_begin (SpruceFolderIndex *index, const char *uid, SpruceFolderIndexField field);
+void spruce_folder_index_write (SpruceFolderIndex *index, const char *text, size_t len);
+void spruce_folder_index_end (SpruceFolderIndex *index);
+
+gboolean spruce_folder_index_may_contain (SpruceFolderIndex *index, const char *uid,
+					  SpruceFolderIndexField field, const char *string);
+
+G_END_DECLS
+
+#endif /* __SPRUCE_FOLDER_INDEX_H__ */
@@ -22,11 +22,14 @@
 #include <config.h>
 #endif
 
+#include <unistd.h>
 #include <string.h>
 #include <time.h>
 
 #include <glib/gi18n.h>
 
+#include <gmime/gmime.h>
+
 #include "spruce-folder-search.h"
 
 
@@ -59,6 +62,21 @@ static SearchResult *current_date (SearchContext *ctx, int argc, SearchResult **
 static SearchResult *size (SearchContext *ctx, int argc, SearchResult **argv,
 			   SpruceFolderSearch *s);
 
+static void body_contains_value (SearchContext *ctx, int argc, SearchResult *argv,
+				 SearchResult *result, SpruceFolderSearch *s);
+static void header_contains_value (SearchContext *ctx, int argc, SearchResult *argv,
+				   SearchResult *result, SpruceFolderSearch *s);
+static void system_flag_value (SearchContext *ctx, int argc, SearchResult *argv,
+			       SearchResult *result, SpruceFolderSearch *s);
+static void sent_date_value (SearchContext *ctx, int argc, SearchResult *argv,
+			     SearchResult *result, SpruceFolderSearch *s);
+static void received_date_value (SearchContext *ctx, int argc, SearchResult *argv,
+				 SearchResult *result, SpruceFolderSearch *s);
+static void current_date_value (SearchContext *ctx, int argc, SearchResult *argv,
+				SearchResult *result, SpruceFolderSearch *s);
+static void size_value (SearchContext *ctx, int argc, SearchResult *argv,
+			SearchResult *result, SpruceFolderSearch *s);
+
 
 static GObjectClass *parent_class = NULL;
 
@@ -110,7 +128,7 @@ spruce_folder_search_class_init (SpruceFolderSearchClass *klass)
 static void
 spruce_folder_search_init (SpruceFolderSearch *search, SpruceFolderSearchClass *klass)
 {
-	search->sexp = NULL;
+	search->sexp = search_context_new ();
 	search->last_search = NULL;
 	search->folder = NULL;
 	search->summary = NULL;
@@ -118,12 +136,28 @@ spruce_folder_search_init (SpruceFolderSearch *search, SpruceFolderSearchClass *
 	search->current = NULL;
 	search->match1 = NULL;
 	search->message = NULL;
+	search->columns = NULL;
+	search->index = 0;
+	search->parent = NULL;
+	search->workers = NULL;
+	search->lock = NULL;
+	search->nthreads = 1;
 }
 
 static void
 spruce_folder_search_finalize (GObject *object)
 {
 	SpruceFolderSearch *search = (SpruceFolderSearch *) object;
+	int i;
+	
+	if (search->workers) {
+		for (i = 0; i < search->workers->len; i++)
+			g_object_unref (search->workers->pdata[i]);
+		g_ptr_array_free (search->workers, TRUE);
+	}
+	
+	if (search->lock)
+		g_mutex_free (search->lock);
 	
 	if (search->sexp)
 		search_context_unref (search->sexp);
@@ -137,164 +171,708 @@ spruce_folder_search_finalize (GObject *object)
 }
 
 
+/* the workers of a parallel match-all take turns at anything that
+ * needs the message itself: neither the folder nor its index are
+ * thread-safe, and message content is read from the folder's stream */
+static void
+search_lock (SpruceFolderSearch *s)
+{
+	if (s->parent)
+		g_mutex_lock (s->parent->lock);
+}
+
+static void
+search_unlock (SpruceFolderSearch *s)
+{
+	if (s->parent)
+		g_mutex_unlock (s->parent->lock);
+}
+
+/* parallel match-all hands out the summary in chunks which are a
+ * multiple of the bitmap word size, so that no two threads ever set
+ * bits in the same word */
+#define MATCH_ALL_CHUNK 256
+
+typedef struct {
+	SearchBitmap *matches;
+	volatile int next;
+	volatile int failed;
+} MatchAllJob;
+
+typedef struct {
+	MatchAllJob *job;
+	SpruceFolderSearch *worker;
+	SearchTerm *term;
+	const char *exception;
+} MatchAllTask;
+
+static void
+search_release_message (SpruceFolderSearch *s)
+{
+	if (s->message) {
+		g_object_unref (s->message);
+		s->message = NULL;
+	}
+}
+
+static SpruceFolderSearch *
+search_worker_new (SpruceFolderSearch *s)
+{
+	SpruceFolderSearch *worker;
+	
+	worker = g_object_new (G_OBJECT_TYPE (s), NULL);
+	search_context_unref (worker->sexp);
+	worker->sexp = search_context_clone (s->sexp);
+	worker->parent = s;
+	
+	return worker;
+}
+
+static void
+match_all_thread (gpointer data, gpointer user_data)
+{
+	MatchAllTask *task = data;
+	MatchAllJob *job = task->job;
+	SpruceFolderSearch *s = task->worker;
+	SearchResult value;
+	int start, end, i;
+	int rv;
+	
+	while (!g_atomic_int_get (&job->failed)) {
+		start = g_atomic_int_exchange_and_add (&job->next, MATCH_ALL_CHUNK);
+		if (start >= s->summary->len)
+			break;
+		
+		end = MIN (start + MATCH_ALL_CHUNK, s->summary->len);
+		
+		for (i = start; i < end; i++) {
+			s->current = s->summary->pdata[i];
+			s->index = i;
+			
+			rv = search_context_eval (s->sexp, task->term, &value, s);
+			
+			if (s->message) {
+				search_lock (s);
+				search_release_message (s);
+				search_unlock (s);
+			}
+			
+			if (rv == -1) {
+				task->exception = search_context_exception (s->sexp);
+				g_atomic_int_set (&job->failed, 1);
+				break;
+			}
+			
+			if (value.type == SEARCH_RESULT_BOOL && value.value.bool)
+				search_bitmap_set (job->matches, i);
+		}
+	}
+	
+	s->current = NULL;
+}
+
+/* evaluates @term for each message on a pool of threads, each with
+ * its own clone of the search context; returns %FALSE if the search
+ * has to be done serially */
+static gboolean
+match_all_threaded (SpruceFolderSearch *s, SearchTerm *term, SearchBitmap *matches, const char **exception)
+{
+	SpruceFolderSearch *worker;
+	MatchAllTask *tasks;
+	GThreadPool *pool;
+	MatchAllJob job;
+	int nthreads, i;
+	
+	*exception = NULL;
+	
+	if (s->parent || s->nthreads < 2 || !s->last_search || !g_thread_supported ())
+		return FALSE;
+	
+	/* not worth it unless each thread gets a few chunks */
+	nthreads = MIN (s->nthreads, s->summary->len / (MATCH_ALL_CHUNK * 2));
+	if (nthreads < 2)
+		return FALSE;
+	
+	if (s->lock == NULL)
+		s->lock = g_mutex_new ();
+	
+	if (s->workers == NULL)
+		s->workers = g_ptr_array_new ();
+	
+	while (s->workers->len < nthreads)
+		g_ptr_array_add (s->workers, search_worker_new (s));
+	
+	tasks = g_new (MatchAllTask, nthreads);
+	
+	for (i = 0; i < nthreads; i++) {
+		worker = s->workers->pdata[i];
+		
+		if (!worker->last_search || strcmp (worker->last_search, s->last_search) != 0) {
+			g_free (worker->last_search);
+			worker->last_search = NULL;
+			
+			if (search_context_build (worker->sexp, s->last_search) == -1) {
+				g_free (tasks);
+				return FALSE;
+			}
+			
+			worker->last_search = g_strdup (s->last_search);
+		}
+		
+		if (!(tasks[i].term = search_context_lookup_term (s->sexp, worker->sexp, term))) {
+			g_free (tasks);
+			return FALSE;
+		}
+		
+		tasks[i].worker = worker;
+		tasks[i].exception = NULL;
+		tasks[i].job = &job;
+	}
+	
+	if (!(pool = g_thread_pool_new (match_all_thread, NULL, nthreads, FALSE, NULL))) {
+		g_free (tasks);
+		return FALSE;
+	}
+	
+	job.matches = matches;
+	job.failed = 0;
+	job.next = 0;
+	
+	for (i = 0; i < nthreads; i++) {
+		worker = tasks[i].worker;
+		worker->folder = s->folder;
+		worker->summary = s->summary;
+		worker->columns = s->columns;
+		
+		g_thread_pool_push (pool, &tasks[i], NULL);
+	}
+	
+	/* wait for all of the tasks to finish */
+	g_thread_pool_free (pool, FALSE, TRUE);
+	
+	for (i = 0; i < nthreads; i++) {
+		worker = tasks[i].worker;
+		worker->folder = NULL;
+		worker->summary = NULL;
+		worker->columns = NULL;
+		
+		/* owned by the worker's search context */
+		if (tasks[i].exception && *exception == NULL)
+			*exception = tasks[i].exception;
+	}
+	
+	g_free (tasks);
+	
+	return TRUE;
+}
+
 static SearchResult *
 match_all (SearchContext *ctx, int argc, SearchTerm **argv, SpruceFolderSearch *s)
 {
-	SearchResult *res;
-	GPtrArray *uids;
+	SearchResult *res, value;
+	SearchBitmap *matches;
+	const char *exception;
 	int i;
 	
 	if (argc != 1)
 		search_context_throw (ctx, _("Incorrect argument count in (match-all )"));
 	
-	uids = g_ptr_array_new ();
+	if (s->match1) {
+		/* only the one message is being matched */
+		matches = search_bitmap_new (1);
+		s->current = s->match1;
+		search_term_eval_value (ctx, argv[0], &value, s);
+		if (value.type == SEARCH_RESULT_BOOL && value.value.bool)
+			search_bitmap_set (matches, 0);
+		
+		goto done;
+	}
+	
+	/* date/size lookups can use the packed summary columns when
+	 * we are matching against the folder summary */
+	if (s->folder && s->folder->summary && s->summary == s->folder->summary->messages)
+		s->columns = spruce_folder_summary_get_columns (s->folder->summary);
+	
+	/* the matches are indexed by summary position and only get
+	 * converted into uids by spruce_folder_search_match_all() */
+	matches = search_bitmap_new (s->summary->len);
+	
+	if (match_all_threaded (s, argv[0], matches, &exception)) {
+		s->columns = NULL;
+		
+		if (exception != NULL) {
+			search_bitmap_free (matches);
+			search_context_throw (ctx, "%s", exception);
+		}
+		
+		goto done;
+	}
+	
 	for (i = 0; i < s->summary->len; i++) {
 		s->current = s->summary->pdata[i];
-		res = search_term_eval (ctx, argv[0], s);
-		if (res->type == SEARCH_RESULT_BOOL && res->value.bool)
-			g_ptr_array_add (uids, s->current->uid);
-		search_result_free (res);
-		if (s->message) {
-			g_object_unref (s->message);
-			s->message = NULL;
-		}
+		s->index = i;
+		search_term_eval_value (ctx, argv[0], &value, s);
+		if (value.type == SEARCH_RESULT_BOOL && value.value.bool)
+			search_bitmap_set (matches, i);
+		search_release_message (s);
 	}
 	
-	res = search_result_new (SEARCH_RESULT_ARRAY);
-	res->value.array = uids;
+	s->columns = NULL;
+	
+ done:
+	
+	res = search_result_new (SEARCH_RESULT_BITMAP);
+	res->value.bitmap = matches;
 	
 	return res;
 }
 
+/* body-contains patterns are matched case-insensitively using
+ * Boyer-Moore-Horspool on the decoded content of each text part */
+typedef struct {
+	unsigned char *pattern;
+	size_t skip[256];
+	size_t len;
+} BodyPattern;
+
+typedef struct {
+	BodyPattern *patterns;
+	int npatterns;
+	size_t maxlen;
+	gboolean found;
+	
+	/* if set, all of the content gets written to the index */
+	SpruceFolderIndex *index;
+} BodyScan;
+
+#define BODY_SCAN_CHUNK 4096
+
+static void
+body_patterns_init (BodyPattern *patterns, int argc, SearchResult *argv)
+{
+	BodyPattern *pat;
+	size_t i;
+	int n;
+	
+	for (n = 0; n < argc; n++) {
+		pat = &patterns[n];
+		pat->pattern = (unsigned char *) g_ascii_strdown (argv[n].value.string, -1);
+		pat->len = strlen ((char *) pat->pattern);
+		
+		for (i = 0; i < 256; i++)
+			pat->skip[i] = pat->len;
+		
+		for (i = 0; i + 1 < pat->len; i++)
+			pat->skip[pat->pattern[i]] = pat->len - 1 - i;
+	}
+}
+
+static gboolean
+body_pattern_match (BodyPattern *pat, const unsigned char *text, size_t len)
+{
+	size_t i = 0, j;
+	
+	if (pat->len == 0)
+		return TRUE;
+	
+	while (i + pat->len <= len) {
+		j = pat->len - 1;
+		while (g_ascii_tolower (text[i + j]) == pat->pattern[j]) {
+			if (j == 0)
+				return TRUE;
+			j--;
+		}
+		
+		i += pat->skip[(unsigned char) g_ascii_tolower (text[i + pat->len - 1])];
+	}
+	
+	return FALSE;
+}
+
+/* reads the decoded content of @part looking for any of the patterns,
+ * stopping as soon as one is found (unless it is being indexed) */
+static void
+body_part_match (GMimePart *part, BodyScan *scan)
+{
+	GMimeStream *stream, *filtered;
+	GMimeDataWrapper *content;
+	GMimeFilter *filter;
+	const char *charset;
+	size_t carry = 0, len;
+	unsigned char *buf;
+	ssize_t nread;
+	int i;
+	
+	if (!(content = g_mime_part_get_content_object (part)))
+		return;
+	
+	if (!(stream = g_mime_data_wrapper_get_stream (content)))
+		return;
+	
+	g_mime_stream_reset (stream);
+	filtered = g_mime_stream_filter_new (stream);
+	
+	switch (g_mime_data_wrapper_get_encoding (content)) {
+	case GMIME_CONTENT_ENCODING_BASE64:
+	case GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE:
+	case GMIME_CONTENT_ENCODING_UUENCODE:
+		filter = g_mime_filter_basic_new (g_mime_data_wrapper_get_encoding (content), FALSE);
+		g_mime_stream_filter_add ((GMimeStreamFilter *) filtered, filter);
+		g_object_unref (filter);
+		break;
+	default:
+		break;
+	}
+	
+	/* the patterns are UTF-8 */
+	charset = g_mime_object_get_content_type_parameter ((GMimeObject *) part, "charset");
+	if (charset && g_ascii_strcasecmp (charset, "utf-8") && g_ascii_strcasecmp (charset, "us-ascii")) {
+		if ((filter = g_mime_filter_charset_new (charset, "UTF-8"))) {
+			g_mime_stream_filter_add ((GMimeStreamFilter *) filtered, filter);
+			g_object_unref (filter);
+		}
+	}
+	
+	/* keep the tail of each chunk around so that matches
+	 * spanning 2 chunks are found */
+	buf = g_malloc (scan->maxlen + BODY_SCAN_CHUNK);
+	
+	while ((!scan->found || scan->index) &&
+	       (nread = g_mime_stream_read (filtered, (char *) buf + carry, BODY_SCAN_CHUNK)) > 0) {
+		if (scan->index)
+			spruce_folder_index_write (scan->index, (char *) buf + carry, nread);
+		
+		len = carry + nread;
+		
+		for (i = 0; i < scan->npatterns && !scan->found; i++)
+			scan->found = body_pattern_match (&scan->patterns[i], buf, len);
+		
+		carry = MIN (len, scan->maxlen > 0 ? scan->maxlen - 1 : 0);
+		memmove (buf, buf + len - carry, carry);
+	}
+	
+	g_object_unref (filtered);
+	g_free (buf);
+}
+
+static void
+body_object_match (GMimeObject *object, BodyScan *scan)
+{
+	GMimeContentType *type;
+	GMimeMessage *message;
+	int count, i;
+	
+	if (GMIME_IS_MULTIPART (object)) {
+		count = g_mime_multipart_get_count ((GMimeMultipart *) object);
+		for (i = 0; i < count && (!scan->found || scan->index); i++)
+			body_object_match (g_mime_multipart_get_part ((GMimeMultipart *) object, i), scan);
+	} else if (GMIME_IS_MESSAGE_PART (object)) {
+		message = g_mime_message_part_get_message ((GMimeMessagePart *) object);
+		if (message && message->mime_part)
+			body_object_match (message->mime_part, scan);
+	} else if (GMIME_IS_PART (object)) {
+		/* don't bother decoding images and other attachments */
+		type = g_mime_object_get_content_type (object);
+		if (g_mime_content_type_is_type (type, "text", "*"))
+			body_part_match ((GMimePart *) object, scan);
+	}
+}
+
+static SpruceFolderIndex *
+search_index (SpruceFolderSearch *s)
+{
+	if (s->folder && s->folder->summary)
+		return spruce_folder_summary_get_index (s->folder->summary);
+	
+	return NULL;
+}
+
+static void
+index_header_list (SpruceFolderIndex *index, GMimeHeaderList *headers)
+{
+	GMimeHeaderIter *iter;
+	const char *value;
+	
+	iter = g_mime_header_iter_new ();
+	
+	if (g_mime_header_list_get_iter (headers, iter)) {
+		do {
+			if ((value = g_mime_header_iter_get_value (iter))) {
+				spruce_folder_index_write (index, value, strlen (value));
+				spruce_folder_index_write (index, "\n", 1);
+			}
+		} while (g_mime_header_iter_next (iter));
+	}
+	
+	g_mime_header_iter_free (iter);
+}
+
+/* indexes the header values of a message, which is where
+ * header-contains looks for headers that aren't in the summary */
+static void
+search_index_headers (SpruceFolderIndex *index, const char *uid, GMimeMessage *message)
+{
+	GMimeObject *object = (GMimeObject *) message;
+	
+	spruce_folder_index_begin (index, uid, SPRUCE_FOLDER_INDEX_HEADERS);
+	
+	index_header_list (index, g_mime_object_get_header_list (object));
+	if (message->mime_part)
+		index_header_list (index, g_mime_object_get_header_list (message->mime_part));
+	
+	spruce_folder_index_end (index);
+}
+
+/* called with the search locked */
+static gboolean
+body_contains_message (int argc, SearchResult *argv, SpruceFolderSearch *s)
+{
+	SpruceFolderIndex *index;
+	BodyScan scan;
+	int i;
+	
+	/* if the message has been indexed, we only need to read it
+	 * when the index can't rule out all of the strings */
+	if ((index = search_index (s)) && spruce_folder_index_has_field (index, s->current->uid, SPRUCE_FOLDER_INDEX_BODY)) {
+		for (i = 0; i < argc; i++) {
+			if (spruce_folder_index_may_contain (index, s->current->uid, SPRUCE_FOLDER_INDEX_BODY,
+							     argv[i].value.string))
+				break;
+		}
+		
+		if (i == argc)
+			return FALSE;
+		
+		index = NULL;
+	}
+	
+	/* the message parser reads from the local store (or the
+	 * cache) and keeps part content on disk, so the parts are
+	 * only decoded as they get scanned */
+	if (!s->message)
+		s->message = spruce_folder_get_message (s->folder, s->current->uid, NULL);
+	
+	if (!s->message || !s->message->mime_part)
+		return FALSE;
+	
+	scan.patterns = g_new (BodyPattern, argc);
+	scan.npatterns = argc;
+	scan.found = FALSE;
+	scan.maxlen = 0;
+	scan.index = index;
+	
+	body_patterns_init (scan.patterns, argc, argv);
+	
+	for (i = 0; i < argc; i++)
+		scan.maxlen = MAX (scan.maxlen, scan.patterns[i].len);
+	
+	if (index) {
+		/* first time around: index the whole message */
+		if (!spruce_folder_index_has_field (index, s->current->uid, SPRUCE_FOLDER_INDEX_HEADERS))
+			search_index_headers (index, s->current->uid, s->message);
+		
+		spruce_folder_index_begin (index, s->current->uid, SPRUCE_FOLDER_INDEX_BODY);
+		body_object_match (s->message->mime_part, &scan);
+		spruce_folder_index_end (index);
+	} else {
+		body_object_match (s->message->mime_part, &scan);
+	}
+	
+	for (i = 0; i < argc; i++)
+		g_free (scan.patterns[i].pattern);
+	g_free (scan.patterns);
+	
+	return scan.found;
+}
+
+static void
+body_contains_value (SearchContext *ctx, int argc, SearchResult *argv, SearchResult *result, SpruceFolderSearch *s)
+{
+	int i;
+	
+	if (argc < 1)
+		search_context_throw (ctx, _("Incorrect argument count in (body-contains )"));
+	
+	for (i = 0; i < argc; i++) {
+		if (argv[i].type != SEARCH_RESULT_STRING)
+			search_context_throw (ctx, _("Incompatable argument types in (body-contains )"));
+	}
+	
+	result->type = SEARCH_RESULT_BOOL;
+	
+	search_lock (s);
+	result->value.bool = body_contains_message (argc, argv, s);
+	search_unlock (s);
+}
+
 static SearchResult *
 body_contains (SearchContext *ctx, int argc, SearchResult **argv, SpruceFolderSearch *s)
 {
-	SearchResult *res;
+	return search_vfunction_call (ctx, (SearchVFunc) body_contains_value, argc, argv, s);
+}
+
+/* called with the search locked */
+static gboolean
+header_contains_message (SpruceFolderSearch *s, const char *header, const char *match)
+{
+	SpruceFolderIndex *index;
+	GMimeMessage *message;
+	gboolean found;
 	
-	/* FIXME: implement me... */
-	res = search_result_new (SEARCH_RESULT_BOOL);
-	res->value.bool = FALSE;
+	index = search_index (s);
 	
-	return res;
+	if (index && spruce_folder_index_has_field (index, s->current->uid, SPRUCE_FOLDER_INDEX_HEADERS)) {
+		if (!spruce_folder_index_may_contain (index, s->current->uid, SPRUCE_FOLDER_INDEX_HEADERS, match))
+			return FALSE;
+		
+		index = NULL;
+	}
+	
+	/* no need to get the whole message (unless we already have it),
+	 * and the folder keeps recently used headers around for us */
+	if (s->message)
+		message = g_object_ref (s->message);
+	else if (!(message = spruce_folder_get_message_headers (s->folder, s->current->uid, NULL)))
+		return FALSE;
+	
+	if (index)
+		search_index_headers (index, s->current->uid, message);
+	
+	if ((header = g_mime_object_get_header ((GMimeObject *) message, header)))
+		found = strstr (header, match) != NULL;
+	else
+		found = FALSE;
+	
+	g_object_unref (message);
+	
+	return found;
 }
 
-static SearchResult *
-header_contains (SearchContext *ctx, int argc, SearchResult **argv, SpruceFolderSearch *s)
+static void
+header_contains_value (SearchContext *ctx, int argc, SearchResult *argv, SearchResult *result, SpruceFolderSearch *s)
 {
-	SearchResult *res;
 	const char *header;
 	const char *match;
 	
 	if (argc != 2)
 		search_context_throw (ctx, _("Incorrect argument count in (header-contains )"));
 	
-	if (argv[0]->type != SEARCH_RESULT_STRING || argv[1]->type != SEARCH_RESULT_STRING)
+	if (argv[0].type != SEARCH_RESULT_STRING || argv[1].type != SEARCH_RESULT_STRING)
 		search_context_throw (ctx, _("Incompatable argument types in (header-contains )"));
 	
-	header = argv[0]->value.string;
-	match = argv[1]->value.string;
+	header = argv[0].value.string;
+	match = argv[1].value.string;
 	
-	res = search_result_new (SEARCH_RESULT_BOOL);
-	res->value.bool = FALSE;
+	result->type = SEARCH_RESULT_BOOL;
+	result->value.bool = FALSE;
 	
 	if (!g_ascii_strcasecmp (header, "From")) {
 		if (s->current->from)
-			res->value.bool = strstr (s->current->from, match) != NULL;
+			result->value.bool = strstr (s->current->from, match) != NULL;
 	} else if (!g_ascii_strcasecmp (header, "To")) {
 		if (s->current->to)
-			res->value.bool = strstr (s->current->to, match) != NULL;
+			result->value.bool = strstr (s->current->to, match) != NULL;
 	} else if (!g_ascii_strcasecmp (header, "Cc")) {
 		if (s->current->cc)
-			res->value.bool = strstr (s->current->cc, match) != NULL;
+			result->value.bool = strstr (s->current->cc, match) != NULL;
 	} else if (!g_ascii_strcasecmp (header, "Subject")) {
 		if (s->current->subject)
-			res->value.bool = strstr (s->current->subject, match) != NULL;
+			result->value.bool = strstr (s->current->subject, match) != NULL;
 	} else {
-		if (!s->message)
-			s->message = spruce_folder_get_message (s->folder, s->current->uid, NULL);
-		
-		if (s->message) {
-			if ((header = g_mime_object_get_header ((GMimeObject *) s->message, header)))
-				res->value.bool = strstr (header, match) != NULL;
-		}
+		search_lock (s);
+		result->value.bool = header_contains_message (s, header, match);
+		search_unlock (s);
 	}
-	
-	return res;
 }
 
 static SearchResult *
-system_flag (SearchContext *ctx, int argc, SearchResult **argv, SpruceFolderSearch *s)
+header_contains (SearchContext *ctx, int argc, SearchResult **argv, SpruceFolderSearch *s)
+{
+	return search_vfunction_call (ctx, (SearchVFunc) header_contains_value, argc, argv, s);
+}
+
+static void
+system_flag_value (SearchContext *ctx, int argc, SearchResult *argv, SearchResult *result, SpruceFolderSearch *s)
 {
-	SearchResult *res;
-	
 	if (argc != 1)
 		search_context_throw (ctx, _("Incorrect argument count in (system-flag )"));
 	
-	if (argv[0]->type != SEARCH_RESULT_STRING)
+	if (argv[0].type != SEARCH_RESULT_STRING)
 		search_context_throw (ctx, _("Incorrect argument type in (system-flag )"));
 	
-	res = search_result_new (SEARCH_RESULT_INT);
-	res->value.integer = spruce_system_flag (argv[0]->value.string);
-	
-	return res;
+	result->type = SEARCH_RESULT_INT;
+	result->value.integer = spruce_system_flag (argv[0].value.string);
 }
 
 static SearchResult *
-sent_date (SearchContext *ctx, int argc, SearchResult **argv, SpruceFolderSearch *s)
+system_flag (SearchContext *ctx, int argc, SearchResult **argv, SpruceFolderSearch *s)
+{
+	return search_vfunction_call (ctx, (SearchVFunc) system_flag_value, argc, argv, s);
+}
+
+static void
+sent_date_value (SearchContext *ctx, int argc, SearchResult *argv, SearchResult *result, SpruceFolderSearch *s)
 {
-	SearchResult *res;
-	
 	if (argc != 0)
 		search_context_throw (ctx, _("Incorrect argument count in (sent-date )"));
 	
-	res = search_result_new (SEARCH_RESULT_TIME);
-	res->value.time = s->current->date_sent;
-	
-	return res;
+	result->type = SEARCH_RESULT_TIME;
+	result->value.time = s->columns ? s->columns->date_sent[s->index] : s->current->date_sent;
 }
 
 static SearchResult *
-received_date (SearchContext *ctx, int argc, SearchResult **argv, SpruceFolderSearch *s)
+sent_date (SearchContext *ctx, int argc, SearchResult **argv, SpruceFolderSearch *s)
+{
+	return search_vfunction_call (ctx, (SearchVFunc) sent_date_value, argc, argv, s);
+}
+
+static void
+received_date_value (SearchContext *ctx, int argc, SearchResult *argv, SearchResult *result, SpruceFolderSearch *s)
 {
-	SearchResult *res;
-	
 	if (argc != 0)
 		search_context_throw (ctx, _("Incorrect argument count in (received-date )"));
 	
-	res = search_result_new (SEARCH_RESULT_TIME);
-	res->value.time = s->current->date_received;
-	
-	return res;
+	result->type = SEARCH_RESULT_TIME;
+	result->value.time = s->columns ? s->columns->date_received[s->index] : s->current->date_received;
 }
 
 static SearchResult *
-current_date (SearchContext *ctx, int argc, SearchResult **argv, SpruceFolderSearch *s)
+received_date (SearchContext *ctx, int argc, SearchResult **argv, SpruceFolderSearch *s)
+{
+	return search_vfunction_call (ctx, (SearchVFunc) received_date_value, argc, argv, s);
+}
+
+static void
+current_date_value (SearchContext *ctx, int argc, SearchResult *argv, SearchResult *result, SpruceFolderSearch *s)
 {
-	SearchResult *res;
-	
 	if (argc != 0)
 		search_context_throw (ctx, _("Incorrect argument count in (current-date )"));
 	
-	res = search_result_new (SEARCH_RESULT_TIME);
-	res->value.time = time (NULL);
-	
-	return res;
+	result->type = SEARCH_RESULT_TIME;
+	result->value.time = time (NULL);
 }
 
 static SearchResult *
-size (SearchContext *ctx, int argc, SearchResult **argv, SpruceFolderSearch *s)
+current_date (SearchContext *ctx, int argc, SearchResult **argv, SpruceFolderSearch *s)
+{
+	return search_vfunction_call (ctx, (SearchVFunc) current_date_value, argc, argv, s);
+}
+
+static void
+size_value (SearchContext *ctx, int argc, SearchResult *argv, SearchResult *result, SpruceFolderSearch *s)
 {
-	SearchResult *res;
-	
 	if (argc != 0)
 		search_context_throw (ctx, _("Incorrect argument count in (size )"));
 	
-	res = search_result_new (SEARCH_RESULT_INT);
-	res->value.integer = s->current->size;
-	
-	return res;
+	result->type = SEARCH_RESULT_INT;
+	result->value.integer = s->columns ? s->columns->size[s->index] : s->current->size;
 }
 
+static SearchResult *
+size (SearchContext *ctx, int argc, SearchResult **argv, SpruceFolderSearch *s)
+{
+	return search_vfunction_call (ctx, (SearchVFunc) size_value, argc, argv, s);
+}
 
 SpruceFolderSearch *
 spruce_folder_search_new (void)
@@ -314,19 +892,30 @@ spruce_folder_search_new (void)
 #define SPRUCE_STRUCT_OFFSET(type, field)  ((int) ((char *) &((type *) 0)->field))
 #endif
 
+/* when a subclass doesn't override a method, its value function
+ * (which doesn't allocate a result) is registered instead */
 struct {
 	char *name;
 	int offset;
 	int flags;
+	void *func;
+	SearchVFunc vfunc;
 } builtins[] = {
-	{ "match-all",       SPRUCE_STRUCT_OFFSET (SpruceFolderSearchClass, match_all),       1 },
-	{ "body-contains",   SPRUCE_STRUCT_OFFSET (SpruceFolderSearchClass, body_contains),   0 },
-	{ "header-contains", SPRUCE_STRUCT_OFFSET (SpruceFolderSearchClass, header_contains), 0 },
-	{ "system-flag",     SPRUCE_STRUCT_OFFSET (SpruceFolderSearchClass, system_flag),     0 },
-	{ "sent-date",       SPRUCE_STRUCT_OFFSET (SpruceFolderSearchClass, sent_date),       0 },
-	{ "received-date",   SPRUCE_STRUCT_OFFSET (SpruceFolderSearchClass, received_date),   0 },
-	{ "current-date",    SPRUCE_STRUCT_OFFSET (SpruceFolderSearchClass, current_date),    0 },
-	{ "size",            SPRUCE_STRUCT_OFFSET (SpruceFolderSearchClass, size),            0 },
+	{ "match-all",       SPRUCE_STRUCT_OFFSET (SpruceFolderSearchClass, match_all),       1, match_all,       NULL },
+	{ "body-contains",   SPRUCE_STRUCT_OFFSET (SpruceFolderSearchClass, body_contains),   0, body_contains,
+	  (SearchVFunc) body_contains_value },
+	{ "header-contains", SPRUCE_STRUCT_OFFSET (SpruceFolderSearchClass, header_contains), 0, header_contains,
+	  (SearchVFunc) header_contains_value },
+	{ "system-flag",     SPRUCE_STRUCT_OFFSET (SpruceFolderSearchClass, system_flag),     0, system_flag,
+	  (SearchVFunc) system_flag_value },
+	{ "sent-date",       SPRUCE_STRUCT_OFFSET (SpruceFolderSearchClass, sent_date),       0, sent_date,
+	  (SearchVFunc) sent_date_value },
+	{ "received-date",   SPRUCE_STRUCT_OFFSET (SpruceFolderSearchClass, received_date),   0, received_date,
+	  (SearchVFunc) received_date_value },
+	{ "current-date",    SPRUCE_STRUCT_OFFSET (SpruceFolderSearchClass, current_date),    0, current_date,
+	  (SearchVFunc) current_date_value },
+	{ "size",            SPRUCE_STRUCT_OFFSET (SpruceFolderSearchClass, size),            0, size,
+	  (SearchVFunc) size_value },
 };
 
 
@@ -344,7 +933,10 @@ spruce_folder_search_construct (SpruceFolderSearch *search)
 	for (i = 0; i < sizeof (builtins) / sizeof (builtins[0]); i++) {
 		func = *((void **)(((char *) klass) + builtins[i].offset));
 		if (func != NULL) {
-			if (builtins[i].flags == 1) {
+			if (func == builtins[i].func && builtins[i].vfunc != NULL) {
+				search_context_add_vfunction (search->sexp, builtins[i].name,
+							      builtins[i].vfunc);
+			} else if (builtins[i].flags == 1) {
 				search_context_add_ifunction (search->sexp, builtins[i].name,
 							      (SearchIFunc) func);
 			} else {
@@ -373,6 +965,36 @@ spruce_folder_search_set_folder (SpruceFolderSearch *search, SpruceFolder *folde
 }
 
 
+/**
+ * spruce_folder_search_set_threads:
+ * @search: a #SpruceFolderSearch
+ * @nthreads: number of threads or %0 to use one per CPU
+ *
+ * Sets the number of threads match-all may use to search large
+ * summaries. Each thread evaluates its share of the messages using
+ * its own clone of the search context; anything which needs to load
+ * the message itself (header-contains on headers not in the summary,
+ * body-contains) is still done one message at a time. Subclasses
+ * which override any of the search methods need to be thread-safe.
+ *
+ * The default is %1 (no threads). Threads are only used if the
+ * GLib thread system has been initialized.
+ **/
+void
+spruce_folder_search_set_threads (SpruceFolderSearch *search, int nthreads)
+{
+	g_return_if_fail (SPRUCE_IS_FOLDER_SEARCH (search));
+	g_return_if_fail (nthreads >= 0);
+	
+#ifdef _SC_NPROCESSORS_ONLN
+	if (nthreads == 0)
+		nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+	
+	search->nthreads = MAX (nthreads, 1);
+}
+
+
 void
 spruce_folder_search_set_summary (SpruceFolderSearch *search, GPtrArray *summary)
 {
@@ -397,6 +1019,7 @@ spruce_folder_search_set_summary (SpruceFolderSearch *search, GPtrArray *summary
 GPtrArray *
 spruce_folder_search_match_all (SpruceFolderSearch *search, const char *expr)
 {
+	SpruceMessageInfo *info;
 	GPtrArray *matches;
 	SearchResult *res;
 	const char *uid;
@@ -406,6 +1029,7 @@ spruce_folder_search_match_all (SpruceFolderSearch *search, const char *expr)
 	g_return_val_if_fail (expr != NULL, NULL);
 	
 	search->current = search->match1 = NULL;
+	search->columns = NULL;
 	
 	if (!search->last_search || strcmp (search->last_search, expr)) {
 		g_free (search->last_search);
@@ -426,7 +1050,14 @@ spruce_folder_search_match_all (SpruceFolderSearch *search, const char *expr)
 	
 	matches = g_ptr_array_new ();
 	
-	if (res->type == SEARCH_RESULT_ARRAY) {
+	if (res->type == SEARCH_RESULT_BITMAP) {
+		i = search_bitmap_next (res->value.bitmap, -1);
+		while (i != -1) {
+			info = search->summary->pdata[i];
+			g_ptr_array_add (matches, g_strdup (info->uid));
+			i = search_bitmap_next (res->value.bitmap, i);
+		}
+	} else if (res->type == SEARCH_RESULT_ARRAY) {
 		for (i = 0; i < res->value.array->len; i++) {
 			uid = res->value.array->pdata[i];
 			g_ptr_array_add (matches, g_strdup (uid));
@@ -462,6 +1093,7 @@ spruce_folder_search_match1 (SpruceFolderSearch *search, const char *expr,
 	}
 	
 	search->current = search->match1 = (SpruceMessageInfo *) info;
+	search->columns = NULL;
 	
 	if (!(res = search_context_run (search->sexp, search))) {
 		search->current = search->match1 = NULL;
@@ -472,6 +1104,8 @@ spruce_folder_search_match1 (SpruceFolderSearch *search, const char *expr,
 	
 	if (res->type == SEARCH_RESULT_BOOL) {
 		matches = res->value.bool;
+	} else if (res->type == SEARCH_RESULT_BITMAP) {
+		matches = search_bitmap_test (res->value.bitmap, 0);
 	} else if (res->type == SEARCH_RESULT_ARRAY) {
 		matches = res->value.array->len == 1;
 	} else
@@ -490,6 +1124,71 @@ spruce_folder_search_match1 (SpruceFolderSearch *search, const char *expr,
 }
 
 
+/**
+ * spruce_folder_search_index_messages:
+ * @search: a #SpruceFolderSearch
+ * @max: the maximum number of messages to index or %-1 for no limit
+ *
+ * Adds the headers and text content of up to @max messages which
+ * haven't been indexed yet to the full-text index of the folder (see
+ * spruce_folder_summary_set_indexed()), so that searches can rule
+ * them out without reading them. The messages come from the summary
+ * set with spruce_folder_search_set_summary().
+ *
+ * This is meant to be called in the background (e.g. from an idle
+ * handler) after messages have been added to an indexed folder,
+ * until it returns %0. The index gets written to disk the next time
+ * the folder summary is saved.
+ *
+ * Returns: the number of messages indexed.
+ **/
+int
+spruce_folder_search_index_messages (SpruceFolderSearch *search, int max)
+{
+	SpruceFolderIndex *index;
+	SpruceMessageInfo *info;
+	GMimeMessage *message;
+	int indexed = 0;
+	BodyScan scan;
+	int i;
+	
+	g_return_val_if_fail (SPRUCE_IS_FOLDER_SEARCH (search), -1);
+	
+	if (!search->summary || !(index = search_index (search)))
+		return 0;
+	
+	scan.patterns = NULL;
+	scan.npatterns = 0;
+	scan.found = FALSE;
+	scan.maxlen = 0;
+	scan.index = index;
+	
+	for (i = 0; i < search->summary->len && (max < 0 || indexed < max); i++) {
+		info = search->summary->pdata[i];
+		
+		if (spruce_folder_index_has_field (index, info->uid, SPRUCE_FOLDER_INDEX_BODY))
+			continue;
+		
+		/* only the text parts need to be read */
+		if (!(message = spruce_folder_get_message_lazy (search->folder, info->uid, NULL)))
+			continue;
+		
+		if (!spruce_folder_index_has_field (index, info->uid, SPRUCE_FOLDER_INDEX_HEADERS))
+			search_index_headers (index, info->uid, message);
+		
+		spruce_folder_index_begin (index, info->uid, SPRUCE_FOLDER_INDEX_BODY);
+		if (message->mime_part)
+			body_object_match (message->mime_part, &scan);
+		spruce_folder_index_end (index);
+		
+		g_object_unref (message);
+		indexed++;
+	}
+	
+	return indexed;
+}
+
+
 void
 spruce_folder_search_free_result (SpruceFolderSearch *search, GPtrArray *uids)
 {
@@ -50,6 +50,16 @@ struct _SpruceFolderSearch {
 	SpruceMessageInfo *current;
 	SpruceMessageInfo *match1;
 	GMimeMessage *message;
+	
+	/* set while match-all scans the folder summary itself */
+	const SpruceSummaryColumns *columns;
+	int index;
+	
+	/* parallel match-all */
+	SpruceFolderSearch *parent;
+	GPtrArray *workers;
+	GMutex *lock;
+	int nthreads;
 };
 
 struct _SpruceFolderSearchClass {
@@ -90,11 +100,15 @@ void spruce_folder_search_construct (SpruceFolderSearch *search);
 void spruce_folder_search_set_folder (SpruceFolderSearch *search, SpruceFolder *folder);
 void spruce_folder_search_set_summary (SpruceFolderSearch *search, GPtrArray *summary);
 
+void spruce_folder_search_set_threads (SpruceFolderSearch *search, int nthreads);
+
 GPtrArray *spruce_folder_search_match_all (SpruceFolderSearch *search, const char *expr);
 
 gboolean spruce_folder_search_match1 (SpruceFolderSearch *search, const char *expr,
 				      const SpruceMessageInfo *info);
 
+int spruce_folder_search_index_messages (SpruceFolderSearch *search, int max);
+
 void spruce_folder_search_free_result (SpruceFolderSearch *search, GPtrArray *uids);
 
 G_END_DECLS
@@ -25,14 +25,17 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 
 #include <gmime/gmime-utils.h>
 #include <gmime/gmime-multipart.h>
 #include <gmime/gmime-multipart-signed.h>
 #include <gmime/gmime-multipart-encrypted.h>
 #include <gmime/gmime-stream-fs.h>
+#include <gmime/gmime-stream-mem.h>
 #include <gmime/gmime-stream-null.h>
 #include <gmime/gmime-stream-buffer.h>
 
@@ -40,8 +43,103 @@
 #include "spruce-file-utils.h"
 
 
+/* The mmap'able summary format:
+ *
+ * [magic] [format] [header-len] [count] [record-size] [strings-len] [reserved]
+ * [header as written by header_save(), padded to a 4-byte boundary]
+ * [count fixed-size records as written by message_info_save_record()]
+ * [string table]
+ * [md5sum of everything preceding it] [magic]
+ *
+ * All integers are in network byte order. Strings are stored as
+ * offsets into the string table and are used in place once the file
+ * has been mapped. The string table always begins and ends with a
+ * nul-byte so any in-bounds offset is a terminated string (offset 0
+ * is the empty string). */
+#define SUMMARY_MAP_MAGIC         "SpruceSm"
+#define SUMMARY_MAP_MAGIC_LEN     8
+#define SUMMARY_MAP_FORMAT        3
+#define SUMMARY_MAP_HEADER_SIZE   (SUMMARY_MAP_MAGIC_LEN + 24)
+#define SUMMARY_MAP_HEADER_MAX    4096
+#define SUMMARY_MAP_DIGEST_LEN    16
+#define SUMMARY_MAP_TRAILER_SIZE  (SUMMARY_MAP_DIGEST_LEN + SUMMARY_MAP_MAGIC_LEN)
+
+#define summary_map_pad(len) (((len) + 3) & ~3)
+
+typedef struct {
+	unsigned char *base;
+	size_t len;
+} SummaryMap;
+
+/* an interned message-info string, referenced once per field using it */
+typedef struct {
+	guint ref_count;
+	char str[1];
+} SummaryString;
+
+/* The summary journal is an append-only log of changes made since
+ * the summary file was last written in full:
+ *
+ * [magic] [version] [summary inode] [summary size] [summary mtime]
+ * followed by any number of [op] [payload-len] [payload] entries.
+ * An ADD entry carries a complete message-info record and replaces
+ * any existing message-info with the same uid.
+ *
+ * The summary file's identity is recorded so that a journal left
+ * behind by a crash between saving the summary and removing the
+ * journal is never replayed onto a summary that already contains its
+ * changes. */
+#define SUMMARY_JOURNAL_MAGIC      "SpruceJl"
+#define SUMMARY_JOURNAL_MAGIC_LEN  8
+#define SUMMARY_JOURNAL_HEADER_LEN (SUMMARY_JOURNAL_MAGIC_LEN + 16)
+#define SUMMARY_JOURNAL_THRESHOLD  (512 * 1024)
+
+enum {
+	SUMMARY_JOURNAL_ADD    = 1,
+	SUMMARY_JOURNAL_REMOVE = 2,
+	SUMMARY_JOURNAL_HEADER = 3,
+};
+
+struct _SpruceSummaryRecord {
+	/* decoder state */
+	const unsigned char *inptr;
+	const unsigned char *inend;
+	const char *strings;
+	guint32 strings_len;
+	
+	/* encoder state */
+	GByteArray *records;
+	GByteArray *table;
+	GHashTable *offsets;
+};
+
 struct _SpruceFolderSummaryPrivate {
 	char *filename;
+	
+	/* mmap'd summary files backing message-info strings - like
+	 * the string pool, these are released once the last
+	 * message-info is freed since message-infos may outlive an
+	 * unload */
+	GSList *maps;
+	
+	/* interned message-info strings (not uids, which are unique
+	 * anyway) mapped to their SummaryString, each released when
+	 * the last message-info field using it is freed */
+	GHashTable *strings;
+	volatile gint live_infos;
+	
+	/* rebuilt on demand whenever the message-infos have changed */
+	SpruceSummaryColumns columns;
+	gboolean columns_valid;
+	
+	/* the journal may only be appended to while it (along with
+	 * the summary file) accounts for every change made so far */
+	gboolean journal_valid;
+	size_t journal_size;
+	int journal_fd;
+	
+	/* full-text index, only if enabled */
+	SpruceFolderIndex *index;
 };
 
 static void spruce_folder_summary_class_init (SpruceFolderSummaryClass *klass);
@@ -60,11 +158,26 @@ static SpruceMessageInfo *message_info_new_from_message (SpruceFolderSummary *su
 static SpruceMessageInfo *message_info_load (SpruceFolderSummary *summary, GMimeStream *stream);
 static int message_info_save (SpruceFolderSummary *summary, GMimeStream *stream, SpruceMessageInfo *info);
 static void message_info_free (SpruceFolderSummary *summary, SpruceMessageInfo *info);
+static SpruceMessageInfo *message_info_load_record (SpruceFolderSummary *summary, SpruceSummaryRecord *record);
+static int message_info_save_record (SpruceFolderSummary *summary, SpruceSummaryRecord *record, SpruceMessageInfo *info);
+static char *summary_string_intern (SpruceFolderSummary *summary, const char *string);
+static void summary_string_adopt (SpruceFolderSummary *summary, char **string);
+static void summary_string_pool_free (SpruceFolderSummary *summary);
+static void summary_string_free (SpruceFolderSummary *summary, char *string);
+static void summary_maps_free (SpruceFolderSummary *summary);
 static char *next_uid_string (SpruceFolderSummary *summary);
+static void summary_index_open (SpruceFolderSummary *summary, gboolean create);
+static int summary_journal_header_save (SpruceFolderSummary *summary);
+static void summary_journal_close (SpruceFolderSummary *summary);
+static void summary_journal_invalidate (SpruceFolderSummary *summary);
 
 
 static GObjectClass *parent_class = NULL;
 
+/* guards the string pools, since search threads may drop the last
+ * reference on a message-info and with it the pooled strings */
+G_LOCK_DEFINE_STATIC (strings);
+
 
 GType
 spruce_folder_summary_get_type (void)
@@ -111,6 +224,8 @@ spruce_folder_summary_class_init (SpruceFolderSummaryClass *klass)
 	klass->message_info_load = message_info_load;
 	klass->message_info_save = message_info_save;
 	klass->message_info_free = message_info_free;
+	klass->message_info_load_record = message_info_load_record;
+	klass->message_info_save_record = message_info_save_record;
 	klass->next_uid_string = next_uid_string;
 }
 
@@ -119,6 +234,15 @@ spruce_folder_summary_init (SpruceFolderSummary *summary, SpruceFolderSummaryCla
 {
 	summary->priv = g_new (struct _SpruceFolderSummaryPrivate, 1);
 	summary->priv->filename = NULL;
+	summary->priv->maps = NULL;
+	summary->priv->strings = NULL;
+	summary->priv->live_infos = 0;
+	memset (&summary->priv->columns, 0, sizeof (SpruceSummaryColumns));
+	summary->priv->columns_valid = FALSE;
+	summary->priv->journal_valid = FALSE;
+	summary->priv->journal_size = 0;
+	summary->priv->journal_fd = -1;
+	summary->priv->index = NULL;
 	
 	summary->version = 0;
 	summary->flags = 0;
@@ -144,6 +268,21 @@ spruce_folder_summary_finalize (GObject *object)
 	g_ptr_array_free (summary->messages, TRUE);
 	g_hash_table_destroy (summary->messages_hash);
 	
+	summary_maps_free (summary);
+	summary_string_pool_free (summary);
+	
+	g_free (summary->priv->columns.flags);
+	g_free (summary->priv->columns.date_sent);
+	g_free (summary->priv->columns.date_received);
+	g_free (summary->priv->columns.size);
+	g_free (summary->priv->columns.message_id);
+	
+	if (summary->priv->journal_fd != -1)
+		close (summary->priv->journal_fd);
+	
+	if (summary->priv->index)
+		spruce_folder_index_free (summary->priv->index);
+	
 	g_free (summary->priv->filename);
 	g_free (summary->priv);
 	
@@ -191,15 +330,89 @@ spruce_folder_summary_get_filename (SpruceFolderSummary *summary)
  * @summary: a #SpruceFolderSummary
  * @filename: filename
  *
- * Sets the summary filename.
+ * Sets the summary filename. The journal and index files kept next
+ * to the summary file are expected to be found next to @filename
+ * from now on; use spruce_folder_summary_rename() to move the files
+ * along with it.
  **/
 void
 spruce_folder_summary_set_filename (SpruceFolderSummary *summary, const char *filename)
 {
+	char *path;
+	
 	g_return_if_fail (SPRUCE_IS_FOLDER_SUMMARY (summary));
 	
 	g_free (summary->priv->filename);
 	summary->priv->filename = g_strdup (filename);
+	
+	/* the journal gets reopened by path on the next append */
+	summary_journal_close (summary);
+	
+	/* the index lives next to the summary file */
+	if (summary->priv->index) {
+		path = g_strdup_printf ("%s.index", filename);
+		spruce_folder_index_set_filename (summary->priv->index, path);
+		g_free (path);
+	}
+}
+
+
+/**
+ * spruce_folder_summary_rename:
+ * @summary: a #SpruceFolderSummary
+ * @filename: new filename
+ *
+ * Moves the summary file, along with its journal and index, to
+ * @filename and sets the summary filename. If the summary is loaded,
+ * it is saved in full first so that nothing is left in the journal.
+ *
+ * Any of the files which cannot be moved is deleted instead so that
+ * it can't get picked up by a later summary at the old location.
+ *
+ * Returns: %0 on success or %-1 if any of the files had to be deleted.
+ **/
+int
+spruce_folder_summary_rename (SpruceFolderSummary *summary, const char *filename)
+{
+	static const char *suffixes[] = { "", ".journal", ".index" };
+	char *oldpath, *newpath;
+	int ret = 0;
+	guint i;
+	
+	g_return_val_if_fail (SPRUCE_IS_FOLDER_SUMMARY (summary), -1);
+	g_return_val_if_fail (filename != NULL, -1);
+	
+	if (summary->priv->filename == NULL) {
+		spruce_folder_summary_set_filename (summary, filename);
+		return 0;
+	}
+	
+	if (summary->loaded) {
+		/* bypass the journal so that all of the changes end up
+		 * in the summary file itself */
+		summary_journal_invalidate (summary);
+		summary->dirty = TRUE;
+	}
+	
+	spruce_folder_summary_save (summary);
+	summary_journal_close (summary);
+	
+	for (i = 0; i < G_N_ELEMENTS (suffixes); i++) {
+		oldpath = g_strdup_printf ("%s%s", summary->priv->filename, suffixes[i]);
+		newpath = g_strdup_printf ("%s%s", filename, suffixes[i]);
+		
+		if (rename (oldpath, newpath) == -1 && errno != ENOENT) {
+			unlink (oldpath);
+			ret = -1;
+		}
+		
+		g_free (oldpath);
+		g_free (newpath);
+	}
+	
+	spruce_folder_summary_set_filename (summary, filename);
+	
+	return ret;
 }
 
 
@@ -290,6 +503,64 @@ header_load (SpruceFolderSummary *summary, GMimeStream *stream)
 }
 
 
+static guint32
+summary_map_get_uint32 (const unsigned char *inptr)
+{
+	return ((guint32) inptr[0] << 24) | ((guint32) inptr[1] << 16) |
+		((guint32) inptr[2] << 8) | (guint32) inptr[3];
+}
+
+static void
+summary_map_put_uint32 (unsigned char *outptr, guint32 value)
+{
+	outptr[0] = (value >> 24) & 0xff;
+	outptr[1] = (value >> 16) & 0xff;
+	outptr[2] = (value >> 8) & 0xff;
+	outptr[3] = value & 0xff;
+}
+
+static gboolean
+summary_map_check (int fd)
+{
+	char magic[SUMMARY_MAP_MAGIC_LEN];
+	ssize_t n;
+	
+	n = spruce_read (fd, magic, SUMMARY_MAP_MAGIC_LEN);
+	lseek (fd, 0, SEEK_SET);
+	
+	return n == SUMMARY_MAP_MAGIC_LEN && !memcmp (magic, SUMMARY_MAP_MAGIC, SUMMARY_MAP_MAGIC_LEN);
+}
+
+static int
+summary_map_header_load (SpruceFolderSummary *summary, int fd)
+{
+	unsigned char header[SUMMARY_MAP_HEADER_SIZE];
+	GMimeStream *stream;
+	guint32 header_len;
+	char *buf;
+	int ret;
+	
+	if (spruce_read (fd, (char *) header, SUMMARY_MAP_HEADER_SIZE) != SUMMARY_MAP_HEADER_SIZE)
+		return -1;
+	
+	if (summary_map_get_uint32 (header + 8) != SUMMARY_MAP_FORMAT)
+		return -1;
+	
+	if ((header_len = summary_map_get_uint32 (header + 12)) > SUMMARY_MAP_HEADER_MAX)
+		return -1;
+	
+	buf = g_alloca (header_len);
+	if (spruce_read (fd, buf, header_len) != (ssize_t) header_len)
+		return -1;
+	
+	stream = g_mime_stream_mem_new_with_buffer (buf, header_len);
+	ret = SPRUCE_FOLDER_SUMMARY_GET_CLASS (summary)->header_load (summary, stream);
+	g_object_unref (stream);
+	
+	return ret;
+}
+
+
 /**
  * spruce_folder_summary_header_load:
  * @summary: a #SpruceFolderSummary
@@ -310,6 +581,13 @@ spruce_folder_summary_header_load (SpruceFolderSummary *summary)
 	if ((fd = open (summary->priv->filename, O_RDONLY)) == -1)
 		return -1;
 	
+	if (summary_map_check (fd)) {
+		ret = summary_map_header_load (summary, fd);
+		close (fd);
+		
+		return ret;
+	}
+	
 	stream = g_mime_stream_fs_new (fd);
 	buffered = g_mime_stream_buffer_new (stream, GMIME_STREAM_BUFFER_BLOCK_READ);
 	g_object_unref (stream);
@@ -326,6 +604,7 @@ static int
 header_save (SpruceFolderSummary *summary, GMimeStream *stream)
 {
 	guint32 i, count, unread = 0, deleted = 0;
+	const SpruceSummaryColumns *columns;
 	
 	summary->timestamp = time (NULL);
 	
@@ -341,21 +620,12 @@ header_save (SpruceFolderSummary *summary, GMimeStream *stream)
 	if (spruce_file_util_encode_time_t (stream, summary->timestamp) == -1)
 		return -1;
 	
-	count = spruce_folder_summary_count (summary);
+	columns = spruce_folder_summary_get_columns (summary);
+	count = columns->len;
+	
 	for (i = 0; i < count; i++) {
-		SpruceMessageInfo *info;
-		
-		if (!(info = spruce_folder_summary_index (summary, i))) {
-			count--;
-			continue;
-		}
-		
-		if ((info->flags & SPRUCE_MESSAGE_SEEN) == 0)
-			unread++;
-		if ((info->flags & SPRUCE_MESSAGE_DELETED) == 0)
-			deleted++;
-		
-		spruce_folder_summary_info_unref (summary, info);
+		unread += (columns->flags[i] & SPRUCE_MESSAGE_SEEN) == 0;
+		deleted += (columns->flags[i] & SPRUCE_MESSAGE_DELETED) == 0;
 	}
 	
 	if (spruce_file_util_encode_uint32 (stream, count) == -1)
@@ -377,6 +647,10 @@ header_save (SpruceFolderSummary *summary, GMimeStream *stream)
  *
  * Saves the summary header to disk.
  *
+ * Note: the header of an mmap'able summary file is covered by its
+ * checksum, so in that case the whole summary is saved if it is
+ * loaded, otherwise the header is logged to the summary journal.
+ *
  * Returns: %0 on success or %-1 on fail.
  **/
 int
@@ -388,9 +662,18 @@ spruce_folder_summary_header_save (SpruceFolderSummary *summary)
 	g_return_val_if_fail (SPRUCE_IS_FOLDER_SUMMARY (summary), -1);
 	g_return_val_if_fail (summary->priv->filename != NULL, -1);
 	
-	if ((fd = open (summary->priv->filename, O_WRONLY | O_CREAT, 0666)) == -1)
+	if ((fd = open (summary->priv->filename, O_RDWR | O_CREAT, 0666)) == -1)
 		return -1;
 	
+	if (summary_map_check (fd)) {
+		close (fd);
+		
+		if (!summary->loaded)
+			return summary_journal_header_save (summary);
+		
+		return SPRUCE_FOLDER_SUMMARY_GET_CLASS (summary)->summary_save (summary);
+	}
+	
 	stream = g_mime_stream_fs_new (fd);
 	buffered = g_mime_stream_buffer_new (stream, GMIME_STREAM_BUFFER_BLOCK_READ);
 	g_object_unref (stream);
@@ -441,6 +724,14 @@ message_info_load (SpruceFolderSummary *summary, GMimeStream *stream)
 	if (spruce_file_util_decode_string (stream, &info->uid) == -1)
 		goto exception;
 	
+	summary_string_adopt (summary, &info->sender);
+	summary_string_adopt (summary, &info->from);
+	summary_string_adopt (summary, &info->reply_to);
+	summary_string_adopt (summary, &info->to);
+	summary_string_adopt (summary, &info->cc);
+	summary_string_adopt (summary, &info->bcc);
+	summary_string_adopt (summary, &info->subject);
+	
 	/* decode Message-Id */
 	if (spruce_file_util_decode_uint32 (stream, &info->message_id.id.part.hi) == -1)
 		goto exception;
@@ -515,165 +806,1250 @@ message_info_load (SpruceFolderSummary *summary, GMimeStream *stream)
 }
 
 
-static int
-summary_load (SpruceFolderSummary *summary)
+/**
+ * spruce_summary_record_encode_uint32:
+ * @record: a #SpruceSummaryRecord
+ * @value: value to encode
+ *
+ * Appends @value to the record being encoded.
+ *
+ * Returns: %0 on success or %-1 on fail.
+ **/
+int
+spruce_summary_record_encode_uint32 (SpruceSummaryRecord *record, guint32 value)
 {
-	return -1;
+	unsigned char buf[4];
+	
+	summary_map_put_uint32 (buf, value);
+	g_byte_array_append (record->records, buf, 4);
+	
+	return 0;
 }
 
 
 /**
- * spruce_folder_summary_load:
- * @summary: a #SpruceFolderSummary
+ * spruce_summary_record_decode_uint32:
+ * @record: a #SpruceSummaryRecord
+ * @value: return location for the decoded value
  *
- * Loads the summary from disk.
+ * Decodes the next 32bit value from the record.
  *
  * Returns: %0 on success or %-1 on fail.
  **/
 int
-spruce_folder_summary_load (SpruceFolderSummary *summary)
+spruce_summary_record_decode_uint32 (SpruceSummaryRecord *record, guint32 *value)
 {
-	GMimeStream *stream, *buffered;
-	SpruceMessageInfo *info;
-	guint32 i = 0;
-	int ret, fd;
+	if (record->inend - record->inptr < 4)
+		return -1;
 	
-	g_return_val_if_fail (SPRUCE_IS_FOLDER_SUMMARY (summary), -1);
-	g_return_val_if_fail (summary->priv->filename != NULL, -1);
+	*value = summary_map_get_uint32 (record->inptr);
+	record->inptr += 4;
 	
-	if (summary->loaded)
-		return 0;
+	return 0;
+}
+
+
+/**
+ * spruce_summary_record_encode_int64:
+ * @record: a #SpruceSummaryRecord
+ * @value: value to encode
+ *
+ * Appends @value to the record being encoded.
+ *
+ * Returns: %0 on success or %-1 on fail.
+ **/
+int
+spruce_summary_record_encode_int64 (SpruceSummaryRecord *record, gint64 value)
+{
+	guint64 v = (guint64) value;
 	
-	/* we first try to load the summary file... */
-	if ((fd = open (summary->priv->filename, O_RDONLY)) == -1)
-		goto reload;
+	spruce_summary_record_encode_uint32 (record, (guint32) (v >> 32));
+	spruce_summary_record_encode_uint32 (record, (guint32) (v & 0xffffffff));
 	
-	stream = g_mime_stream_fs_new (fd);
-	buffered = g_mime_stream_buffer_new (stream, GMIME_STREAM_BUFFER_BLOCK_READ);
-	g_object_unref (stream);
+	return 0;
+}
+
+
+/**
+ * spruce_summary_record_decode_int64:
+ * @record: a #SpruceSummaryRecord
+ * @value: return location for the decoded value
+ *
+ * Decodes the next 64bit value from the record.
+ *
+ * Returns: %0 on success or %-1 on fail.
+ **/
+int
+spruce_summary_record_decode_int64 (SpruceSummaryRecord *record, gint64 *value)
+{
+	guint32 hi, lo;
 	
-	ret = SPRUCE_FOLDER_SUMMARY_GET_CLASS (summary)->header_load (summary, buffered);
+	if (spruce_summary_record_decode_uint32 (record, &hi) == -1)
+		return -1;
 	
-	while (ret != -1 && i < summary->count) {
-		if ((info = SPRUCE_FOLDER_SUMMARY_GET_CLASS (summary)->message_info_load (summary, buffered))) {
-			g_ptr_array_add (summary->messages, info);
-			g_hash_table_insert (summary->messages_hash, info->uid, info);
-		} else
-			ret = -1;
-		
-		i++;
-	}
+	if (spruce_summary_record_decode_uint32 (record, &lo) == -1)
+		return -1;
 	
-	g_object_unref (buffered);
+	*value = (gint64) (((guint64) hi << 32) | lo);
 	
-	if (ret == -1) {
-	reload:
-		/* loading the summary file failed, time to do it the hard way */
-		spruce_folder_summary_clear (summary);
-		ret = SPRUCE_FOLDER_SUMMARY_GET_CLASS (summary)->summary_load (summary);
-	}
+	return 0;
+}
+
+
+static int
+summary_record_add_data (SpruceSummaryRecord *record, const void *data, size_t len, guint32 *offset)
+{
+	if ((guint64) record->table->len + len > G_MAXUINT32)
+		return -1;
 	
-	if (ret == 0)
-		summary->loaded = TRUE;
+	*offset = record->table->len;
+	g_byte_array_append (record->table, data, len);
 	
-	return ret;
+	return 0;
 }
 
 
-static int
-message_info_save (SpruceFolderSummary *summary, GMimeStream *stream, SpruceMessageInfo *info)
+/**
+ * spruce_summary_record_encode_string:
+ * @record: a #SpruceSummaryRecord
+ * @value: string to encode
+ *
+ * Adds @value to the string table (if it isn't already there) and
+ * appends its offset to the record being encoded.
+ *
+ * Returns: %0 on success or %-1 on fail.
+ **/
+int
+spruce_summary_record_encode_string (SpruceSummaryRecord *record, const char *value)
 {
-	guint32 i, count = 0;
-	SpruceFlag *flag;
-	SpruceTag *tag;
+	guint32 offset;
 	
-	if (spruce_file_util_encode_string (stream, info->sender) == -1)
-		return -1;
+	if (value == NULL || *value == '\0')
+		return spruce_summary_record_encode_uint32 (record, 0);
 	
-	if (spruce_file_util_encode_string (stream, info->from) == -1)
-		return -1;
+	if (!(offset = GPOINTER_TO_UINT (g_hash_table_lookup (record->offsets, value)))) {
+		if (summary_record_add_data (record, value, strlen (value) + 1, &offset) == -1)
+			return -1;
+		
+		g_hash_table_insert (record->offsets, (char *) value, GUINT_TO_POINTER (offset));
+	}
 	
-	if (spruce_file_util_encode_string (stream, info->reply_to) == -1)
-		return -1;
+	return spruce_summary_record_encode_uint32 (record, offset);
+}
+
+
+/**
+ * spruce_summary_record_decode_string:
+ * @record: a #SpruceSummaryRecord
+ * @value: return location for the decoded string
+ *
+ * Decodes the next string from the record. The string points into
+ * the mapped summary file and must not be freed by the caller.
+ *
+ * Returns: %0 on success or %-1 on fail.
+ **/
+int
+spruce_summary_record_decode_string (SpruceSummaryRecord *record, char **value)
+{
+	guint32 offset;
 	
-	if (spruce_file_util_encode_string (stream, info->to) == -1)
+	if (spruce_summary_record_decode_uint32 (record, &offset) == -1)
 		return -1;
 	
-	if (spruce_file_util_encode_string (stream, info->cc) == -1)
+	if (offset >= record->strings_len)
 		return -1;
 	
-	if (spruce_file_util_encode_string (stream, info->bcc) == -1)
-		return -1;
+	*value = (char *) record->strings + offset;
+	
+	return 0;
+}
+
+
+static SpruceMessageInfo *
+message_info_load_record (SpruceFolderSummary *summary, SpruceSummaryRecord *record)
+{
+	guint32 count, offset, i;
+	SpruceMessageInfo *info;
+	const char *inptr;
+	gint64 date, size;
+	char *name;
+	
+	info = spruce_folder_summary_info_new (summary);
+	
+	if (spruce_summary_record_decode_string (record, &info->sender) == -1)
+		goto exception;
+	
+	if (spruce_summary_record_decode_string (record, &info->from) == -1)
+		goto exception;
+	
+	if (spruce_summary_record_decode_string (record, &info->reply_to) == -1)
+		goto exception;
+	
+	if (spruce_summary_record_decode_string (record, &info->to) == -1)
+		goto exception;
+	
+	if (spruce_summary_record_decode_string (record, &info->cc) == -1)
+		goto exception;
+	
+	if (spruce_summary_record_decode_string (record, &info->bcc) == -1)
+		goto exception;
+	
+	if (spruce_summary_record_decode_string (record, &info->subject) == -1)
+		goto exception;
+	
+	if (spruce_summary_record_decode_int64 (record, &date) == -1)
+		goto exception;
+	info->date_sent = (time_t) date;
+	
+	if (spruce_summary_record_decode_int64 (record, &date) == -1)
+		goto exception;
+	info->date_received = (time_t) date;
+	
+	if (spruce_summary_record_decode_string (record, &info->uid) == -1)
+		goto exception;
+	
+	/* decode Message-Id */
+	if (spruce_summary_record_decode_uint32 (record, &info->message_id.id.part.hi) == -1)
+		goto exception;
+	if (spruce_summary_record_decode_uint32 (record, &info->message_id.id.part.lo) == -1)
+		goto exception;
+	
+	/* decode References (count, offset) */
+	if (spruce_summary_record_decode_uint32 (record, &count) == -1)
+		goto exception;
+	if (spruce_summary_record_decode_uint32 (record, &offset) == -1)
+		goto exception;
+	if (count > 0) {
+		if ((guint64) offset + (guint64) count * 8 > record->strings_len)
+			goto exception;
+		
+		info->references = g_try_malloc (sizeof (SpruceSummaryReferences) + sizeof (SpruceSummaryMessageID) * (count - 1));
+		if (info->references == NULL)
+			goto exception;
+		
+		info->references->count = count;
+		inptr = record->strings + offset;
+		for (i = 0; i < count; i++, inptr += 8) {
+			info->references->references[i].id.part.hi = summary_map_get_uint32 ((unsigned char *) inptr);
+			info->references->references[i].id.part.lo = summary_map_get_uint32 ((unsigned char *) inptr + 4);
+		}
+	}
+	
+	if (spruce_summary_record_decode_uint32 (record, &info->flags) == -1)
+		goto exception;
+	
+	if (spruce_summary_record_decode_int64 (record, &size) == -1 || size < 0)
+		goto exception;
+	info->size = (size_t) size;
+	
+	if (spruce_summary_record_decode_uint32 (record, &info->lines) == -1)
+		goto exception;
+	
+	/* decode user flags (count, offset of consecutive names) */
+	if (spruce_summary_record_decode_uint32 (record, &count) == -1)
+		goto exception;
+	if (spruce_summary_record_decode_uint32 (record, &offset) == -1)
+		goto exception;
+	for (i = 0; i < count; i++) {
+		if (offset >= record->strings_len)
+			goto exception;
+		
+		name = (char *) record->strings + offset;
+		offset += strlen (name) + 1;
+		
+		spruce_flag_set (&info->user_flags, name, TRUE);
+	}
+	
+	/* decode user tags (count, offset of consecutive name/value pairs) */
+	if (spruce_summary_record_decode_uint32 (record, &count) == -1)
+		goto exception;
+	if (spruce_summary_record_decode_uint32 (record, &offset) == -1)
+		goto exception;
+	for (i = 0; i < count; i++) {
+		if (offset >= record->strings_len)
+			goto exception;
+		
+		name = (char *) record->strings + offset;
+		offset += strlen (name) + 1;
+		
+		if (offset >= record->strings_len)
+			goto exception;
+		
+		inptr = record->strings + offset;
+		offset += strlen (inptr) + 1;
+		
+		spruce_tag_set (&info->user_tags, name, inptr);
+	}
+	
+	return info;
+	
+ exception:
+	
+	spruce_folder_summary_info_unref (summary, info);
+	
+	return NULL;
+}
+
+
+static int
+summary_load (SpruceFolderSummary *summary)
+{
+	return -1;
+}
+
+
+static int
+summary_map_load (SpruceFolderSummary *summary, int fd)
+{
+	SpruceFolderSummaryClass *klass = SPRUCE_FOLDER_SUMMARY_GET_CLASS (summary);
+	guint32 header_len, count, record_size, strings_len, i;
+	unsigned char digest[SUMMARY_MAP_DIGEST_LEN];
+	size_t records_offset, strings_offset;
+	gsize len = SUMMARY_MAP_DIGEST_LEN;
+	SpruceSummaryRecord record;
+	SpruceMessageInfo *info;
+	unsigned char *inptr;
+	GChecksum *checksum;
+	GMimeStream *stream;
+	SummaryMap *map;
+	struct stat st;
+	guint64 size;
+	void *base;
+	int ret;
+	
+	if (fstat (fd, &st) == -1 || st.st_size < SUMMARY_MAP_HEADER_SIZE + SUMMARY_MAP_TRAILER_SIZE)
+		return -1;
+	
+	/* map it privately so that stray writes to in-place strings
+	 * never make it back to disk */
+	base = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED)
+		return -1;
+	
+	inptr = base;
+	
+	header_len = summary_map_get_uint32 (inptr + 12);
+	count = summary_map_get_uint32 (inptr + 16);
+	record_size = summary_map_get_uint32 (inptr + 20);
+	strings_len = summary_map_get_uint32 (inptr + 24);
+	
+	records_offset = SUMMARY_MAP_HEADER_SIZE + summary_map_pad ((guint64) header_len);
+	size = records_offset + ((guint64) count * record_size);
+	strings_offset = size;
+	size += (guint64) strings_len + SUMMARY_MAP_TRAILER_SIZE;
+	
+	if (memcmp (inptr, SUMMARY_MAP_MAGIC, SUMMARY_MAP_MAGIC_LEN) != 0 ||
+	    summary_map_get_uint32 (inptr + 8) != SUMMARY_MAP_FORMAT ||
+	    size != (guint64) st.st_size || strings_len == 0)
+		goto exception;
+	
+	if (memcmp (inptr + st.st_size - SUMMARY_MAP_MAGIC_LEN, SUMMARY_MAP_MAGIC, SUMMARY_MAP_MAGIC_LEN) != 0)
+		goto exception;
+	
+	/* validate the tail checksum, which covers the string table too
+	 * since only the offsets into it get bounds-checked */
+	checksum = g_checksum_new (G_CHECKSUM_MD5);
+	g_checksum_update (checksum, inptr, strings_offset + strings_len);
+	g_checksum_get_digest (checksum, digest, &len);
+	g_checksum_free (checksum);
+	
+	if (memcmp (inptr + strings_offset + strings_len, digest, SUMMARY_MAP_DIGEST_LEN) != 0)
+		goto exception;
+	
+	if (inptr[strings_offset] != '\0' || inptr[strings_offset + strings_len - 1] != '\0')
+		goto exception;
+	
+	/* the header itself is still decoded by the stream-based vfunc */
+	stream = g_mime_stream_mem_new_with_buffer ((char *) inptr + SUMMARY_MAP_HEADER_SIZE, header_len);
+	ret = klass->header_load (summary, stream);
+	g_object_unref (stream);
+	
+	if (ret == -1 || summary->count != count)
+		goto exception;
+	
+	map = g_new (SummaryMap, 1);
+	map->base = base;
+	map->len = st.st_size;
+	summary->priv->maps = g_slist_prepend (summary->priv->maps, map);
+	
+	record.strings = (char *) inptr + strings_offset;
+	record.strings_len = strings_len;
+	
+	for (i = 0, inptr += records_offset; i < count; i++, inptr += record_size) {
+		record.inptr = inptr;
+		record.inend = inptr + record_size;
+		
+		if (!(info = klass->message_info_load_record (summary, &record))) {
+			/* nothing else can hold a ref on these yet, so
+			 * this normally unmaps the file as well */
+			spruce_folder_summary_clear (summary);
+			
+			if (!g_slist_find (summary->priv->maps, map))
+				return -1;
+			
+			summary->priv->maps = g_slist_remove (summary->priv->maps, map);
+			g_free (map);
+			goto exception;
+		}
+		
+		g_ptr_array_add (summary->messages, info);
+		g_hash_table_insert (summary->messages_hash, info->uid, info);
+	}
+	
+	return 0;
+	
+ exception:
+	
+	munmap (base, st.st_size);
+	
+	return -1;
+}
+
+
+static char *
+summary_journal_filename (SpruceFolderSummary *summary)
+{
+	return g_strdup_printf ("%s.journal", summary->priv->filename);
+}
+
+static void
+summary_journal_close (SpruceFolderSummary *summary)
+{
+	if (summary->priv->journal_fd != -1) {
+		close (summary->priv->journal_fd);
+		summary->priv->journal_fd = -1;
+	}
+}
+
+static void
+summary_journal_invalidate (SpruceFolderSummary *summary)
+{
+	summary_journal_close (summary);
+	summary->priv->journal_valid = FALSE;
+}
+
+static void
+summary_journal_reset (SpruceFolderSummary *summary)
+{
+	char *path;
+	
+	summary_journal_close (summary);
+	
+	path = summary_journal_filename (summary);
+	if (unlink (path) == -1 && errno != ENOENT) {
+		summary->priv->journal_valid = FALSE;
+	} else {
+		summary->priv->journal_valid = TRUE;
+		summary->priv->journal_size = 0;
+	}
+	
+	g_free (path);
+}
+
+static int
+summary_journal_open (SpruceFolderSummary *summary)
+{
+	unsigned char header[SUMMARY_JOURNAL_HEADER_LEN];
+	struct stat st;
+	char *path;
+	int fd;
+	
+	if (summary->priv->journal_fd != -1)
+		return 0;
+	
+	if (!summary->priv->journal_valid)
+		return -1;
+	
+	path = summary_journal_filename (summary);
+	
+	if ((fd = open (path, O_WRONLY | O_APPEND)) == -1) {
+		/* start a new journal against the current summary file */
+		if (errno != ENOENT || stat (summary->priv->filename, &st) == -1)
+			goto exception;
+		
+		if ((fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666)) == -1)
+			goto exception;
+		
+		memcpy (header, SUMMARY_JOURNAL_MAGIC, SUMMARY_JOURNAL_MAGIC_LEN);
+		summary_map_put_uint32 (header + 8, summary->version);
+		summary_map_put_uint32 (header + 12, (guint32) st.st_ino);
+		summary_map_put_uint32 (header + 16, (guint32) st.st_size);
+		summary_map_put_uint32 (header + 20, (guint32) st.st_mtime);
+		
+		if (spruce_write (fd, (char *) header, SUMMARY_JOURNAL_HEADER_LEN) == -1) {
+			close (fd);
+			unlink (path);
+			goto exception;
+		}
+		
+		summary->priv->journal_size = SUMMARY_JOURNAL_HEADER_LEN;
+	}
+	
+	summary->priv->journal_fd = fd;
+	g_free (path);
+	
+	return 0;
+	
+ exception:
+	
+	summary->priv->journal_valid = FALSE;
+	g_free (path);
+	
+	return -1;
+}
+
+static GMimeStream *
+summary_journal_entry_new (guint32 op)
+{
+	GMimeStream *entry;
+	
+	entry = g_mime_stream_mem_new ();
+	spruce_file_util_encode_uint32 (entry, op);
+	spruce_file_util_encode_uint32 (entry, 0);
+	
+	return entry;
+}
+
+static int
+summary_journal_entry_append (SpruceFolderSummary *summary, GMimeStream *entry)
+{
+	GByteArray *array;
+	
+	array = g_mime_stream_mem_get_byte_array ((GMimeStreamMem *) entry);
+	
+	/* fill in the payload length */
+	summary_map_put_uint32 (array->data + 4, array->len - 8);
+	
+	if (summary_journal_open (summary) == -1)
+		return -1;
+	
+	if (spruce_write (summary->priv->journal_fd, (char *) array->data, array->len) == -1) {
+		summary_journal_invalidate (summary);
+		return -1;
+	}
+	
+	summary->priv->journal_size += array->len;
+	
+	return 0;
+}
+
+static void
+summary_journal_info (SpruceFolderSummary *summary, SpruceMessageInfo *info)
+{
+	GMimeStream *entry;
+	
+	if (!summary->loaded || !summary->priv->journal_valid)
+		return;
+	
+	entry = summary_journal_entry_new (SUMMARY_JOURNAL_ADD);
+	
+	if (SPRUCE_FOLDER_SUMMARY_GET_CLASS (summary)->message_info_save (summary, entry, info) == -1)
+		summary_journal_invalidate (summary);
+	else
+		summary_journal_entry_append (summary, entry);
+	
+	g_object_unref (entry);
+}
+
+static void
+summary_journal_remove (SpruceFolderSummary *summary, SpruceMessageInfo *info)
+{
+	GMimeStream *entry;
+	
+	if (!summary->loaded || !summary->priv->journal_valid)
+		return;
+	
+	entry = summary_journal_entry_new (SUMMARY_JOURNAL_REMOVE);
+	spruce_file_util_encode_string (entry, info->uid);
+	summary_journal_entry_append (summary, entry);
+	g_object_unref (entry);
+}
+
+static int
+summary_journal_commit (SpruceFolderSummary *summary)
+{
+	GMimeStream *entry;
+	time_t timestamp;
+	int ret;
+	
+	if (!summary->priv->journal_valid || summary->priv->journal_size > SUMMARY_JOURNAL_THRESHOLD)
+		return -1;
+	
+	/* the timestamp always refers to the summary file itself
+	 * (providers compare it against their backing store) */
+	timestamp = summary->timestamp;
+	entry = summary_journal_entry_new (SUMMARY_JOURNAL_HEADER);
+	ret = SPRUCE_FOLDER_SUMMARY_GET_CLASS (summary)->header_save (summary, entry);
+	summary->timestamp = timestamp;
+	
+	if (ret != -1)
+		ret = summary_journal_entry_append (summary, entry);
+	
+	g_object_unref (entry);
+	
+	if (ret == -1 || fsync (summary->priv->journal_fd) == -1) {
+		summary_journal_invalidate (summary);
+		return -1;
+	}
+	
+	return 0;
+}
+
+/* maps each message-info to its index so that replaying the journal
+ * doesn't have to search the array for every replaced entry */
+static GHashTable *
+summary_journal_positions (SpruceFolderSummary *summary)
+{
+	GHashTable *positions;
+	guint i;
+	
+	positions = g_hash_table_new (g_direct_hash, g_direct_equal);
+	for (i = 0; i < summary->messages->len; i++)
+		g_hash_table_insert (positions, summary->messages->pdata[i], GUINT_TO_POINTER (i));
+	
+	return positions;
+}
+
+/* drops the holes left by removals */
+static void
+summary_journal_compact (SpruceFolderSummary *summary)
+{
+	guint i, n = 0;
+	
+	for (i = 0; i < summary->messages->len; i++) {
+		if (summary->messages->pdata[i] != NULL)
+			summary->messages->pdata[n++] = summary->messages->pdata[i];
+	}
+	
+	g_ptr_array_set_size (summary->messages, n);
+}
+
+static int
+summary_journal_apply (SpruceFolderSummary *summary, guint32 op, GMimeStream *stream, GHashTable **positions)
+{
+	SpruceFolderSummaryClass *klass = SPRUCE_FOLDER_SUMMARY_GET_CLASS (summary);
+	SpruceMessageInfo *info, *old;
+	time_t timestamp;
+	gpointer index;
+	char *uid;
+	int ret;
+	
+	switch (op) {
+	case SUMMARY_JOURNAL_ADD:
+		if (!(info = klass->message_info_load (summary, stream)))
+			return -1;
+		
+		if ((old = g_hash_table_lookup (summary->messages_hash, info->uid))) {
+			/* replace the old message-info in place */
+			if (*positions == NULL)
+				*positions = summary_journal_positions (summary);
+			
+			index = g_hash_table_lookup (*positions, old);
+			g_hash_table_remove (*positions, old);
+			g_hash_table_insert (*positions, info, index);
+			
+			g_hash_table_remove (summary->messages_hash, old->uid);
+			summary->messages->pdata[GPOINTER_TO_UINT (index)] = info;
+			spruce_folder_summary_info_unref (summary, old);
+		} else {
+			if (*positions != NULL)
+				g_hash_table_insert (*positions, info, GUINT_TO_POINTER (summary->messages->len));
+			
+			g_ptr_array_add (summary->messages, info);
+		}
+		
+		g_hash_table_insert (summary->messages_hash, info->uid, info);
+		break;
+	case SUMMARY_JOURNAL_REMOVE:
+		if (spruce_file_util_decode_string (stream, &uid) == -1)
+			return -1;
+		
+		if ((info = g_hash_table_lookup (summary->messages_hash, uid))) {
+			if (*positions == NULL)
+				*positions = summary_journal_positions (summary);
+			
+			/* leave a hole so that the other positions stay
+			 * valid, summary_journal_replay() compacts them */
+			index = g_hash_table_lookup (*positions, info);
+			g_hash_table_remove (*positions, info);
+			summary->messages->pdata[GPOINTER_TO_UINT (index)] = NULL;
+			
+			g_hash_table_remove (summary->messages_hash, info->uid);
+			spruce_folder_summary_info_unref (summary, info);
+		}
+		
+		g_free (uid);
+		break;
+	case SUMMARY_JOURNAL_HEADER:
+		timestamp = summary->timestamp;
+		ret = klass->header_load (summary, stream);
+		summary->timestamp = timestamp;
+		
+		return ret;
+	default:
+		return -1;
+	}
+	
+	return 0;
+}
+
+/* checks that a journal header refers to the current summary file */
+static gboolean
+summary_journal_matches (SpruceFolderSummary *summary, const unsigned char *header)
+{
+	struct stat st;
+	
+	return memcmp (header, SUMMARY_JOURNAL_MAGIC, SUMMARY_JOURNAL_MAGIC_LEN) == 0 &&
+		summary_map_get_uint32 (header + 8) == summary->version &&
+		stat (summary->priv->filename, &st) == 0 &&
+		summary_map_get_uint32 (header + 12) == (guint32) st.st_ino &&
+		summary_map_get_uint32 (header + 16) == (guint32) st.st_size &&
+		summary_map_get_uint32 (header + 20) == (guint32) st.st_mtime;
+}
+
+/* logs the header of a summary that isn't loaded to the journal so
+ * that it gets applied on top of the summary file by the next load */
+static int
+summary_journal_header_save (SpruceFolderSummary *summary)
+{
+	unsigned char header[SUMMARY_JOURNAL_HEADER_LEN];
+	char *path;
+	int fd, ret;
+	
+	/* anything appended to a journal left over from an older
+	 * summary file would be thrown away along with it on load */
+	path = summary_journal_filename (summary);
+	if ((fd = open (path, O_RDONLY)) != -1) {
+		if (spruce_read (fd, (char *) header, SUMMARY_JOURNAL_HEADER_LEN) != SUMMARY_JOURNAL_HEADER_LEN ||
+		    !summary_journal_matches (summary, header))
+			unlink (path);
+		
+		close (fd);
+	}
+	
+	g_free (path);
+	
+	summary->priv->journal_valid = TRUE;
+	summary->priv->journal_size = 0;
+	
+	ret = summary_journal_commit (summary);
+	
+	/* the journal gets revalidated when the summary is loaded */
+	summary_journal_invalidate (summary);
+	
+	return ret;
+}
+
+static void
+summary_journal_replay (SpruceFolderSummary *summary)
+{
+	unsigned char header[SUMMARY_JOURNAL_HEADER_LEN];
+	GMimeStream *stream, *buffered, *entry;
+	GHashTable *positions = NULL;
+	size_t size, jsize;
+	guint32 op, len;
+	struct stat st;
+	char *path, *buf;
+	int fd;
+	
+	path = summary_journal_filename (summary);
+	
+	if ((fd = open (path, O_RDONLY)) == -1) {
+		summary->priv->journal_valid = errno == ENOENT;
+		summary->priv->journal_size = 0;
+		g_free (path);
+		return;
+	}
+	
+	jsize = fstat (fd, &st) == 0 ? st.st_size : 0;
+	
+	stream = g_mime_stream_fs_new (fd);
+	buffered = g_mime_stream_buffer_new (stream, GMIME_STREAM_BUFFER_BLOCK_READ);
+	g_object_unref (stream);
+	
+	/* make sure this journal belongs to the summary file we loaded */
+	if (g_mime_stream_read (buffered, (char *) header, SUMMARY_JOURNAL_HEADER_LEN) != SUMMARY_JOURNAL_HEADER_LEN ||
+	    !summary_journal_matches (summary, header)) {
+		g_object_unref (buffered);
+		summary_journal_reset (summary);
+		g_free (path);
+		return;
+	}
+	
+	size = SUMMARY_JOURNAL_HEADER_LEN;
+	
+	while (spruce_file_util_decode_uint32 (buffered, &op) != -1) {
+		if (spruce_file_util_decode_uint32 (buffered, &len) == -1)
+			goto torn;
+		
+		if (len > jsize - size - 8 || !(buf = g_try_malloc (len + 1)))
+			goto torn;
+		
+		if (g_mime_stream_read (buffered, buf, len) != (ssize_t) len) {
+			g_free (buf);
+			goto torn;
+		}
+		
+		entry = g_mime_stream_mem_new_with_buffer (buf, len);
+		g_free (buf);
+		
+		if (summary_journal_apply (summary, op, entry, &positions) == -1) {
+			g_object_unref (entry);
+			goto torn;
+		}
+		
+		g_object_unref (entry);
+		size += len + 8;
+	}
+	
+	if (positions != NULL) {
+		g_hash_table_destroy (positions);
+		summary_journal_compact (summary);
+	}
+	
+	g_object_unref (buffered);
+	g_free (path);
+	
+	summary->priv->journal_valid = TRUE;
+	summary->priv->journal_size = size;
+	
+	return;
+	
+ torn:
+	
+	/* a partially written entry at the tail (or a corrupt one);
+	 * keep what was replayed so far and force a full save */
+	if (positions != NULL) {
+		g_hash_table_destroy (positions);
+		summary_journal_compact (summary);
+	}
+	
+	g_object_unref (buffered);
+	g_free (path);
+	
+	summary->priv->journal_valid = FALSE;
+	summary->dirty = TRUE;
+}
+
+
+/**
+ * spruce_folder_summary_load:
+ * @summary: a #SpruceFolderSummary
+ *
+ * Loads the summary from disk.
+ *
+ * Returns: %0 on success or %-1 on fail.
+ **/
+int
+spruce_folder_summary_load (SpruceFolderSummary *summary)
+{
+	GMimeStream *stream, *buffered;
+	SpruceMessageInfo *info;
+	guint32 i = 0;
+	int ret, fd;
+	
+	g_return_val_if_fail (SPRUCE_IS_FOLDER_SUMMARY (summary), -1);
+	g_return_val_if_fail (summary->priv->filename != NULL, -1);
+	
+	if (summary->loaded)
+		return 0;
+	
+	summary->priv->columns_valid = FALSE;
+	
+	/* the index is enabled for as long as its file exists */
+	if (!summary->priv->index)
+		summary_index_open (summary, FALSE);
+	
+	/* we first try to load the summary file... */
+	if ((fd = open (summary->priv->filename, O_RDONLY)) == -1)
+		goto reload;
+	
+	if (summary_map_check (fd)) {
+		ret = summary_map_load (summary, fd);
+		close (fd);
+		
+		if (ret == -1)
+			goto reload;
+		
+		summary_journal_replay (summary);
+		summary->loaded = TRUE;
+		
+		return 0;
+	}
+	
+	/* an old-style summary file, it'll get upgraded on the next save */
+	stream = g_mime_stream_fs_new (fd);
+	buffered = g_mime_stream_buffer_new (stream, GMIME_STREAM_BUFFER_BLOCK_READ);
+	g_object_unref (stream);
+	
+	ret = SPRUCE_FOLDER_SUMMARY_GET_CLASS (summary)->header_load (summary, buffered);
+	
+	while (ret != -1 && i < summary->count) {
+		if ((info = SPRUCE_FOLDER_SUMMARY_GET_CLASS (summary)->message_info_load (summary, buffered))) {
+			g_ptr_array_add (summary->messages, info);
+			g_hash_table_insert (summary->messages_hash, info->uid, info);
+		} else
+			ret = -1;
+		
+		i++;
+	}
+	
+	g_object_unref (buffered);
+	
+	if (ret == 0) {
+		summary_journal_replay (summary);
+		summary->priv->journal_valid = FALSE;
+		summary->dirty = TRUE;
+	}
+	
+	if (ret == -1) {
+	reload:
+		/* loading the summary file failed, time to do it the hard way */
+		summary_journal_reset (summary);
+		spruce_folder_summary_clear (summary);
+		ret = SPRUCE_FOLDER_SUMMARY_GET_CLASS (summary)->summary_load (summary);
+	}
+	
+	if (ret == 0)
+		summary->loaded = TRUE;
+	
+	return ret;
+}
+
+
+static int
+message_info_save (SpruceFolderSummary *summary, GMimeStream *stream, SpruceMessageInfo *info)
+{
+	guint32 i, count = 0;
+	SpruceFlag *flag;
+	SpruceTag *tag;
+	
+	if (spruce_file_util_encode_string (stream, info->sender) == -1)
+		return -1;
+	
+	if (spruce_file_util_encode_string (stream, info->from) == -1)
+		return -1;
+	
+	if (spruce_file_util_encode_string (stream, info->reply_to) == -1)
+		return -1;
+	
+	if (spruce_file_util_encode_string (stream, info->to) == -1)
+		return -1;
+	
+	if (spruce_file_util_encode_string (stream, info->cc) == -1)
+		return -1;
+	
+	if (spruce_file_util_encode_string (stream, info->bcc) == -1)
+		return -1;
+	
+	if (spruce_file_util_encode_string (stream, info->subject) == -1)
+		return -1;
+	
+	if (spruce_file_util_encode_time_t (stream, info->date_sent) == -1)
+		return -1;
+	
+	if (spruce_file_util_encode_time_t (stream, info->date_received) == -1)
+		return -1;
+	
+	if (spruce_file_util_encode_string (stream, info->uid) == -1)
+		return -1;
+	
+	/* encode Message-Id */
+	if (spruce_file_util_encode_uint32 (stream, info->message_id.id.part.hi) == -1)
+		return -1;
+	if (spruce_file_util_encode_uint32 (stream, info->message_id.id.part.lo) == -1)
+		return -1;
+	
+	/* encode References */
+	if (info->references)
+		count = info->references->count;
+	if (spruce_file_util_encode_uint32 (stream, count) == -1)
+		return -1;
+	for (i = 0; i < count; i++) {
+		if (spruce_file_util_encode_uint32 (stream, info->references->references[i].id.part.hi) == -1)
+			return -1;
+		if (spruce_file_util_encode_uint32 (stream, info->references->references[i].id.part.lo) == -1)
+			return -1;
+	}
+	
+	if (spruce_file_util_encode_uint32 (stream, info->flags) == -1)
+		return -1;
+	
+	if (spruce_file_util_encode_size_t (stream, info->size) == -1)
+		return -1;
+	
+	if (spruce_file_util_encode_uint32 (stream, info->lines) == -1)
+		return -1;
+	
+	/* encode user flags */
+	count = spruce_flag_list_size (&info->user_flags);
+	if (spruce_file_util_encode_uint32 (stream, count) == -1)
+		return -1;
+	flag = info->user_flags;
+	while (flag != NULL) {
+		if (spruce_file_util_encode_string (stream, flag->name) == -1)
+			return -1;
+		flag = flag->next;
+	}
+	
+	/* encode user tags */
+	count = spruce_tag_list_size (&info->user_tags);
+	if (spruce_file_util_encode_uint32 (stream, count) == -1)
+		return -1;
+	tag = info->user_tags;
+	while (tag != NULL) {
+		if (spruce_file_util_encode_string (stream, tag->name) == -1)
+			return -1;
+		if (spruce_file_util_encode_string (stream, tag->value) == -1)
+			return -1;
+		tag = tag->next;
+	}
+	
+	return 0;
+}
+
+
+static int
+message_info_save_record (SpruceFolderSummary *summary, SpruceSummaryRecord *record, SpruceMessageInfo *info)
+{
+	guint32 offset = 0, count = 0, added, i;
+	const char *value;
+	unsigned char *buf;
+	SpruceFlag *flag;
+	SpruceTag *tag;
+	int ret;
+	
+	if (spruce_summary_record_encode_string (record, info->sender) == -1)
+		return -1;
+	
+	if (spruce_summary_record_encode_string (record, info->from) == -1)
+		return -1;
+	
+	if (spruce_summary_record_encode_string (record, info->reply_to) == -1)
+		return -1;
+	
+	if (spruce_summary_record_encode_string (record, info->to) == -1)
+		return -1;
+	
+	if (spruce_summary_record_encode_string (record, info->cc) == -1)
+		return -1;
+	
+	if (spruce_summary_record_encode_string (record, info->bcc) == -1)
+		return -1;
+	
+	if (spruce_summary_record_encode_string (record, info->subject) == -1)
+		return -1;
+	
+	if (spruce_summary_record_encode_int64 (record, (gint64) info->date_sent) == -1)
+		return -1;
+	
+	if (spruce_summary_record_encode_int64 (record, (gint64) info->date_received) == -1)
+		return -1;
+	
+	if (spruce_summary_record_encode_string (record, info->uid) == -1)
+		return -1;
+	
+	/* encode Message-Id */
+	if (spruce_summary_record_encode_uint32 (record, info->message_id.id.part.hi) == -1)
+		return -1;
+	if (spruce_summary_record_encode_uint32 (record, info->message_id.id.part.lo) == -1)
+		return -1;
+	
+	/* encode References (count, offset) */
+	if (info->references && info->references->count > 0) {
+		count = info->references->count;
+		buf = g_malloc (count * 8);
+		for (i = 0; i < count; i++) {
+			summary_map_put_uint32 (buf + (i * 8), info->references->references[i].id.part.hi);
+			summary_map_put_uint32 (buf + (i * 8) + 4, info->references->references[i].id.part.lo);
+		}
+		
+		ret = summary_record_add_data (record, buf, count * 8, &offset);
+		g_free (buf);
+		
+		if (ret == -1)
+			return -1;
+	}
+	
+	if (spruce_summary_record_encode_uint32 (record, count) == -1)
+		return -1;
+	if (spruce_summary_record_encode_uint32 (record, offset) == -1)
+		return -1;
+	
+	if (spruce_summary_record_encode_uint32 (record, info->flags) == -1)
+		return -1;
+	
+	if (spruce_summary_record_encode_int64 (record, (gint64) info->size) == -1)
+		return -1;
+	
+	if (spruce_summary_record_encode_uint32 (record, info->lines) == -1)
+		return -1;
+	
+	/* encode user flags (count, offset of consecutive names) */
+	count = 0;
+	offset = record->table->len;
+	for (flag = info->user_flags; flag != NULL; flag = flag->next, count++) {
+		if (summary_record_add_data (record, flag->name, strlen (flag->name) + 1, &added) == -1)
+			return -1;
+	}
+	
+	if (spruce_summary_record_encode_uint32 (record, count) == -1)
+		return -1;
+	if (spruce_summary_record_encode_uint32 (record, count ? offset : 0) == -1)
+		return -1;
+	
+	/* encode user tags (count, offset of consecutive name/value pairs) */
+	count = 0;
+	offset = record->table->len;
+	for (tag = info->user_tags; tag != NULL; tag = tag->next, count++) {
+		value = tag->value ? tag->value : "";
+		
+		if (summary_record_add_data (record, tag->name, strlen (tag->name) + 1, &added) == -1)
+			return -1;
+		if (summary_record_add_data (record, value, strlen (value) + 1, &added) == -1)
+			return -1;
+	}
+	
+	if (spruce_summary_record_encode_uint32 (record, count) == -1)
+		return -1;
+	if (spruce_summary_record_encode_uint32 (record, count ? offset : 0) == -1)
+		return -1;
+	
+	return 0;
+}
+
+
+static int
+summary_map_write (int fd, GChecksum *checksum, const unsigned char *buf, size_t len)
+{
+	if (len == 0)
+		return 0;
+	
+	if (checksum != NULL)
+		g_checksum_update (checksum, buf, len);
+	
+	if (spruce_write (fd, (const char *) buf, len) == -1)
+		return -1;
+	
+	return 0;
+}
+
+static int
+summary_map_save (SpruceFolderSummary *summary)
+{
+	SpruceFolderSummaryClass *klass = SPRUCE_FOLDER_SUMMARY_GET_CLASS (summary);
+	static const unsigned char padding[4] = { 0, 0, 0, 0 };
+	unsigned char header[SUMMARY_MAP_HEADER_SIZE];
+	unsigned char digest[SUMMARY_MAP_DIGEST_LEN];
+	gsize len = SUMMARY_MAP_DIGEST_LEN;
+	guint32 record_size = 0, n, i;
+	SpruceSummaryRecord record;
+	GByteArray *header_data;
+	GChecksum *checksum;
+	GMimeStream *stream;
+	char *tmpname;
+	int ret = -1;
+	int fd;
+	
+	memset (&record, 0, sizeof (record));
+	record.records = g_byte_array_new ();
+	record.table = g_byte_array_new ();
+	record.offsets = g_hash_table_new (g_str_hash, g_str_equal);
+	
+	/* offset 0 is reserved for NULL and empty strings */
+	g_byte_array_append (record.table, padding, 1);
+	
+	stream = g_mime_stream_mem_new ();
+	if (klass->header_save (summary, stream) == -1)
+		goto exception;
+	
+	header_data = g_mime_stream_mem_get_byte_array ((GMimeStreamMem *) stream);
+	if (header_data->len > SUMMARY_MAP_HEADER_MAX)
+		goto exception;
+	
+	for (i = 0; i < summary->messages->len; i++) {
+		n = record.records->len;
+		
+		if (klass->message_info_save_record (summary, &record, summary->messages->pdata[i]) == -1)
+			goto exception;
+		
+		/* every record has to be the same size */
+		if (i == 0)
+			record_size = record.records->len - n;
+		else if (record.records->len - n != record_size)
+			goto exception;
+	}
+	
+	if (record.table->data[record.table->len - 1] != '\0')
+		g_byte_array_append (record.table, padding, 1);
+	
+	memcpy (header, SUMMARY_MAP_MAGIC, SUMMARY_MAP_MAGIC_LEN);
+	summary_map_put_uint32 (header + 8, SUMMARY_MAP_FORMAT);
+	summary_map_put_uint32 (header + 12, header_data->len);
+	summary_map_put_uint32 (header + 16, summary->messages->len);
+	summary_map_put_uint32 (header + 20, record_size);
+	summary_map_put_uint32 (header + 24, record.table->len);
+	summary_map_put_uint32 (header + 28, 0);
+	
+	/* write to a temp file and rename it into place so that a
+	 * failed save never leaves a truncated summary behind */
+	tmpname = g_strdup_printf ("%s.tmp", summary->priv->filename);
+	if ((fd = open (tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) {
+		g_free (tmpname);
+		goto exception;
+	}
+	
+	checksum = g_checksum_new (G_CHECKSUM_MD5);
+	
+	if (summary_map_write (fd, checksum, header, SUMMARY_MAP_HEADER_SIZE) == -1 ||
+	    summary_map_write (fd, checksum, header_data->data, header_data->len) == -1 ||
+	    summary_map_write (fd, checksum, padding, summary_map_pad (header_data->len) - header_data->len) == -1 ||
+	    summary_map_write (fd, checksum, record.records->data, record.records->len) == -1 ||
+	    summary_map_write (fd, checksum, record.table->data, record.table->len) == -1)
+		goto fail;
+	
+	g_checksum_get_digest (checksum, digest, &len);
 	
-	if (spruce_file_util_encode_string (stream, info->subject) == -1)
-		return -1;
+	if (summary_map_write (fd, NULL, digest, SUMMARY_MAP_DIGEST_LEN) == -1 ||
+	    summary_map_write (fd, NULL, (unsigned char *) SUMMARY_MAP_MAGIC, SUMMARY_MAP_MAGIC_LEN) == -1)
+		goto fail;
 	
-	if (spruce_file_util_encode_time_t (stream, info->date_sent) == -1)
-		return -1;
+	if (close (fd) == -1) {
+		fd = -1;
+		goto fail;
+	}
 	
-	if (spruce_file_util_encode_time_t (stream, info->date_received) == -1)
-		return -1;
+	fd = -1;
 	
-	if (spruce_file_util_encode_string (stream, info->uid) == -1)
-		return -1;
+	if (rename (tmpname, summary->priv->filename) == -1)
+		goto fail;
 	
-	/* encode Message-Id */
-	if (spruce_file_util_encode_uint32 (stream, info->message_id.id.part.hi) == -1)
-		return -1;
-	if (spruce_file_util_encode_uint32 (stream, info->message_id.id.part.lo) == -1)
-		return -1;
+	ret = 0;
 	
-	/* encode References */
-	if (info->references)
-		count = info->references->count;
-	if (spruce_file_util_encode_uint32 (stream, count) == -1)
-		return -1;
-	for (i = 0; i < count; i++) {
-		if (spruce_file_util_encode_uint32 (stream, info->references->references[i].id.part.hi) == -1)
-			return -1;
-		if (spruce_file_util_encode_uint32 (stream, info->references->references[i].id.part.lo) == -1)
-			return -1;
-	}
+ fail:
 	
-	if (spruce_file_util_encode_uint32 (stream, info->flags) == -1)
-		return -1;
+	g_checksum_free (checksum);
 	
-	if (spruce_file_util_encode_size_t (stream, info->size) == -1)
-		return -1;
+	if (fd != -1)
+		close (fd);
 	
-	if (spruce_file_util_encode_uint32 (stream, info->lines) == -1)
-		return -1;
+	if (ret == -1)
+		unlink (tmpname);
 	
-	/* encode user flags */
-	count = spruce_flag_list_size (&info->user_flags);
-	if (spruce_file_util_encode_uint32 (stream, count) == -1)
-		return -1;
-	flag = info->user_flags;
-	while (flag != NULL) {
-		if (spruce_file_util_encode_string (stream, flag->name) == -1)
-			return -1;
-		flag = flag->next;
-	}
+	g_free (tmpname);
 	
-	/* encode user tags */
-	count = spruce_tag_list_size (&info->user_tags);
-	if (spruce_file_util_encode_uint32 (stream, count) == -1)
-		return -1;
-	tag = info->user_tags;
-	while (tag != NULL) {
-		if (spruce_file_util_encode_string (stream, tag->name) == -1)
-			return -1;
-		if (spruce_file_util_encode_string (stream, tag->value) == -1)
-			return -1;
-		tag = tag->next;
-	}
+ exception:
 	
-	return 0;
+	g_hash_table_destroy (record.offsets);
+	g_byte_array_free (record.records, TRUE);
+	g_byte_array_free (record.table, TRUE);
+	g_object_unref (stream);
+	
+	return ret;
 }
 
-
 static int
-summary_save (SpruceFolderSummary *summary)
+summary_stream_save (SpruceFolderSummary *summary)
 {
 	GMimeStream *stream, *buffered;
 	SpruceMessageInfo *info;
@@ -701,6 +2077,24 @@ summary_save (SpruceFolderSummary *summary)
 	return ret;
 }
 
+static int
+summary_save (SpruceFolderSummary *summary)
+{
+	/* if everything that changed since the last full save is in
+	 * the journal, committing it is all that's needed */
+	if (summary_journal_commit (summary) == 0)
+		return 0;
+	
+	/* try the mmap'able format first, falling back to the old
+	 * stream format for summaries with variable-sized records */
+	if (summary_map_save (summary) == -1 && summary_stream_save (summary) == -1)
+		return -1;
+	
+	summary_journal_reset (summary);
+	
+	return 0;
+}
+
 
 /**
  * spruce_folder_summary_save:
@@ -716,6 +2110,10 @@ spruce_folder_summary_save (SpruceFolderSummary *summary)
 	g_return_val_if_fail (SPRUCE_IS_FOLDER_SUMMARY (summary), -1);
 	g_return_val_if_fail (summary->priv->filename != NULL, -1);
 	
+	/* searches update the index without touching the summary */
+	if (summary->priv->index && spruce_folder_index_save (summary->priv->index) == -1)
+		return -1;
+	
 	if (!summary->loaded || !summary->dirty)
 		return 0;
 	
@@ -731,6 +2129,14 @@ spruce_folder_summary_save (SpruceFolderSummary *summary)
 static int
 summary_unload (SpruceFolderSummary *summary)
 {
+	/* only the in-memory copy of the index goes away, the next
+	 * load reopens it from disk */
+	if (summary->priv->index) {
+		spruce_folder_index_save (summary->priv->index);
+		spruce_folder_index_free (summary->priv->index);
+		summary->priv->index = NULL;
+	}
+	
 	spruce_folder_summary_clear (summary);
 	
 	return 0;
@@ -781,6 +2187,8 @@ spruce_folder_summary_reload (SpruceFolderSummary *summary)
 	if (unlink (summary->priv->filename) == -1)
 		return -1;
 	
+	summary_journal_reset (summary);
+	
 	return spruce_folder_summary_load (summary);
 }
 
@@ -789,15 +2197,46 @@ spruce_folder_summary_reload (SpruceFolderSummary *summary)
  * spruce_folder_summary_touch:
  * @summary: a #SpruceFolderSummary
  *
- * Sets the dirty bit on a loaded summary.
+ * Sets the dirty bit on a loaded summary. Since there is no way of
+ * knowing what changed, the next save will rewrite the summary in
+ * full. Use spruce_folder_summary_touch_info() instead when only a
+ * single message-info was modified.
  **/
 void
 spruce_folder_summary_touch (SpruceFolderSummary *summary)
 {
 	g_return_if_fail (SPRUCE_IS_FOLDER_SUMMARY (summary));
 	
-	if (summary->loaded)
+	summary->priv->columns_valid = FALSE;
+	
+	if (summary->loaded) {
+		summary_journal_invalidate (summary);
+		summary->dirty = TRUE;
+	}
+}
+
+
+/**
+ * spruce_folder_summary_touch_info:
+ * @summary: a #SpruceFolderSummary
+ * @info: a #SpruceMessageInfo belonging to @summary
+ *
+ * Sets the dirty bit on a loaded summary after @info has been
+ * modified (e.g. its flags were changed), logging the new state of
+ * @info to the summary journal.
+ **/
+void
+spruce_folder_summary_touch_info (SpruceFolderSummary *summary, SpruceMessageInfo *info)
+{
+	g_return_if_fail (SPRUCE_IS_FOLDER_SUMMARY (summary));
+	g_return_if_fail (info != NULL);
+	
+	summary->priv->columns_valid = FALSE;
+	
+	if (summary->loaded) {
+		summary_journal_info (summary, info);
 		summary->dirty = TRUE;
+	}
 }
 
 
@@ -813,13 +2252,22 @@ summary_add (SpruceFolderSummary *summary, SpruceMessageInfo *info)
 		}
 		
 		g_warning ("trying to add a new message-info with clashing uid");
-		g_free (info->uid);
+		summary_string_free (summary, info->uid);
 		info->uid = NULL;
 	}
 	
 	if (info->uid == NULL)
 		info->uid = spruce_folder_summary_uid_string (summary);
 	
+	/* move the strings into the pool */
+	summary_string_adopt (summary, &info->sender);
+	summary_string_adopt (summary, &info->from);
+	summary_string_adopt (summary, &info->reply_to);
+	summary_string_adopt (summary, &info->to);
+	summary_string_adopt (summary, &info->cc);
+	summary_string_adopt (summary, &info->bcc);
+	summary_string_adopt (summary, &info->subject);
+	
 	g_hash_table_insert (summary->messages_hash, info->uid, info);
 	g_ptr_array_add (summary->messages, info);
 }
@@ -839,7 +2287,12 @@ spruce_folder_summary_add (SpruceFolderSummary *summary, SpruceMessageInfo *info
 	g_return_if_fail (info != NULL);
 	
 	SPRUCE_FOLDER_SUMMARY_GET_CLASS (summary)->add (summary, info);
+	summary_journal_info (summary, info);
 	
+	if (summary->priv->index)
+		spruce_folder_index_add (summary->priv->index, info->uid);
+	
+	summary->priv->columns_valid = FALSE;
 	summary->dirty = TRUE;
 }
 
@@ -852,6 +2305,8 @@ message_info_new (SpruceFolderSummary *summary)
 	info = g_slice_alloc0 (summary->message_info_size);
 	info->ref_count = 1;
 	
+	g_atomic_int_inc (&summary->priv->live_infos);
+	
 	return info;
 }
 
@@ -925,25 +2380,28 @@ message_info_new_from_message (SpruceFolderSummary *summary, GMimeMessage *messa
 	info = SPRUCE_FOLDER_SUMMARY_GET_CLASS (summary)->message_info_new (summary);
 	
 	string = g_mime_object_get_header ((GMimeObject *) message, "Sender");
-	info->sender = g_strdup (string);
+	info->sender = summary_string_intern (summary, string);
 	
 	string = g_mime_message_get_sender (message);
-	info->from = g_strdup (string);
+	info->from = summary_string_intern (summary, string);
 	
 	string = g_mime_message_get_reply_to (message);
-	info->reply_to = g_strdup (string);
+	info->reply_to = summary_string_intern (summary, string);
 	
 	ia = g_mime_message_get_recipients (message, GMIME_RECIPIENT_TYPE_TO);
 	info->to = internet_address_list_to_string (ia, FALSE);
+	summary_string_adopt (summary, &info->to);
 	
 	ia = g_mime_message_get_recipients (message, GMIME_RECIPIENT_TYPE_CC);
 	info->cc = internet_address_list_to_string (ia, FALSE);
+	summary_string_adopt (summary, &info->cc);
 	
 	ia = g_mime_message_get_recipients (message, GMIME_RECIPIENT_TYPE_CC);
 	info->bcc = internet_address_list_to_string (ia, FALSE);
+	summary_string_adopt (summary, &info->bcc);
 	
 	string = g_mime_message_get_subject (message);
-	info->subject = g_strdup (string);
+	info->subject = summary_string_intern (summary, string);
 	
 	g_mime_message_get_date (message, &info->date_sent, NULL);
 	
@@ -1004,6 +2462,30 @@ spruce_folder_summary_info_new_from_message (SpruceFolderSummary *summary, GMime
 }
 
 
+/**
+ * spruce_folder_summary_string_intern:
+ * @summary: a #SpruceFolderSummary
+ * @string: a string or %NULL
+ *
+ * Copies @string into @summary's shared string storage, reusing an
+ * existing copy if there is one. The result holds a reference on the
+ * shared copy which is released when the #SpruceMessageInfo it is
+ * assigned to is freed, so it must be assigned to exactly one of the
+ * string fields (other than the uid) of a #SpruceMessageInfo. This
+ * saves providers from allocating a temporary copy that
+ * spruce_folder_summary_add() would only intern and free again.
+ *
+ * Returns the interned copy of @string.
+ **/
+char *
+spruce_folder_summary_string_intern (SpruceFolderSummary *summary, const char *string)
+{
+	g_return_val_if_fail (SPRUCE_IS_FOLDER_SUMMARY (summary), NULL);
+	
+	return summary_string_intern (summary, string);
+}
+
+
 /**
  * spruce_folder_summary_info_ref:
  * @summary: a #SpruceFolderSummary
@@ -1017,24 +2499,177 @@ spruce_folder_summary_info_ref (SpruceFolderSummary *summary, SpruceMessageInfo
 	g_return_if_fail (SPRUCE_IS_FOLDER_SUMMARY (summary));
 	g_return_if_fail (info != NULL);
 	
-	info->ref_count++;
+	g_atomic_int_inc ((gint *) &info->ref_count);
+}
+
+
+static char *
+summary_string_intern (SpruceFolderSummary *summary, const char *string)
+{
+	struct _SpruceFolderSummaryPrivate *priv = summary->priv;
+	SummaryString *entry;
+	size_t n;
+	
+	if (string == NULL)
+		return NULL;
+	
+	G_LOCK (strings);
+	
+	if (priv->strings == NULL) {
+		priv->strings = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+	} else if ((entry = g_hash_table_lookup (priv->strings, string))) {
+		entry->ref_count++;
+		G_UNLOCK (strings);
+		return entry->str;
+	}
+	
+	n = strlen (string) + 1;
+	
+	entry = g_malloc (G_STRUCT_OFFSET (SummaryString, str) + n);
+	memcpy (entry->str, string, n);
+	entry->ref_count = 1;
+	
+	g_hash_table_insert (priv->strings, entry->str, entry);
+	
+	G_UNLOCK (strings);
+	
+	return entry->str;
+}
+
+/* returns the pool entry for @string if @string is an interned copy;
+ * must be called with the strings lock held */
+static SummaryString *
+summary_string_lookup (SpruceFolderSummary *summary, const char *string)
+{
+	SummaryString *entry;
+	
+	if (summary->priv->strings == NULL)
+		return NULL;
+	
+	if (!(entry = g_hash_table_lookup (summary->priv->strings, string)) || entry->str != string)
+		return NULL;
+	
+	return entry;
+}
+
+static void
+summary_string_pool_free (SpruceFolderSummary *summary)
+{
+	GHashTable *strings;
+	
+	G_LOCK (strings);
+	strings = summary->priv->strings;
+	summary->priv->strings = NULL;
+	G_UNLOCK (strings);
+	
+	if (strings != NULL)
+		g_hash_table_destroy (strings);
+}
+
+static void
+summary_maps_free (SpruceFolderSummary *summary)
+{
+	SummaryMap *map;
+	GSList *node;
+	
+	node = summary->priv->maps;
+	while (node != NULL) {
+		map = node->data;
+		munmap (map->base, map->len);
+		g_free (map);
+		node = node->next;
+	}
+	
+	g_slist_free (summary->priv->maps);
+	summary->priv->maps = NULL;
+}
+
+static gboolean
+summary_string_is_shared (SpruceFolderSummary *summary, const char *string)
+{
+	gboolean pooled;
+	SummaryMap *map;
+	GSList *node;
+	
+	G_LOCK (strings);
+	pooled = summary_string_lookup (summary, string) != NULL;
+	G_UNLOCK (strings);
+	
+	if (pooled)
+		return TRUE;
+	
+	/* strings loaded from an mmap'd summary are used in place */
+	node = summary->priv->maps;
+	while (node != NULL) {
+		map = node->data;
+		if ((unsigned char *) string >= map->base && (unsigned char *) string < map->base + map->len)
+			return TRUE;
+		
+		node = node->next;
+	}
+	
+	return FALSE;
+}
+
+/* replaces a g_malloc'd string with its interned copy */
+static void
+summary_string_adopt (SpruceFolderSummary *summary, char **string)
+{
+	char *str = *string;
+	
+	if (str == NULL || summary_string_is_shared (summary, str))
+		return;
+	
+	*string = summary_string_intern (summary, str);
+	g_free (str);
 }
 
+static void
+summary_string_free (SpruceFolderSummary *summary, char *string)
+{
+	SummaryString *entry;
+	
+	if (string == NULL)
+		return;
+	
+	G_LOCK (strings);
+	if ((entry = summary_string_lookup (summary, string))) {
+		if (--entry->ref_count == 0)
+			g_hash_table_remove (summary->priv->strings, string);
+		G_UNLOCK (strings);
+		return;
+	}
+	G_UNLOCK (strings);
+	
+	if (summary_string_is_shared (summary, string))
+		return;
+	
+	g_free (string);
+}
 
 static void
 message_info_free (SpruceFolderSummary *summary, SpruceMessageInfo *info)
 {
-	g_free (info->sender);
-	g_free (info->from);
-	g_free (info->reply_to);
-	g_free (info->to);
-	g_free (info->cc);
-	g_free (info->bcc);
-	g_free (info->subject);
-	g_free (info->uid);
+	summary_string_free (summary, info->sender);
+	summary_string_free (summary, info->from);
+	summary_string_free (summary, info->reply_to);
+	summary_string_free (summary, info->to);
+	summary_string_free (summary, info->cc);
+	summary_string_free (summary, info->bcc);
+	summary_string_free (summary, info->subject);
+	summary_string_free (summary, info->uid);
 	g_free (info->references);
 	
+	if (info->content)
+		spruce_summary_content_info_free (info->content);
+	
 	g_slice_free1 (summary->message_info_size, info);
+	
+	/* nothing references the string pool or the maps anymore */
+	if (g_atomic_int_dec_and_test (&summary->priv->live_infos)) {
+		summary_string_pool_free (summary);
+		summary_maps_free (summary);
+	}
 }
 
 
@@ -1051,8 +2686,7 @@ spruce_folder_summary_info_unref (SpruceFolderSummary *summary, SpruceMessageInf
 	g_return_if_fail (SPRUCE_IS_FOLDER_SUMMARY (summary));
 	g_return_if_fail (info != NULL);
 	
-	info->ref_count--;
-	if (info->ref_count <= 0)
+	if (g_atomic_int_dec_and_test ((gint *) &info->ref_count))
 		SPRUCE_FOLDER_SUMMARY_GET_CLASS (summary)->message_info_free (summary, info);
 }
 
@@ -1071,8 +2705,13 @@ spruce_folder_summary_remove (SpruceFolderSummary *summary, SpruceMessageInfo *i
 	g_return_if_fail (info != NULL);
 	g_return_if_fail (info->uid != NULL);
 	
+	summary_journal_remove (summary, info);
+	if (summary->priv->index)
+		spruce_folder_index_remove (summary->priv->index, info->uid);
+	
 	g_hash_table_remove (summary->messages_hash, info->uid);
 	g_ptr_array_remove (summary->messages, info);
+	summary->priv->columns_valid = FALSE;
 	summary->dirty = TRUE;
 	
 	spruce_folder_summary_info_unref (summary, info);
@@ -1119,8 +2758,13 @@ spruce_folder_summary_remove_index (SpruceFolderSummary *summary, int index)
 	g_return_if_fail (index >= 0 && index < summary->messages->len);
 	
 	info = summary->messages->pdata[index];
+	summary_journal_remove (summary, info);
+	if (summary->priv->index)
+		spruce_folder_index_remove (summary->priv->index, info->uid);
+	
 	g_hash_table_remove (summary->messages_hash, info->uid);
 	g_ptr_array_remove_index (summary->messages, index);
+	summary->priv->columns_valid = FALSE;
 	summary->dirty = TRUE;
 	
 	spruce_folder_summary_info_unref (summary, info);
@@ -1149,6 +2793,11 @@ spruce_folder_summary_clear (SpruceFolderSummary *summary)
 	}
 	
 	g_ptr_array_set_size (summary->messages, 0);
+	summary->priv->columns_valid = FALSE;
+	summary_journal_invalidate (summary);
+	
+	if (summary->priv->index)
+		spruce_folder_index_clear (summary->priv->index);
 	
 	summary->dirty = TRUE;
 }
@@ -1219,6 +2868,131 @@ spruce_folder_summary_index (SpruceFolderSummary *summary, int index)
 }
 
 
+/**
+ * spruce_folder_summary_get_columns:
+ * @summary: a #SpruceFolderSummary
+ *
+ * Gets a struct-of-arrays view of the message-infos in @summary
+ * which is cheaper to scan than the message-infos themselves. The
+ * view is rebuilt if any message-infos have been added or removed
+ * or touched (see spruce_folder_summary_touch_info()) since the
+ * last call.
+ *
+ * Returns: the columns, valid until the summary is next modified.
+ **/
+const SpruceSummaryColumns *
+spruce_folder_summary_get_columns (SpruceFolderSummary *summary)
+{
+	SpruceSummaryColumns *columns;
+	SpruceMessageInfo *info;
+	guint i, n;
+	
+	g_return_val_if_fail (SPRUCE_IS_FOLDER_SUMMARY (summary), NULL);
+	
+	columns = &summary->priv->columns;
+	
+	if (summary->priv->columns_valid)
+		return columns;
+	
+	n = summary->messages->len;
+	
+	if (n > columns->len || columns->flags == NULL) {
+		columns->flags = g_renew (guint32, columns->flags, n);
+		columns->date_sent = g_renew (time_t, columns->date_sent, n);
+		columns->date_received = g_renew (time_t, columns->date_received, n);
+		columns->size = g_renew (size_t, columns->size, n);
+		columns->message_id = g_renew (guint64, columns->message_id, n);
+	}
+	
+	for (i = 0; i < n; i++) {
+		info = summary->messages->pdata[i];
+		columns->flags[i] = info->flags;
+		columns->date_sent[i] = info->date_sent;
+		columns->date_received[i] = info->date_received;
+		columns->size[i] = info->size;
+		columns->message_id[i] = info->message_id.id.id;
+	}
+	
+	columns->len = n;
+	summary->priv->columns_valid = TRUE;
+	
+	return columns;
+}
+
+
+static void
+summary_index_open (SpruceFolderSummary *summary, gboolean create)
+{
+	SpruceFolderIndex *index;
+	char *path;
+	
+	path = g_strdup_printf ("%s.index", summary->priv->filename);
+	index = spruce_folder_index_new (path);
+	g_free (path);
+	
+	if (spruce_folder_index_load (index) == -1 && !create) {
+		spruce_folder_index_free (index);
+		return;
+	}
+	
+	summary->priv->index = index;
+}
+
+
+/**
+ * spruce_folder_summary_set_indexed:
+ * @summary: a #SpruceFolderSummary
+ * @indexed: whether to keep a full-text index
+ *
+ * Enables or disables the full-text index of the folder, saved next
+ * to the summary file. Messages get indexed by
+ * spruce_folder_search_index_messages() or, failing that, when they
+ * are first searched (see #SpruceFolderSearch).
+ *
+ * Disabling the index deletes its file, so this should also be used
+ * when the folder itself is deleted.
+ **/
+void
+spruce_folder_summary_set_indexed (SpruceFolderSummary *summary, gboolean indexed)
+{
+	char *path;
+	
+	g_return_if_fail (SPRUCE_IS_FOLDER_SUMMARY (summary));
+	g_return_if_fail (summary->priv->filename != NULL);
+	
+	if (indexed) {
+		if (!summary->priv->index)
+			summary_index_open (summary, TRUE);
+	} else if (summary->priv->index) {
+		spruce_folder_index_clear (summary->priv->index);
+		spruce_folder_index_free (summary->priv->index);
+		summary->priv->index = NULL;
+	} else {
+		/* the index isn't open while the summary is unloaded */
+		path = g_strdup_printf ("%s.index", summary->priv->filename);
+		unlink (path);
+		g_free (path);
+	}
+}
+
+
+/**
+ * spruce_folder_summary_get_index:
+ * @summary: a #SpruceFolderSummary
+ *
+ * Gets the full-text index of the folder.
+ *
+ * Returns: the index or %NULL if the folder isn't indexed.
+ **/
+SpruceFolderIndex *
+spruce_folder_summary_get_index (SpruceFolderSummary *summary)
+{
+	g_return_val_if_fail (SPRUCE_IS_FOLDER_SUMMARY (summary), NULL);
+	
+	return summary->priv->index;
+}
+
+
 struct {
 	char *name;
 	guint32 flag;
@@ -1602,3 +3376,48 @@ spruce_tag_list_free (SpruceTag **list)
 	
 	*list = NULL;
 }
+
+
+/**
+ * spruce_summary_content_info_new:
+ *
+ * Creates a new (empty) #SpruceSummaryContentInfo node.
+ *
+ * Returns: a new #SpruceSummaryContentInfo.
+ **/
+SpruceSummaryContentInfo *
+spruce_summary_content_info_new (void)
+{
+	return g_new0 (SpruceSummaryContentInfo, 1);
+}
+
+
+/**
+ * spruce_summary_content_info_free:
+ * @content: a #SpruceSummaryContentInfo
+ *
+ * Frees @content along with all of its children.
+ **/
+void
+spruce_summary_content_info_free (SpruceSummaryContentInfo *content)
+{
+	SpruceSummaryContentInfo *child, *next;
+	
+	child = content->children;
+	while (child != NULL) {
+		next = child->next;
+		spruce_summary_content_info_free (child);
+		child = next;
+	}
+	
+	if (content->content_type)
+		g_object_unref (content->content_type);
+	
+	if (content->disposition)
+		g_object_unref (content->disposition);
+	
+	g_free (content->content_id);
+	g_free (content->description);
+	g_free (content->encoding);
+	g_free (content);
+}
@@ -30,6 +30,9 @@
 
 #include <gmime/gmime-stream.h>
 #include <gmime/gmime-message.h>
+#include <gmime/gmime-disposition.h>
+
+#include <spruce/spruce-folder-index.h>
 
 G_BEGIN_DECLS
 
@@ -41,6 +44,7 @@ G_BEGIN_DECLS
 #define SPRUCE_FOLDER_SUMMARY_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), SPRUCE_TYPE_FOLDER_SUMMARY, SpruceFolderSummaryClass))
 
 typedef struct _SpruceMessageInfo SpruceMessageInfo;
+typedef struct _SpruceSummaryRecord SpruceSummaryRecord;
 typedef struct _SpruceFolderSummary SpruceFolderSummary;
 typedef struct _SpruceFolderSummaryClass SpruceFolderSummaryClass;
 
@@ -86,12 +90,24 @@ typedef struct _SpruceSummaryReferences {
 	SpruceSummaryMessageID references[1];
 } SpruceSummaryReferences;
 
+/* a struct-of-arrays view of the summary for scanning, where row
+ * i corresponds to the message-info at index i */
+typedef struct _SpruceSummaryColumns {
+	guint len;
+	guint32 *flags;
+	time_t *date_sent;
+	time_t *date_received;
+	size_t *size;
+	guint64 *message_id;
+} SpruceSummaryColumns;
+
 typedef struct _SpruceSummaryContentInfo {
 	struct _SpruceSummaryContentInfo *next;
 	struct _SpruceSummaryContentInfo *parent;
 	struct _SpruceSummaryContentInfo *children;
 	
 	GMimeContentType *content_type;
+	GMimeContentDisposition *disposition;
 	char *content_id;
 	char *description;
 	char *encoding;
@@ -136,7 +152,7 @@ struct _SpruceMessageInfo {
 	SpruceFlag *user_flags;
 	SpruceTag *user_tags;
 	
-	/*SpruceSummaryContentInfo *content;*/
+	SpruceSummaryContentInfo *content;  /* MIME structure, if known */
 };
 
 struct _SpruceFolderSummary {
@@ -186,6 +202,13 @@ struct _SpruceFolderSummaryClass {
 						   SpruceMessageInfo *info);
 	void		    (* message_info_free) (SpruceFolderSummary *summary, SpruceMessageInfo *info);
 	
+	/* load/save an individual message info as a fixed-size record
+	 * in the mmap'able summary format (subclasses which extend
+	 * SpruceMessageInfo must override both of these) */
+	SpruceMessageInfo * (* message_info_load_record) (SpruceFolderSummary *summary, SpruceSummaryRecord *record);
+	int		    (* message_info_save_record) (SpruceFolderSummary *summary, SpruceSummaryRecord *record,
+							  SpruceMessageInfo *info);
+	
 	/* get the next uid */
 	char * (* next_uid_string) (SpruceFolderSummary *summary);
 };
@@ -197,6 +220,7 @@ SpruceFolderSummary *spruce_folder_summary_new (void);
 
 const char *spruce_folder_summary_get_filename (SpruceFolderSummary *summary);
 void spruce_folder_summary_set_filename (SpruceFolderSummary *summary, const char *filename);
+int spruce_folder_summary_rename (SpruceFolderSummary *summary, const char *filename);
 
 guint32 spruce_folder_summary_next_uid (SpruceFolderSummary *summary);
 char *spruce_folder_summary_uid_string (SpruceFolderSummary *summary);
@@ -215,6 +239,7 @@ int spruce_folder_summary_reload (SpruceFolderSummary *summary);
 
 /* set the dirty bit on the summary */
 void spruce_folder_summary_touch (SpruceFolderSummary *summary);
+void spruce_folder_summary_touch_info (SpruceFolderSummary *summary, SpruceMessageInfo *info);
 
 /* add a new raw summary item */
 void spruce_folder_summary_add (SpruceFolderSummary *summary, SpruceMessageInfo *info);
@@ -227,6 +252,9 @@ SpruceMessageInfo *spruce_folder_summary_info_new_from_message (SpruceFolderSumm
 void spruce_folder_summary_info_ref (SpruceFolderSummary *summary, SpruceMessageInfo *info);
 void spruce_folder_summary_info_unref (SpruceFolderSummary *summary, SpruceMessageInfo *info);
 
+/* copy a string into the summary's shared string storage */
+char *spruce_folder_summary_string_intern (SpruceFolderSummary *summary, const char *string);
+
 /* removes a summary item, doesn't fix content offsets */
 void spruce_folder_summary_remove (SpruceFolderSummary *summary, SpruceMessageInfo *info);
 void spruce_folder_summary_remove_uid (SpruceFolderSummary *summary, const char *uid);
@@ -241,6 +269,21 @@ int spruce_folder_summary_count (SpruceFolderSummary *summary);
 SpruceMessageInfo *spruce_folder_summary_uid (SpruceFolderSummary *summary, const char *uid);
 SpruceMessageInfo *spruce_folder_summary_index (SpruceFolderSummary *summary, int index);
 
+const SpruceSummaryColumns *spruce_folder_summary_get_columns (SpruceFolderSummary *summary);
+
+/* optional full-text index */
+void spruce_folder_summary_set_indexed (SpruceFolderSummary *summary, gboolean indexed);
+SpruceFolderIndex *spruce_folder_summary_get_index (SpruceFolderSummary *summary);
+
+
+/* fixed-size summary record encoders/decoders */
+int spruce_summary_record_encode_uint32 (SpruceSummaryRecord *record, guint32 value);
+int spruce_summary_record_decode_uint32 (SpruceSummaryRecord *record, guint32 *value);
+int spruce_summary_record_encode_int64 (SpruceSummaryRecord *record, gint64 value);
+int spruce_summary_record_decode_int64 (SpruceSummaryRecord *record, gint64 *value);
+int spruce_summary_record_encode_string (SpruceSummaryRecord *record, const char *value);
+int spruce_summary_record_decode_string (SpruceSummaryRecord *record, char **value);
+
 
 /* message flag operations */
 gboolean spruce_flag_get (SpruceFlag **list, const char *name);
@@ -259,6 +302,10 @@ gboolean spruce_tag_list_copy (SpruceTag **to, SpruceTag **from);
 int spruce_tag_list_size (SpruceTag **list);
 void spruce_tag_list_free (SpruceTag **list);
 
+/* message content info */
+SpruceSummaryContentInfo *spruce_summary_content_info_new (void);
+void spruce_summary_content_info_free (SpruceSummaryContentInfo *content);
+
 G_END_DECLS
 
 #endif /* __SPRUCE_FOLDER_SUMMARY_H__ */
@@ -26,13 +26,36 @@
 
 #include <glib/gi18n.h>
 
+#include <gmime/gmime.h>
+
 #include <spruce/spruce-store.h>
 
+#include "spruce-list.h"
 #include "spruce-error.h"
 #include "spruce-folder.h"
 #include "spruce-marshal.h"
 
 
+/* number of header blocks kept by spruce_folder_get_message_headers() */
+#define HEADER_CACHE_SIZE 256
+
+/* how much folder_copy_messages() downloads ahead of itself */
+#define COPY_PREFETCH_COUNT  32
+#define COPY_PREFETCH_BUDGET (4 * 1024 * 1024)
+
+typedef struct {
+	SpruceListNode node;
+	GMimeMessage *headers;
+	char *uid;
+} HeaderCacheNode;
+
+struct _SpruceHeaderCache {
+	GHashTable *uids;
+	SpruceList lru;  /* most recently used first */
+	guint count;
+};
+
+
 enum {
 	DELETING,
 	DELETED,
@@ -87,6 +110,13 @@ static void folder_free_message_info (SpruceFolder *folder, SpruceMessageInfo *i
 static guint32 folder_get_message_flags (SpruceFolder *folder, const char *uid);
 static int folder_set_message_flags (SpruceFolder *folder, const char *uid, guint32 flags, guint32 set);
 static GMimeMessage *folder_get_message (SpruceFolder *folder, const char *uid, GError **err);
+static GMimeMessage *folder_get_message_headers (SpruceFolder *folder, const char *uid, GError **err);
+static GMimeStream *folder_get_message_stream (SpruceFolder *folder, const char *uid, GError **err);
+static GMimeMessage *folder_get_message_lazy (SpruceFolder *folder, const char *uid, GError **err);
+static int folder_prefetch_messages (SpruceFolder *folder, GPtrArray *uids, guint64 budget,
+				     SpruceFolderProgressFunc progress, void *user_data, GError **err);
+static int folder_idle (SpruceFolder *folder, GError **err);
+static int folder_idle_dispatch (SpruceFolder *folder, GError **err);
 static int folder_append_message (SpruceFolder *folder, GMimeMessage *message,
 				  SpruceMessageInfo *info, GError **err);
 static int folder_copy_messages (SpruceFolder *src, GPtrArray *uids, SpruceFolder *dest, GError **err);
@@ -98,6 +128,7 @@ static gboolean folder_is_frozen (SpruceFolder *folder);
 
 
 static void spruce_folder_newname (SpruceFolder *folder, const char *parent, const char *name);
+static void header_cache_clear (SpruceFolder *folder);
 
 
 static GObjectClass *parent_class = NULL;
@@ -175,6 +206,12 @@ spruce_folder_class_init (SpruceFolderClass *klass)
 	klass->get_message_flags = folder_get_message_flags;
 	klass->set_message_flags = folder_set_message_flags;
 	klass->get_message = folder_get_message;
+	klass->get_message_headers = folder_get_message_headers;
+	klass->get_message_stream = folder_get_message_stream;
+	klass->get_message_lazy = folder_get_message_lazy;
+	klass->prefetch_messages = folder_prefetch_messages;
+	klass->idle = folder_idle;
+	klass->idle_dispatch = folder_idle_dispatch;
 	klass->append_message = folder_append_message;
 	klass->copy_messages = folder_copy_messages;
 	klass->move_messages = folder_move_messages;
@@ -266,6 +303,7 @@ spruce_folder_init (SpruceFolder *folder, SpruceFolderClass *klass)
 	folder->mode = 0;
 	folder->name = NULL;
 	folder->full_name = NULL;
+	folder->header_cache = NULL;
 }
 
 static void
@@ -282,6 +320,12 @@ spruce_folder_finalize (GObject *object)
 	if (folder->summary)
 		g_object_unref (folder->summary);
 	
+	if (folder->header_cache) {
+		header_cache_clear (folder);
+		g_hash_table_destroy (folder->header_cache->uids);
+		g_free (folder->header_cache);
+	}
+	
 	g_free (folder->name);
 	g_free (folder->full_name);
 	
@@ -786,7 +830,7 @@ spruce_folder_get_message_count (SpruceFolder *folder)
 static int
 folder_get_unread_message_count (SpruceFolder *folder)
 {
-	SpruceMessageInfo *info;
+	const SpruceSummaryColumns *columns;
 	int i, count = 0;
 	
 	if (folder->summary == NULL)
@@ -795,12 +839,9 @@ folder_get_unread_message_count (SpruceFolder *folder)
 	if (!folder->summary->loaded)
 		return folder->summary->unread;
 	
-	for (i = 0; i < folder->summary->messages->len; i++) {
-		info = folder->summary->messages->pdata[i];
-		
-		if (!(info->flags & SPRUCE_MESSAGE_SEEN))
-			count++;
-	}
+	columns = spruce_folder_summary_get_columns (folder->summary);
+	for (i = 0; i < columns->len; i++)
+		count += (columns->flags[i] & SPRUCE_MESSAGE_SEEN) == 0;
 	
 	return count;
 }
@@ -904,8 +945,10 @@ spruce_folder_close (SpruceFolder *folder, gboolean expunge, GError **err)
 		return 0;
 	}
 	
-	if ((retval = SPRUCE_FOLDER_GET_CLASS (folder)->close (folder, expunge, err)) == 0)
+	if ((retval = SPRUCE_FOLDER_GET_CLASS (folder)->close (folder, expunge, err)) == 0) {
+		header_cache_clear (folder);
 		folder->open_count = 0;
+	}
 	
 	return retval;
 }
@@ -1140,6 +1183,9 @@ spruce_folder_expunge (SpruceFolder *folder, GPtrArray *uids, GError **err)
 	if (!(folder->type & SPRUCE_FOLDER_CAN_HOLD_MESSAGES))
 		return 0;
 	
+	/* uids may get reused once they've been expunged */
+	header_cache_clear (folder);
+	
 	return SPRUCE_FOLDER_GET_CLASS (folder)->expunge (folder, uids, err);
 }
 
@@ -1466,7 +1512,7 @@ folder_set_message_flags (SpruceFolder *folder, const char *uid, guint32 flags,
 			
 			if (info->flags != new) {
 				info->flags = new | SPRUCE_MESSAGE_DIRTY;
-				spruce_folder_summary_touch (folder->summary);
+				spruce_folder_summary_touch_info (folder->summary, info);
 			}
 			
 			return 0;
@@ -1512,6 +1558,384 @@ spruce_folder_get_message (SpruceFolder *folder, const char *uid, GError **err)
 }
 
 
+/**
+ * spruce_folder_parse_message_headers:
+ * @stream: stream positioned at the start of a message
+ * @scan_from: %TRUE if the message starts with an mbox From-line
+ *
+ * Parses just the headers of the message, reading @stream only as
+ * far as the end of the header block (give or take a buffer's
+ * worth). Useful for implementing the get_message_headers() method.
+ *
+ * Returns: a #GMimeMessage with the headers of the message and an
+ * empty body or %NULL on error.
+ **/
+GMimeMessage *
+spruce_folder_parse_message_headers (GMimeStream *stream, gboolean scan_from)
+{
+	gboolean eoh = FALSE, nl = FALSE;
+	char buf[4096], *inptr, *inend;
+	GMimeMessage *message;
+	GMimeParser *parser;
+	GMimeStream *mem;
+	ssize_t nread;
+	
+	mem = g_mime_stream_mem_new ();
+	
+	while (!eoh && (nread = g_mime_stream_read (stream, buf, sizeof (buf))) > 0) {
+		inend = buf + nread;
+		inptr = buf;
+		
+		/* look for the blank line that ends the headers */
+		while (inptr < inend && !eoh) {
+			if (*inptr == '\n') {
+				eoh = nl;
+				nl = TRUE;
+			} else if (*inptr != '\r') {
+				nl = FALSE;
+			}
+			
+			inptr++;
+		}
+		
+		g_mime_stream_write (mem, buf, inptr - buf);
+	}
+	
+	g_mime_stream_reset (mem);
+	
+	parser = g_mime_parser_new_with_stream (mem);
+	g_mime_parser_set_scan_from (parser, scan_from);
+	message = g_mime_parser_construct_message (parser);
+	g_object_unref (parser);
+	g_object_unref (mem);
+	
+	return message;
+}
+
+
+/* for folders that can't do any better: get the whole message and
+ * keep only its headers */
+static GMimeMessage *
+folder_get_message_headers (SpruceFolder *folder, const char *uid, GError **err)
+{
+	GMimeMessage *message, *headers;
+	GMimeStream *stream;
+	
+	if (!(message = SPRUCE_FOLDER_GET_CLASS (folder)->get_message (folder, uid, err)))
+		return NULL;
+	
+	stream = g_mime_stream_mem_new ();
+	g_mime_header_list_write_to_stream (g_mime_object_get_header_list ((GMimeObject *) message), stream);
+	if (message->mime_part)
+		g_mime_header_list_write_to_stream (g_mime_object_get_header_list (message->mime_part), stream);
+	g_mime_stream_write (stream, "\n", 1);
+	g_object_unref (message);
+	
+	g_mime_stream_reset (stream);
+	headers = spruce_folder_parse_message_headers (stream, FALSE);
+	g_object_unref (stream);
+	
+	return headers;
+}
+
+
+static void
+header_cache_clear (SpruceFolder *folder)
+{
+	struct _SpruceHeaderCache *cache = folder->header_cache;
+	HeaderCacheNode *node;
+	
+	if (cache == NULL)
+		return;
+	
+	while ((node = (HeaderCacheNode *) spruce_list_unlink_head (&cache->lru))) {
+		g_hash_table_remove (cache->uids, node->uid);
+		g_object_unref (node->headers);
+		g_free (node->uid);
+		g_free (node);
+	}
+	
+	cache->count = 0;
+}
+
+
+/**
+ * spruce_folder_get_message_headers:
+ * @folder: a #SpruceFolder
+ * @uid: message uid
+ * @err: a #GError
+ *
+ * Gets just the headers of a message, which for most folders is a
+ * lot cheaper than getting the whole message. The most recently
+ * used header blocks are kept by the folder until it is closed or
+ * expunged, so asking for the same headers again is cheap.
+ *
+ * Returns: a #GMimeMessage containing the headers of the message
+ * (and an empty body) or %NULL on error.
+ **/
+GMimeMessage *
+spruce_folder_get_message_headers (SpruceFolder *folder, const char *uid, GError **err)
+{
+	struct _SpruceHeaderCache *cache;
+	HeaderCacheNode *node;
+	GMimeMessage *headers;
+	
+	g_return_val_if_fail (SPRUCE_IS_FOLDER (folder), NULL);
+	g_return_val_if_fail (uid != NULL, NULL);
+	
+	if (!(folder->type & SPRUCE_FOLDER_CAN_HOLD_MESSAGES)) {
+		/* FIXME: set an error */
+		return NULL;
+	}
+	
+	if (!(cache = folder->header_cache)) {
+		cache = folder->header_cache = g_new (struct _SpruceHeaderCache, 1);
+		cache->uids = g_hash_table_new (g_str_hash, g_str_equal);
+		spruce_list_init (&cache->lru);
+		cache->count = 0;
+	}
+	
+	if ((node = g_hash_table_lookup (cache->uids, uid))) {
+		spruce_list_unlink ((SpruceListNode *) node);
+		spruce_list_prepend (&cache->lru, (SpruceListNode *) node);
+		
+		return g_object_ref (node->headers);
+	}
+	
+	if (!(headers = SPRUCE_FOLDER_GET_CLASS (folder)->get_message_headers (folder, uid, err)))
+		return NULL;
+	
+	if (cache->count == HEADER_CACHE_SIZE) {
+		/* recycle the least recently used node */
+		node = (HeaderCacheNode *) spruce_list_unlink_tail (&cache->lru);
+		g_hash_table_remove (cache->uids, node->uid);
+		g_object_unref (node->headers);
+		g_free (node->uid);
+	} else {
+		node = g_new (HeaderCacheNode, 1);
+		cache->count++;
+	}
+	
+	node->headers = g_object_ref (headers);
+	node->uid = g_strdup (uid);
+	
+	g_hash_table_insert (cache->uids, node->uid, node);
+	spruce_list_prepend (&cache->lru, (SpruceListNode *) node);
+	
+	return headers;
+}
+
+
+/* for folders that can't do any better: get the message and write
+ * it out to memory */
+static GMimeStream *
+folder_get_message_stream (SpruceFolder *folder, const char *uid, GError **err)
+{
+	GMimeMessage *message;
+	GMimeStream *stream;
+	
+	if (!(message = SPRUCE_FOLDER_GET_CLASS (folder)->get_message (folder, uid, err)))
+		return NULL;
+	
+	stream = g_mime_stream_mem_new ();
+	g_mime_object_write_to_stream ((GMimeObject *) message, stream);
+	g_object_unref (message);
+	
+	g_mime_stream_reset (stream);
+	
+	return stream;
+}
+
+
+/**
+ * spruce_folder_get_message_stream:
+ * @folder: a #SpruceFolder
+ * @uid: message uid
+ * @err: a #GError
+ *
+ * Gets the raw message without parsing it, for callers that only
+ * want to pass the message along (e.g. to save or forward it as-is).
+ * Folders that keep messages on disk can hand back a stream over
+ * their local copy without ever constructing a #GMimeMessage.
+ *
+ * Returns: a read-only #GMimeStream positioned at the start of the
+ * message or %NULL on error.
+ **/
+GMimeStream *
+spruce_folder_get_message_stream (SpruceFolder *folder, const char *uid, GError **err)
+{
+	g_return_val_if_fail (SPRUCE_IS_FOLDER (folder), NULL);
+	g_return_val_if_fail (uid != NULL, NULL);
+	
+	if (!(folder->type & SPRUCE_FOLDER_CAN_HOLD_MESSAGES)) {
+		/* FIXME: set an error */
+		return NULL;
+	}
+	
+	return SPRUCE_FOLDER_GET_CLASS (folder)->get_message_stream (folder, uid, err);
+}
+
+
+static GMimeMessage *
+folder_get_message_lazy (SpruceFolder *folder, const char *uid, GError **err)
+{
+	return SPRUCE_FOLDER_GET_CLASS (folder)->get_message (folder, uid, err);
+}
+
+
+/**
+ * spruce_folder_get_message_lazy:
+ * @folder: a #SpruceFolder
+ * @uid: message uid
+ * @err: a #GError
+ *
+ * Gets a message for reading (e.g. to display or index it) without
+ * necessarily downloading all of it: remote folders may build the
+ * message from its MIME structure and fetch the content of each part
+ * only once it is read, which blocks on the server each time.
+ *
+ * The result is not a faithful copy of the message: part headers
+ * other than the content headers, and multipart preambles and
+ * epilogues, may be missing. Use spruce_folder_get_message() or
+ * spruce_folder_get_message_stream() to save, copy or forward it.
+ *
+ * Returns: a #GMimeMessage or %NULL on error.
+ **/
+GMimeMessage *
+spruce_folder_get_message_lazy (SpruceFolder *folder, const char *uid, GError **err)
+{
+	g_return_val_if_fail (SPRUCE_IS_FOLDER (folder), NULL);
+	g_return_val_if_fail (uid != NULL, NULL);
+	
+	if (!(folder->type & SPRUCE_FOLDER_CAN_HOLD_MESSAGES)) {
+		/* FIXME: set an error */
+		return NULL;
+	}
+	
+	return SPRUCE_FOLDER_GET_CLASS (folder)->get_message_lazy (folder, uid, err);
+}
+
+
+/* local folders already have every message to hand */
+static int
+folder_prefetch_messages (SpruceFolder *folder, GPtrArray *uids, guint64 budget,
+			  SpruceFolderProgressFunc progress, void *user_data, GError **err)
+{
+	return 0;
+}
+
+
+/**
+ * spruce_folder_prefetch_messages:
+ * @folder: a #SpruceFolder
+ * @uids: array of message uids
+ * @budget: maximum number of bytes to fetch (0 for no limit)
+ * @progress: progress callback or %NULL
+ * @user_data: user data to pass to @progress
+ * @err: a #GError
+ *
+ * Hints to remote folders that the messages listed in @uids are about
+ * to be requested, so that they can be downloaded into the local cache
+ * in as few round trips as possible. Messages already cached are
+ * skipped and fetching stops once @budget bytes worth of messages have
+ * been requested. @progress, if given, is called as each message
+ * arrives.
+ *
+ * Returns: 0 on success or -1 on fail.
+ **/
+int
+spruce_folder_prefetch_messages (SpruceFolder *folder, GPtrArray *uids, guint64 budget,
+				 SpruceFolderProgressFunc progress, void *user_data, GError **err)
+{
+	g_return_val_if_fail (SPRUCE_IS_FOLDER (folder), -1);
+	g_return_val_if_fail (uids != NULL, -1);
+	
+	if (!(folder->type & SPRUCE_FOLDER_CAN_HOLD_MESSAGES)) {
+		/* FIXME: set an error */
+		return -1;
+	}
+	
+	return SPRUCE_FOLDER_GET_CLASS (folder)->prefetch_messages (folder, uids, budget, progress, user_data, err);
+}
+
+
+static int
+folder_idle (SpruceFolder *folder, GError **err)
+{
+	g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_GENERIC,
+		     _("Cannot watch folder `%s' for changes: not supported"),
+		     folder->full_name);
+	
+	return -1;
+}
+
+
+/**
+ * spruce_folder_idle:
+ * @folder: a #SpruceFolder
+ * @err: a #GError
+ *
+ * Asks the folder to notify us of changes as they happen (e.g. using
+ * IMAP IDLE) rather than needing to be polled. The returned file
+ * descriptor should be watched for readability (with poll(), a
+ * #GIOChannel, etc), at which point spruce_folder_idle_dispatch()
+ * should be called to emit the "folder-changed" signals.
+ *
+ * Other requests made on the folder may interrupt the wait, which
+ * is resumed once they are done where possible. If it can't be,
+ * spruce_folder_idle_dispatch() fails and this needs to be called
+ * again.
+ *
+ * Returns: a file descriptor to watch or -1 if the folder can't
+ * notify us of changes, in which case it needs to be polled instead.
+ **/
+int
+spruce_folder_idle (SpruceFolder *folder, GError **err)
+{
+	g_return_val_if_fail (SPRUCE_IS_FOLDER (folder), -1);
+	
+	if (!(folder->type & SPRUCE_FOLDER_CAN_HOLD_MESSAGES)) {
+		g_set_error (err, SPRUCE_ERROR, SPRUCE_ERROR_GENERIC,
+			     _("Cannot watch folder `%s' for changes: not supported"),
+			     folder->full_name);
+		return -1;
+	}
+	
+	return SPRUCE_FOLDER_GET_CLASS (folder)->idle (folder, err);
+}
+
+
+static int
+folder_idle_dispatch (SpruceFolder *folder, GError **err)
+{
+	return 0;
+}
+
+
+/**
+ * spruce_folder_idle_dispatch:
+ * @folder: a #SpruceFolder
+ * @err: a #GError
+ *
+ * Processes the change notifications waiting on the file descriptor
+ * returned by spruce_folder_idle(), emitting "folder-changed" as
+ * appropriate. This should be called when that descriptor becomes
+ * readable and will only process notifications which have already
+ * arrived in full.
+ *
+ * Returns: 0 on success or -1 on fail, including when the folder
+ * has stopped watching for changes and spruce_folder_idle() needs
+ * to be called again.
+ **/
+int
+spruce_folder_idle_dispatch (SpruceFolder *folder, GError **err)
+{
+	g_return_val_if_fail (SPRUCE_IS_FOLDER (folder), -1);
+	
+	return SPRUCE_FOLDER_GET_CLASS (folder)->idle_dispatch (folder, err);
+}
+
+
 static int
 folder_append_message (SpruceFolder *folder, GMimeMessage *message, SpruceMessageInfo *info, GError **err)
 {
@@ -1545,19 +1969,50 @@ folder_copy_messages (SpruceFolder *src, GPtrArray *uids, SpruceFolder *dest, GE
 {
 	SpruceMessageInfo *info;
 	GMimeMessage *message;
-	int i;
+	GPtrArray *prefetch;
+	GMimeParser *parser;
+	GMimeStream *stream;
+	int i, j;
+	
+	prefetch = g_ptr_array_sized_new (COPY_PREFETCH_COUNT);
 	
 	for (i = 0; i < uids->len; i++) {
+		/* get remote folders to download the next few messages in
+		 * bulk, keeping within a small budget so as not to push
+		 * everything else out of their cache; if that fails we'll
+		 * still fetch whatever is missing one by one */
+		if ((i % COPY_PREFETCH_COUNT) == 0) {
+			g_ptr_array_set_size (prefetch, 0);
+			for (j = i; j < uids->len && j < i + COPY_PREFETCH_COUNT; j++)
+				g_ptr_array_add (prefetch, uids->pdata[j]);
+			
+			SPRUCE_FOLDER_GET_CLASS (src)->prefetch_messages (src, prefetch, COPY_PREFETCH_BUDGET,
+									  NULL, NULL, NULL);
+		}
+		
 		if (!(info = SPRUCE_FOLDER_GET_CLASS (src)->get_message_info (src, uids->pdata[i])))
 			continue;
 		
-		if (!(message = SPRUCE_FOLDER_GET_CLASS (src)->get_message (src, uids->pdata[i], err))) {
+		/* parse the raw message ourselves so that what gets
+		 * appended is exactly what the source folder has */
+		if (!(stream = SPRUCE_FOLDER_GET_CLASS (src)->get_message_stream (src, uids->pdata[i], err))) {
+			spruce_folder_free_message_info (src, info);
+			continue;
+		}
+		
+		parser = g_mime_parser_new_with_stream (stream);
+		message = g_mime_parser_construct_message (parser);
+		g_object_unref (parser);
+		g_object_unref (stream);
+		
+		if (message == NULL) {
 			spruce_folder_free_message_info (src, info);
 			continue;
 		}
 		
 		if (spruce_folder_append_message (dest, message, info, err) == -1) {
 			spruce_folder_free_message_info (src, info);
+			g_ptr_array_free (prefetch, TRUE);
 			g_object_unref (message);
 			return -1;
 		}
@@ -1566,6 +2021,8 @@ folder_copy_messages (SpruceFolder *src, GPtrArray *uids, SpruceFolder *dest, GE
 		g_object_unref (message);
 	}
 	
+	g_ptr_array_free (prefetch, TRUE);
+	
 	return 0;
 }
 
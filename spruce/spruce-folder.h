@@ -24,6 +24,7 @@
 #include <glib.h>
 
 #include <gmime/gmime-message.h>
+#include <gmime/gmime-stream.h>
 
 #include <spruce/spruce-url.h>
 #include <spruce/spruce-folder-summary.h>
@@ -61,6 +62,8 @@ typedef struct _SpruceFolderChangeInfo {
 	GPtrArray *removed_uids;
 } SpruceFolderChangeInfo;
 
+typedef void (* SpruceFolderProgressFunc) (SpruceFolder *folder, int done, int total, void *user_data);
+
 struct _SpruceFolder {
 	GObject parent_object;
 	
@@ -88,6 +91,9 @@ struct _SpruceFolder {
 	char *full_name;
 	
 	guint32 permanent_flags;
+	
+	/* recently used message headers */
+	struct _SpruceHeaderCache *header_cache;
 };
 
 struct _SpruceFolderClass {
@@ -163,6 +169,15 @@ struct _SpruceFolderClass {
 					      guint32 flags, guint32 set);
 	
 	GMimeMessage * (* get_message) (SpruceFolder *folder, const char *uid, GError **err);
+	GMimeMessage * (* get_message_headers) (SpruceFolder *folder, const char *uid, GError **err);
+	GMimeStream *  (* get_message_stream) (SpruceFolder *folder, const char *uid, GError **err);
+	GMimeMessage * (* get_message_lazy) (SpruceFolder *folder, const char *uid, GError **err);
+	
+	int            (* prefetch_messages) (SpruceFolder *folder, GPtrArray *uids, guint64 budget,
+					      SpruceFolderProgressFunc progress, void *user_data, GError **err);
+	
+	int            (* idle) (SpruceFolder *folder, GError **err);
+	int            (* idle_dispatch) (SpruceFolder *folder, GError **err);
 	
 	int            (* append_message) (SpruceFolder *folder, GMimeMessage *message,
 					   SpruceMessageInfo *info, GError **err);
@@ -241,6 +256,17 @@ guint32 spruce_folder_get_message_flags (SpruceFolder *folder, const char *uid);
 int     spruce_folder_set_message_flags (SpruceFolder *folder, const char *uid, guint32 flags, guint32 set);
 
 GMimeMessage *spruce_folder_get_message (SpruceFolder *folder, const char *uid, GError **err);
+GMimeMessage *spruce_folder_get_message_headers (SpruceFolder *folder, const char *uid, GError **err);
+GMimeStream  *spruce_folder_get_message_stream (SpruceFolder *folder, const char *uid, GError **err);
+GMimeMessage *spruce_folder_get_message_lazy (SpruceFolder *folder, const char *uid, GError **err);
+
+int spruce_folder_prefetch_messages (SpruceFolder *folder, GPtrArray *uids, guint64 budget,
+				     SpruceFolderProgressFunc progress, void *user_data, GError **err);
+
+int spruce_folder_idle (SpruceFolder *folder, GError **err);
+int spruce_folder_idle_dispatch (SpruceFolder *folder, GError **err);
+
+GMimeMessage *spruce_folder_parse_message_headers (GMimeStream *stream, gboolean scan_from);
 
 int spruce_folder_append_message (SpruceFolder *folder, GMimeMessage *message,
 				  SpruceMessageInfo *info, GError **err);
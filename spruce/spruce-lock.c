@@ -30,6 +30,9 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <utime.h>
 
 #include <glib/gi18n.h>
 
@@ -37,11 +40,41 @@
 #include <spruce/spruce-lock.h>
 
 
+#define d(x)
+
 #define SPRUCE_DOT_LOCK_RETRY    5
 #define SPRUCE_DOT_LOCK_DELAY    2
 #define SPRUCE_DOT_LOCK_STALE    60
+#define SPRUCE_DOT_LOCK_REFRESH  (SPRUCE_DOT_LOCK_STALE / 4)
+
+/* how long to keep retrying a lock held by someone else (usec) */
+#define SPRUCE_LOCK_TIMEOUT      (10 * G_USEC_PER_SEC)
+#define SPRUCE_LOCK_MIN_DELAY    1000
+#define SPRUCE_LOCK_MAX_DELAY    100000
+
+typedef struct {
+	guint64 since;     /* when the lock was acquired */
+	time_t touched;    /* when the dot lock was last refreshed, 0 if none was taken */
+} LockHold;
+
+G_LOCK_DEFINE_STATIC (stats);
+static SpruceLockStats stats;
+static GHashTable *held = NULL;
+
+
+static guint64
+lock_time (void)
+{
+	GTimeVal tv;
+	
+	g_get_current_time (&tv);
+	
+	return ((guint64) tv.tv_sec * G_USEC_PER_SEC) + tv.tv_usec;
+}
 
-#ifdef USE_DOT_LOCK
+#ifdef USE_DOT_LOCKING
+/* returns %0 if the dot lock was taken, %1 if dot locking isn't
+ * possible because the directory isn't writable or %-1 on fail */
 static int
 spruce_lock_dot (const char *path, GError **err)
 {
@@ -74,6 +107,10 @@ spruce_lock_dot (const char *path, GError **err)
 			
 			unlink (lock);
 			unlink (tmp);
+		} else if (errno == EACCES || errno == EROFS) {
+			/* we can't create the lock file, so other
+			 * processes can't either; rely on fcntl() */
+			return 1;
 		}
 		
 		/* remove stale locks */
@@ -93,168 +130,354 @@ spruce_lock_dot (const char *path, GError **err)
 	
 	return -1;
 }
-#endif /* USE_DOT_LOCK */
+
+static int
+spruce_unlock_dot (const char *path)
+{
+	char *lock;
+	
+	lock = g_alloca (strlen (path) + 6);
+	sprintf (lock, "%s.lock", path);
+	
+	return unlink (lock);
+}
+#endif /* USE_DOT_LOCKING */
 
 #ifdef USE_FCNTL
 static int
-spruce_lock_fcntl (const char *path, int fd, GError **err)
+spruce_lock_fcntl (int fd, SpruceLockType type)
 {
 	struct flock lock;
 	
-	lock.l_type = F_WRLCK;
+	lock.l_type = type == SPRUCE_LOCK_READ ? F_RDLCK : F_WRLCK;
 	lock.l_whence = SEEK_SET;
 	lock.l_start = 0;
 	lock.l_len = 0;
 	lock.l_pid = getpid ();
 	
-	if (fcntl (fd, F_SETLK, &lock) == 0)
-		return 0;
+	return fcntl (fd, F_SETLK, &lock);
+}
+
+static int
+spruce_unlock_fcntl (int fd)
+{
+	struct flock lock;
 	
-	g_set_error (err, SPRUCE_ERROR, errno, _("Cannot get lock file for `%s': %s"), path, g_strerror (errno));
+	lock.l_type = F_UNLCK;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = 0;
+	lock.l_len = 0;
+	lock.l_pid = getpid ();
 	
-	return -1;
+	return fcntl (fd, F_SETLK, &lock);
 }
 #endif /* USE_FCNTL */
 
 #ifdef USE_FLOCK
 static int
-spruce_lock_flock (const char *path, int fd, GError **err)
+spruce_lock_flock (int fd, SpruceLockType type)
 {
-	if (flock (fd, LOCK_EX | LOCK_NB) == 0)
-		return 0;
-	
-	g_set_error (err, SPRUCE_ERROR, errno, _("Cannot get lock file for `%s': %s"), path, g_strerror (errno));
-	
-	return -1;
+	return flock (fd, (type == SPRUCE_LOCK_READ ? LOCK_SH : LOCK_EX) | LOCK_NB);
+}
+
+static int
+spruce_unlock_flock (int fd)
+{
+	return flock (fd, LOCK_UN);
 }
 #endif /* USE_FLOCK */
 
 #ifdef USE_LOCKF
 static int
-spruce_lock_lockf (const char *path, int fd, GError **err)
+spruce_lock_lockf (int fd, SpruceLockType type)
 {
-	if (lockf (fd, F_TLOCK, 0) == 0)
+	/* lockf() locks are always exclusive and need a writable fd */
+	if (type == SPRUCE_LOCK_READ)
 		return 0;
 	
-	g_set_error (err, SPRUCE_ERROR, errno, _("Cannot get lock file for `%s': %s"), path, g_strerror (errno));
+	return lockf (fd, F_TLOCK, 0);
+}
+
+static int
+spruce_unlock_lockf (int fd, SpruceLockType type)
+{
+	if (type == SPRUCE_LOCK_READ)
+		return 0;
 	
-	return -1;
+	return lockf (fd, F_ULOCK, 0);
 }
 #endif /* USE_LOCKF */
 
-
-int
-spruce_lock (const char *path, int fd, GError **err)
+static int
+spruce_unlock_fd (int fd, SpruceLockType type)
 {
-#ifdef USE_DOT_LOCK
-	if (spruce_lock_dot (path, err) == -1)
-		return -1;
-#endif
+	int ret = 0;
 	
 #ifdef USE_FCNTL
-	if (spruce_lock_fcntl (path, fd, err) == -1)
-		return -1;
+	if (spruce_unlock_fcntl (fd) == -1)
+		ret = -1;
 #endif
 	
 #ifdef USE_FLOCK
-	if (spruce_lock_flock (path, fd, err) == -1)
-		return -1;
+	if (spruce_unlock_flock (fd) == -1)
+		ret = -1;
 #endif
 
 #ifdef USE_LOCKF
-	if (spruce_lock_lockf (path, fd, err) == -1)
-		return -1;
+	if (spruce_unlock_lockf (fd, type) == -1)
+		ret = -1;
 #endif
 	
-	return 0;
+	return ret;
 }
 
-
-#ifdef USE_DOT_LOCK
 static int
-spruce_unlock_dot (const char *path, GError **err)
+spruce_lock_fd (int fd, SpruceLockType type)
 {
-	char *lock;
+#if defined (USE_FLOCK) || defined (USE_LOCKF)
+	int errnosave;
+#endif
 	
-	lock = g_alloca (strlen (path) + 6);
-	sprintf (lock, "%s.lock", path);
+#ifdef USE_FCNTL
+	if (spruce_lock_fcntl (fd, type) == -1)
+		return -1;
+#endif
 	
-	unlink (lock);
+#ifdef USE_FLOCK
+	if (spruce_lock_flock (fd, type) == -1)
+		goto exception;
+#endif
 	
-	return 0;
-}
-#endif /* USE_DOT_LOCK */
-
-#ifdef USE_FCNTL
-static int
-spruce_unlock_fcntl (const char *path, int fd, GError **err)
-{
-	struct flock lock;
+#ifdef USE_LOCKF
+	if (spruce_lock_lockf (fd, type) == -1)
+		goto exception;
+#endif
 	
-	lock.l_type = F_UNLCK;
-	lock.l_whence = SEEK_SET;
-	lock.l_start = 0;
-	lock.l_len = 0;
-	lock.l_pid = getpid ();
+	return 0;
 	
-	if (fcntl (fd, F_SETLK, &lock) == 0)
-		return 0;
+#if defined (USE_FLOCK) || defined (USE_LOCKF)
+ exception:
 	
-	g_set_error (err, SPRUCE_ERROR, errno, _("Cannot get lock file for `%s': %s"), path, g_strerror (errno));
+	errnosave = errno;
+	spruce_unlock_fd (fd, type);
+	errno = errnosave;
 	
 	return -1;
+#endif
 }
-#endif /* USE_FCNTL */
 
-#ifdef USE_FLOCK
-static int
-spruce_unlock_flock (const char *path, int fd, GError **err)
+/**
+ * spruce_lock:
+ * @path: path to the file being locked
+ * @fd: file descriptor open on @path
+ * @type: #SPRUCE_LOCK_READ for a shared lock or #SPRUCE_LOCK_WRITE for
+ * an exclusive lock
+ * @err: a #GError
+ *
+ * Locks @path using whichever locking methods were configured. Dot
+ * locks are only taken for @SPRUCE_LOCK_WRITE since they cannot be
+ * shared, and are skipped if the directory containing @path isn't
+ * writable. If the file is locked by someone else, the lock is
+ * retried for up to 10 seconds.
+ *
+ * Locks should only be held for as long as they are actually needed
+ * since they block other processes (such as the MDA) from accessing
+ * the file. Note that on most systems closing any file descriptor
+ * open on @path releases all of the process's fcntl() locks on it.
+ *
+ * Returns: %0 on success or %-1 on fail.
+ **/
+int
+spruce_lock (const char *path, int fd, SpruceLockType type, GError **err)
 {
-	if (flock (fd, LOCK_UN) == 0)
-		return 0;
+	guint64 start, now, delay = SPRUCE_LOCK_MIN_DELAY;
+	gboolean contended = FALSE;
+	gboolean dotlock = FALSE;
+	LockHold *hold;
 	
-	g_set_error (err, SPRUCE_ERROR, errno, _("Cannot unlock `%s': %s"), path, g_strerror (errno));
+	start = lock_time ();
+	
+#ifdef USE_DOT_LOCKING
+	if (type == SPRUCE_LOCK_WRITE) {
+		switch (spruce_lock_dot (path, err)) {
+		case 0:
+			dotlock = TRUE;
+			break;
+		case 1:
+			d(fprintf (stderr, "spruce_lock: cannot dot lock `%s', using fcntl only\n", path));
+			break;
+		default:
+			goto exception;
+		}
+	}
+#endif
+	
+	while (spruce_lock_fd (fd, type) == -1) {
+		if ((errno != EAGAIN && errno != EACCES && errno != EWOULDBLOCK && errno != EINTR)
+		    || lock_time () - start >= SPRUCE_LOCK_TIMEOUT) {
+			g_set_error (err, SPRUCE_ERROR, errno, _("Cannot get lock file for `%s': %s"),
+				     path, g_strerror (errno));
+#ifdef USE_DOT_LOCKING
+			if (dotlock)
+				spruce_unlock_dot (path);
+#endif
+			goto exception;
+		}
+		
+		/* someone else has it locked, back off and try again */
+		g_usleep (delay);
+		delay = MIN (delay * 2, SPRUCE_LOCK_MAX_DELAY);
+		contended = TRUE;
+	}
+	
+	now = lock_time ();
+	
+	G_LOCK (stats);
+	stats.acquired++;
+	if (contended)
+		stats.contended++;
+	stats.wait_usec += now - start;
+	stats.max_wait_usec = MAX (stats.max_wait_usec, now - start);
+	
+	if (held == NULL)
+		held = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+	
+	hold = g_new (LockHold, 1);
+	hold->touched = dotlock ? time (NULL) : 0;
+	hold->since = now;
+	g_hash_table_replace (held, GINT_TO_POINTER (fd), hold);
+	G_UNLOCK (stats);
+	
+	d(fprintf (stderr, "spruce_lock: waited %" G_GUINT64_FORMAT " usec for `%s'\n", now - start, path));
+	
+	return 0;
+	
+ exception:
+	
+	G_LOCK (stats);
+	stats.failed++;
+	stats.wait_usec += lock_time () - start;
+	G_UNLOCK (stats);
 	
 	return -1;
 }
-#endif /* USE_FLOCK */
 
-#ifdef USE_LOCKF
-static int
-spruce_unlock_lockf (const char *path, int fd, GError **err)
+
+/**
+ * spruce_unlock:
+ * @path: path to the locked file
+ * @fd: the file descriptor that was passed to spruce_lock()
+ * @type: the type of lock that was requested from spruce_lock()
+ * @err: a #GError
+ *
+ * Releases a lock obtained with spruce_lock().
+ *
+ * Returns: %0 on success or %-1 on fail.
+ **/
+int
+spruce_unlock (const char *path, int fd, SpruceLockType type, GError **err)
 {
-	if (lockf (fd, F_ULOCK, 0) == 0)
-		return 0;
+	gboolean dotlock = FALSE;
+	LockHold *hold;
+	guint64 usec;
+	int ret = 0;
 	
-	g_set_error (err, SPRUCE_ERROR, errno, _("Cannot unlock `%s': %s"), path, g_strerror (errno));
+	if (spruce_unlock_fd (fd, type) == -1) {
+		g_set_error (err, SPRUCE_ERROR, errno, _("Cannot unlock `%s': %s"), path, g_strerror (errno));
+		ret = -1;
+	}
 	
-	return -1;
+	G_LOCK (stats);
+	if (held && (hold = g_hash_table_lookup (held, GINT_TO_POINTER (fd)))) {
+		usec = lock_time () - hold->since;
+		stats.hold_usec += usec;
+		stats.max_hold_usec = MAX (stats.max_hold_usec, usec);
+		dotlock = hold->touched != 0;
+		g_hash_table_remove (held, GINT_TO_POINTER (fd));
+		
+		d(fprintf (stderr, "spruce_unlock: held `%s' for %" G_GUINT64_FORMAT " usec\n", path, usec));
+	}
+	G_UNLOCK (stats);
+	
+#ifdef USE_DOT_LOCKING
+	/* only remove the dot lock if it is ours */
+	if (dotlock)
+		spruce_unlock_dot (path);
+#endif
+	
+	return ret;
 }
-#endif /* USE_LOCKF */
 
 
-int
-spruce_unlock (const char *path, int fd, GError **err)
+/**
+ * spruce_lock_refresh:
+ * @path: path to the locked file
+ * @fd: the file descriptor that was passed to spruce_lock()
+ *
+ * Keeps the dot lock taken on @path, if any, from being broken as
+ * stale by other processes. Should be called every so often while
+ * a write lock is held for a long time; it only touches the lock
+ * file once every few seconds, so it is cheap to call often.
+ **/
+void
+spruce_lock_refresh (const char *path, int fd)
 {
-#ifdef USE_DOT_LOCK
-	if (spruce_unlock_dot (path, err) == -1)
-		return -1;
-#endif
+#ifdef USE_DOT_LOCKING
+	gboolean touch = FALSE;
+	LockHold *hold;
+	char *lock;
+	time_t now;
 	
-#ifdef USE_FCNTL
-	if (spruce_unlock_fcntl (path, fd, err) == -1)
-		return -1;
-#endif
+	now = time (NULL);
 	
-#ifdef USE_FLOCK
-	if (spruce_unlock_flock (path, fd, err) == -1)
-		return -1;
+	G_LOCK (stats);
+	if (held && (hold = g_hash_table_lookup (held, GINT_TO_POINTER (fd)))) {
+		if (hold->touched != 0 && now - hold->touched >= SPRUCE_DOT_LOCK_REFRESH) {
+			hold->touched = now;
+			touch = TRUE;
+		}
+	}
+	G_UNLOCK (stats);
+	
+	if (touch) {
+		lock = g_alloca (strlen (path) + 6);
+		sprintf (lock, "%s.lock", path);
+		
+		/* updates the ctime that stale locks are judged by */
+		utime (lock, NULL);
+	}
 #endif
+}
 
-#ifdef USE_LOCKF
-	if (spruce_unlock_lockf (path, fd, err) == -1)
-		return -1;
-#endif
+
+/**
+ * spruce_lock_get_stats:
+ * @stats: a #SpruceLockStats to fill in
+ *
+ * Gets the number of locks taken with spruce_lock() along with how
+ * long they were waited for and held, which is useful for finding
+ * out how contended a mail spool is.
+ **/
+void
+spruce_lock_get_stats (SpruceLockStats *stats_out)
+{
+	g_return_if_fail (stats_out != NULL);
 	
-	return 0;
+	G_LOCK (stats);
+	*stats_out = stats;
+	G_UNLOCK (stats);
+}
+
+
+/**
+ * spruce_lock_reset_stats:
+ *
+ * Resets the lock statistics returned by spruce_lock_get_stats().
+ **/
+void
+spruce_lock_reset_stats (void)
+{
+	G_LOCK (stats);
+	memset (&stats, 0, sizeof (stats));
+	G_UNLOCK (stats);
 }
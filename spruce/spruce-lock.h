@@ -25,8 +25,28 @@
 
 G_BEGIN_DECLS
 
-int spruce_lock (const char *path, int fd, GError **err);
-int spruce_unlock (const char *path, int fd, GError **err);
+typedef enum {
+	SPRUCE_LOCK_READ,
+	SPRUCE_LOCK_WRITE
+} SpruceLockType;
+
+typedef struct {
+	guint64 acquired;       /* number of locks acquired */
+	guint64 contended;      /* number of those that had to be waited for */
+	guint64 failed;         /* number of locks that could not be acquired */
+	guint64 wait_usec;      /* total time spent waiting for locks */
+	guint64 max_wait_usec;
+	guint64 hold_usec;      /* total time locks were held */
+	guint64 max_hold_usec;
+} SpruceLockStats;
+
+int spruce_lock (const char *path, int fd, SpruceLockType type, GError **err);
+int spruce_unlock (const char *path, int fd, SpruceLockType type, GError **err);
+
+void spruce_lock_refresh (const char *path, int fd);
+
+void spruce_lock_get_stats (SpruceLockStats *stats);
+void spruce_lock_reset_stats (void);
 
 G_END_DECLS
 
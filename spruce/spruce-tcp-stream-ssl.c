@@ -391,4 +391,24 @@ spruce_tcp_stream_ssl_enable_ssl (SpruceTcpStreamSSL *stream, GError **err)
 	return 0;
 }
 
+
+/**
+ * spruce_tcp_stream_ssl_pending:
+ * @stream: ssl stream
+ *
+ * Checks whether data has already been received and decrypted but not
+ * yet read. Such data won't make the socket readable again, so callers
+ * polling the socket should check this first.
+ *
+ * Returns %TRUE if there is buffered data to be read or %FALSE
+ * otherwise.
+ **/
+gboolean
+spruce_tcp_stream_ssl_pending (SpruceTcpStreamSSL *stream)
+{
+	g_return_val_if_fail (SPRUCE_IS_TCP_STREAM_SSL (stream), FALSE);
+	
+	return stream->priv->ssl && SSL_pending (stream->priv->ssl) > 0;
+}
+
 #endif /* HAVE_OPENSSL */
@@ -61,6 +61,8 @@ GMimeStream *spruce_tcp_stream_ssl_new (SpruceSession *session, const char *expe
 
 int spruce_tcp_stream_ssl_enable_ssl (SpruceTcpStreamSSL *ssl, GError **err);
 
+gboolean spruce_tcp_stream_ssl_pending (SpruceTcpStreamSSL *stream);
+
 G_END_DECLS
 
 #endif /* __SPRUCE_TCP_STREAM_SSL_H__ */
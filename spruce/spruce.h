@@ -27,6 +27,7 @@
 #include <spruce/spruce-cache-stream.h>
 #include <spruce/spruce-error.h>
 #include <spruce/spruce-folder.h>
+#include <spruce/spruce-folder-index.h>
 #include <spruce/spruce-folder-search.h>
 #include <spruce/spruce-folder-summary.h>
 #include <spruce/spruce-provider.h>
@@ -0,0 +1,636 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*  Spruce
+ *  Copyright (C) 1999-2009 Jeffrey Stedfast
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+
+/* Measures how many UID STORE commands and how much wall time it
+ * takes to sync a large batch of mixed flag changes to an IMAP
+ * server.
+ *
+ * The server is faked by a child process listening on the loopback
+ * interface which delays every tagged response by the given
+ * round-trip time (measured from the moment the command arrived, so
+ * pipelined commands overlap the way they would on a real link).
+ *
+ * The changes are synced once the way imap_sync_changes() does it
+ * now and once a flag at a time, which issues the same STOREs (one
+ * +FLAGS and one -FLAGS per flag, one after the other) that the
+ * per-flag implementation it replaced used to. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <glib.h>
+
+#include <spruce/spruce.h>
+#include <spruce/spruce-file-utils.h>
+
+#define ENABLE_ZENTIMER
+#include "zentimer.h"
+
+
+static struct {
+	const char *name;
+	guint32 flag;
+} bench_flags[] = {
+	{ "\\Answered", SPRUCE_MESSAGE_ANSWERED },
+	{ "\\Deleted",  SPRUCE_MESSAGE_DELETED  },
+	{ "\\Draft",    SPRUCE_MESSAGE_DRAFT    },
+	{ "\\Flagged",  SPRUCE_MESSAGE_FLAGGED  },
+	{ "\\Seen",     SPRUCE_MESSAGE_SEEN     },
+};
+
+#define BENCH_FLAGS (SPRUCE_MESSAGE_ANSWERED | SPRUCE_MESSAGE_DELETED | SPRUCE_MESSAGE_DRAFT | \
+		     SPRUCE_MESSAGE_FLAGGED | SPRUCE_MESSAGE_SEEN)
+
+/* the initial flags of message @uid on the server */
+#define INITIAL_FLAGS(uid) (((uid) & 1) ? SPRUCE_MESSAGE_SEEN : 0)
+
+
+/* fake IMAP server */
+
+struct server {
+	guint32 *flags;      /* flags of each message, indexed by uid */
+	guint32 count;       /* number of messages */
+	ztime_t rtt;         /* simulated round-trip time (usec) */
+
+	int fd;
+	char inbuf[65536];
+	size_t inlen;
+	GQueue arrivals;     /* arrival times of the buffered lines */
+	GString *out;
+
+	guint32 commands;
+	guint32 stores;
+};
+
+/* reads whatever is available on the socket, waiting at most
+ * @timeout milliseconds, and records the arrival time of each
+ * complete line */
+static int
+server_fill (struct server *server, int timeout)
+{
+	struct pollfd pfd;
+	char *inptr, *inend;
+	ztime_t *now;
+	ssize_t n;
+	
+	pfd.fd = server->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	
+	if (poll (&pfd, 1, timeout) <= 0)
+		return 0;
+	
+	if (server->inlen == sizeof (server->inbuf))
+		return -1;
+	
+	if ((n = read (server->fd, server->inbuf + server->inlen, sizeof (server->inbuf) - server->inlen)) <= 0)
+		return -1;
+	
+	now = g_new (ztime_t, 1);
+	ztime (now);
+	
+	inptr = server->inbuf + server->inlen;
+	inend = inptr + n;
+	
+	while (inptr < inend) {
+		if (*inptr++ == '\n') {
+			ztime_t *stamp = g_new (ztime_t, 1);
+			
+			*stamp = *now;
+			g_queue_push_tail (&server->arrivals, stamp);
+		}
+	}
+	
+	server->inlen += n;
+	g_free (now);
+	
+	return 0;
+}
+
+/* returns the next command line (without the CRLF) or %NULL on EOF */
+static char *
+server_read_line (struct server *server, ztime_t *arrived)
+{
+	ztime_t *stamp;
+	char *eoln, *line;
+	size_t len;
+	
+	while (g_queue_is_empty (&server->arrivals)) {
+		if (server_fill (server, -1) == -1)
+			return NULL;
+	}
+	
+	eoln = memchr (server->inbuf, '\n', server->inlen);
+	len = (eoln - server->inbuf) + 1;
+	
+	line = g_strndup (server->inbuf, len);
+	g_strchomp (line);
+	
+	memmove (server->inbuf, server->inbuf + len, server->inlen - len);
+	server->inlen -= len;
+	
+	stamp = g_queue_pop_head (&server->arrivals);
+	*arrived = *stamp;
+	g_free (stamp);
+	
+	return line;
+}
+
+/* sends the queued responses once @due has passed, reading any
+ * commands which arrive in the mean time */
+static int
+server_flush (struct server *server, ztime_t due)
+{
+	ztime_t now;
+	
+	ztime (&now);
+	while (now < due) {
+		if (server_fill (server, (int) ((due - now + 999) / 1000)) == -1)
+			return -1;
+		
+		ztime (&now);
+	}
+	
+	if (spruce_write (server->fd, server->out->str, server->out->len) == -1)
+		return -1;
+	
+	g_string_truncate (server->out, 0);
+	
+	return 0;
+}
+
+/* parses a UID set such as "1:5,7,9:*" and calls @func on each
+ * message in it */
+static void
+server_foreach_uid (struct server *server, const char *set, void (* func) (struct server *, guint32, gpointer), gpointer user_data)
+{
+	const char *inptr = set;
+	guint32 first, last, uid;
+	char *end;
+	
+	while (*inptr) {
+		first = strtoul (inptr, &end, 10);
+		inptr = end;
+		
+		if (*inptr == ':') {
+			inptr++;
+			if (*inptr == '*') {
+				last = server->count;
+				inptr++;
+			} else {
+				last = strtoul (inptr, &end, 10);
+				inptr = end;
+			}
+		} else {
+			last = first;
+		}
+		
+		if (first > last) {
+			uid = first;
+			first = last;
+			last = uid;
+		}
+		
+		for (uid = MAX (first, 1); uid <= last && uid <= server->count; uid++)
+			func (server, uid, user_data);
+		
+		if (*inptr != ',')
+			break;
+		
+		inptr++;
+	}
+}
+
+static void
+server_flags_list (GString *out, guint32 flags)
+{
+	gboolean first = TRUE;
+	int i;
+	
+	g_string_append_c (out, '(');
+	for (i = 0; i < G_N_ELEMENTS (bench_flags); i++) {
+		if (flags & bench_flags[i].flag) {
+			if (!first)
+				g_string_append_c (out, ' ');
+			g_string_append (out, bench_flags[i].name);
+			first = FALSE;
+		}
+	}
+	g_string_append_c (out, ')');
+}
+
+static void
+server_fetch_all (struct server *server, guint32 uid, gpointer user_data)
+{
+	g_string_append_printf (server->out, "* %u FETCH (UID %u FLAGS ", uid, uid);
+	server_flags_list (server->out, server->flags[uid]);
+	g_string_append_printf (server->out, " INTERNALDATE \"17-Oct-2009 12:00:00 +0000\" RFC822.SIZE 2048 "
+				"ENVELOPE (\"Sat, 17 Oct 2009 12:00:00 +0000\" \"message %u\" "
+				"((\"Sender\" NIL \"sender\" \"example.com\")) "
+				"((\"Sender\" NIL \"sender\" \"example.com\")) "
+				"((\"Sender\" NIL \"sender\" \"example.com\")) "
+				"((\"Recipient\" NIL \"rcpt\" \"example.com\")) "
+				"NIL NIL NIL \"<%u@example.com>\"))\r\n", uid, uid);
+}
+
+static void
+server_fetch_flags (struct server *server, guint32 uid, gpointer user_data)
+{
+	g_string_append_printf (server->out, "* %u FETCH (UID %u FLAGS ", uid, uid);
+	server_flags_list (server->out, server->flags[uid]);
+	g_string_append (server->out, ")\r\n");
+}
+
+struct store {
+	guint32 flags;
+	char onoff;
+};
+
+static void
+server_store (struct server *server, guint32 uid, gpointer user_data)
+{
+	struct store *store = user_data;
+	
+	if (store->onoff == '+')
+		server->flags[uid] |= store->flags;
+	else
+		server->flags[uid] &= ~store->flags;
+}
+
+static void
+server_command (struct server *server, char *line)
+{
+	char *tag, *cmd, *args, *p;
+	struct store store;
+	int i;
+	
+	tag = line;
+	if (!(cmd = strchr (tag, ' ')))
+		return;
+	*cmd++ = '\0';
+	
+	if ((args = strchr (cmd, ' ')))
+		*args++ = '\0';
+	else
+		args = "";
+	
+	server->commands++;
+	
+	if (!g_ascii_strcasecmp (cmd, "CAPABILITY")) {
+		g_string_append (server->out, "* CAPABILITY IMAP4rev1\r\n");
+	} else if (!g_ascii_strcasecmp (cmd, "LIST")) {
+		if (!strcmp (args, "\"\" \"\""))
+			g_string_append (server->out, "* LIST (\\Noselect) \"/\" \"\"\r\n");
+		else
+			g_string_append (server->out, "* LIST (\\HasNoChildren) \"/\" INBOX\r\n");
+	} else if (!g_ascii_strcasecmp (cmd, "SELECT") || !g_ascii_strcasecmp (cmd, "EXAMINE")) {
+		g_string_append_printf (server->out,
+					"* FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)\r\n"
+					"* OK [PERMANENTFLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft \\*)] Ok\r\n"
+					"* %u EXISTS\r\n"
+					"* 0 RECENT\r\n"
+					"* OK [UIDVALIDITY 1] Ok\r\n"
+					"* OK [UIDNEXT %u] Ok\r\n"
+					"%s OK [READ-WRITE] Ok\r\n", server->count, server->count + 1, tag);
+		return;
+	} else if (!g_ascii_strcasecmp (cmd, "UID") && !g_ascii_strncasecmp (args, "FETCH ", 6)) {
+		args += 6;
+		if ((p = strchr (args, ' '))) {
+			*p++ = '\0';
+			if (strstr (p, "ALL"))
+				server_foreach_uid (server, args, server_fetch_all, NULL);
+			else if (strstr (p, "FLAGS"))
+				server_foreach_uid (server, args, server_fetch_flags, NULL);
+		}
+	} else if (!g_ascii_strcasecmp (cmd, "UID") && !g_ascii_strncasecmp (args, "STORE ", 6)) {
+		server->stores++;
+		
+		args += 6;
+		if ((p = strchr (args, ' '))) {
+			*p++ = '\0';
+			store.onoff = *p;
+			store.flags = 0;
+			
+			for (i = 0; i < G_N_ELEMENTS (bench_flags); i++) {
+				if (strstr (p, bench_flags[i].name))
+					store.flags |= bench_flags[i].flag;
+			}
+			
+			server_foreach_uid (server, args, server_store, &store);
+		}
+	} else if (!g_ascii_strcasecmp (cmd, "LOGOUT")) {
+		g_string_append (server->out, "* BYE Logging out\r\n");
+	}
+	
+	g_string_append_printf (server->out, "%s OK Completed\r\n", tag);
+}
+
+/* serves a single connection, then writes the command and STORE
+ * counts to @report */
+static void
+server_run (int sockfd, guint32 count, ztime_t rtt, int report)
+{
+	struct server server;
+	ztime_t arrived;
+	char *line;
+	guint32 i;
+	
+	if ((server.fd = accept (sockfd, NULL, NULL)) == -1)
+		_exit (1);
+	
+	close (sockfd);
+	
+	server.flags = g_new (guint32, count + 1);
+	for (i = 0; i <= count; i++)
+		server.flags[i] = INITIAL_FLAGS (i);
+	
+	server.count = count;
+	server.rtt = rtt;
+	server.inlen = 0;
+	g_queue_init (&server.arrivals);
+	server.out = g_string_new ("* PREAUTH Spruce benchmark server ready\r\n");
+	server.commands = 0;
+	server.stores = 0;
+	
+	ztime (&arrived);
+	server_flush (&server, arrived + rtt / 2);
+	
+	while ((line = server_read_line (&server, &arrived))) {
+		server_command (&server, line);
+		g_free (line);
+		
+		if (server_flush (&server, arrived + rtt) == -1)
+			break;
+	}
+	
+	spruce_write (report, (char *) &server.commands, sizeof (server.commands));
+	spruce_write (report, (char *) &server.stores, sizeof (server.stores));
+	
+	_exit (0);
+}
+
+static pid_t
+server_start (guint32 count, ztime_t rtt, int *port, int *report)
+{
+	struct sockaddr_in sin;
+	socklen_t len;
+	int fd, fds[2];
+	pid_t pid;
+	
+	if ((fd = socket (AF_INET, SOCK_STREAM, 0)) == -1)
+		return -1;
+	
+	memset (&sin, 0, sizeof (sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+	sin.sin_port = 0;
+	
+	len = sizeof (sin);
+	if (bind (fd, (struct sockaddr *) &sin, sizeof (sin)) == -1 || listen (fd, 1) == -1 ||
+	    getsockname (fd, (struct sockaddr *) &sin, &len) == -1 || pipe (fds) == -1) {
+		close (fd);
+		return -1;
+	}
+	
+	if ((pid = fork ()) == 0) {
+		signal (SIGPIPE, SIG_IGN);
+		close (fds[0]);
+		server_run (fd, count, rtt, fds[1]);
+	}
+	
+	close (fds[1]);
+	close (fd);
+	
+	*port = ntohs (sin.sin_port);
+	*report = fds[0];
+	
+	return pid;
+}
+
+
+/* client */
+
+/* the flags each message should end up with */
+static guint32 *
+bench_changes (guint32 count, guint32 seed)
+{
+	guint32 *wanted, uid;
+	GRand *rand;
+	int i;
+	
+	rand = g_rand_new_with_seed (seed);
+	wanted = g_new (guint32, count + 1);
+	
+	/* toggle each flag of each message with a 1 in 4 chance */
+	for (uid = 0; uid <= count; uid++) {
+		wanted[uid] = INITIAL_FLAGS (uid);
+		for (i = 0; i < G_N_ELEMENTS (bench_flags); i++) {
+			if (g_rand_int_range (rand, 0, 4) == 0)
+				wanted[uid] ^= bench_flags[i].flag;
+		}
+	}
+	
+	g_rand_free (rand);
+	
+	return wanted;
+}
+
+static int
+bench_sync (SpruceSession *session, guint32 count, ztime_t rtt, const guint32 *wanted, gboolean per_flag)
+{
+	guint32 commands, stores, mask, uid;
+	SpruceFolder *folder = NULL;
+	SpruceStore *store = NULL;
+	int port, report, status;
+	int retval = 0;
+	ztimer_t ztimer;
+	GError *err = NULL;
+	char uidstr[16];
+	char *uri;
+	pid_t pid;
+	int i, n;
+	
+	if ((pid = server_start (count, rtt, &port, &report)) == -1) {
+		fprintf (stderr, "could not start the IMAP server: %s\n", g_strerror (errno));
+		return -1;
+	}
+	
+	uri = g_strdup_printf ("imap://bench@127.0.0.1:%d/", port);
+	
+	if (!(store = spruce_session_get_store (session, uri, &err)))
+		goto error;
+	
+	if (spruce_service_connect ((SpruceService *) store, &err) == -1)
+		goto error;
+	
+	if (!(folder = spruce_store_get_folder (store, "INBOX", &err)))
+		goto error;
+	
+	if (spruce_folder_open (folder, &err) == -1)
+		goto error;
+	
+	/* syncing a flag at a time issues the same STOREs that the
+	 * old per-flag implementation of imap_sync_changes() did */
+	n = per_flag ? G_N_ELEMENTS (bench_flags) : 1;
+	
+	ZenTimerStart (&ztimer);
+	
+	for (i = 0; i < n; i++) {
+		mask = per_flag ? bench_flags[i].flag : BENCH_FLAGS;
+		
+		for (uid = 1; uid <= count; uid++) {
+			sprintf (uidstr, "%u", uid);
+			spruce_folder_set_message_flags (folder, uidstr, mask, wanted[uid]);
+		}
+		
+		if (spruce_folder_sync (folder, FALSE, &err) == -1) {
+			ZenTimerStop (&ztimer);
+			goto error;
+		}
+	}
+	
+	ZenTimerStop (&ztimer);
+	
+	spruce_folder_close (folder, FALSE, NULL);
+	
+	if (err != NULL) {
+	error:
+		fprintf (stderr, "ERROR: %s\n", err ? err->message : "Unknown");
+		g_clear_error (&err);
+		retval = -1;
+		
+		/* the server may never have seen a connection */
+		kill (pid, SIGTERM);
+	}
+	
+	if (folder)
+		g_object_unref (folder);
+	
+	if (store) {
+		spruce_service_disconnect ((SpruceService *) store, TRUE, NULL);
+		g_object_unref (store);
+	}
+	
+	g_free (uri);
+	
+	if (spruce_read (report, (char *) &commands, sizeof (commands)) != sizeof (commands) ||
+	    spruce_read (report, (char *) &stores, sizeof (stores)) != sizeof (stores))
+		commands = stores = 0;
+	
+	close (report);
+	waitpid (pid, &status, 0);
+	
+	if (retval == -1)
+		return -1;
+	
+	printf ("%-9s %8u STOREs %10.3f sec\n", per_flag ? "per-flag" : "grouped",
+		stores, ZenTimerElapsed (&ztimer, NULL));
+	
+	return 0;
+}
+
+static void
+usage (const char *progname)
+{
+	fprintf (stderr, "Usage: %s [-n messages] [-r rtt-msec] [-s seed]\n", progname);
+	exit (1);
+}
+
+int main (int argc, char **argv)
+{
+	guint32 count = 10000, seed = 0, changed, uid;
+	char template[] = "/tmp/bench-imap-XXXXXX";
+	SpruceSession *session;
+	ztime_t rtt = 0;
+	guint32 *wanted;
+	int opt;
+	
+	while ((opt = getopt (argc, argv, "n:r:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = strtoul (optarg, NULL, 10);
+			break;
+		case 'r':
+			rtt = strtoul (optarg, NULL, 10) * 1000;
+			break;
+		case 's':
+			seed = strtoul (optarg, NULL, 10);
+			break;
+		default:
+			usage (argv[0]);
+		}
+	}
+	
+	if (count == 0)
+		usage (argv[0]);
+	
+	if (!mkdtemp (template)) {
+		fprintf (stderr, "could not create a temporary directory: %s\n", g_strerror (errno));
+		return 1;
+	}
+	
+	spruce_init (template);
+	
+	/* use the provider from the build tree rather than an installed one */
+	spruce_provider_module_init ();
+	
+	session = g_object_new (SPRUCE_TYPE_SESSION, NULL);
+	
+	wanted = bench_changes (count, seed);
+	
+	for (changed = 0, uid = 1; uid <= count; uid++) {
+		if (wanted[uid] != INITIAL_FLAGS (uid))
+			changed++;
+	}
+	
+	printf ("%u messages, %u with flag changes, %.1f ms round trip\n",
+		count, changed, rtt / 1000.0);
+	
+	/* each run gets its own cache so neither starts out synced */
+	session->storage_path = g_build_filename (template, "grouped", NULL);
+	bench_sync (session, count, rtt, wanted, FALSE);
+	g_free (session->storage_path);
+	
+	session->storage_path = g_build_filename (template, "per-flag", NULL);
+	bench_sync (session, count, rtt, wanted, TRUE);
+	
+	g_object_unref (session);
+	g_free (wanted);
+	
+	spruce_shutdown ();
+	
+	spruce_rmdir (template);
+	
+	return 0;
+}
@@ -0,0 +1,265 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*  Spruce
+ *  Copyright (C) 1999-2009 Jeffrey Stedfast
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+
+/* Compares the time it takes to build an mbox summary with the
+ * windowed mmap scanner, mbox_summary_scan_fd(), and with the
+ * GMimeParser based scanner it falls back to,
+ * mbox_summary_scan_stream().
+ *
+ * Both are static, so the summary code is compiled straight into
+ * this program. The mbox is either given on the command line or
+ * generated: a mix of plain text messages and multipart messages
+ * with base64 attachments of up to 256K, with the occasional
+ * ">From " line in the bodies. */
+
+#include "providers/mbox/spruce-mbox-summary.c"
+
+#include <stdio.h>
+
+#define ENABLE_ZENTIMER
+#include "zentimer.h"
+
+
+static const char base64_alphabet[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#define ATTACHMENT_LINES (256 * 1024 / 57)
+
+/* base64 encoded attachment data, 76 columns wide; every attachment
+ * is a prefix of it */
+static char *attachment = NULL;
+
+static void
+write_message (FILE *fp, guint32 n, GRand *rand)
+{
+	guint32 lines, i, j;
+	
+	if (attachment == NULL) {
+		attachment = g_malloc (ATTACHMENT_LINES * 77);
+		for (i = 0; i < ATTACHMENT_LINES; i++) {
+			for (j = 0; j < 76; j++)
+				attachment[(i * 77) + j] = base64_alphabet[g_rand_int_range (rand, 0, 64)];
+			attachment[(i * 77) + 76] = '\n';
+		}
+	}
+	
+	fprintf (fp, "From sender%u@example.com Sat Oct 17 12:00:00 2009\n", n % 100);
+	fprintf (fp, "Return-Path: <sender%u@example.com>\n", n % 100);
+	fprintf (fp, "Received: from mail.example.com (mail.example.com [192.0.2.1])\n"
+		 "\tby mx.example.org with ESMTP id %u\n"
+		 "\tfor <rcpt@example.org>; Sat, 17 Oct 2009 12:00:00 +0000\n", n);
+	fprintf (fp, "From: Sender %u <sender%u@example.com>\n", n % 100, n % 100);
+	fprintf (fp, "To: Recipient <rcpt@example.org>\n");
+	fprintf (fp, "Subject: benchmark message %u\n", n);
+	fprintf (fp, "Date: Sat, 17 Oct 2009 12:00:00 +0000\n");
+	fprintf (fp, "Message-Id: <%u@example.com>\n", n);
+	
+	if (n % 3 == 0)
+		fprintf (fp, "References: <%u@example.com>\n", n / 3);
+	
+	if (n % 4 == 0)
+		fprintf (fp, "Status: RO\nX-Status: A\n");
+	
+	fprintf (fp, "MIME-Version: 1.0\n");
+	
+	if (n % 3 != 0) {
+		fprintf (fp, "Content-Type: text/plain; charset=us-ascii\n\n");
+	} else {
+		fprintf (fp, "Content-Type: multipart/mixed; boundary=\"=-%u\"\n\n", n);
+		fprintf (fp, "--=-%u\nContent-Type: text/plain; charset=us-ascii\n\n", n);
+	}
+	
+	lines = g_rand_int_range (rand, 5, 100);
+	for (i = 0; i < lines; i++) {
+		if (g_rand_int_range (rand, 0, 50) == 0)
+			fputs (">From the benchmark, a line which had to be escaped.\n", fp);
+		else
+			fputs ("The quick brown fox jumps over the lazy dog, again and again.\n", fp);
+	}
+	
+	if (n % 3 == 0) {
+		fprintf (fp, "\n--=-%u\nContent-Type: application/octet-stream; name=\"%u.bin\"\n"
+			 "Content-Transfer-Encoding: base64\n\n", n, n);
+		
+		lines = g_rand_int_range (rand, 1, ATTACHMENT_LINES);
+		fwrite (attachment, 77, lines, fp);
+		
+		fprintf (fp, "\n--=-%u--\n", n);
+	}
+	
+	fputc ('\n', fp);
+}
+
+static int
+write_mbox (const char *path, gint64 size)
+{
+	guint32 n = 0;
+	GRand *rand;
+	FILE *fp;
+	
+	if (!(fp = fopen (path, "w")))
+		return -1;
+	
+	rand = g_rand_new_with_seed (0);
+	
+	while ((gint64) ftello (fp) < size)
+		write_message (fp, n++, rand);
+	
+	g_rand_free (rand);
+	g_free (attachment);
+	attachment = NULL;
+	
+	if (fclose (fp) == EOF)
+		return -1;
+	
+	return 0;
+}
+
+typedef int (* ScanFunc) (SpruceFolderSummary *summary, int fd, gint64 start);
+
+/* returns the fastest of @iterations scans in seconds */
+static double
+bench_scan (const char *path, ScanFunc scan, int iterations, int *count)
+{
+	SpruceFolderSummary *summary;
+	double elapsed, best = -1.0;
+	ztimer_t ztimer;
+	int fd, i;
+	
+	for (i = 0; i < iterations; i++) {
+		if ((fd = open (path, O_LARGEFILE | O_RDONLY)) == -1)
+			return -1.0;
+		
+		summary = spruce_mbox_summary_new (path);
+		
+		ZenTimerStart (&ztimer);
+		if (scan (summary, fd, 0) == -1) {
+			fprintf (stderr, "scan failed: %s\n", g_strerror (errno));
+			g_object_unref (summary);
+			close (fd);
+			return -1.0;
+		}
+		ZenTimerStop (&ztimer);
+		
+		elapsed = ZenTimerElapsed (&ztimer, NULL);
+		if (best < 0.0 || elapsed < best)
+			best = elapsed;
+		
+		*count = spruce_folder_summary_count (summary);
+		
+		g_object_unref (summary);
+		close (fd);
+	}
+	
+	return best;
+}
+
+static void
+report (const char *name, double elapsed, int count, gint64 size)
+{
+	printf ("%-7s %8d messages %9.3f sec %9.1f MB/s %10.0f msgs/s\n", name, count,
+		elapsed, (size / (1024.0 * 1024.0)) / elapsed, count / elapsed);
+}
+
+static void
+usage (const char *progname)
+{
+	fprintf (stderr, "Usage: %s [-i iterations] [-s size-in-MB | mbox]\n", progname);
+	exit (1);
+}
+
+int main (int argc, char **argv)
+{
+	double mapped, streamed;
+	int mcount, scount;
+	char *path = NULL;
+	int iterations = 3;
+	gint64 size = 2048;
+	struct stat st;
+	int opt;
+	
+	while ((opt = getopt (argc, argv, "i:s:")) != -1) {
+		switch (opt) {
+		case 'i':
+			iterations = strtol (optarg, NULL, 10);
+			break;
+		case 's':
+			size = strtoll (optarg, NULL, 10);
+			break;
+		default:
+			usage (argv[0]);
+		}
+	}
+	
+	if (iterations < 1 || size < 1 || argc - optind > 1)
+		usage (argv[0]);
+	
+	g_mime_init (0);
+	
+	if (optind < argc) {
+		path = g_strdup (argv[optind]);
+	} else {
+		path = g_strdup ("/tmp/bench-mbox-XXXXXX");
+		if ((opt = g_mkstemp (path)) == -1) {
+			fprintf (stderr, "could not create a temporary mbox: %s\n", g_strerror (errno));
+			return 1;
+		}
+		
+		close (opt);
+		
+		printf ("generating a %" G_GINT64_FORMAT " MB mbox in %s...\n", size, path);
+		if (write_mbox (path, size * 1024 * 1024) == -1) {
+			fprintf (stderr, "could not write %s: %s\n", path, g_strerror (errno));
+			unlink (path);
+			return 1;
+		}
+	}
+	
+	if (stat (path, &st) == -1) {
+		fprintf (stderr, "%s: %s\n", path, g_strerror (errno));
+		return 1;
+	}
+	
+	printf ("%s: %.1f MB, best of %d\n", path, st.st_size / (1024.0 * 1024.0), iterations);
+	
+	/* read it once so that neither scanner pays for the cold cache */
+	bench_scan (path, mbox_summary_scan_fd, 1, &mcount);
+	
+	if ((mapped = bench_scan (path, mbox_summary_scan_fd, iterations, &mcount)) >= 0.0)
+		report ("mmap", mapped, mcount, st.st_size);
+	
+	if ((streamed = bench_scan (path, mbox_summary_scan_stream, iterations, &scount)) >= 0.0)
+		report ("stream", streamed, scount, st.st_size);
+	
+	if (mapped > 0.0 && streamed >= 0.0) {
+		printf ("mmap is %.2fx the speed of stream\n", streamed / mapped);
+		if (mcount != scount)
+			printf ("WARNING: the scanners disagree on the number of messages\n");
+	}
+	
+	if (optind == argc)
+		unlink (path);
+	
+	g_free (path);
+	
+	g_mime_shutdown ();
+	
+	return 0;
+}